@@ -0,0 +1,532 @@
+// Microbenchmarks for peer lookup, RPC encoding and handle change fanout.
+//
+// Each benchmark times one operation in batches that double in size until a
+// batch takes at least -m ms, then runs that batch -r times and keeps the
+// fastest, which is the one the rest of the machine disturbed least. Peer
+// benchmarks run at 10 to -n peers, tracked without connecting like in
+// p2ppeers. With -o the results also go to a JSON file, which
+// dev/scripts/bench_compare.py compares against a baseline such as
+// dev/bench/baseline.json.
+//
+// Usage: p2pmicro [-o results.json] [-f filter] [-n max peers]
+//                 [-F max fanout peers] [-m ms] [-r runs] [-t transport]
+#include "address.h"
+#include "generated/rpc.h"
+#include "peer.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/rpc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MICRO_PORT 9 // discard, which nothing listens on
+#define MICRO_NAME_SIZE 64
+#define MICRO_TEXT_SIZE 32
+#define MICRO_MAX_BATCH (1ULL << 32U)
+
+typedef void (*micro_op_t)(void *state, uint64_t iteration);
+
+struct Micro { // NOLINT(altera-struct-pack-align)
+  double min_s;
+  int runs;
+  const char *filter;
+  FILE *json;
+  int num_results;
+};
+
+static double micro_now_s(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const double NS_PER_S = 1e9;
+  return (double)ts.tv_sec + (double)ts.tv_nsec / NS_PER_S;
+}
+
+static int micro_wanted(const struct Micro *micro, const char *name) {
+  return !micro->filter || strstr(name, micro->filter);
+}
+
+static void micro_report(struct Micro *micro, const char *name, double ns) {
+  (void)printf("%-36s %14.1f ns/op\n", name, ns);
+  (void)fflush(stdout);
+  if (!micro->json)
+    return;
+  (void)fprintf(micro->json, "%s\n    {\"name\": \"%s\", \"ns_per_op\": %.3f}",
+                micro->num_results ? "," : "", name, ns);
+  micro->num_results += 1;
+}
+
+// Nanoseconds per call of op, fastest of micro->runs batches
+static double micro_time(const struct Micro *micro, micro_op_t op,
+                         void *state) {
+  uint64_t batch = 1;
+  uint64_t iteration = 0;
+  double elapsed = 0;
+  for (;;) {
+    double start = micro_now_s();
+    for (uint64_t ii = 0; ii < batch; ++ii)
+      op(state, iteration++);
+    elapsed = micro_now_s() - start;
+    if (elapsed >= micro->min_s || batch >= MICRO_MAX_BATCH)
+      break;
+    batch *= 2;
+  }
+
+  double best = elapsed;
+  for (int run = 1; run < micro->runs; ++run) {
+    double start = micro_now_s();
+    for (uint64_t ii = 0; ii < batch; ++ii)
+      op(state, iteration++);
+    elapsed = micro_now_s() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+  const double NS_PER_S = 1e9;
+  return best * NS_PER_S / (double)batch;
+}
+
+static void micro_run(struct Micro *micro, const char *name, micro_op_t op,
+                      void *state) {
+  if (micro_wanted(micro, name))
+    micro_report(micro, name, micro_time(micro, op, state));
+}
+
+/***************
+  Peers
+ ***************/
+struct MicroPeers { // NOLINT(altera-struct-pack-align)
+  struct PeerEnv env;
+  struct Peer *peers;
+  int num_peers;
+  int capacity;
+  // Precomputed, so that only the code under test is timed
+  char (*handles)[MICRO_TEXT_SIZE];
+  char (*addresses)[MICRO_TEXT_SIZE];
+  char (*targets)[MICRO_TEXT_SIZE];
+  struct PeerTargets *cache;
+  char my_address[MICRO_TEXT_SIZE];
+  int failed;
+};
+
+// Fingerprints repeat past 65535 peers, handles tell the peers apart
+static fingerprint_t micro_fingerprint(int peer) {
+  const int FINGERPRINTS = 65535;
+  return (fingerprint_t)(peer % FINGERPRINTS + 1);
+}
+
+// Visits the peers in a scattered order, the same on every run
+static int micro_pick(const struct MicroPeers *state, uint64_t iteration) {
+  const uint64_t GOLDEN = 2654435761U;
+  return (int)(iteration * GOLDEN % (uint64_t)state->num_peers);
+}
+
+static int micro_peers_setup(struct MicroPeers *state, int capacity) {
+  state->capacity = capacity;
+  (void)strcpy(state->my_address, "127.0.0.1:1");
+  state->handles = calloc(capacity, MICRO_TEXT_SIZE);
+  state->addresses = calloc(capacity, MICRO_TEXT_SIZE);
+  state->targets = calloc(capacity, MICRO_TEXT_SIZE);
+  state->cache = peer_targets_new();
+  if (!state->handles || !state->addresses || !state->targets ||
+      !state->cache)
+    return -1;
+  for (int ii = 0; ii < capacity; ++ii) {
+    int host = ii + 1; // skip 127.0.0.0
+    const int BYTE = 0xff;
+    (void)snprintf(state->handles[ii], MICRO_TEXT_SIZE, "peer%d", ii);
+    (void)snprintf(state->addresses[ii], MICRO_TEXT_SIZE, "127.%d.%d.%d:%d",
+                   (host >> 16) & BYTE, (host >> 8) & BYTE, host & BYTE,
+                   MICRO_PORT);
+    (void)snprintf(state->targets[ii], MICRO_TEXT_SIZE, "peer%d#%d", ii,
+                   micro_fingerprint(ii));
+  }
+  return 0;
+}
+
+static void micro_peers_clear(struct MicroPeers *state) {
+  peers_free(state->peers, state->num_peers);
+  state->peers = 0;
+  state->num_peers = 0;
+  peer_directory_free(state->env.directory);
+  state->env.directory = 0;
+}
+
+static void micro_peers_teardown(struct MicroPeers *state) {
+  micro_peers_clear(state);
+  peer_targets_free(state->cache);
+  free(state->targets);
+  free(state->addresses);
+  free(state->handles);
+}
+
+static void micro_track(struct MicroPeers *state, int peer) {
+  if (peer_track(state->handles[peer], micro_fingerprint(peer),
+                 state->addresses[peer], &state->peers, &state->num_peers,
+                 state->my_address, &state->env, /*do_connect*/ 0) == -1)
+    state->failed = 1;
+}
+
+// Tracks num_peers new peers, the fastest of micro->runs times. Leaves them
+// tracked for the lookups.
+static double micro_peers_add(const struct Micro *micro,
+                              struct MicroPeers *state, int num_peers) {
+  double best = 0;
+  for (int run = 0; run < micro->runs; ++run) {
+    micro_peers_clear(state);
+    state->env.directory = peer_directory_new();
+    if (!state->env.directory) {
+      state->failed = 1;
+      return 0;
+    }
+    double start = micro_now_s();
+    for (int ii = 0; ii < num_peers; ++ii)
+      micro_track(state, ii);
+    double elapsed = micro_now_s() - start;
+    if (run == 0 || elapsed < best)
+      best = elapsed;
+  }
+  const double NS_PER_S = 1e9;
+  return best * NS_PER_S / num_peers;
+}
+
+// Tracking a peer we already have finds it by address
+static void micro_track_existing(void *arg, uint64_t iteration) {
+  struct MicroPeers *state = arg;
+  micro_track(state, micro_pick(state, iteration));
+}
+
+// Parses handle#fingerprint and scans the peers for it
+static void micro_resolve(void *arg, uint64_t iteration) {
+  struct MicroPeers *state = arg;
+  char target[MICRO_TEXT_SIZE];
+  (void)memcpy(target, state->targets[micro_pick(state, iteration)],
+               MICRO_TEXT_SIZE);
+  fingerprint_t fingerprint = 0;
+  if (peer_resolve_fingerprint(target, state->peers, state->num_peers,
+                               &fingerprint) == -1)
+    state->failed = 1;
+}
+
+// Sending to the same peer again, which the cache answers
+static void micro_resolve_cached(void *arg, uint64_t iteration) {
+  (void)iteration;
+  struct MicroPeers *state = arg;
+  const char *target = state->targets[state->num_peers / 2];
+  if (peer_targets_resolve(state->cache, target, strlen(target), state->peers,
+                           state->num_peers) == -1)
+    state->failed = 1;
+}
+
+static void micro_peers(struct Micro *micro, struct MicroPeers *state,
+                        int max_peers) {
+  const int STEP = 10;
+  for (int num_peers = STEP; num_peers <= max_peers; num_peers *= STEP) {
+    char name[MICRO_NAME_SIZE];
+    (void)snprintf(name, sizeof(name), "peer_track.add/%d", num_peers);
+    double add_ns = micro_peers_add(micro, state, num_peers);
+    if (micro_wanted(micro, name))
+      micro_report(micro, name, add_ns);
+
+    (void)snprintf(name, sizeof(name), "peer_track.existing/%d", num_peers);
+    micro_run(micro, name, micro_track_existing, state);
+    (void)snprintf(name, sizeof(name), "peer_resolve_fingerprint/%d",
+                   num_peers);
+    micro_run(micro, name, micro_resolve, state);
+    (void)snprintf(name, sizeof(name), "peer_targets_resolve.cached/%d",
+                   num_peers);
+    micro_run(micro, name, micro_resolve_cached, state);
+  }
+}
+
+// Time taken to start notifying every peer, per peer. The first run also
+// gives the peers their links. The requests fail against the discard port
+// and are finished between runs.
+static void micro_fanout(struct Micro *micro, struct MicroPeers *state,
+                         int max_peers) {
+  const int STEP = 10;
+  for (int num_peers = STEP; num_peers <= max_peers; num_peers *= STEP) {
+    char name[MICRO_NAME_SIZE];
+    (void)snprintf(name, sizeof(name), "peers_notify_new_handle/%d",
+                   num_peers);
+    if (!micro_wanted(micro, name))
+      continue;
+    micro_peers_clear(state);
+    state->env.directory = peer_directory_new();
+    if (!state->env.directory) {
+      state->failed = 1;
+      return;
+    }
+    for (int ii = 0; ii < num_peers; ++ii)
+      micro_track(state, ii);
+
+    double best = 0;
+    for (int run = 0; run < micro->runs; ++run) {
+      double start = micro_now_s();
+      peers_notify_new_handle(run % 2 ? "micro" : "orcim", 1, state->peers,
+                              state->num_peers);
+      double elapsed = micro_now_s() - start;
+      if (run == 0 || elapsed < best)
+        best = elapsed;
+      const int SETTLE_US = 250000;
+      struct timeval settle = {0, SETTLE_US};
+      (void)event_base_loopexit(state->env.base, &settle);
+      (void)event_base_dispatch(state->env.base);
+    }
+    const double NS_PER_S = 1e9;
+    micro_report(micro, name, best * NS_PER_S / num_peers);
+  }
+}
+
+/***************
+  Parsing and encoding
+ ***************/
+struct MicroMessage { // NOLINT(altera-struct-pack-align)
+  struct MessageRequest *request;
+  struct evbuffer *buffer;
+  char *encoded;
+  size_t encoded_length;
+  int failed;
+};
+
+static void micro_marshal(void *arg, uint64_t iteration) {
+  (void)iteration;
+  struct MicroMessage *state = arg;
+  MessageRequest_marshal(state->buffer, state->request);
+  (void)evbuffer_drain(state->buffer, evbuffer_get_length(state->buffer));
+}
+
+// Copying the bytes in is part of it, as when evrpc reads a request
+static void micro_unmarshal(void *arg, uint64_t iteration) {
+  (void)iteration;
+  struct MicroMessage *state = arg;
+  (void)evbuffer_add(state->buffer, state->encoded, state->encoded_length);
+  MessageRequest_clear(state->request);
+  if (MessageRequest_unmarshal(state->request, state->buffer) == -1)
+    state->failed = 1;
+}
+
+static int micro_message_setup(struct MicroMessage *state, size_t size) {
+  char *text = malloc(size + 1);
+  state->request = MessageRequest_new();
+  state->buffer = evbuffer_new();
+  if (!text || !state->request || !state->buffer)
+    goto failure;
+  (void)memset(text, 'x', size);
+  text[size] = 0;
+  const uint64_t SENT_MS = 1700000000000ULL;
+  (void)EVTAG_ASSIGN(state->request, message, text);
+  (void)EVTAG_ASSIGN(state->request, fingerprint, 1);
+  (void)EVTAG_ASSIGN(state->request, session, 1);
+  (void)EVTAG_ASSIGN(state->request, sequence, 1);
+  (void)EVTAG_ASSIGN(state->request, oldest, 1);
+  (void)EVTAG_ASSIGN(state->request, sent, SENT_MS);
+  free(text);
+  text = 0;
+
+  MessageRequest_marshal(state->buffer, state->request);
+  state->encoded_length = evbuffer_get_length(state->buffer);
+  state->encoded = malloc(state->encoded_length);
+  if (!state->encoded)
+    goto failure;
+  (void)evbuffer_remove(state->buffer, state->encoded, state->encoded_length);
+  return 0;
+
+failure:
+  free(text);
+  return -1;
+}
+
+static void micro_message_teardown(struct MicroMessage *state) {
+  free(state->encoded);
+  if (state->buffer)
+    evbuffer_free(state->buffer);
+  if (state->request)
+    MessageRequest_free(state->request);
+}
+
+static int micro_messages(struct Micro *micro) {
+  const size_t SIZES[] = {16, 256, 4096, RPC_MAX_MESSAGE_LEN};
+  for (unsigned ii = 0; ii < ARRAY_SIZE(SIZES); ++ii) {
+    struct MicroMessage state = {0};
+    if (micro_message_setup(&state, SIZES[ii]) == -1) {
+      micro_message_teardown(&state);
+      return -1;
+    }
+    char name[MICRO_NAME_SIZE];
+    (void)snprintf(name, sizeof(name), "MessageRequest.marshal/%zu",
+                   SIZES[ii]);
+    micro_run(micro, name, micro_marshal, &state);
+    (void)snprintf(name, sizeof(name), "MessageRequest.unmarshal/%zu",
+                   SIZES[ii]);
+    micro_run(micro, name, micro_unmarshal, &state);
+    micro_message_teardown(&state);
+    if (state.failed)
+      return -1;
+  }
+  return 0;
+}
+
+struct MicroParse { // NOLINT(altera-struct-pack-align)
+  const char *text;
+  struct Peer *peers;
+  int num_peers;
+  int failed;
+};
+
+// There is one peer, so this is all parsing
+static void micro_parse_handle(void *arg, uint64_t iteration) {
+  (void)iteration;
+  struct MicroParse *state = arg;
+  char target[MICRO_TEXT_SIZE];
+  (void)strncpy(target, state->text, sizeof(target));
+  fingerprint_t fingerprint = 0;
+  if (peer_resolve_fingerprint(target, state->peers, state->num_peers,
+                               &fingerprint) == -1)
+    state->failed = 1;
+}
+
+// What peer_track does with host:port before looking the peer up
+static void micro_parse_address(void *arg, uint64_t iteration) {
+  (void)iteration;
+  struct MicroParse *state = arg;
+  char host[MICRO_TEXT_SIZE];
+  uint16_t port = 0;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = 0;
+  if (address_split(state->text, host, &port) == -1 ||
+      address_parse_numeric(host, port, &addr, &addrlen) == -1)
+    state->failed = 1;
+}
+
+static int micro_parse(struct Micro *micro, struct MicroPeers *peers) {
+  struct MicroParse state = {0};
+
+  micro_peers_clear(peers);
+  peers->env.directory = peer_directory_new();
+  if (!peers->env.directory)
+    return -1;
+  micro_track(peers, 0);
+  state.peers = peers->peers;
+  state.num_peers = peers->num_peers;
+  state.text = peers->targets[0];
+  micro_run(micro, "parse.handle", micro_parse_handle, &state);
+
+  state.text = "127.0.0.1:9000";
+  micro_run(micro, "parse.address/ipv4", micro_parse_address, &state);
+  state.text = "[2001:db8:85a3::8a2e:370:7334]:9000";
+  micro_run(micro, "parse.address/ipv6", micro_parse_address, &state);
+  return state.failed ? -1 : 0;
+}
+
+static void usage(const char *argv0) {
+  (void)printf("Usage: %s [-o results.json] [-f filter] [-n max peers] "
+               "[-F max fanout peers] [-m ms] [-r runs] [-t transport]\n",
+               argv0);
+}
+
+int main(int argc, char *argv[]) {
+  int ret = EXIT_FAILURE;
+  struct Micro micro = {0};
+  const char *json_path = 0;
+  const char *transport_name = "http";
+  int max_peers = 1000000;
+  int max_fanout = 10000;
+  int min_ms = 20;
+  micro.runs = 5;
+
+  int opt = 0;
+  const int base = 10;
+  while ((opt = getopt(argc, argv, "o:f:n:F:m:r:t:h")) != -1) {
+    switch (opt) {
+    case 'o':
+      json_path = optarg;
+      break;
+    case 'f':
+      micro.filter = optarg;
+      break;
+    case 'n':
+      max_peers = (int)strtol(optarg, NULL, base);
+      break;
+    case 'F':
+      max_fanout = (int)strtol(optarg, NULL, base);
+      break;
+    case 'm':
+      min_ms = (int)strtol(optarg, NULL, base);
+      break;
+    case 'r':
+      micro.runs = (int)strtol(optarg, NULL, base);
+      break;
+    case 't':
+      transport_name = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  struct MicroPeers peers = {0};
+  peers.env.transport = transport_find(transport_name);
+  const int MAX_PEERS = 1 << 24; // addresses in 127.0.0.0/8
+  if (!peers.env.transport || max_peers < 1 || max_peers > MAX_PEERS ||
+      max_fanout < 0 || max_fanout > max_peers || min_ms < 1 ||
+      micro.runs < 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const double MS_PER_S = 1000.0;
+  micro.min_s = min_ms / MS_PER_S;
+
+  // Every peer logs as it is tracked, and failed notifications log too
+  if (!freopen("/dev/null", "w", stderr))
+    return EXIT_FAILURE;
+
+  peers.env.base = event_base_new();
+  if (!peers.env.base)
+    goto failure1;
+  if (peers.env.transport->ctx_new) {
+    peers.env.transport_ctx = peers.env.transport->ctx_new(peers.env.base);
+    if (!peers.env.transport_ctx)
+      goto failure2;
+  }
+  if (micro_peers_setup(&peers, max_peers) == -1)
+    goto failure3;
+
+  if (json_path) {
+    micro.json = fopen(json_path, "w");
+    if (!micro.json) {
+      (void)printf("Cannot write %s\n", json_path);
+      goto failure3;
+    }
+    (void)fprintf(micro.json, "{\n  \"unit\": \"ns/op\",\n  \"results\": [");
+  }
+
+  micro_peers(&micro, &peers, max_peers);
+  micro_fanout(&micro, &peers, max_fanout);
+  if (peers.failed || micro_messages(&micro) == -1 ||
+      micro_parse(&micro, &peers) == -1) {
+    (void)printf("A benchmark failed, the numbers above are suspect\n");
+    goto failure4;
+  }
+  ret = EXIT_SUCCESS;
+
+failure4:
+  if (micro.json) {
+    (void)fprintf(micro.json, "\n  ]\n}\n");
+    (void)fclose(micro.json);
+  }
+failure3:
+  micro_peers_teardown(&peers);
+  if (peers.env.transport_ctx)
+    peers.env.transport->ctx_free(peers.env.transport_ctx);
+failure2:
+  event_base_free(peers.env.base);
+failure1:
+  return ret;
+}
@@ -0,0 +1,166 @@
+// Memory benchmark for tracked peers.
+//
+// Tracks a large number of peers without connecting to them, the way a node
+// learns of peers it may never talk to, and reports how much resident memory
+// each one costs. Then pings a sample of them so that they get a link and
+// reports what a peer in use costs on top. Addresses are spread over
+// 127.0.0.0/8 with a port nobody listens on, so the pings fail fast.
+//
+// Usage: p2ppeers [-t transport] [-n peers] [-u distinct handles]
+//                 [-p peers to ping]
+#include "peer.h"
+#include "transport.h"
+#include "types.h"
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 9 // discard, which nothing listens on
+
+static long bench_rss_bytes(void) {
+  long size = 0;
+  long resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  (void)fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double bench_now_s(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const double NS_PER_S = 1e9;
+  return (double)ts.tv_sec + (double)ts.tv_nsec / NS_PER_S;
+}
+
+static void usage(const char *argv0) {
+  (void)printf("Usage: %s [-t transport] [-n peers] [-u distinct handles] "
+               "[-p peers to ping]\n",
+               argv0);
+}
+
+int main(int argc, char *argv[]) {
+  int ret = EXIT_FAILURE;
+  const char *transport_name = "http";
+  int num_tracked = 1000000;
+  int num_handles = 1000;
+  int num_pinged = 1000;
+
+  int opt = 0;
+  const int base = 10;
+  while ((opt = getopt(argc, argv, "t:n:u:p:h")) != -1) {
+    switch (opt) {
+    case 't':
+      transport_name = optarg;
+      break;
+    case 'n':
+      num_tracked = (int)strtol(optarg, NULL, base);
+      break;
+    case 'u':
+      num_handles = (int)strtol(optarg, NULL, base);
+      break;
+    case 'p':
+      num_pinged = (int)strtol(optarg, NULL, base);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  struct PeerEnv env = {0};
+  env.transport = transport_find(transport_name);
+  const int MAX_TRACKED = 1 << 24; // addresses in 127.0.0.0/8
+  if (!env.transport || num_tracked < 1 || num_tracked > MAX_TRACKED ||
+      num_handles < 1 || num_pinged < 0 || num_pinged > num_tracked) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Every peer logs as it is tracked
+  if (!freopen("/dev/null", "w", stderr))
+    return EXIT_FAILURE;
+
+  env.base = event_base_new();
+  if (!env.base)
+    goto failure1;
+  if (env.transport->ctx_new) {
+    env.transport_ctx = env.transport->ctx_new(env.base);
+    if (!env.transport_ctx)
+      goto failure2;
+  }
+  env.directory = peer_directory_new();
+  if (!env.directory)
+    goto failure3;
+
+  struct Peer *peers = 0;
+  int num_peers = 0;
+  char my_address[] = "127.0.0.1:1";
+  long rss_start = bench_rss_bytes();
+  double start_s = bench_now_s();
+
+  for (int ii = 0; ii < num_tracked; ++ii) {
+    char handle[32];
+    char address[32];
+    (void)snprintf(handle, sizeof(handle), "peer%d", ii % num_handles);
+    int host = ii + 1; // skip 127.0.0.0
+    const int BYTE = 0xff;
+    (void)snprintf(address, sizeof(address), "127.%d.%d.%d:%d",
+                   (host >> 16) & BYTE, (host >> 8) & BYTE, host & BYTE,
+                   BENCH_PORT);
+    if (peer_track(handle, (fingerprint_t)ii, address, &peers, &num_peers,
+                   my_address, &env, /*do_connect*/ 0) == -1 ||
+        num_peers != ii + 1) {
+      (void)printf("Could not track peer %d\n", ii);
+      goto failure4;
+    }
+  }
+
+  double track_s = bench_now_s() - start_s;
+  long rss_tracked = bench_rss_bytes();
+
+  for (int ii = 0; ii < num_pinged; ++ii) {
+    if (peer_ping(0, ii, peers, num_peers) == -1) {
+      (void)printf("Could not ping peer %d\n", ii);
+      goto failure4;
+    }
+  }
+  // Long enough for the refused connections to come back
+  struct timeval settle = {1, 0};
+  (void)event_base_loopexit(env.base, &settle);
+  (void)event_base_dispatch(env.base);
+  long rss_pinged = bench_rss_bytes();
+
+  const double KIB = 1024;
+  (void)printf("%s: %d peers, %d handles, tracked in %.3fs (%.2f us/peer)\n",
+               env.transport->name, num_peers, num_handles, track_s,
+               track_s * 1e6 / num_peers);
+  (void)printf("rss %.0f KiB at start, %.0f KiB tracked, %.0f KiB after "
+               "pinging %d\n",
+               (double)rss_start / KIB, (double)rss_tracked / KIB,
+               (double)rss_pinged / KIB, num_pinged);
+  (void)printf("%.1f bytes/tracked peer", (double)(rss_tracked - rss_start) /
+                                              num_peers);
+  if (num_pinged > 0)
+    (void)printf(", %.1f more bytes/pinged peer",
+                 (double)(rss_pinged - rss_tracked) / num_pinged);
+  (void)printf("\n");
+  ret = EXIT_SUCCESS;
+
+failure4:
+  peers_free(peers, num_peers);
+  peer_directory_free(env.directory);
+failure3:
+  if (env.transport_ctx)
+    env.transport->ctx_free(env.transport_ctx);
+failure2:
+  event_base_free(env.base);
+failure1:
+  return ret;
+}
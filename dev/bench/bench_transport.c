@@ -0,0 +1,299 @@
+// Loopback benchmark for the transports.
+//
+// A server and a number of links to it run on one event loop, each link
+// keeping a window of message requests in flight until the total is sent.
+// Reports throughput, latency percentiles and the CPU time of the whole
+// process, which covers both ends.
+//
+// Usage: p2pbench [-t transport] [-n requests] [-c links] [-w window]
+//                 [-s message bytes]
+#include "address.h"
+#include "generated/rpc.h"
+#include "log.h"
+#include "rpc.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <event2/event.h>
+#include <event2/rpc.h>
+#include <event2/rpc_struct.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Bench;
+
+struct BenchLink {
+  struct Bench *bench;
+  void *link;
+};
+
+struct BenchRequest {
+  struct BenchLink *link;
+  uint64_t start_ns;
+};
+
+struct Bench { // NOLINT(altera-struct-pack-align)
+  const struct TransportOps *transport;
+  struct event_base *base;
+  char *message;
+  int num_requests;
+  int sent;
+  int done;
+  int failed;
+  uint64_t *latencies_ns;
+};
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t NS_PER_S = 1000000000;
+  return (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec;
+}
+
+static double bench_seconds(struct timeval tv) {
+  const double US_PER_S = 1e6;
+  return (double)tv.tv_sec + (double)tv.tv_usec / US_PER_S;
+}
+
+static void bench_dispatch(enum RpcType type, void *request, void *reply,
+                           void *arg) {
+  (void)type;
+  (void)request;
+  (void)reply;
+  (void)arg;
+  // MessageReply has nothing required, it is complete as it is
+}
+
+static int bench_send(struct BenchLink *link);
+
+static void bench_reply_cb(struct evrpc_status *status, void *request,
+                           void *reply, void *arg) {
+  struct BenchRequest *bench_request = CAST(struct BenchRequest *, arg);
+  struct BenchLink *link = bench_request->link;
+  struct Bench *bench = link->bench;
+
+  if (status->error != EVRPC_STATUS_ERR_NONE)
+    bench->failed += 1;
+  bench->latencies_ns[bench->done++] = bench_now_ns() - bench_request->start_ns;
+  MessageRequest_free(request);
+  MessageReply_free(reply);
+  free(bench_request);
+
+  if (bench->done == bench->num_requests)
+    (void)event_base_loopbreak(bench->base);
+  else if (bench->sent < bench->num_requests && bench_send(link) == -1)
+    (void)event_base_loopbreak(bench->base);
+}
+
+static int bench_send(struct BenchLink *link) {
+  struct Bench *bench = link->bench;
+  struct BenchRequest *bench_request = calloc(1, sizeof(struct BenchRequest));
+  struct MessageRequest *request = MessageRequest_new();
+  struct MessageReply *reply = MessageReply_new();
+  if (!bench_request || !request || !reply)
+    goto failure;
+  EVTAG_ASSIGN(request, message, bench->message);
+  EVTAG_ASSIGN(request, fingerprint, 1);
+
+  bench_request->link = link;
+  bench_request->start_ns = bench_now_ns();
+  if (bench->transport->request(link->link, RPC_MESSAGE, request, reply,
+                                bench_reply_cb, bench_request) == -1)
+    goto failure;
+  bench->sent += 1;
+  return 0;
+
+failure:
+  (void)printf("Could not send request %d\n", bench->sent);
+  if (request)
+    MessageRequest_free(request);
+  if (reply)
+    MessageReply_free(reply);
+  free(bench_request);
+  return -1;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+static void bench_report(struct Bench *bench, double wall_s,
+                         struct rusage *before, struct rusage *after) {
+  qsort(bench->latencies_ns, bench->done, sizeof(uint64_t), bench_compare);
+  const double NS_PER_US = 1000;
+  const double P50 = 0.5;
+  const double P99 = 0.99;
+  uint64_t p50 = bench->latencies_ns[(int)(bench->done * P50)];
+  uint64_t p99 = bench->latencies_ns[(int)(bench->done * P99)];
+
+  struct timeval user = {0};
+  struct timeval sys = {0};
+  timersub(&after->ru_utime, &before->ru_utime, &user);
+  timersub(&after->ru_stime, &before->ru_stime, &sys);
+  double cpu_s = bench_seconds(user) + bench_seconds(sys);
+
+  (void)printf("%-6s %8d requests %6.3fs %10.0f req/s p50 %8.1f us p99 %8.1f "
+               "us cpu %.3fs user + %.3fs sys, %.2f us/request, %ld context "
+               "switches, %d failed\n",
+               bench->transport->name, bench->done, wall_s,
+               bench->done / wall_s, (double)p50 / NS_PER_US,
+               (double)p99 / NS_PER_US, bench_seconds(user),
+               bench_seconds(sys), cpu_s * NS_PER_US * NS_PER_US / bench->done,
+               (after->ru_nvcsw - before->ru_nvcsw) +
+                   (after->ru_nivcsw - before->ru_nivcsw),
+               bench->failed);
+}
+
+static void usage(const char *argv0) {
+  (void)printf("Usage: %s [-t transport] [-n requests] [-c links] "
+               "[-w window] [-s message bytes]\n",
+               argv0);
+  (void)printf("Transports:");
+  const char *names[] = {"http", "uring", "udp"};
+  for (unsigned ii = 0; ii < ARRAY_SIZE(names); ++ii) {
+    if (transport_find(names[ii]))
+      (void)printf(" %s", names[ii]);
+  }
+  (void)printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  int ret = EXIT_FAILURE;
+  const char *transport_name = "http";
+  int num_links = 1;
+  int window = 1;
+  int message_size = 64;
+
+  struct Bench bench = {0};
+  bench.num_requests = 100000;
+
+  int opt = 0;
+  const int base = 10;
+  while ((opt = getopt(argc, argv, "t:n:c:w:s:h")) != -1) {
+    switch (opt) {
+    case 't':
+      transport_name = optarg;
+      break;
+    case 'n':
+      bench.num_requests = (int)strtol(optarg, NULL, base);
+      break;
+    case 'c':
+      num_links = (int)strtol(optarg, NULL, base);
+      break;
+    case 'w':
+      window = (int)strtol(optarg, NULL, base);
+      break;
+    case 's':
+      message_size = (int)strtol(optarg, NULL, base);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  bench.transport = transport_find(transport_name);
+  if (!bench.transport || bench.num_requests < 1 || num_links < 1 ||
+      window < 1 || message_size < 0 || message_size > RPC_MAX_MESSAGE_LEN) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  bench.message = malloc(message_size + 1);
+  bench.latencies_ns = calloc(bench.num_requests, sizeof(uint64_t));
+  struct BenchLink *links = calloc(num_links, sizeof(struct BenchLink));
+  if (!bench.message || !bench.latencies_ns || !links)
+    goto failure1;
+  memset(bench.message, 'x', message_size);
+  bench.message[message_size] = 0;
+
+  bench.base = event_base_new();
+  if (!bench.base)
+    goto failure1;
+
+  void *ctx = 0;
+  if (bench.transport->ctx_new) {
+    ctx = bench.transport->ctx_new(bench.base);
+    if (!ctx)
+      goto failure2;
+  }
+
+  char *address = 0;
+  // Every client is on loopback, admission would only get in the way
+  void *server = bench.transport->listen(ctx, bench.base, bench_dispatch, NULL,
+                                         &bench, &address);
+  if (!server)
+    goto failure3;
+
+  // The server listens on every address, reach it over IPv4 loopback
+  char host[ADDRESS_MAX_LEN] = {0};
+  uint16_t port = 0;
+  struct sockaddr_storage addr = {0};
+  socklen_t addrlen = 0;
+  if (address_split(address, host, &port) == -1 ||
+      address_parse_numeric("127.0.0.1", port, &addr, &addrlen) != 0)
+    goto failure4;
+
+  for (int ii = 0; ii < num_links; ++ii) {
+    links[ii].bench = &bench;
+    links[ii].link = bench.transport->link_new(
+        ctx, bench.base, (struct sockaddr *)&addr, addrlen);
+    if (!links[ii].link)
+      goto failure5;
+  }
+
+  (void)printf("%s: %d requests of %d bytes over %d links, %d in flight on "
+               "each\n",
+               bench.transport->name, bench.num_requests, message_size,
+               num_links, window);
+
+  struct rusage before = {0};
+  struct rusage after = {0};
+  (void)getrusage(RUSAGE_SELF, &before);
+  uint64_t start_ns = bench_now_ns();
+
+  for (int ii = 0; ii < num_links; ++ii) {
+    for (int jj = 0; jj < window && bench.sent < bench.num_requests; ++jj) {
+      if (bench_send(&links[ii]) == -1)
+        goto failure5;
+    }
+  }
+  (void)event_base_dispatch(bench.base);
+
+  const double NS_PER_S = 1e9;
+  double wall_s = (double)(bench_now_ns() - start_ns) / NS_PER_S;
+  (void)getrusage(RUSAGE_SELF, &after);
+
+  if (bench.done == bench.num_requests) {
+    bench_report(&bench, wall_s, &before, &after);
+    ret = bench.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else {
+    (void)printf("Only %d of %d requests finished\n", bench.done,
+                 bench.num_requests);
+  }
+
+failure5:
+  for (int ii = 0; ii < num_links; ++ii) {
+    if (links[ii].link)
+      bench.transport->link_free(links[ii].link);
+  }
+failure4:
+  bench.transport->close(server);
+  free(address);
+failure3:
+  if (ctx)
+    bench.transport->ctx_free(ctx);
+failure2:
+  event_base_free(bench.base);
+failure1:
+  free(links);
+  free(bench.latencies_ns);
+  free(bench.message);
+  return ret;
+}
@@ -0,0 +1,127 @@
+// Example of embedding libp2pchat, see src/p2pchat.h.
+//
+// Runs two nodes in this one process, each with its own event_base, and has
+// bob send alice messages once they are connected. alice answers the last
+// one. Nothing reads the terminal, so it runs as well from a script.
+//
+// Usage: p2pembed [-n messages] [-t transport]
+#include "p2pchat.h"
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMBED_TIMEOUT_S 30
+#define EMBED_NAME_SIZE 64
+
+struct Embed { // NOLINT(altera-struct-pack-align)
+  struct P2pNode *alice;
+  struct P2pNode *bob;
+  int messages;
+  int received; // by alice
+  int sent;     // acknowledged by alice
+  int failed;
+  int answered; // bob got alice's answer
+};
+
+static void alice_message_cb(struct P2pNode *node, const char *peer,
+                             const char *message, void *arg) {
+  struct Embed *embed = arg;
+  embed->received += 1;
+  if (embed->received == embed->messages &&
+      p2p_node_send(node, peer, "got them all", 0, 0) == -1)
+    embed->failed += 1;
+  (void)message;
+}
+
+static void bob_message_cb(struct P2pNode *node, const char *peer,
+                           const char *message, void *arg) {
+  (void)node;
+  struct Embed *embed = arg;
+  printf("%s answered: %s\n", peer, message);
+  embed->answered = 1;
+}
+
+static void bob_sent_cb(struct P2pNode *node, int error, void *arg) {
+  (void)node;
+  struct Embed *embed = arg;
+  if (error)
+    embed->failed += 1;
+  else
+    embed->sent += 1;
+}
+
+static void bob_peer_cb(struct P2pNode *node, const char *peer, void *arg) {
+  struct Embed *embed = arg;
+  printf("bob connected to %s\n", peer);
+  char text[EMBED_NAME_SIZE] = {0};
+  for (int ii = 0; ii < embed->messages; ++ii) {
+    (void)snprintf(text, sizeof(text), "message %d", ii);
+    if (p2p_node_send(node, peer, text, bob_sent_cb, embed) == -1)
+      embed->failed += 1;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct Embed embed = {0};
+  embed.messages = 100;
+  const char *transport = 0;
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    const int base = 10;
+    if (opt == 'n')
+      embed.messages = (int)strtol(optarg, NULL, base);
+    else if (opt == 't')
+      transport = optarg;
+    else {
+      (void)fprintf(stderr, "Usage: %s [-n messages] [-t transport]\n",
+                    argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  P2pConfig config = {0};
+  config.transport = transport;
+  config.cbarg = &embed;
+
+  config.fingerprint = 1;
+  config.handle = "alice";
+  config.message_cb = alice_message_cb;
+  embed.alice = p2p_node_new(&config);
+
+  config.fingerprint = 2;
+  config.handle = "bob";
+  config.message_cb = bob_message_cb;
+  config.peer_cb = bob_peer_cb;
+  embed.bob = p2p_node_new(&config);
+
+  int ret = EXIT_FAILURE;
+  if (!embed.alice || !embed.bob ||
+      p2p_node_connect(embed.bob, p2p_node_address(embed.alice)) == -1)
+    goto done;
+
+  // Each node has its own event_base, so take turns without blocking
+  time_t deadline = time(NULL) + EMBED_TIMEOUT_S;
+  const useconds_t IDLE_US = 1000;
+  while (!embed.answered || embed.sent + embed.failed < embed.messages) {
+    int alice = p2p_node_poll(embed.alice);
+    int bob = p2p_node_poll(embed.bob);
+    if (alice == -1 || bob == -1 || time(NULL) > deadline)
+      break;
+    (void)usleep(IDLE_US);
+  }
+
+  printf("alice received %d of %d, bob saw %d delivered and %d failed\n",
+         embed.received, embed.messages, embed.sent, embed.failed);
+  if (embed.answered && embed.received == embed.messages &&
+      embed.sent == embed.messages && !embed.failed)
+    ret = EXIT_SUCCESS;
+
+done:
+  p2p_node_free(embed.bob);
+  p2p_node_free(embed.alice);
+  libevent_global_shutdown();
+  return ret;
+}
@@ -0,0 +1,52 @@
+// Stand-in for libFuzzer's main when the compiler has no -fsanitize=fuzzer:
+// runs each file given on the command line through the target once, which is
+// enough to replay a corpus or a crash under gcc.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int replay_file(const char *path) {
+  int ret = -1;
+
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    goto failure1;
+
+  if (fseek(file, 0, SEEK_END) == -1)
+    goto failure2;
+  long size = ftell(file);
+  if (size < 0 || fseek(file, 0, SEEK_SET) == -1)
+    goto failure2;
+
+  uint8_t *data = malloc(size ? size : 1);
+  if (!data)
+    goto failure2;
+  if (fread(data, 1, size, file) != (size_t)size)
+    goto failure3;
+
+  (void)LLVMFuzzerTestOneInput(data, size);
+  ret = 0;
+
+failure3:
+  free(data);
+failure2:
+  (void)fclose(file);
+failure1:
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  (void)LLVMFuzzerInitialize(&argc, &argv);
+
+  int ret = EXIT_SUCCESS;
+  for (int ii = 1; ii < argc; ++ii) {
+    if (replay_file(argv[ii]) == -1) {
+      perror(argv[ii]);
+      ret = EXIT_FAILURE;
+    }
+  }
+  return ret;
+}
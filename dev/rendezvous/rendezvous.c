@@ -0,0 +1,207 @@
+// Stand-in rendezvous server for the UDP transport, see src/rendezvous.h.
+//
+// Remembers the address each registering peer was seen at, and when one asks
+// to be introduced to another, tells both to punch through to each other.
+// Run it where both peers can reach it and start them with
+// P2P_TRANSPORT=udp P2P_RENDEZVOUS=host:port. Locally, P2P_UDP_FILTER=1 on the
+// peers makes them drop what a NAT would.
+//
+// Usage: p2prendezvous [-p port]
+#include "address.h"
+#include "rendezvous.h"
+#include "transport.h"
+#include "types.h"
+#include <errno.h>
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_DATAGRAM_MAX 64
+
+struct Registration {
+  struct AddressPacked addr;
+  time_t seen;
+};
+
+struct Server {
+  evutil_socket_t fd;
+  int family;
+  struct Registration *registrations;
+  int num_registrations;
+  int capacity;
+};
+
+static const char *server_format(const struct AddressPacked *addr, char *buf,
+                                 size_t len) {
+  struct sockaddr_storage storage = {0};
+  (void)address_unpack(addr, &storage);
+  if (address_format((struct sockaddr *)&storage, buf, len) == -1)
+    return "?";
+  return buf;
+}
+
+// Registered lately, forgetting whoever has not been
+static struct Registration *server_find(struct Server *server,
+                                        const struct AddressPacked *addr) {
+  time_t now = time(NULL);
+  for (int ii = 0; ii < server->num_registrations;) {
+    struct Registration *registration = &server->registrations[ii];
+    if (now - registration->seen > RENDEZVOUS_EXPIRY_S) {
+      *registration = server->registrations[--server->num_registrations];
+      continue;
+    }
+    if (memcmp(&registration->addr, addr, sizeof(*addr)) == 0)
+      return registration;
+    ++ii;
+  }
+  return 0;
+}
+
+static void server_send(struct Server *server, const struct AddressPacked *to,
+                        enum RendezvousType type,
+                        const struct AddressPacked *about) {
+  uint8_t datagram[1 + RENDEZVOUS_ADDRESS_MAX];
+  struct sockaddr_storage addr = {0};
+  (void)address_unpack(about, &addr);
+  int length = rendezvous_encode(datagram, type, &addr);
+  if (length == -1)
+    return;
+  socklen_t addrlen = address_unpack(to, &addr);
+  if (server->family == AF_INET6)
+    address_map(&addr, &addrlen);
+  if (sendto(server->fd, datagram, length, 0, (struct sockaddr *)&addr,
+             addrlen) == -1)
+    (void)fprintf(stderr, "Could not send: %s\n", strerror(errno));
+}
+
+static void server_register(struct Server *server,
+                            const struct AddressPacked *from) {
+  struct Registration *registration = server_find(server, from);
+  if (!registration) {
+    if (server->num_registrations == server->capacity) {
+      int capacity = server->capacity ? server->capacity * 2 : 16;
+      struct Registration *registrations = realloc(
+          server->registrations, capacity * sizeof(struct Registration));
+      if (!registrations)
+        return;
+      server->registrations = registrations;
+      server->capacity = capacity;
+    }
+    registration = &server->registrations[server->num_registrations++];
+    registration->addr = *from;
+    char buf[ADDRESS_MAX_LEN];
+    (void)printf("Registered %s\n", server_format(from, buf, sizeof(buf)));
+  }
+  registration->seen = time(NULL);
+  server_send(server, from, RENDEZVOUS_REGISTERED, from);
+}
+
+static void server_introduce(struct Server *server,
+                             const struct AddressPacked *from,
+                             const struct AddressPacked *to) {
+  char from_buf[ADDRESS_MAX_LEN];
+  char to_buf[ADDRESS_MAX_LEN];
+  if (!server_find(server, to)) {
+    (void)printf("%s asked for %s, which has not registered\n",
+                 server_format(from, from_buf, sizeof(from_buf)),
+                 server_format(to, to_buf, sizeof(to_buf)));
+    return;
+  }
+  server_send(server, to, RENDEZVOUS_PUNCH, from);
+  server_send(server, from, RENDEZVOUS_PUNCH, to);
+  (void)printf("Introduced %s to %s\n",
+               server_format(from, from_buf, sizeof(from_buf)),
+               server_format(to, to_buf, sizeof(to_buf)));
+}
+
+static void server_readable_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)flags;
+  struct Server *server = CAST(struct Server *, arg);
+  for (;;) {
+    uint8_t datagram[SERVER_DATAGRAM_MAX];
+    struct sockaddr_storage addr = {0};
+    socklen_t addrlen = sizeof(addr);
+    ssize_t length = recvfrom(fd, datagram, sizeof(datagram), 0,
+                              (struct sockaddr *)&addr, &addrlen);
+    if (length <= 0)
+      return;
+
+    struct AddressPacked from;
+    address_unmap(&addr, &addrlen);
+    if (address_pack(&addr, &from) == -1)
+      continue;
+    if (datagram[0] == RENDEZVOUS_REGISTER) {
+      server_register(server, &from);
+    } else if (datagram[0] == RENDEZVOUS_INTRODUCE) {
+      struct AddressPacked to;
+      if (rendezvous_decode_address(datagram, length, &addr, &addrlen) == -1)
+        continue;
+      address_unmap(&addr, &addrlen);
+      if (address_pack(&addr, &to) == 0)
+        server_introduce(server, &from, &to);
+    }
+  }
+}
+
+static void usage(const char *argv0) {
+  (void)printf("Usage: %s [-p port]\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  int ret = EXIT_FAILURE;
+  uint16_t port = 0;
+
+  int opt = 0;
+  const int base = 10;
+  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = (uint16_t)strtol(optarg, NULL, base);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  // Whoever runs this wants to watch the introductions as they happen
+  (void)setvbuf(stdout, NULL, _IOLBF, 0);
+
+  struct Server server = {0};
+  char *address = 0;
+  server.fd = transport_datagram_socket(port, &address);
+  if (server.fd == -1) {
+    (void)fprintf(stderr, "Could not bind port %u\n", port);
+    return EXIT_FAILURE;
+  }
+  struct sockaddr_storage bound = {0};
+  socklen_t bound_len = sizeof(bound);
+  if (getsockname(server.fd, (struct sockaddr *)&bound, &bound_len) == -1)
+    goto failure1;
+  server.family = bound.ss_family;
+
+  struct event_base *base_loop = event_base_new();
+  if (!base_loop)
+    goto failure1;
+  struct event *readable = event_new(base_loop, server.fd,
+                                     EV_READ | EV_PERSIST,
+                                     server_readable_cb, &server);
+  if (!readable || event_add(readable, 0) == -1)
+    goto failure2;
+
+  (void)printf("Rendezvous server on %s\n", address);
+  if (event_base_dispatch(base_loop) == 0)
+    ret = EXIT_SUCCESS;
+
+failure2:
+  if (readable)
+    event_free(readable);
+  event_base_free(base_loop);
+failure1:
+  (void)evutil_closesocket(server.fd);
+  free(server.registrations);
+  free(address);
+  return ret;
+}
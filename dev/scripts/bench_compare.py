@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Compares p2pmicro results against a baseline.
+
+Usage: bench_compare.py [-t percent] <baseline.json> <results.json>
+
+Prints every benchmark with its change in ns/op and marks the ones that got
+slower by more than the threshold (10% by default). Exits with 1 if any did,
+so that it can gate a build. Benchmarks only one side has are listed but do
+not fail the comparison. Both sides should come from the same machine and
+build type, see dev/bench/bench_micro.c.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)["results"]
+    return {r["name"]: r["ns_per_op"] for r in results}
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Compare p2pmicro results against a baseline")
+    parser.add_argument("-t", "--threshold", type=float, default=10.0,
+                        help="percent slower that counts as a regression")
+    parser.add_argument("baseline")
+    parser.add_argument("results")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    results = load(args.results)
+
+    regressions = 0
+    width = max(len(name) for name in list(baseline) + list(results))
+    for name, new in results.items():
+        old = baseline.get(name)
+        if old is None:
+            print(f"{name:<{width}} {new:14.1f} ns/op  (new)")
+            continue
+        change = (new - old) / old * 100 if old > 0 else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = "  faster"
+        print(f"{name:<{width}} {old:14.1f} -> {new:14.1f} ns/op "
+              f"{change:+7.1f}%{mark}")
+    for name in baseline:
+        if name not in results:
+            print(f"{name:<{width}} missing from {args.results}")
+
+    if regressions:
+        print(f"{regressions} regression(s) over {args.threshold:g}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -332,7 +332,10 @@ struct %(name)s *
             )
         filep.write(
             """      default:
-        return -1;
+        /* A field from a newer peer, skip it */
+        if (evtag_consume(evbuf) == -1)
+          return (-1);
+        break;
     }
   }
 
@@ -434,6 +437,8 @@ class Entry(object):
         self._line_count = -1
         self._struct = None
         self._refname = None
+        self._max_length = None
+        self._can_be_bounded = False
 
         self._optpointer = True
         self._optaddarg = True
@@ -473,7 +478,38 @@ class Entry(object):
     def MakeOptional(self):
         self._optional = True
 
+    def SetMaxLength(self, max_length):
+        self._max_length = max_length
+
+    def MaxLength(self):
+        return self._max_length
+
+    def CodeCheckLength(self):
+        """Rejects a field that is longer than its limit before anything is
+        allocated for it. The tag has been peeked but not consumed. Returns
+        an untranslated template that expects buf."""
+        if self._max_length is None:
+            return []
+        code = [
+            "{",
+            "  ev_uint32_t len_;",
+            "  if (evtag_payload_length(%(buf)s, &len_) == -1 ||",
+            "      len_ > (ev_uint32_t)(%(max)s)) {",
+            '    event_warnx("%%s: %(name)s is too long", __func__);',
+            "    return (-1);",
+            "  }",
+            "}",
+        ]
+        return code
+
     def Verify(self):
+        if self._max_length is not None and (
+            not self._can_be_bounded or self.Array()
+        ):
+            raise RpcGenError(
+                'Entry "%s" cannot have a maximum length '
+                "around line %d" % (self._name, self.LineCount())
+            )
         if self.Array() and not self._can_be_array:
             raise RpcGenError(
                 'Entry "%s" cannot be created as an array '
@@ -501,6 +537,7 @@ class Entry(object):
             "optpointer": self._optpointer and "*" or "",
             "optreference": self._optpointer and "&" or "",
             "optaddarg": self._optaddarg and ", const %s value" % self._ctype or "",
+            "max": self._max_length,
         }
         for (k, v) in list(extradict.items()):
             mapping[k] = v
@@ -763,6 +800,7 @@ class EntryString(Entry):
         super(EntryString, self).__init__(ent_type, name, tag)
 
         self._can_be_array = True
+        self._can_be_bounded = True
         self._ctype = "char *"
 
     @staticmethod
@@ -816,20 +854,27 @@ class EntryString(Entry):
 %(parent_name)s_%(name)s_assign(struct %(parent_name)s *msg,
     const %(ctype)s value)
 {
-  if (msg->%(name)s_data != NULL)
+%(check)s  if (msg->%(name)s_data != NULL)
     free(msg->%(name)s_data);
   if ((msg->%(name)s_data = strdup(value)) == NULL)
     return (-1);
   msg->%(name)s_set = 1;
   return (0);
 }""" % (
-            self.GetTranslation()
+            self.GetTranslation({"check": self.CodeAssignCheck()})
         )
 
         return code.split("\n")
 
+    def CodeAssignCheck(self):
+        if self._max_length is None:
+            return ""
+        return "  if (strnlen(value, (%(max)s) + 1) > (%(max)s))\n    return (-1);\n" % {
+            "max": self._max_length
+        }
+
     def CodeUnmarshal(self, buf, tag_name, var_name, _var_len):
-        code = [
+        code = self.CodeCheckLength() + [
             "if (evtag_unmarshal_string(%(buf)s, %(tag)s, &%(var)s) == -1) {",
             '  event_warnx("%%s: failed to unmarshal %(name)s", __func__);',
             "  return (-1);",
@@ -1059,6 +1104,7 @@ class EntryVarBytes(Entry):
         # Init base class
         super(EntryVarBytes, self).__init__(ent_type, name, tag)
 
+        self._can_be_bounded = True
         self._ctype = "ev_uint8_t *"
 
     @staticmethod
@@ -1095,6 +1141,13 @@ class EntryVarBytes(Entry):
             "const %s value, ev_uint32_t len)"
             % (self._struct.Name(), name, self._struct.Name(), self._ctype),
             "{",
+        ]
+        if self._max_length is not None:
+            code += [
+                "  if (len > (ev_uint32_t)(%s))" % self._max_length,
+                "    return (-1);",
+            ]
+        code += [
             "  if (msg->%s_data != NULL)" % name,
             "    free (msg->%s_data);" % name,
             "  msg->%s_data = malloc(len);" % name,
@@ -1125,7 +1178,7 @@ class EntryVarBytes(Entry):
         return code
 
     def CodeUnmarshal(self, buf, tag_name, var_name, var_len):
-        code = [
+        code = self.CodeCheckLength() + [
             "if (evtag_payload_length(%(buf)s, &%(varlen)s) == -1)",
             "  return (-1);",
             # We do not want DoS opportunities
@@ -1471,6 +1524,8 @@ def NormalizeLine(line):
 
 ENTRY_NAME_RE = re.compile(r"(?P<name>[^\[\]]+)(\[(?P<fixed_length>.*)\])?")
 ENTRY_TAG_NUMBER_RE = re.compile(r"(0x)?\d+", re.I)
+# string name = 1 [max = LIMIT] bounds what unmarshalling will accept
+ENTRY_OPTIONS_RE = re.compile(r"^\[ ?max ?= ?(?P<max>\w+) ?\]$")
 
 
 def ProcessOneEntry(factory, newstruct, entry):
@@ -1482,6 +1537,7 @@ def ProcessOneEntry(factory, newstruct, entry):
     tag_set = None
     separator = ""
     fixed_length = ""
+    options = []
 
     for token in entry.split(" "):
         if not entry_type:
@@ -1522,11 +1578,18 @@ def ProcessOneEntry(factory, newstruct, entry):
             tag = int(token, 0)
             continue
 
-        raise RpcGenError(r'''Cannot parse "%s"''' % (entry))
+        options.append(token)
 
     if not tag_set:
         raise RpcGenError(r'''Need tag number: "%s"''' % (entry))
 
+    max_length = None
+    if options:
+        res = ENTRY_OPTIONS_RE.match(" ".join(options))
+        if not res:
+            raise RpcGenError(r'''Cannot parse "%s"''' % (entry))
+        max_length = res.group("max")
+
     # Create the right entry
     if entry_type == "bytes":
         if fixed_length:
@@ -1553,6 +1616,8 @@ def ProcessOneEntry(factory, newstruct, entry):
         newentry.MakeOptional()
     if array:
         newentry.MakeArray()
+    if max_length is not None:
+        newentry.SetMaxLength(max_length)
 
     newentry.SetStruct(newstruct)
     newentry.SetLineCount(LINE_COUNT)
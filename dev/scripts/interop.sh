@@ -0,0 +1,60 @@
+#!/bin/bash
+# interop.sh: Check that two builds of p2pchat talk to each other on loopback.
+#
+# Usage: interop.sh <old p2pchat> <new p2pchat>
+#
+# Runs every pairing (old/old, old/new, new/old, new/new), each side
+# connecting and sending a message, and prints a line per pairing. The
+# deterministic version of this for many nodes is `p2psim interop`.
+
+set -u
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <old p2pchat> <new p2pchat>" >&2
+    exit 2
+fi
+
+old=$1
+new=$2
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+run_pair() {
+    local a=$1 b=$2 name=$3
+    # Keep stdin open until the other side is done, EOF quits
+    (sleep 1; echo "/handle alice"; sleep 4; echo "bob#2 hello from alice"
+     sleep 2) | "$a" 1 > "$dir/$name.a" 2>&1 &
+    local a_pid=$!
+
+    local port=""
+    for _ in $(seq 50); do
+        port=$(grep -ao "use .*:[0-9]*" "$dir/$name.a" | head -1 | sed 's/.*://')
+        [ -n "$port" ] && break
+        sleep 0.1
+    done
+    if [ -z "$port" ]; then
+        echo "$name: FAIL, first node did not start"
+        wait $a_pid
+        return 1
+    fi
+
+    (sleep 1; echo "/handle bob"; echo "/connect 127.0.0.1:$port"; sleep 2
+     echo "alice#1 hello from bob"; sleep 4) | "$b" 2 > "$dir/$name.b" 2>&1
+    wait $a_pid
+
+    if grep -q "bob#2 says: hello from bob" "$dir/$name.a" &&
+       grep -q "alice#1 says: hello from alice" "$dir/$name.b"; then
+        echo "$name: ok"
+    else
+        echo "$name: FAIL, logs follow"
+        cat "$dir/$name.a" "$dir/$name.b"
+        return 1
+    fi
+}
+
+status=0
+run_pair "$old" "$old" "old -> old" || status=1
+run_pair "$old" "$new" "new -> old" || status=1
+run_pair "$new" "$old" "old -> new" || status=1
+run_pair "$new" "$new" "new -> new" || status=1
+exit $status
@@ -0,0 +1,100 @@
+#!/bin/bash
+# pgo.sh: Build the release configurations and compare them on the message
+# path.
+#
+# Usage: pgo.sh [runs]
+#
+# Run from the source directory. Builds, under build/:
+#   default         no build type, what a bare `cmake ..` gives
+#   release-no-lto  -O3, each target optimized on its own
+#   release         -O3 with link-time optimization
+#   pgo             release, trained on the workload below, then rebuilt
+# Training runs p2pbench, which sends messages over loopback through each
+# transport, and p2psim, which runs them through the application. The report
+# is the median of [runs] (default 5) p2pbench runs per workload. CPU time
+# per request covers both ends and is steadier than the rates on a busy
+# machine.
+
+set -eu
+
+runs=${1:-5}
+jobs=$(nproc)
+
+# Message requests: one at a time, then pipelined over several links
+workloads=("-n 20000" "-n 100000 -c 8 -w 16")
+
+build() {
+    local preset=$1
+    cmake --preset "$preset" > /dev/null
+    cmake --build --preset "$preset" -j"$jobs" > /dev/null
+}
+
+echo "Building" >&2
+cmake -S . -B build/default > /dev/null
+cmake --build build/default -j"$jobs" > /dev/null
+build release-no-lto
+build release
+
+rm -rf build/pgo
+build pgo-generate
+transports=$(build/pgo/p2pbench -h | sed -n 's/^Transports: //p')
+
+echo "Training" >&2
+for transport in $transports; do
+    for workload in "${workloads[@]}"; do
+        # shellcheck disable=SC2086
+        build/pgo/p2pbench -t "$transport" $workload > /dev/null 2>&1
+    done
+done
+build/pgo/p2psim -n 2000 storm > /dev/null
+if ls build/pgo/pgo/*.profraw > /dev/null 2>&1; then
+    llvm-profdata merge -o build/pgo/pgo/merged.profdata build/pgo/pgo/*.profraw
+fi
+# Only the objects need rebuilding, the profiles stay
+cmake --preset pgo-use > /dev/null
+cmake --build --preset pgo-use -j"$jobs" --clean-first > /dev/null
+
+configs=(default release-no-lto release pgo)
+results=build/pgo/results
+rm -rf "$results"
+mkdir -p "$results"
+
+# One run of every configuration per round, so that whatever else the machine
+# is doing spreads evenly over them. Keeps req/s, p50 us, p99 us and CPU us
+# per request.
+echo "Measuring" >&2
+for transport in $transports; do
+    for ii in "${!workloads[@]}"; do
+        for _ in $(seq "$runs"); do
+            for config in "${configs[@]}"; do
+                # shellcheck disable=SC2086
+                "build/$config/p2pbench" -t "$transport" ${workloads[$ii]} \
+                    2> /dev/null | tail -1 | awk '{ print $5, $8, $11, $19 }' \
+                    >> "$results/$transport.$ii.$config"
+            done
+        done
+    done
+done
+
+# Median run by req/s
+median() {
+    sort -n "$1" | awk '{ line[NR] = $0 } END { print line[int((NR + 1) / 2)] }'
+}
+
+printf "%-8s %-22s %-15s %10s %8s %10s %10s %10s\n" transport workload \
+    build "req/s" gain "p50 us" "p99 us" "cpu us/req"
+for transport in $transports; do
+    for ii in "${!workloads[@]}"; do
+        base=""
+        for config in "${configs[@]}"; do
+            read -r rate p50 p99 cpu <<< "$(median \
+                "$results/$transport.$ii.$config")"
+            [ -z "$base" ] && base=$rate
+            gain=$(awk -v r="$rate" -v b="$base" \
+                'BEGIN { printf "%+.0f%%", (r / b - 1) * 100 }')
+            printf "%-8s %-22s %-15s %10s %8s %10s %10s %10s\n" \
+                "$transport" "${workloads[$ii]}" "$config" "$rate" "$gain" \
+                "$p50" "$p99" "$cpu"
+        done
+    done
+done
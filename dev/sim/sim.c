@@ -0,0 +1,823 @@
+// Deterministic simulator for the peer protocol.
+//
+// Runs many applications in one process on virtual time. Requests travel
+// through a simulated transport instead of sockets: they are marshalled and
+// unmarshalled exactly as on the wire, then delivered after a seeded random
+// latency, or lost, or stopped by a partition. The same seed gives the same
+// run.
+//
+// Usage: p2psim [-n nodes] [-s seed] [-l latency ms] [-j jitter ms]
+//               [-p loss probability] [-t timeout ms] [-L every] [-v]
+//               [scenario]
+#include "app.h"
+#include "generated/rpc.h"
+#include "protocol.h"
+#include "rpc.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <arpa/inet.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/rpc.h>
+#include <event2/rpc_struct.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Node i listens on 10.0.0.0 + i + 1
+#define SIM_NET 0x0A000000U
+#define SIM_PORT 7000
+#define SIM_MAX_NODES 65534 // fingerprints are 16 bits and 0 is reserved
+#define SIM_MAX_LINE 256
+#define SIM_MS 1000 // virtual time is in microseconds
+
+typedef uint64_t sim_time_t;
+
+struct Sim;
+
+/********************
+ Events
+********************/
+struct SimEvent;
+typedef void (*sim_fire_t)(struct Sim *sim, struct SimEvent *event);
+
+struct SimEvent { // NOLINT(altera-struct-pack-align)
+  sim_time_t time;
+  uint64_t seq; // breaks ties so equal times fire in scheduling order
+  sim_fire_t fire;
+  void *data;
+};
+
+struct SimNode { // NOLINT(altera-struct-pack-align)
+  struct Sim *sim;
+  int index;
+  int group; // nodes only reach nodes in the same group
+  int legacy; // speaks protocol version 0, see src/protocol.h
+  struct Application *app;
+
+  transport_dispatch_t dispatch;
+  void *dispatch_arg;
+};
+
+struct SimStats {
+  uint64_t sent;
+  uint64_t ok;
+  uint64_t failed;
+  uint64_t bytes;
+  sim_time_t total_rtt;
+  sim_time_t max_rtt;
+};
+
+struct SimConfig {
+  int num_nodes;
+  uint64_t seed;
+  sim_time_t latency;
+  sim_time_t jitter;
+  double loss;
+  sim_time_t timeout;
+  int legacy_every; // every nth node speaks protocol version 0, 0 for none
+  int verbose;
+};
+
+struct Sim { // NOLINT(altera-struct-pack-align)
+  struct SimConfig cfg;
+  struct event_base *base;
+  uint64_t rng;
+
+  sim_time_t now;
+  uint64_t next_seq;
+  struct SimEvent **heap;
+  int heap_len;
+  int heap_cap;
+  uint64_t fired;
+
+  struct SimNode *nodes;
+  int num_nodes;
+
+  sim_time_t phase_start;
+  sim_time_t phase_end;
+  uint64_t lost;
+  struct SimStats stats[RPC_NUM_TYPES];
+  // By whether the sender, then the receiver, speaks version 0
+  struct SimStats interop[2][2][RPC_NUM_TYPES];
+};
+
+static int sim_event_before(const struct SimEvent *a, const struct SimEvent *b) {
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int sim_schedule(struct Sim *sim, sim_time_t delay, sim_fire_t fire,
+                        void *data) {
+  if (sim->heap_len == sim->heap_cap) {
+    int cap = sim->heap_cap ? sim->heap_cap * 2 : 1024;
+    struct SimEvent **heap = reallocarray(sim->heap, cap, sizeof(*heap));
+    if (!heap)
+      goto failure1;
+    sim->heap = heap;
+    sim->heap_cap = cap;
+  }
+
+  struct SimEvent *event = malloc(sizeof(struct SimEvent));
+  if (!event)
+    goto failure1;
+  event->time = sim->now + delay;
+  event->seq = sim->next_seq++;
+  event->fire = fire;
+  event->data = data;
+
+  int ii = sim->heap_len++;
+  while (ii > 0) {
+    int parent = (ii - 1) / 2;
+    if (!sim_event_before(event, sim->heap[parent]))
+      break;
+    sim->heap[ii] = sim->heap[parent];
+    ii = parent;
+  }
+  sim->heap[ii] = event;
+  return 0;
+
+failure1:
+  (void)printf("Out of memory scheduling an event\n");
+  return -1;
+}
+
+static struct SimEvent *sim_pop(struct Sim *sim) {
+  if (sim->heap_len == 0)
+    return 0;
+  struct SimEvent *top = sim->heap[0];
+  struct SimEvent *last = sim->heap[--sim->heap_len];
+
+  int ii = 0;
+  for (;;) {
+    int child = 2 * ii + 1;
+    if (child >= sim->heap_len)
+      break;
+    if (child + 1 < sim->heap_len &&
+        sim_event_before(sim->heap[child + 1], sim->heap[child]))
+      child += 1;
+    if (!sim_event_before(sim->heap[child], last))
+      break;
+    sim->heap[ii] = sim->heap[child];
+    ii = child;
+  }
+  if (sim->heap_len > 0)
+    sim->heap[ii] = last;
+  return top;
+}
+
+// Runs until nothing is left to happen
+static void sim_run(struct Sim *sim) {
+  struct SimEvent *event = 0;
+  while ((event = sim_pop(sim))) {
+    sim->now = event->time;
+    sim->fired += 1;
+    event->fire(sim, event);
+    free(event);
+  }
+}
+
+/********************
+ Randomness
+********************/
+// splitmix64, which is good enough and the same everywhere
+static uint64_t sim_random(struct Sim *sim) {
+  uint64_t z = (sim->rng += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27U)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31U);
+}
+
+static double sim_uniform(struct Sim *sim) {
+  return (double)(sim_random(sim) >> 11U) / (double)(1ULL << 53U);
+}
+
+static sim_time_t sim_delay(struct Sim *sim) {
+  sim_time_t delay = sim->cfg.latency;
+  if (sim->cfg.jitter)
+    delay += sim_random(sim) % (sim->cfg.jitter + 1);
+  return delay;
+}
+
+/********************
+ Transport
+********************/
+struct SimLink {
+  struct SimNode *from;
+  int to; // -1 if the address is not a node
+};
+
+struct SimMessage { // NOLINT(altera-struct-pack-align)
+  enum RpcType type;
+  int from;
+  int to;
+  sim_time_t sent;
+  struct evbuffer *payload;
+
+  // Owned by the sender until the callback
+  void *request;
+  void *reply;
+  transport_cb_t callback;
+  void *cbarg;
+};
+
+static void sim_message_free(struct SimMessage *msg) {
+  if (msg->payload)
+    evbuffer_free(msg->payload);
+  free(msg);
+}
+
+static int sim_reachable(struct Sim *sim, int from, int to) {
+  return to >= 0 && sim->nodes[to].dispatch &&
+         sim->nodes[from].group == sim->nodes[to].group;
+}
+
+static void sim_count(struct SimStats *stats, sim_time_t rtt, int error) {
+  if (error == EVRPC_STATUS_ERR_NONE) {
+    stats->ok += 1;
+    stats->total_rtt += rtt;
+    if (rtt > stats->max_rtt)
+      stats->max_rtt = rtt;
+  } else {
+    stats->failed += 1;
+  }
+}
+
+static void sim_complete(struct Sim *sim, struct SimMessage *msg,
+                         int error) {
+  sim_time_t rtt = sim->now - msg->sent;
+  sim_count(&sim->stats[msg->type], rtt, error);
+  struct SimStats *interop = &sim->interop[sim->nodes[msg->from].legacy]
+                                          [sim->nodes[msg->to].legacy]
+                                          [msg->type];
+  interop->sent += 1;
+  sim_count(interop, rtt, error);
+  if (sim->now > sim->phase_end)
+    sim->phase_end = sim->now;
+
+  struct evrpc_status status = {0};
+  status.error = error;
+  msg->callback(&status, msg->request, msg->reply, msg->cbarg);
+  sim_message_free(msg);
+}
+
+static void sim_fire_timeout(struct Sim *sim, struct SimEvent *event) {
+  sim_complete(sim, event->data, EVRPC_STATUS_ERR_TIMEOUT);
+}
+
+// Lost messages look like a timeout to the sender, counted from when it sent
+static void sim_lose(struct Sim *sim, struct SimMessage *msg) {
+  sim->lost += 1;
+  sim_time_t deadline = msg->sent + sim->cfg.timeout;
+  sim_time_t delay = deadline > sim->now ? deadline - sim->now : 0;
+  if (sim_schedule(sim, delay, sim_fire_timeout, msg) == -1)
+    sim_complete(sim, msg, EVRPC_STATUS_ERR_TIMEOUT);
+}
+
+static int sim_lost_in_transit(struct Sim *sim, struct SimMessage *msg) {
+  return !sim_reachable(sim, msg->from, msg->to) ||
+         (sim->cfg.loss > 0 && sim_uniform(sim) < sim->cfg.loss);
+}
+
+// Version 0 decoders refuse fields they do not know and RPCs added since
+static int sim_legacy_rejects_request(enum RpcType type, void *request) {
+  if (type == RPC_PING || type == RPC_SYNC)
+    return 1;
+  struct ConnectRequest *connect = request;
+  struct MessageRequest *message = request;
+  return (type == RPC_CONNECT && (EVTAG_HAS(connect, protocol_version) ||
+                                  EVTAG_HAS(connect, capabilities))) ||
+         (type == RPC_MESSAGE &&
+          (EVTAG_HAS(message, session) || EVTAG_HAS(message, sequence) ||
+           EVTAG_HAS(message, oldest) || EVTAG_HAS(message, sent)));
+}
+
+static int sim_legacy_rejects_reply(enum RpcType type, void *reply) {
+  struct ConnectReply *connect = reply;
+  struct MessageReply *message = reply;
+  return (type == RPC_CONNECT && (EVTAG_HAS(connect, protocol_version) ||
+                                  EVTAG_HAS(connect, capabilities))) ||
+         (type == RPC_MESSAGE &&
+          (EVTAG_HAS(message, ack) || EVTAG_HAS(message, sack)));
+}
+
+static void sim_fire_reply(struct Sim *sim, struct SimEvent *event) {
+  struct SimMessage *msg = CAST(struct SimMessage *, event->data);
+  if (sim->nodes[msg->from].group != sim->nodes[msg->to].group) {
+    sim_lose(sim, msg);
+    return;
+  }
+
+  const struct RpcInfo *info = rpc_info(msg->type);
+  info->reply_clear(msg->reply);
+  if (info->reply_unmarshal(msg->reply, msg->payload) == -1 ||
+      (sim->nodes[msg->from].legacy &&
+       sim_legacy_rejects_reply(msg->type, msg->reply))) {
+    sim_complete(sim, msg, EVRPC_STATUS_ERR_BADPAYLOAD);
+    return;
+  }
+  sim_complete(sim, msg, EVRPC_STATUS_ERR_NONE);
+}
+
+static void sim_fire_request(struct Sim *sim, struct SimEvent *event) {
+  struct SimMessage *msg = CAST(struct SimMessage *, event->data);
+  if (sim_lost_in_transit(sim, msg)) {
+    sim_lose(sim, msg);
+    return;
+  }
+
+  struct SimNode *node = &sim->nodes[msg->to];
+  const struct RpcInfo *info = rpc_info(msg->type);
+  void *request = info->request_new(0);
+  void *reply = info->reply_new(0);
+  if (!request || !reply)
+    goto failure1;
+
+  if (info->request_unmarshal(request, msg->payload) == -1 ||
+      (node->legacy && sim_legacy_rejects_request(msg->type, request)))
+    goto failure2;
+
+  node->dispatch(msg->type, request, reply, node->dispatch_arg);
+  if (info->reply_complete(reply) == -1)
+    goto failure2;
+
+  (void)evbuffer_drain(msg->payload, evbuffer_get_length(msg->payload));
+  info->reply_marshal(msg->payload, reply);
+  sim->stats[msg->type].bytes += evbuffer_get_length(msg->payload);
+  info->request_free(request);
+  info->reply_free(reply);
+
+  if (sim->cfg.loss > 0 && sim_uniform(sim) < sim->cfg.loss) {
+    sim_lose(sim, msg);
+    return;
+  }
+  if (sim_schedule(sim, sim_delay(sim), sim_fire_reply, msg) == -1)
+    sim_complete(sim, msg, EVRPC_STATUS_ERR_UNSTARTED);
+  return;
+
+failure2:
+failure1:
+  if (request)
+    info->request_free(request);
+  if (reply)
+    info->reply_free(reply);
+  // evrpc answers a request it cannot decode or answer with a 503
+  sim_complete(sim, msg, transport_http_status(HTTP_SERVUNAVAIL));
+}
+
+static const char *sim_node_address(struct Sim *sim, int node,
+                                    char *buffer, size_t size) {
+  (void)sim;
+  struct in_addr in = {htonl(SIM_NET + node + 1)};
+  char host[INET_ADDRSTRLEN] = {0};
+  (void)inet_ntop(AF_INET, &in, host, sizeof(host));
+  (void)snprintf(buffer, size, "%s:%d", host, SIM_PORT);
+  return buffer;
+}
+
+// Nodes are not told apart by address, so there is nothing to admit by
+static void *sim_listen(void *ctx, struct event_base *base,
+                        transport_dispatch_t dispatch, transport_admit_t admit,
+                        void *dispatch_arg, char **address_out) {
+  (void)base;
+  (void)admit;
+  struct SimNode *node = CAST(struct SimNode *, ctx);
+  const int ADDRESS_LEN = 32;
+  char *address = malloc(ADDRESS_LEN);
+  if (!address)
+    return 0;
+  (void)sim_node_address(node->sim, node->index, address, ADDRESS_LEN);
+
+  node->dispatch = dispatch;
+  node->dispatch_arg = dispatch_arg;
+  *address_out = address;
+  return node;
+}
+
+static void sim_close(void *server) {
+  struct SimNode *node = CAST(struct SimNode *, server);
+  node->dispatch = 0;
+  node->dispatch_arg = 0;
+}
+
+static void *sim_link_new(void *ctx, struct event_base *base,
+                          const struct sockaddr *addr, socklen_t addrlen) {
+  (void)base;
+  (void)addrlen;
+  struct SimNode *node = CAST(struct SimNode *, ctx);
+  struct SimLink *link = malloc(sizeof(struct SimLink));
+  if (!link)
+    return 0;
+  link->from = node;
+  link->to = -1;
+
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    uint32_t ip = ntohl(sin->sin_addr.s_addr);
+    if (ip > SIM_NET && ip - SIM_NET <= (uint32_t)node->sim->num_nodes &&
+        ntohs(sin->sin_port) == SIM_PORT)
+      link->to = (int)(ip - SIM_NET - 1);
+  }
+  return link;
+}
+
+static void sim_link_free(void *link) { free(link); }
+
+static int sim_request(void *arg, enum RpcType type, void *request,
+                       void *reply, transport_cb_t callback, void *cbarg) {
+  struct SimLink *link = CAST(struct SimLink *, arg);
+  struct Sim *sim = link->from->sim;
+
+  struct SimMessage *msg = calloc(1, sizeof(struct SimMessage));
+  if (!msg)
+    goto failure1;
+  msg->payload = evbuffer_new();
+  if (!msg->payload)
+    goto failure2;
+
+  msg->type = type;
+  msg->from = link->from->index;
+  msg->to = link->to;
+  msg->sent = sim->now;
+  msg->request = request;
+  msg->reply = reply;
+  msg->callback = callback;
+  msg->cbarg = cbarg;
+
+  rpc_info(type)->request_marshal(msg->payload, request);
+  if (evbuffer_get_length(msg->payload) > RPC_MAX_BODY_SIZE)
+    goto failure2; // HTTP would refuse it too
+  sim->stats[type].sent += 1;
+  sim->stats[type].bytes += evbuffer_get_length(msg->payload);
+
+  if (sim_schedule(sim, sim_delay(sim), sim_fire_request, msg) == -1)
+    goto failure2;
+  return 0;
+
+failure2:
+  sim_message_free(msg);
+failure1:
+  return -1;
+}
+
+static const struct TransportOps g_sim_transport = {
+    "sim",        sim_listen,    sim_close,
+    sim_link_new, sim_link_free, sim_request,
+    NULL,         NULL,
+};
+
+/********************
+ Nodes
+********************/
+struct SimCommand {
+  int node;
+  char line[SIM_MAX_LINE];
+};
+
+static void sim_fire_command(struct Sim *sim, struct SimEvent *event) {
+  struct SimCommand *command = CAST(struct SimCommand *, event->data);
+  if (sim->cfg.verbose)
+    (void)fprintf(stderr, "SIM: %llu.%03llu node %d: %s\n",
+                  (unsigned long long)(sim->now / (SIM_MS * SIM_MS)),
+                  (unsigned long long)(sim->now / SIM_MS % SIM_MS),
+                  command->node, command->line);
+  app_handle_line(sim->nodes[command->node].app, command->line);
+  free(command);
+}
+
+// Runs line at node as if typed at its prompt, delay from now
+static void sim_command(struct Sim *sim, sim_time_t delay, int node,
+                        const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void sim_command(struct Sim *sim, sim_time_t delay, int node,
+                        const char *fmt, ...) {
+  struct SimCommand *command = malloc(sizeof(struct SimCommand));
+  if (!command)
+    return;
+  command->node = node;
+  va_list args;
+  va_start(args, fmt);
+  (void)vsnprintf(command->line, sizeof(command->line), fmt, args);
+  va_end(args);
+  if (sim_schedule(sim, delay, sim_fire_command, command) == -1)
+    free(command);
+}
+
+static sim_time_t sim_spread(struct Sim *sim, sim_time_t spread) {
+  return spread ? sim_random(sim) % spread : 0;
+}
+
+static int sim_nodes_new(struct Sim *sim) {
+  sim->nodes = calloc(sim->cfg.num_nodes, sizeof(struct SimNode));
+  if (!sim->nodes)
+    return -1;
+
+  for (int ii = 0; ii < sim->cfg.num_nodes; ++ii) {
+    struct SimNode *node = &sim->nodes[ii];
+    node->sim = sim;
+    node->index = ii;
+    node->legacy = sim->cfg.legacy_every > 0 &&
+                   ii % sim->cfg.legacy_every == sim->cfg.legacy_every - 1;
+
+    char handle[RPC_MAX_HANDLE_LEN + 1] = {0};
+    (void)snprintf(handle, sizeof(handle), "n%d", ii);
+    ApplicationConfig cfg = {0};
+    cfg.fingerprint = ii + 1;
+    cfg.handle = handle;
+    cfg.base = sim->base;
+    cfg.transport = &g_sim_transport;
+    cfg.transport_ctx = node;
+    cfg.legacy_protocol = node->legacy;
+    node->app = app_new(&cfg);
+    if (!node->app || app_listen(node->app) == -1)
+      return -1;
+    sim->num_nodes += 1;
+  }
+  return 0;
+}
+
+static void sim_nodes_free(struct Sim *sim) {
+  for (int ii = 0; ii < sim->num_nodes; ++ii)
+    app_free(sim->nodes[ii].app);
+  free(sim->nodes);
+}
+
+/********************
+ Scenarios
+********************/
+static void sim_phase_begin(struct Sim *sim) {
+  sim->phase_start = sim->now;
+  sim->phase_end = sim->now;
+  sim->lost = 0;
+  memset(sim->stats, 0, sizeof(sim->stats));
+  memset(sim->interop, 0, sizeof(sim->interop));
+}
+
+static void sim_phase_report(struct Sim *sim, const char *name) {
+  (void)printf("%-12s %9.3fs virtual, %llu lost\n", name,
+               (double)(sim->phase_end - sim->phase_start) / (SIM_MS * SIM_MS),
+               (unsigned long long)sim->lost);
+  for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+    struct SimStats *stats = &sim->stats[ii];
+    if (!stats->sent)
+      continue;
+    (void)printf("  %-14s sent %8llu ok %8llu failed %8llu bytes %10llu "
+                 "rtt avg %8.3fms max %8.3fms\n",
+                 rpc_info(ii)->name, (unsigned long long)stats->sent,
+                 (unsigned long long)stats->ok,
+                 (unsigned long long)stats->failed,
+                 (unsigned long long)stats->bytes,
+                 stats->ok ? (double)stats->total_rtt / stats->ok / SIM_MS : 0,
+                 (double)stats->max_rtt / SIM_MS);
+  }
+}
+
+static void sim_interop_report(struct Sim *sim) {
+  for (int from = 0; from < 2; ++from) {
+    for (int to = 0; to < 2; ++to) {
+      for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+        struct SimStats *stats = &sim->interop[from][to][ii];
+        if (!stats->sent)
+          continue;
+        (void)printf("  v%d -> v%d %-14s sent %8llu ok %8llu failed %8llu\n",
+                     from ? 0 : PROTOCOL_VERSION, to ? 0 : PROTOCOL_VERSION,
+                     rpc_info(ii)->name, (unsigned long long)stats->sent,
+                     (unsigned long long)stats->ok,
+                     (unsigned long long)stats->failed);
+      }
+    }
+  }
+}
+
+static void sim_phase_run(struct Sim *sim, const char *name) {
+  sim_run(sim);
+  sim_phase_report(sim, name);
+  sim_phase_begin(sim);
+}
+
+// Every node connects to node 0 within the same second
+static void scenario_storm(struct Sim *sim) {
+  char hub[SIM_MAX_LINE] = {0};
+  (void)sim_node_address(sim, 0, hub, sizeof(hub));
+  for (int ii = 1; ii < sim->num_nodes; ++ii)
+    sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii, "/connect %s", hub);
+  sim_phase_run(sim, "connect");
+
+  for (int ii = 1; ii < sim->num_nodes; ++ii)
+    sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii, "n0#1 hello from %d",
+                ii);
+  sim_phase_run(sim, "message");
+}
+
+// Node 0 knows everyone, then changes its handle, which it tells everyone
+static void scenario_fanout(struct Sim *sim) {
+  char address[SIM_MAX_LINE] = {0};
+  for (int ii = 1; ii < sim->num_nodes; ++ii)
+    sim_command(sim, 0, 0, "/connect %s",
+                sim_node_address(sim, ii, address, sizeof(address)));
+  sim_phase_run(sim, "connect");
+
+  sim_command(sim, 0, 0, "/handle hub");
+  sim_phase_run(sim, "fanout");
+}
+
+// Half the nodes are cut off from node 0 for a while, keep talking, then
+// reconnect once the partition heals
+static void sim_fire_heal(struct Sim *sim, struct SimEvent *event) {
+  (void)event;
+  for (int ii = 0; ii < sim->num_nodes; ++ii)
+    sim->nodes[ii].group = 0;
+}
+
+static void scenario_reconnect(struct Sim *sim) {
+  char hub[SIM_MAX_LINE] = {0};
+  (void)sim_node_address(sim, 0, hub, sizeof(hub));
+  for (int ii = 1; ii < sim->num_nodes; ++ii)
+    sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii, "/connect %s", hub);
+  sim_phase_run(sim, "connect");
+
+  for (int ii = 1; ii < sim->num_nodes; ii += 2)
+    sim->nodes[ii].group = 1;
+  const sim_time_t partition = 10 * SIM_MS * SIM_MS;
+  (void)sim_schedule(sim, partition, sim_fire_heal, 0);
+  for (int ii = 1; ii < sim->num_nodes; ++ii)
+    sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii,
+                "n0#1 during partition");
+  sim_phase_run(sim, "partition");
+
+  for (int ii = 1; ii < sim->num_nodes; ++ii) {
+    sim_time_t at = sim_spread(sim, SIM_MS * SIM_MS);
+    sim_command(sim, at, ii, "/connect %s", hub);
+    sim_command(sim, at + SIM_MS * SIM_MS, ii, "n0#1 after partition");
+  }
+  sim_phase_run(sim, "reconnect");
+}
+
+// Every node connects to the next two, so with every other node on version 0
+// each pairing of versions gets both ways round. A version 1 node first
+// offers version 1 to a version 0 node, which refuses it, so those Connects
+// show one failure each before the retry succeeds.
+static void scenario_interop(struct Sim *sim) {
+  char address[SIM_MAX_LINE] = {0};
+  const int NEXT = 2;
+  for (int ii = 0; ii < sim->num_nodes; ++ii) {
+    for (int jj = 1; jj <= NEXT; ++jj)
+      sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii, "/connect %s",
+                  sim_node_address(sim, (ii + jj) % sim->num_nodes, address,
+                                   sizeof(address)));
+  }
+  sim_run(sim);
+  sim_phase_report(sim, "connect");
+  sim_interop_report(sim);
+  sim_phase_begin(sim);
+
+  for (int ii = 0; ii < sim->num_nodes; ++ii) {
+    for (int jj = 1; jj <= NEXT; ++jj) {
+      int to = (ii + jj) % sim->num_nodes;
+      sim_command(sim, sim_spread(sim, SIM_MS * SIM_MS), ii,
+                  "n%d#%d hello from %d", to, to + 1, ii);
+    }
+  }
+  sim_run(sim);
+  sim_phase_report(sim, "message");
+  sim_interop_report(sim);
+  sim_phase_begin(sim);
+}
+
+struct SimScenario {
+  const char *name;
+  void (*run)(struct Sim *sim);
+  int legacy_every; // unless given with -L
+};
+
+static const struct SimScenario g_scenarios[] = {
+    {"storm", scenario_storm, 0},
+    {"fanout", scenario_fanout, 0},
+    {"reconnect", scenario_reconnect, 0},
+    {"interop", scenario_interop, 2},
+};
+
+/********************
+ main
+********************/
+static void usage(const char *argv0) {
+  (void)printf("Usage: %s [-n nodes] [-s seed] [-l latency ms] [-j jitter ms] "
+               "[-p loss] [-t timeout ms] [-L every nth node on version 0] "
+               "[-v] [scenario]\n",
+               argv0);
+  (void)printf("Scenarios:");
+  for (unsigned ii = 0; ii < ARRAY_SIZE(g_scenarios); ++ii)
+    (void)printf(" %s", g_scenarios[ii].name);
+  (void)printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  int ret = EXIT_FAILURE;
+
+  struct Sim sim = {0};
+  sim.cfg.num_nodes = 1000;
+  sim.cfg.seed = 1;
+  sim.cfg.latency = 20 * SIM_MS;
+  sim.cfg.jitter = 10 * SIM_MS;
+  sim.cfg.timeout = 5 * SIM_MS * SIM_MS;
+  sim.cfg.legacy_every = -1;
+
+  int opt = 0;
+  const int base = 10;
+  while ((opt = getopt(argc, argv, "n:s:l:j:p:t:L:vh")) != -1) {
+    switch (opt) {
+    case 'n':
+      sim.cfg.num_nodes = (int)strtol(optarg, NULL, base);
+      break;
+    case 's':
+      sim.cfg.seed = strtoull(optarg, NULL, base);
+      break;
+    case 'l':
+      sim.cfg.latency = (sim_time_t)(strtod(optarg, NULL) * SIM_MS);
+      break;
+    case 'j':
+      sim.cfg.jitter = (sim_time_t)(strtod(optarg, NULL) * SIM_MS);
+      break;
+    case 'p':
+      sim.cfg.loss = strtod(optarg, NULL);
+      break;
+    case 't':
+      sim.cfg.timeout = (sim_time_t)(strtod(optarg, NULL) * SIM_MS);
+      break;
+    case 'L':
+      sim.cfg.legacy_every = (int)strtol(optarg, NULL, base);
+      break;
+    case 'v':
+      sim.cfg.verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  const struct SimScenario *scenario = &g_scenarios[0];
+  if (optind < argc) {
+    scenario = 0;
+    for (unsigned ii = 0; ii < ARRAY_SIZE(g_scenarios); ++ii) {
+      if (strcmp(g_scenarios[ii].name, argv[optind]) == 0)
+        scenario = &g_scenarios[ii];
+    }
+  }
+  if (!scenario || sim.cfg.num_nodes < 2 ||
+      sim.cfg.num_nodes > SIM_MAX_NODES) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (sim.cfg.legacy_every < 0)
+    sim.cfg.legacy_every = scenario->legacy_every;
+
+  // The applications log every step, which at this scale is all noise
+  if (!sim.cfg.verbose && !freopen("/dev/null", "w", stderr))
+    return EXIT_FAILURE;
+
+  sim.rng = sim.cfg.seed;
+  sim.base = event_base_new();
+  if (!sim.base)
+    goto failure1;
+
+  (void)printf("%s: %d nodes, seed %llu, latency %.1fms + %.1fms jitter, "
+               "loss %.3f, timeout %.1fms, 1 in %d nodes on version 0\n",
+               scenario->name, sim.cfg.num_nodes,
+               (unsigned long long)sim.cfg.seed,
+               (double)sim.cfg.latency / SIM_MS,
+               (double)sim.cfg.jitter / SIM_MS, sim.cfg.loss,
+               (double)sim.cfg.timeout / SIM_MS, sim.cfg.legacy_every);
+
+  struct timespec start = {0};
+  struct timespec end = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (sim_nodes_new(&sim) == -1) {
+    (void)printf("Could not create %d nodes\n", sim.cfg.num_nodes);
+    goto failure2;
+  }
+
+  sim_phase_begin(&sim);
+  scenario->run(&sim);
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &end);
+  (void)printf("%llu events in %.3fs wall\n", (unsigned long long)sim.fired,
+               (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+  ret = EXIT_SUCCESS;
+
+failure2:
+  sim_nodes_free(&sim);
+  free(sim.heap);
+  event_base_free(sim.base);
+failure1:
+  return ret;
+}
@@ -0,0 +1,173 @@
+#include "address.h"
+#include "log.h"
+#include <event2/util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int address_split(const char *address, char *host_out, uint16_t *port_out) {
+  const char *host = address;
+  const char *s = 0;
+  size_t host_len = 0;
+  if (*host == '[') {
+    host += 1;
+    const char *end = strchr(host, ']');
+    if (!end || end[1] != ':')
+      goto failure;
+    host_len = end - host;
+    s = end + 1;
+  } else {
+    s = strrchr(host, ':');
+    if (!s || strchr(host, ':') != s) // bare IPv6 needs brackets
+      goto failure;
+    host_len = s - host;
+  }
+
+  if (host_len == 0)
+    goto failure;
+
+  const int base = 10;
+  char *end = 0;
+  long int port = strtol(s + 1, &end, base);
+  if (end == s + 1 || *end != 0 || port <= 0 || port > UINT16_MAX) {
+    LOG_ERROR("Invalid port in address: %s", address);
+    return -1;
+  }
+
+  (void)memcpy(host_out, host, host_len);
+  host_out[host_len] = 0;
+  *port_out = port;
+  return 0;
+
+failure:
+  LOG_ERROR("Expected host:port or [host]:port, got %s", address);
+  return -1;
+}
+
+int address_parse_numeric(const char *host, uint16_t port,
+                          struct sockaddr_storage *addr, socklen_t *addrlen) {
+  memset(addr, 0, sizeof(*addr));
+
+  struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+  if (evutil_inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    *addrlen = sizeof(*sin);
+    return 0;
+  }
+
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+  if (evutil_inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    *addrlen = sizeof(*sin6);
+    return 0;
+  }
+
+  return 1;
+}
+
+void address_set_port(struct sockaddr_storage *addr, uint16_t port) {
+  if (addr->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+uint16_t address_get_port(const struct sockaddr_storage *addr) {
+  if (addr->ss_family == AF_INET6)
+    return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+  return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+const char *address_format_host(const struct sockaddr_storage *addr,
+                                char *buf, size_t len) {
+  const void *src = &((const struct sockaddr_in *)addr)->sin_addr;
+  if (addr->ss_family == AF_INET6)
+    src = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+  return evutil_inet_ntop(addr->ss_family, src, buf, len);
+}
+
+int address_format(const struct sockaddr *sa, char *buf, size_t len) {
+  const struct sockaddr_storage *addr = (const struct sockaddr_storage *)sa;
+  char host[INET6_ADDRSTRLEN] = {0};
+  if (!address_format_host(addr, host, sizeof(host)))
+    return -1;
+
+  const char *format = addr->ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d";
+  int ret = snprintf(buf, len, format, host, address_get_port(addr));
+  if (ret < 0 || (size_t)ret >= len)
+    return -1;
+  return 0;
+}
+
+void address_unmap(struct sockaddr_storage *addr, socklen_t *addrlen) {
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+  if (addr->ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+    return;
+  struct sockaddr_in sin = {0};
+  sin.sin_family = AF_INET;
+  sin.sin_port = sin6->sin6_port;
+  (void)memcpy(&sin.sin_addr, &sin6->sin6_addr.s6_addr[12],
+               sizeof(sin.sin_addr));
+  memset(addr, 0, sizeof(*addr));
+  (void)memcpy(addr, &sin, sizeof(sin));
+  *addrlen = sizeof(sin);
+}
+
+void address_map(struct sockaddr_storage *addr, socklen_t *addrlen) {
+  if (addr->ss_family != AF_INET)
+    return;
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+  struct sockaddr_in6 sin6 = {0};
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_port = sin->sin_port;
+  const int MAPPED_PREFIX = 0xff;
+  sin6.sin6_addr.s6_addr[10] = MAPPED_PREFIX;
+  sin6.sin6_addr.s6_addr[11] = MAPPED_PREFIX;
+  (void)memcpy(&sin6.sin6_addr.s6_addr[12], &sin->sin_addr,
+               sizeof(sin->sin_addr));
+  memset(addr, 0, sizeof(*addr));
+  (void)memcpy(addr, &sin6, sizeof(sin6));
+  *addrlen = sizeof(sin6);
+}
+
+int address_equal(const struct sockaddr_storage *a, socklen_t alen,
+                  const struct sockaddr_storage *b, socklen_t blen) {
+  return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+int address_pack(const struct sockaddr_storage *addr,
+                 struct AddressPacked *out) {
+  memset(out, 0, sizeof(*out));
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    (void)memcpy(out->host, &sin->sin_addr, sizeof(sin->sin_addr));
+    out->port = sin->sin_port;
+  } else if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    (void)memcpy(out->host, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    out->port = sin6->sin6_port;
+  } else {
+    return -1;
+  }
+  out->family = (uint8_t)addr->ss_family;
+  return 0;
+}
+
+socklen_t address_unpack(const struct AddressPacked *packed,
+                         struct sockaddr_storage *out) {
+  memset(out, 0, sizeof(*out));
+  if (packed->family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)out;
+    sin6->sin6_family = AF_INET6;
+    (void)memcpy(&sin6->sin6_addr, packed->host, sizeof(sin6->sin6_addr));
+    sin6->sin6_port = packed->port;
+    return sizeof(*sin6);
+  }
+  struct sockaddr_in *sin = (struct sockaddr_in *)out;
+  sin->sin_family = AF_INET;
+  (void)memcpy(&sin->sin_addr, packed->host, sizeof(sin->sin_addr));
+  sin->sin_port = packed->port;
+  return sizeof(*sin);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Enough for "[v6 address]:port"
+#define ADDRESS_MAX_LEN (INET6_ADDRSTRLEN + 8)
+
+// Splits host:port or [v6host]:port into host_out, which must be at least as
+// long as address
+int address_split(const char *address, char *host_out, uint16_t *port_out);
+
+// Fills in addr if host is a numeric address. Returns 0 on success, 1 if
+// host needs a DNS lookup.
+int address_parse_numeric(const char *host, uint16_t port,
+                          struct sockaddr_storage *addr, socklen_t *addrlen);
+
+void address_set_port(struct sockaddr_storage *addr, uint16_t port);
+uint16_t address_get_port(const struct sockaddr_storage *addr);
+
+// Writes the numeric host part only, suitable for evhttp
+const char *address_format_host(const struct sockaddr_storage *addr,
+                                char *buf, size_t len);
+
+// Formats addr as host:port, or [host]:port for IPv6
+int address_format(const struct sockaddr *addr, char *buf, size_t len);
+
+// A dual-stack socket reports IPv4 peers as IPv4-mapped IPv6 addresses, and
+// can only send to them in that form. Both leave other addresses alone.
+void address_unmap(struct sockaddr_storage *addr, socklen_t *addrlen);
+void address_map(struct sockaddr_storage *addr, socklen_t *addrlen);
+
+int address_equal(const struct sockaddr_storage *a, socklen_t alen,
+                  const struct sockaddr_storage *b, socklen_t blen);
+
+// An IP address and port in 20 bytes, for keeping a lot of them. Scope ids
+// of link-local IPv6 addresses are not kept.
+struct AddressPacked {
+  uint8_t host[16]; // IPv4 addresses take the first 4 bytes
+  uint16_t port;    // network byte order
+  uint8_t family;
+  uint8_t unused; // always 0, so packed addresses compare with memcmp
+};
+
+// -1 if addr is neither IPv4 nor IPv6
+int address_pack(const struct sockaddr_storage *addr,
+                 struct AddressPacked *out);
+socklen_t address_unpack(const struct AddressPacked *packed,
+                         struct sockaddr_storage *out);
@@ -0,0 +1,187 @@
+#include "admission.h"
+#include "address.h"
+#include "hash.h"
+#include "log.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Sources remembered at once, a power of 2. Past that the least recently
+// seen of the slots a source could go in is forgotten, and the global bucket
+// still holds.
+#define ADMISSION_SOURCES 1024
+#define ADMISSION_PROBES 8
+
+struct AdmissionRate {
+  double per_s;
+  double burst;
+  int priority; // may use the global reserve
+};
+
+// Indexed by enum RpcType
+static const struct AdmissionRate g_admission_rates[] = {
+    {2, 10, 0},        // Connect
+    {10000, 20000, 1}, // Message, a script can pipe in thousands a second
+    {1, 5, 0},         // HandleChange
+    {500, 1000, 0},    // FileChunk
+    {10, 20, 1},       // Ping
+    {2, 16, 0},        // Sync, enough for a table to grow to full size
+};
+_Static_assert(ARRAY_SIZE(g_admission_rates) == RPC_NUM_TYPES,
+               "every RpcType needs a rate");
+
+#define ADMISSION_GLOBAL_PER_S 50000.0
+#define ADMISSION_GLOBAL_BURST 20000.0
+// Tokens in the global bucket that only priority requests may take
+#define ADMISSION_GLOBAL_RESERVE 10000.0
+// What one source may take of the reserve, so that a host flooding Messages
+// leaves the rest of it to everyone else
+#define ADMISSION_RESERVE_PER_S 1000.0
+#define ADMISSION_RESERVE_BURST 2000.0
+_Static_assert((int)ADMISSION_RESERVE_BURST < (int)ADMISSION_GLOBAL_RESERVE,
+               "one source could take the whole reserve");
+
+struct AdmissionBucket {
+  double tokens;
+  uint64_t filled_ms;
+};
+
+struct AdmissionSource { // NOLINT(altera-struct-pack-align)
+  struct AddressPacked host; // port always 0, family 0 if the slot is free
+  uint64_t seen_ms;
+  uint32_t refusing; // bit per type, so refusals are logged once per bout
+  struct AdmissionBucket buckets[RPC_NUM_TYPES];
+  struct AdmissionBucket reserve; // its share of the global reserve
+};
+
+struct Admission { // NOLINT(altera-struct-pack-align)
+  struct AdmissionBucket global;
+  uint64_t refused;
+  struct AdmissionSource sources[ADMISSION_SOURCES];
+};
+
+static uint64_t admission_now_ms(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t MS_PER_S = 1000;
+  const uint64_t NS_PER_MS = 1000000;
+  return (uint64_t)ts.tv_sec * MS_PER_S + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+static void admission_fill(struct AdmissionBucket *bucket, double per_s,
+                           double burst, uint64_t now) {
+  const double MS_PER_S = 1000.0;
+  bucket->tokens += (double)(now - bucket->filled_ms) * per_s / MS_PER_S;
+  if (bucket->tokens > burst)
+    bucket->tokens = burst;
+  bucket->filled_ms = now;
+}
+
+struct Admission *admission_new(void) {
+  struct Admission *admission = calloc(1, sizeof(struct Admission));
+  if (!admission)
+    return 0;
+  admission->global.tokens = ADMISSION_GLOBAL_BURST;
+  admission->global.filled_ms = admission_now_ms();
+  return admission;
+}
+
+void admission_free(struct Admission *admission) {
+  if (admission && admission->refused)
+    LOG_DEBUG("Refused %llu requests",
+              CAST(unsigned long long, admission->refused));
+  free(admission);
+}
+
+static unsigned admission_slot(const struct AddressPacked *host) {
+  return hash_fnv1a(host, sizeof(*host));
+}
+
+static struct AdmissionSource *
+admission_source(struct Admission *admission, const struct AddressPacked *host,
+                 uint64_t now) {
+  unsigned slot = admission_slot(host);
+  struct AdmissionSource *oldest = 0;
+  for (unsigned ii = 0; ii < ADMISSION_PROBES; ++ii) {
+    struct AdmissionSource *source =
+        &admission->sources[(slot + ii) & (ADMISSION_SOURCES - 1U)];
+    if (source->host.family &&
+        memcmp(&source->host, host, sizeof(*host)) == 0)
+      return source;
+    if (!oldest || !source->host.family ||
+        (oldest->host.family && source->seen_ms < oldest->seen_ms))
+      oldest = source;
+  }
+
+  // A source we forgot starts over with full buckets
+  memset(oldest, 0, sizeof(*oldest));
+  oldest->host = *host;
+  for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+    oldest->buckets[ii].tokens = g_admission_rates[ii].burst;
+    oldest->buckets[ii].filled_ms = now;
+  }
+  oldest->reserve.tokens = ADMISSION_RESERVE_BURST;
+  oldest->reserve.filled_ms = now;
+  return oldest;
+}
+
+int admission_admit(struct Admission *admission, enum RpcType type,
+                    const struct sockaddr *from, socklen_t fromlen) {
+  if (!admission || type >= RPC_NUM_TYPES)
+    return 1;
+  uint64_t now = admission_now_ms();
+  const struct AdmissionRate *rate = &g_admission_rates[type];
+
+  struct AdmissionBucket *global = &admission->global;
+  admission_fill(global, ADMISSION_GLOBAL_PER_S, ADMISSION_GLOBAL_BURST, now);
+  double floor = rate->priority ? 1.0 : ADMISSION_GLOBAL_RESERVE + 1.0;
+  if (global->tokens < floor) {
+    admission->refused += 1;
+    LOG_DEBUG("Refusing %s request, too busy", rpc_info(type)->name);
+    return 0;
+  }
+
+  struct sockaddr_storage addr = {0};
+  struct AddressPacked host = {0};
+  if (fromlen > sizeof(addr))
+    fromlen = sizeof(addr);
+  (void)memcpy(&addr, from, fromlen);
+  address_unmap(&addr, &fromlen);
+  if (address_pack(&addr, &host) == -1) {
+    global->tokens -= 1.0;
+    return 1; // a Unix socket, say, is nobody's to limit
+  }
+  host.port = 0;
+
+  struct AdmissionSource *source = admission_source(admission, &host, now);
+  source->seen_ms = now;
+  struct AdmissionBucket *bucket = &source->buckets[type];
+  admission_fill(bucket, rate->per_s, rate->burst, now);
+  // Into the reserve, which only goes so far for each source
+  struct AdmissionBucket *reserve = 0;
+  if (global->tokens < ADMISSION_GLOBAL_RESERVE + 1.0) {
+    reserve = &source->reserve;
+    admission_fill(reserve, ADMISSION_RESERVE_PER_S, ADMISSION_RESERVE_BURST,
+                   now);
+  }
+  uint32_t bit = 1U << (unsigned)type;
+  if (bucket->tokens >= rate->burst)
+    source->refusing &= ~bit; // it has kept to the rate for a while
+  if (bucket->tokens < 1.0 || (reserve && reserve->tokens < 1.0)) {
+    admission->refused += 1;
+    if (!(source->refusing & bit)) {
+      char name[ADDRESS_MAX_LEN] = "?";
+      (void)address_format_host(&addr, name, sizeof(name));
+      LOG_WARNING("Too many %s requests from %s, refusing some",
+                  rpc_info(type)->name, name);
+      source->refusing |= bit;
+    }
+    return 0;
+  }
+  bucket->tokens -= 1.0;
+  if (reserve)
+    reserve->tokens -= 1.0;
+  global->tokens -= 1.0;
+  return 1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "rpc.h"
+#include <sys/socket.h>
+
+struct Admission;
+
+// Decides which incoming requests get decoded and handled at all, so that one
+// peer cannot keep the event loop to itself.
+//
+// Every source address gets a token bucket per RPC type, refilled at a rate
+// that suits the type: Connect and HandleChange are rare and dear, Messages
+// and FileChunks come in bursts. Sources are told apart by host only, since
+// every new connection comes from a new port. A global bucket caps the work
+// taken from everyone together, and keeps a reserve that only Message and
+// Ping requests may use, so conversations go on while the rest is refused.
+// Each source only gets a share of the reserve.
+//
+// Start with P2P_ADMISSION=0 to admit everything.
+struct Admission *admission_new(void);
+void admission_free(struct Admission *admission);
+
+// 1 if the request may go ahead, 0 to refuse it before decoding. Admits
+// everything if admission is NULL.
+int admission_admit(struct Admission *admission, enum RpcType type,
+                    const struct sockaddr *from, socklen_t fromlen);
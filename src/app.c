@@ -1,180 +1,408 @@
 #include "app.h"
-#include "event2/bufferevent.h"
+#include "admission.h"
+#include "delivery.h"
 #include "generated/rpc.h"
 #include "log.h"
 #include "peer.h"
+#include "presence.h"
+#include "protocol.h"
+#include "resolver.h"
 #include "rpc.h"
+#include "rpc_limits.h"
+#include "sync.h"
+#include "trace.h"
+#include "transfer.h"
+#include "transport.h"
 #include "types.h"
-#include <arpa/inet.h>
 #include <assert.h>
 #include <event2/event.h>
-#include <event2/event_compat.h>
-#include <event2/http.h>
 #include <event2/rpc.h>
 #include <event2/util.h>
-#include <netinet/in.h>
-#include <readline/readline.h>
-#include <readline/tilde.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+// Callbacks running longer than this get their stack dumped when tracing
+#define APP_TRACE_SLOW_MS 50
+// Slots in the command hash table, a power of 2 larger than the commands
+#define APP_COMMAND_SLOTS 16
+
 struct Application { // NOLINT(altera-struct-pack-align)
   char *address; // address to send to peers to let them connect to us
   char *handle;
   fingerprint_t fingerprint;
   struct event_base *base;
-  struct evhttp *http;
-  struct evrpc_base *rpc;
+  int owns_base;
+  struct PeerEnv peer_env;
+  int owns_transport_ctx;
+  void *server;
+  struct Admission *admission; // NULL admits every request
+  unsigned char commands[APP_COMMAND_SLOTS]; // index into g_commands + 1
+  struct PeerTargets *targets;
 
   struct Peer *peers;
   int num_peers;
+
+  struct Transfers *transfers;
+
+  app_message_cb_t message_cb; // optional, messages are logged otherwise
+  app_peer_cb_t peer_cb;       // optional
+  void *cbarg;
 };
 
 /***********
-app_run
+app_listen
 ************/
-static evutil_socket_t app_init_socket(struct Application *app);
-static void log_unhandled_requests(struct evhttp_request *req, void *ignored);
-
-static int app_setup_prompt(struct Application *app, struct event *event_stdin);
-static void app_cleanup_prompt(struct Application *app,
-                               struct event *event_stdin);
-
-int app_run(struct Application *app) {
-  int ret = EXIT_FAILURE;
-
-  evutil_socket_t server_socket = app_init_socket(app);
-  if (server_socket == -1)
-    goto failure1;
-
-  if (evhttp_accept_socket(app->http, server_socket) == -1)
-    goto failure2;
-
-  evhttp_set_gencb(app->http, log_unhandled_requests, NULL);
-
-  struct event *event_stdin = malloc(event_get_struct_event_size());
-  if (app_setup_prompt(app, event_stdin) == -1)
-    goto failure3;
-
-  LOG_DEBUG0("Starting event loop");
-  (void)event_base_dispatch(app->base);
-  LOG_DEBUG("Event loop done, exit code: %d", ret);
+static void app_dispatch(enum RpcType type, void *request, void *reply,
+                         void *arg);
+static int app_admit(enum RpcType type, const struct sockaddr *from,
+                     socklen_t fromlen, void *arg);
+
+
+int app_listen(struct Application *app) {
+  if (app->server)
+    return 0;
+
+  const struct TransportOps *transport = app->peer_env.transport;
+  char *address = 0;
+  app->server = transport->listen(app->peer_env.transport_ctx, app->base,
+                                  app_dispatch, app_admit, app, &address);
+  if (!app->server) {
+    LOG_ERROR("Could not listen using %s transport", transport->name);
+    return -1;
+  }
 
-  ret = EXIT_SUCCESS;
-  goto cleanup;
+  free(app->address);
+  app->address = address;
 
-cleanup:
-  app_cleanup_prompt(app, event_stdin);
-failure3:
-  free(event_stdin);
-failure2:
-  evutil_closesocket(server_socket);
-failure1:
-  (void)exit;
-  /* exit: */
-  return ret;
+  LOG_DEBUG("Listening on %s", app->address);
+  LOG_INFO("Ask your friends to use %s to connect to you", app->address);
+  return 0;
 }
 
 /********************
  RPC
 ********************/
 
-static void connect_cb(EVRPC_STRUCT(Connect) * rpc, void *arg);
-static void message_cb(EVRPC_STRUCT(Message) * rpc, void *arg);
-static void handle_cb(EVRPC_STRUCT(HandleChange) *rpc, void *arg);
+static void connect_cb(struct Application *app, struct ConnectRequest *request,
+                       struct ConnectReply *reply);
+static void message_cb(struct Application *app, struct MessageRequest *request,
+                       struct MessageReply *reply);
+static void handle_cb(struct Application *app,
+                      struct HandleChangeRequest *request,
+                      struct HandleChangeReply *reply);
+static void file_chunk_cb(struct Application *app,
+                          struct FileChunkRequest *request,
+                          struct FileChunkReply *reply);
+static void ping_cb(struct Application *app, struct PingRequest *request,
+                    struct PingReply *reply);
+static void sync_cb(struct Application *app, struct SyncRequest *request,
+                    struct SyncReply *reply);
+
+// Indexed by enum RpcType
+static const char *const g_app_handler_names[] = {
+    "app.connect_cb",
+    "app.message_cb",
+    "app.handle_cb",
+    "app.file_chunk_cb",
+    "app.ping_cb",
+    "app.sync_cb",
+};
+_Static_assert(ARRAY_SIZE(g_app_handler_names) == RPC_NUM_TYPES,
+               "every RpcType needs a handler name");
+
+static int app_admit(enum RpcType type, const struct sockaddr *from,
+                     socklen_t fromlen, void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  return admission_admit(app->admission, type, from, fromlen);
+}
+
+static void app_dispatch(enum RpcType type, void *request, void *reply,
+                         void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  uint64_t start = tracer_begin(app->peer_env.tracer, g_app_handler_names[type]);
+  switch (type) {
+  case RPC_CONNECT:
+    connect_cb(app, request, reply);
+    break;
+  case RPC_MESSAGE:
+    message_cb(app, request, reply);
+    break;
+  case RPC_HANDLE_CHANGE:
+    handle_cb(app, request, reply);
+    break;
+  case RPC_FILE_CHUNK:
+    file_chunk_cb(app, request, reply);
+    break;
+  case RPC_PING:
+    ping_cb(app, request, reply);
+    break;
+  case RPC_SYNC:
+    sync_cb(app, request, reply);
+    break;
+  case RPC_NUM_TYPES:
+    break;
+  }
+  tracer_end(app->peer_env.tracer, g_app_handler_names[type], start);
+}
 
 /********
  Peer stuff
 *********/
-static void app_connect_peer(struct Application *app, char *peer_address) {
-  if (peer_track(app->handle, app->fingerprint, peer_address, &app->peers,
-                 &app->num_peers, app->address, app->base,
+int app_connect(struct Application *app, const char *peer_address) {
+  // peer_track may hold on to it until the name is resolved
+  char *copy = strdup(peer_address);
+  if (!copy ||
+      peer_track(app->handle, app->fingerprint, copy, &app->peers,
+                 &app->num_peers, app->address, &app->peer_env,
                  /*do_connect*/ 1) == -1) {
     LOG_ERROR0("Could not start connection");
+    free(copy);
+    return -1;
+  }
+  free(copy);
+  return 0;
+}
+
+int app_send(struct Application *app, const char *peer, size_t peer_length,
+             const char *message, delivery_done_cb_t done_cb, void *done_arg) {
+  int id = peer_targets_resolve(app->targets, peer, peer_length, app->peers,
+                                app->num_peers);
+  if (id == -1 || delivery_send(app->peer_env.delivery, id, message, done_cb,
+                                done_arg) == -1) {
+    LOG_ERROR0("Unable to send message");
+    return -1;
+  }
+  return 0;
+}
+
+static void app_message_cb(fingerprint_t fingerprint, const char *message,
+                           void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  if (app->message_cb) {
+    char name[RPC_MAX_HANDLE_LEN + 16] = "?";
+    (void)peer_format(peer_index(fingerprint, app->peers, app->num_peers),
+                      app->peers, app->num_peers, name, sizeof(name));
+    app->message_cb(name, message, app->cbarg);
+    return;
+  }
+  const char *handle = peer_find_handle(fingerprint, app->peers, app->num_peers);
+  LOG_INFO("%s#%d says: %s", handle, fingerprint, message);
+}
+
+static void app_connected_cb(int peer, void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  char name[RPC_MAX_HANDLE_LEN + 16] = "?";
+  if (peer_format(peer, app->peers, app->num_peers, name, sizeof(name)) == 0)
+    app->peer_cb(name, app->cbarg);
+}
+
+static void app_receipt_cb(int peer, uint32_t first, uint32_t last,
+                           void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  char name[RPC_MAX_HANDLE_LEN + 16] = "?";
+  (void)peer_format(peer, app->peers, app->num_peers, name, sizeof(name));
+  if (first == last)
+    LOG_INFO("Delivered to %s: message %u", name, last);
+  else
+    LOG_INFO("Delivered to %s: messages %u to %u", name, first, last);
+}
+
+static void app_backfill_cb(int peer, fingerprint_t author, uint64_t sent_ms,
+                            const char *message, void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  char name[RPC_MAX_HANDLE_LEN + 16] = "you";
+  if (author != app->fingerprint)
+    (void)peer_format(peer, app->peers, app->num_peers, name, sizeof(name));
+  // Embedders get what the peer said that they missed, as if it were new
+  if (app->message_cb) {
+    if (author != app->fingerprint)
+      app->message_cb(name, message, app->cbarg);
+    return;
   }
+  const uint64_t MS_PER_S = 1000;
+  time_t sent = (time_t)(sent_ms / MS_PER_S);
+  struct tm tm = {0};
+  char when[32] = "?";
+  if (localtime_r(&sent, &tm))
+    (void)strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+  LOG_INFO("Backfill, %s %s said: %s", when, name, message);
 }
 
-static void app_ack_message_cb(void *cbarg) {
-  struct Application *app = CAST(struct Application *, cbarg);
-  (void)app;
+// Catches up on what was said while the peer was away
+static void app_back_cb(int peer, void *arg) {
+  struct Application *app = CAST(struct Application *, arg);
+  sync_start(app->peer_env.sync, peer);
 }
 
 /****************
 app_new/app_free
 ****************/
+static int app_index_commands(struct Application *app);
+
+// P2P_TRANSPORT picks one by name, for trying them out
+static const struct TransportOps *app_default_transport(void) {
+  const char *name = getenv("P2P_TRANSPORT"); // NOLINT(concurrency-mt-unsafe)
+  if (!name || !*name)
+    return transport_http();
+  const struct TransportOps *transport = transport_find(name);
+  if (!transport) {
+    LOG_WARNING("No %s transport in this build, using http", name);
+    return transport_http();
+  }
+  return transport;
+}
+
 struct Application *app_new(ApplicationConfig *cfg) {
   if (getenv("LIBEVENT_DEBUG")) // NOLINT(concurrency-mt-unsafe)
     event_enable_debug_logging(EVENT_DBG_ALL);
 
-  (void)event_init(); // without this, everything breaks
-
   LOG_INFO("PID: %d", getpid());
 
   LOG_DEBUG0("Initializing app");
   struct Application *app =
-      (struct Application *)malloc(sizeof(struct Application));
+      (struct Application *)calloc(1, sizeof(struct Application));
 
   if (!app)
     goto failure1;
 
   app->address = 0;
   app->fingerprint = cfg->fingerprint;
+  app->message_cb = cfg->message_cb;
+  app->peer_cb = cfg->peer_cb;
+  app->cbarg = cfg->cbarg;
+
+  if (cfg->handle) {
+    app->handle = strndup(cfg->handle, RPC_MAX_HANDLE_LEN);
+    if (!app->handle)
+      goto failure3;
+  } else {
+    app->handle = malloc(sizeof(char) * (RPC_MAX_HANDLE_LEN + 1));
+    if (!app->handle)
+      goto failure3;
+    app->handle[RPC_MAX_HANDLE_LEN] = 0;
+
+    int ret = getlogin_r(app->handle, RPC_MAX_HANDLE_LEN);
+    if (ret != 0)
+      goto failure4;
+  }
 
-  const int HANDLE_LEN = 64;
-  app->handle = malloc(sizeof(char) * (HANDLE_LEN + 1));
-  if (!app->handle)
-    goto failure3;
-  app->handle[HANDLE_LEN] = 0;
-
-  int ret = getlogin_r(app->handle, HANDLE_LEN);
-  if (ret != 0)
-    goto failure4;
-
-  app->base = event_base_new();
+  app->base = cfg->base;
+  if (!app->base) {
+    app->base = event_base_new();
+    app->owns_base = 1;
+  }
 
   if (!app->base)
     goto failure5;
   LOG_DEBUG0("Initialized event loop");
 
-  app->http = evhttp_new(app->base);
-  if (!app->http)
+  app->peer_env.base = app->base;
+  app->peer_env.transport =
+      cfg->transport ? cfg->transport : app_default_transport();
+  app->peer_env.transport_ctx = cfg->transport_ctx;
+  if (!cfg->legacy_protocol) {
+    app->peer_env.protocol_version = PROTOCOL_VERSION;
+    app->peer_env.capabilities = PROTOCOL_CAPABILITIES;
+  }
+  if (cfg->peer_cb) {
+    app->peer_env.connected_cb = app_connected_cb;
+    app->peer_env.connected_arg = app;
+  }
+
+  const char *trace = getenv("P2P_TRACE"); // NOLINT(concurrency-mt-unsafe)
+  if (trace && *trace && strcmp(trace, "0") != 0) {
+    const int base = 10;
+    const char *slow_ms = getenv("P2P_TRACE_SLOW_MS"); // NOLINT(concurrency-mt-unsafe)
+    app->peer_env.tracer = tracer_new(
+        slow_ms ? (unsigned)strtoul(slow_ms, NULL, base) : APP_TRACE_SLOW_MS);
+  }
+
+  // P2P_ADMISSION=0 takes every request, for benchmarks on loopback
+  const char *admission = getenv("P2P_ADMISSION"); // NOLINT(concurrency-mt-unsafe)
+  if (!admission || strcmp(admission, "0") != 0) {
+    app->admission = admission_new();
+    if (!app->admission)
+      goto failure6;
+  }
+
+  const struct TransportOps *transport = app->peer_env.transport;
+  if (!app->peer_env.transport_ctx && transport->ctx_new) {
+    app->peer_env.transport_ctx = transport->ctx_new(app->base);
+    if (!app->peer_env.transport_ctx) {
+      LOG_ERROR("Could not set up %s transport", transport->name);
+      goto failure6;
+    }
+    app->owns_transport_ctx = 1;
+  }
+
+  app->peer_env.resolver = resolver_new(app->base);
+  if (!app->peer_env.resolver)
     goto failure6;
-  LOG_DEBUG0("Initialized HTTP server");
+  LOG_DEBUG0("Initialized DNS resolver");
 
-  app->rpc = evrpc_init(app->http);
-  if (!app->rpc)
+  app->peers = 0;
+  app->num_peers = 0;
+
+  app->peer_env.directory = peer_directory_new();
+  if (!app->peer_env.directory)
     goto failure7;
 
-  if (EVRPC_REGISTER(app->rpc, Connect, ConnectRequest, ConnectReply,
-                     connect_cb, app) == -1)
+  app->targets = peer_targets_new();
+  if (!app->targets)
     goto failure8;
 
-  if (EVRPC_REGISTER(app->rpc, Message, MessageRequest, MessageReply,
-                     message_cb, app) == -1)
+  app->peer_env.presence = presence_new(app->base, app->fingerprint,
+                                        &app->peers, &app->num_peers);
+  if (!app->peer_env.presence)
     goto failure9;
+  presence_set_back_cb(app->peer_env.presence, app_back_cb, app);
 
-  if (EVRPC_REGISTER(app->rpc, HandleChange, HandleChangeRequest,
-                     HandleChangeReply, handle_cb, app) == -1)
+  app->peer_env.sync = sync_new(app->fingerprint, &app->peers,
+                                &app->num_peers, app_backfill_cb, app);
+  if (!app->peer_env.sync)
     goto failure10;
 
-  LOG_DEBUG0("Initialized RPC server");
+  app->peer_env.delivery =
+      delivery_new(app->base, app->fingerprint, app->peer_env.presence,
+                   app->peer_env.sync, &app->peers, &app->num_peers,
+                   app_message_cb, app_receipt_cb, app);
+  if (!app->peer_env.delivery)
+    goto failure11;
 
-  app->peers = 0;
-  app->num_peers = 0;
+  if (app_index_commands(app) == -1)
+    goto failure12;
+
+  app->transfers = transfers_new(app->base, app->fingerprint, &app->peers,
+                                 &app->num_peers);
+  if (!app->transfers)
+    goto failure12;
+  app->peer_env.transfers = app->transfers;
 
   LOG_DEBUG0("Done initializing app");
   return app;
 
+failure12:
+  delivery_free(app->peer_env.delivery);
+failure11:
+  sync_free(app->peer_env.sync);
 failure10:
+  presence_free(app->peer_env.presence);
 failure9:
+  peer_targets_free(app->targets);
 failure8:
-  evrpc_free(app->rpc);
+  peer_directory_free(app->peer_env.directory);
 failure7:
-  evhttp_free(app->http);
+  resolver_free(app->peer_env.resolver);
 failure6:
-  event_base_free(app->base);
+  if (app->owns_transport_ctx)
+    app->peer_env.transport->ctx_free(app->peer_env.transport_ctx);
+  admission_free(app->admission);
+  tracer_free(app->peer_env.tracer);
+  if (app->owns_base)
+    event_base_free(app->base);
 failure5:
 failure4:
   free(app->handle);
@@ -187,26 +415,31 @@ failure1:
 void app_free(struct Application *app) {
   free(app->handle);
   free(app->address);
-  (void)EVRPC_UNREGISTER(app->rpc, Connect);
-  (void)EVRPC_UNREGISTER(app->rpc, Message);
-  (void)EVRPC_UNREGISTER(app->rpc, HandleChange);
-  evrpc_free(app->rpc);
-  evhttp_free(app->http);
-  event_base_free(app->base);
+  if (app->server)
+    app->peer_env.transport->close(app->server);
+  resolver_free(app->peer_env.resolver);
   peers_free(app->peers, app->num_peers);
+  peer_directory_free(app->peer_env.directory);
+  delivery_free(app->peer_env.delivery);
+  sync_free(app->peer_env.sync);
+  transfers_free(app->transfers);
+  peer_targets_free(app->targets);
+  presence_free(app->peer_env.presence);
+  if (app->owns_transport_ctx)
+    app->peer_env.transport->ctx_free(app->peer_env.transport_ctx);
+  admission_free(app->admission);
+  tracer_free(app->peer_env.tracer);
+  if (app->owns_base)
+    event_base_free(app->base);
   free(app);
-  libevent_global_shutdown();
 }
 
 /*********************
   RPC IMPLEMENTATION
  ********************/
-static void connect_cb(EVRPC_STRUCT(Connect) * rpc, void *arg) {
-  struct Application *app = CAST(struct Application *, arg);
-
+static void connect_cb(struct Application *app, struct ConnectRequest *request,
+                       struct ConnectReply *reply) {
   LOG_DEBUG0("Got connection");
-  struct ConnectRequest *request = rpc->request;
-  struct ConnectReply *reply = rpc->reply;
 
   uint32_t fingerprint_in = 0;
   if (EVTAG_GET(request, fingerprint, &fingerprint_in) == -1)
@@ -223,7 +456,7 @@ static void connect_cb(EVRPC_STRUCT(Connect) * rpc, void *arg) {
     goto failure;
 
   if (peer_track(handle, fingerprint, peer_address, &app->peers,
-                 &app->num_peers, app->address, app->base,
+                 &app->num_peers, app->address, &app->peer_env,
                  /*do_connect*/ 0) == -1) {
     LOG_ERROR0("Could not add peer connection");
     goto failure;
@@ -232,39 +465,42 @@ static void connect_cb(EVRPC_STRUCT(Connect) * rpc, void *arg) {
   LOG_INFO("New connection, remote peer %s#%d from %s", handle, fingerprint,
            peer_address);
 
+  uint32_t protocol_version = 0;
+  uint32_t capabilities = 0;
+  if (EVTAG_GET(request, protocol_version, &protocol_version) == 0)
+    (void)EVTAG_GET(request, capabilities, &capabilities);
+  peer_set_protocol(fingerprint, protocol_version, capabilities, app->peers,
+                    app->num_peers);
+  peer_heard(fingerprint, app->peers, app->num_peers);
+
   (void)EVTAG_ASSIGN(reply, fingerprint, app->fingerprint);
   (void)EVTAG_ASSIGN(reply, handle, app->handle);
+  if (protocol_version > 0 && app->peer_env.protocol_version > 0) {
+    (void)EVTAG_ASSIGN(reply, protocol_version, app->peer_env.protocol_version);
+    (void)EVTAG_ASSIGN(reply, capabilities, app->peer_env.capabilities);
+  }
 
 failure:
-  EVRPC_REQUEST_DONE(rpc);
+  return;
 }
 
-static void message_cb(EVRPC_STRUCT(Message) * rpc, void *arg) {
-  struct Application *app = CAST(struct Application *, arg);
-
-  struct MessageRequest *request = rpc->request;
-
-  char *message = 0;
+static void message_cb(struct Application *app, struct MessageRequest *request,
+                       struct MessageReply *reply) {
   uint32_t fingerprint = 0;
-
-  if (EVTAG_GET(request, message, &message) == -1)
-    goto failure1;
-
   if (EVTAG_GET(request, fingerprint, &fingerprint) == -1)
-    goto failure2;
+    goto failure1;
 
-  char *handle = peer_find_handle(fingerprint, app->peers, app->num_peers);
-  LOG_INFO("%s#%d says: %s", handle, fingerprint, message);
+  delivery_receive(app->peer_env.delivery, request, reply);
+  peer_heard(fingerprint, app->peers, app->num_peers);
 
-failure2:
 failure1:
-  EVRPC_REQUEST_DONE(rpc);
+  return;
 }
 
-static void handle_cb(EVRPC_STRUCT(HandleChange) *rpc, void *arg) {
-  struct Application *app = CAST(struct Application *, arg);
-
-  struct HandleChangeRequest *request = rpc->request;
+static void handle_cb(struct Application *app,
+                      struct HandleChangeRequest *request,
+                      struct HandleChangeReply *reply) {
+  (void)reply;
 
   char *new_handle = 0;
   uint32_t fingerprint = 0;
@@ -275,117 +511,108 @@ static void handle_cb(EVRPC_STRUCT(HandleChange) *rpc, void *arg) {
   if (EVTAG_GET(request, fingerprint, &fingerprint) == -1)
     goto failure2;
 
-  char * curr_handle = peer_find_handle(fingerprint, app->peers,app->num_peers);
+  const char * curr_handle = peer_find_handle(fingerprint, app->peers,app->num_peers);
   LOG_INFO("Peer with fingerprint %d changing handle from %s to %s", fingerprint,curr_handle,new_handle);
   peer_set_handle(new_handle,fingerprint,app->peers,app->num_peers);
+  peer_heard(fingerprint, app->peers, app->num_peers);
 
 failure2:
 failure1:
-  EVRPC_REQUEST_DONE(rpc);
+  return;
 }
 
-static void log_unhandled_requests(struct evhttp_request *req, void *ignored) {
-  (void)ignored;
-  LOG_DEBUG("Got unhandled request: %d", evhttp_request_get_command(req));
-  evhttp_send_error(req, HTTP_BADREQUEST, "Unknown request");
+static void file_chunk_cb(struct Application *app,
+                          struct FileChunkRequest *request,
+                          struct FileChunkReply *reply) {
+  transfer_receive_chunk(app->transfers, request, reply);
 }
 
-static evutil_socket_t app_init_socket(struct Application *app) {
-  evutil_socket_t server_socket = socket(AF_INET, SOCK_STREAM, 0);
-
-  struct sockaddr_in sin = {0};
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = 0;
-  sin.sin_port = htons(0);
-
-  int reuseaddr_opt_val = 1;
-  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt_val,
-                 sizeof(int))) {
-    perror("Could not retrieve socket information");
-    goto failure;
-  }
-
-  if (server_socket == -1) {
-    perror("socket() failed");
-    goto failure;
-  }
-
-  if (evutil_make_socket_nonblocking(server_socket) == -1) {
-    perror("Could not make socket nonblocking");
-    goto failure;
-  }
-
-  const int MAX_BACKLOG_LENGTH=16;
-  if (bind(server_socket, (void *)&sin, sizeof(sin)) == -1 ||
-      listen(server_socket, MAX_BACKLOG_LENGTH) == -1) {
-    LOG_ERROR0("Could not bind socket");
-    perror("Could not bind socket");
-    goto failure;
-  }
-
-  memset(&sin, 0, sizeof(sin));
-  socklen_t size = sizeof(sin);
-  if (getsockname(server_socket, (void *)&sin, &size) == -1) {
-    LOG_ERROR0("Could not get bound socket");
-    perror("Could not get bound socket");
-    goto failure;
-  }
-
-  char *addr = inet_ntoa(sin.sin_addr); // NOLINT(concurrency-mt-unsafe)
-  const int MAX_NUM_CHARS_IN_PORT=6;
-  size_t size2 = strlen(addr) + MAX_NUM_CHARS_IN_PORT + 1;
-  char *bound_addr = malloc(size2);
-  (void)snprintf(bound_addr, size, "%s:%d", addr, ntohs(sin.sin_port));
-  if (app->address)
-    free(app->address);
-
-  app->address = bound_addr;
-
-  LOG_DEBUG("Listening on %s", bound_addr);
-  LOG_INFO("Ask your friends to use %s to connect to you", bound_addr);
-
-  return server_socket;
+static void ping_cb(struct Application *app, struct PingRequest *request,
+                    struct PingReply *reply) {
+  uint32_t fingerprint = 0;
+  if (EVTAG_GET(request, fingerprint, &fingerprint) == -1)
+    return;
+  // Their ping is as good as ours, so they spare us pinging them back
+  peer_heard(fingerprint, app->peers, app->num_peers);
+  (void)EVTAG_ASSIGN(reply, fingerprint, app->fingerprint);
+}
 
-failure:
-  if (server_socket != -1)
-    (void)evutil_closesocket(server_socket);
-  return -1;
+static void sync_cb(struct Application *app, struct SyncRequest *request,
+                    struct SyncReply *reply) {
+  uint32_t fingerprint = 0;
+  if (EVTAG_GET(request, fingerprint, &fingerprint) == -1)
+    return;
+  sync_receive(app->peer_env.sync, request, reply);
+  peer_heard(fingerprint, app->peers, app->num_peers);
 }
 
 /***************
-  Interactive prompt/commands
+  Commands
  ***************/
-static struct Application *g_app_readline = 0; // NOLINT for readline callback only
-
-static void app_set_handle(struct Application *app, char *handle);
 
 typedef struct { // NOLINT(altera-struct-pack-align)
   const char *command;
+  size_t length;
   const char *help;
-  void (*callback)(struct Application *, char *rest_of_line);
+  // argument is whatever follows the command and a space, "" if nothing does
+  void (*callback)(struct Application *, char *argument);
 } command;
 
-static void command_show_handle(struct Application *app, char *rest_of_line) { // NOLINT(readability-non-const-parameter)
-  (void)rest_of_line;
-  LOG_INFO("%s", app->handle);
-}
+#define COMMAND(name, help, callback) {name, sizeof(name) - 1, help, callback}
 
-static void command_set_handle(struct Application *app, char *rest_of_line) {
-  app_set_handle(app, rest_of_line);
+static void command_handle(struct Application *app, char *handle) {
+  if (*handle == 0)
+    LOG_INFO("%s", app->handle);
+  else
+    (void)app_set_handle(app, handle);
 }
 
 static void command_connect_peer(struct Application *app, char *address) {
-  app_connect_peer(app, address);
+  if (*address == 0) {
+    LOG_WARNING0("Usage: /connect host:port");
+    return;
+  }
+  (void)app_connect(app, address);
+}
+
+static void command_send_file(struct Application *app, char *rest_of_line) {
+  // handle#fingerprint path
+  char *path = strchr(rest_of_line, ' ');
+  if (!path || path[1] == 0) {
+    LOG_WARNING0("Usage: /send-file handle#fingerprint path");
+    return;
+  }
+  *path = 0;
+  path += 1;
+  if (transfer_send_file(app->transfers, rest_of_line, path) == -1)
+    LOG_ERROR("Unable to send %s", path);
+}
+
+static void command_dump_trace(struct Application *app, char *path) {
+  char default_path[64] = {0};
+  if (*path == 0) {
+    (void)snprintf(default_path, sizeof(default_path), "p2pchat-trace-%d.json",
+                   getpid());
+    path = default_path;
+  }
+  (void)tracer_dump(app->peer_env.tracer, path);
 }
 
 static void command_show_help(struct Application *app, char * /*ignored*/);
 
 const command g_commands[] = {
-    {"/handle ", "/handle <handle>: set handle", command_set_handle},
-    {"/handle", "/handle: show current handle", command_show_handle},
-    {"/connect ", "/connect ipaddr:port: Connect to peer",
-     command_connect_peer},
-    {"/help", "/help: show help", command_show_help}};
+    COMMAND("/handle", "/handle [handle]: show or set your handle",
+            command_handle),
+    COMMAND("/connect",
+            "/connect host:port: Connect to peer, [host]:port for IPv6",
+            command_connect_peer),
+    COMMAND("/send-file", "/send-file handle#fingerprint path: Send a file",
+            command_send_file),
+    COMMAND("/trace",
+            "/trace [path]: write callback trace (needs P2P_TRACE=1), "
+            "defaults to p2pchat-trace-<pid>.json",
+            command_dump_trace),
+    COMMAND("/help", "/help: show help", command_show_help)};
 
 static void command_show_help(struct Application *app, char * ignored) { // NOLINT(readability-non-const-parameter)
   (void)app; (void) ignored;
@@ -395,113 +622,109 @@ static void command_show_help(struct Application *app, char * ignored) { // NOLI
   LOG_INFO0("To send a message: handle#fingerprint <your message here>");
 }
 
-static void handle_eof(struct Application *app) {
-  rl_callback_handler_remove(); // avoid extra output
-  if (event_base_loopexit(app->base, 0) == -1) {
-    LOG_ERROR0("Cannot exit loop?!");
-  }
+// Perfect for the commands we have, app_index_commands refuses to start if a
+// new one collides and the hash needs changing
+static unsigned command_slot(const char *name, size_t length) {
+  return (unsigned)(length * 2 + (unsigned char)name[1] +
+                    (unsigned char)name[length - 1]) &
+         (APP_COMMAND_SLOTS - 1U);
 }
 
-static void handle_command(struct Application *app, char * line) {
-  int found = 0;
+static int app_index_commands(struct Application *app) {
+  _Static_assert(ARRAY_SIZE(g_commands) < APP_COMMAND_SLOTS,
+                 "command table is too small");
+  memset(app->commands, 0, sizeof(app->commands));
   for (unsigned ii = 0; ii < ARRAY_SIZE(g_commands); ++ii) {
-    size_t size = strlen(g_commands[ii].command);
-    if (memcmp(g_commands[ii].command, line, size) == 0) {
-      g_commands[ii].callback(app, line + size);
-      found = 1;
-      break;
+    unsigned slot = command_slot(g_commands[ii].command, g_commands[ii].length);
+    if (app->commands[slot]) {
+      LOG_ERROR("Commands %s and %s collide", g_commands[ii].command,
+                g_commands[app->commands[slot] - 1].command);
+      return -1;
     }
+    app->commands[slot] = (unsigned char)(ii + 1);
   }
-  if (!found) {
+  return 0;
+}
+
+static void handle_command(struct Application *app, char *line,
+                           size_t length) {
+  char *end = memchr(line, ' ', length);
+  size_t name_length = end ? (size_t)(end - line) : length;
+  char *argument = end ? end + 1 : line + length;
+
+  unsigned char index = app->commands[command_slot(line, name_length)];
+  const command *found = index ? &g_commands[index - 1] : 0;
+  if (found && found->length == name_length &&
+      memcmp(found->command, line, name_length) == 0)
+    found->callback(app, argument);
+  else
     command_show_help(app, 0);
-  }
 }
 
-static void handle_message(struct Application *app, char * line) {
-  // Otherewise assume we have a message, where the format needs to be
-  // handle[#fingerprint] <message here>
-  size_t length = strlen(line);
-  char *ignored = 0;
-  char *peer = strtok_r(line, " ", &ignored);
-  size_t length_peer = strlen(peer);
+static void handle_message(struct Application *app, char *line,
+                           size_t length) {
+  // Otherwise assume we have a message, where the format needs to be
+  // handle#fingerprint <message here>
+  char *space = memchr(line, ' ', length);
   // No message
-  if (length_peer == length) {
+  if (!space || space == line || space + 1 == line + length) {
     command_show_help(app, 0);
-  } else {
-    char *message = line + length_peer + 1;
-    assert(*message != 0);
-    if (peer_send_message(app->fingerprint, peer, message, app->peers,
-                          app->num_peers, app_ack_message_cb, app) == -1) {
-      LOG_ERROR0("Unable to send message");
-    }
+    return;
   }
-}
-
-static void readline_handler(char *line) {
-  assert(g_app_readline != 0);
-  if (line == 0)
-    handle_eof(g_app_readline);
-  else if (*line == '/')
-    handle_command(g_app_readline, line);
-  else if (strlen(line))
-    handle_message(g_app_readline, line);
-  free(line);
-}
 
-static void stdin_callback(evutil_socket_t socket, short flags, void *app) {
-  (void)socket;
-  g_app_readline = (struct Application *)app;
-  if (flags & EV_READ) { // NOLINT(hicpp-signed-bitwise)
-    rl_callback_read_char();
+  char *message = space + 1;
+  if ((size_t)(line + length - message) > RPC_MAX_MESSAGE_LEN) {
+    LOG_ERROR("Messages are at most %d characters", RPC_MAX_MESSAGE_LEN);
+    return;
   }
+  (void)app_send(app, line, (size_t)(space - line), message, 0, 0);
 }
 
-#define MAX_PROMPT_SIZE 256
+void app_handle_line_length(struct Application *app, char *line,
+                            size_t length) {
+  if (*line == '/')
+    handle_command(app, line, length);
+  else if (length)
+    handle_message(app, line, length);
+}
 
-static void app_update_prompt(struct Application *app) {
-  char prompt[MAX_PROMPT_SIZE] = {0};
-  (void)snprintf(prompt, ARRAY_SIZE(prompt) - 1, "P2PCHAT:%s#%d@%s> ", app->handle,
-                 app->fingerprint, app->address);
-  rl_callback_handler_install(prompt, &readline_handler);
+void app_handle_line(struct Application *app, char *line) {
+  app_handle_line_length(app, line, strlen(line));
 }
 
-static void app_set_handle(struct Application *app, char *handle) {
+int app_set_handle(struct Application *app, const char *handle) {
   if (!handle || *handle == 0) {
     LOG_WARNING0("Attempted to set null handle, ignored");
-    return;
+    return -1;
   }
-  size_t size = strlen(handle) + 1;
+  if (strlen(handle) > RPC_MAX_HANDLE_LEN) {
+    LOG_WARNING("Handles are at most %d characters, ignored",
+                RPC_MAX_HANDLE_LEN);
+    return -1;
+  }
+  char *copy = strdup(handle);
+  if (!copy)
+    return -1;
   free(app->handle);
-  app->handle = malloc(size);
-  (void)strncpy(app->handle, handle, size);
-  assert(app->handle[size - 1] == 0);
-  app_update_prompt(app);
+  app->handle = copy;
 
   peers_notify_new_handle(app->handle, app->fingerprint, app->peers,
                           app->num_peers);
+  return 0;
 }
 
-static int app_setup_prompt(struct Application *app,
-                            struct event *event_stdin) {
-  LOG_INFO0("Type /help to get started");
-  if (event_assign(event_stdin, app->base, fileno(stdin), EV_READ | EV_PERSIST, // NOLINT(hicpp-signed-bitwise)
-                   stdin_callback, app) == -1)
-    goto failure;
-  if (event_add(event_stdin, 0) == -1)
-    goto failure;
-
-  app_update_prompt(app);
+struct event_base *app_base(const struct Application *app) {
+  return app->base;
+}
 
-  return 0;
-failure:
-  return -1;
+struct Tracer *app_tracer(const struct Application *app) {
+  return app->peer_env.tracer;
 }
 
-static void app_cleanup_prompt(struct Application *app,
-                               struct event *event_stdin) {
-  (void)app;
-  if (event_del(event_stdin) == -1) {
-    LOG_ERROR0("Unable to remove event");
-  }
-  rl_callback_handler_remove();
+const char *app_handle(const struct Application *app) { return app->handle; }
+
+fingerprint_t app_fingerprint(const struct Application *app) {
+  return app->fingerprint;
 }
+
+const char *app_address(const struct Application *app) { return app->address; }
@@ -1,12 +1,53 @@
 #pragma once
 
+#include "delivery.h"
 #include "types.h"
+#include <stddef.h>
+
+struct event_base;
+struct Tracer;
+struct TransportOps;
+
+// peer is handle#fingerprint
+typedef void (*app_message_cb_t)(const char *peer, const char *message,
+                                 void *arg);
+typedef void (*app_peer_cb_t)(const char *peer, void *arg);
 
 typedef struct {
   fingerprint_t fingerprint;
+  const char *handle;    // defaults to the login name
+  struct event_base *base; // defaults to a base owned by the application
+  const struct TransportOps *transport; // defaults to HTTP
+  void *transport_ctx;
+  int legacy_protocol; // behave like a version 0 node, for interop testing
+  // Messages from peers, including backfilled ones. Logged if NULL.
+  app_message_cb_t message_cb;
+  // A peer connected, either way
+  app_peer_cb_t peer_cb;
+  void *cbarg;
 } ApplicationConfig;
 
 struct Application *app_new(ApplicationConfig * cfg);
 void app_free(struct Application *app);
 
-int app_run(struct Application *app);
+// Start accepting peers without taking over the terminal
+int app_listen(struct Application *app);
+// Run a line as if it had been typed at the prompt
+void app_handle_line(struct Application *app, char *line);
+void app_handle_line_length(struct Application *app, char *line,
+                            size_t length);
+
+// address is host:port
+int app_connect(struct Application *app, const char *address);
+// peer is handle#fingerprint and does not need to be NUL terminated. done_cb
+// may be NULL.
+int app_send(struct Application *app, const char *peer, size_t peer_length,
+             const char *message, delivery_done_cb_t done_cb, void *done_arg);
+int app_set_handle(struct Application *app, const char *handle);
+
+struct event_base *app_base(const struct Application *app);
+struct Tracer *app_tracer(const struct Application *app);
+const char *app_handle(const struct Application *app);
+fingerprint_t app_fingerprint(const struct Application *app);
+// NULL until app_listen
+const char *app_address(const struct Application *app);
@@ -0,0 +1,240 @@
+#include "cli.h"
+#include "app.h"
+#include "log.h"
+#include "trace.h"
+#include "types.h"
+#include <assert.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <readline/readline.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How much of stdin we read at a time when it is not a terminal, also the
+// longest line we accept from it
+#define CLI_INPUT_SIZE (64 * 1024)
+#define CLI_MAX_PROMPT_SIZE 256
+
+struct CliInput;
+
+struct Cli { // NOLINT(altera-struct-pack-align)
+  struct Application *app;
+  struct event *event_stdin;
+  int interactive;        // readline owns the terminal
+  struct CliInput *input; // stdin is not a terminal, we split lines ourselves
+  char prompt[CLI_MAX_PROMPT_SIZE];
+};
+
+/***************
+  Interactive prompt
+ ***************/
+// readline's callbacks take no argument, and there is one terminal anyway
+static struct Cli *g_cli_readline = 0; // NOLINT for readline callback only
+
+static void cli_eof(struct Cli *cli) {
+  if (cli->interactive)
+    rl_callback_handler_remove(); // avoid extra output
+  if (event_base_loopexit(app_base(cli->app), 0) == -1) {
+    LOG_ERROR0("Cannot exit loop?!");
+  }
+}
+
+static void readline_handler(char *line);
+
+// The prompt shows our handle, so a /handle changes it
+static void cli_update_prompt(struct Cli *cli) {
+  if (!cli->interactive)
+    return;
+  char prompt[CLI_MAX_PROMPT_SIZE] = {0};
+  (void)snprintf(prompt, ARRAY_SIZE(prompt) - 1, "P2PCHAT:%s#%d@%s> ",
+                 app_handle(cli->app), app_fingerprint(cli->app),
+                 app_address(cli->app));
+  if (strcmp(prompt, cli->prompt) == 0)
+    return;
+  (void)memcpy(cli->prompt, prompt, sizeof(prompt));
+  rl_callback_handler_install(cli->prompt, &readline_handler);
+}
+
+static void readline_handler(char *line) {
+  assert(g_cli_readline != 0);
+  if (line == 0) {
+    cli_eof(g_cli_readline);
+  } else {
+    app_handle_line(g_cli_readline->app, line);
+    cli_update_prompt(g_cli_readline);
+  }
+  free(line);
+}
+
+static void stdin_callback(evutil_socket_t socket, short flags, void *arg) {
+  (void)socket;
+  g_cli_readline = CAST(struct Cli *, arg);
+  struct Tracer *tracer = app_tracer(g_cli_readline->app);
+  uint64_t start = tracer_begin(tracer, "app.stdin_callback");
+  if (flags & EV_READ) { // NOLINT(hicpp-signed-bitwise)
+    rl_callback_read_char();
+  }
+  tracer_end(tracer, "app.stdin_callback", start);
+}
+
+/***************
+  Scripted input
+ ***************/
+// readline goes through stdin a character at a time, which is what we want
+// for a person typing but far too slow when stdin is a pipe or a file. Then we
+// read large blocks and find the lines in them ourselves.
+struct CliInput { // NOLINT(altera-struct-pack-align)
+  int pollable; // regular files cannot be polled, keep the event active instead
+  int skipping; // dropping the rest of a line that was too long
+  size_t length;
+  char data[CLI_INPUT_SIZE + 1];
+};
+
+static void cli_input_lines(struct Cli *cli, struct CliInput *input) {
+  char *line = input->data;
+  char *end = input->data + input->length;
+  char *newline = 0;
+  // memchr is vectorized, unlike looking at one character at a time
+  while ((newline = memchr(line, '\n', (size_t)(end - line)))) {
+    size_t length = (size_t)(newline - line);
+    if (length && line[length - 1] == '\r')
+      length -= 1;
+    line[length] = 0;
+    if (input->skipping)
+      input->skipping = 0;
+    else
+      app_handle_line_length(cli->app, line, length);
+    line = newline + 1;
+  }
+
+  size_t rest = (size_t)(end - line);
+  if (rest == CLI_INPUT_SIZE) {
+    LOG_WARNING("Lines are at most %d characters, ignored", CLI_INPUT_SIZE);
+    input->skipping = 1;
+    rest = 0;
+  }
+  (void)memmove(input->data, line, rest);
+  input->length = rest;
+}
+
+static void input_callback(evutil_socket_t socket, short flags, void *arg) {
+  (void)socket;
+  (void)flags;
+  struct Cli *cli = CAST(struct Cli *, arg);
+  struct CliInput *input = cli->input;
+  struct Tracer *tracer = app_tracer(cli->app);
+  uint64_t start = tracer_begin(tracer, "app.stdin_callback");
+
+  ssize_t got = read(fileno(stdin), input->data + input->length,
+                     CLI_INPUT_SIZE - input->length);
+  if (got > 0) {
+    input->length += (size_t)got;
+    cli_input_lines(cli, input);
+    // One block per loop iteration, so peers still get served
+    if (!input->pollable)
+      event_active(cli->event_stdin, EV_READ, 0);
+  } else if (got == 0 || (errno != EINTR && errno != EAGAIN)) {
+    if (got == -1)
+      LOG_ERROR("Cannot read input: %s", strerror(errno));
+    // The last line does not need a newline
+    if (input->length && !input->skipping) {
+      input->data[input->length] = 0;
+      app_handle_line_length(cli->app, input->data, input->length);
+    }
+    input->length = 0;
+    cli_eof(cli);
+  } else if (!input->pollable) {
+    event_active(cli->event_stdin, EV_READ, 0);
+  }
+
+  tracer_end(tracer, "app.stdin_callback", start);
+}
+
+static int cli_setup_input(struct Cli *cli) {
+  struct CliInput *input = calloc(1, sizeof(struct CliInput));
+  if (!input)
+    goto failure1;
+
+  // epoll refuses regular files, which are always readable anyway
+  struct stat info = {0};
+  input->pollable = fstat(fileno(stdin), &info) == -1 || !S_ISREG(info.st_mode);
+
+  struct event_base *base = app_base(cli->app);
+  if (input->pollable) {
+    if (event_assign(cli->event_stdin, base, fileno(stdin),
+                     EV_READ | EV_PERSIST, // NOLINT(hicpp-signed-bitwise)
+                     input_callback, cli) == -1 ||
+        event_add(cli->event_stdin, 0) == -1)
+      goto failure2;
+  } else {
+    if (event_assign(cli->event_stdin, base, -1, 0, input_callback, cli) == -1)
+      goto failure2;
+    event_active(cli->event_stdin, EV_READ, 0);
+  }
+
+  cli->input = input;
+  return 0;
+
+failure2:
+  free(input);
+failure1:
+  return -1;
+}
+
+static int cli_setup_prompt(struct Cli *cli) {
+  if (!isatty(fileno(stdin)))
+    return cli_setup_input(cli);
+
+  LOG_INFO0("Type /help to get started");
+  if (event_assign(cli->event_stdin, app_base(cli->app), fileno(stdin),
+                   EV_READ | EV_PERSIST, // NOLINT(hicpp-signed-bitwise)
+                   stdin_callback, cli) == -1)
+    goto failure;
+  if (event_add(cli->event_stdin, 0) == -1)
+    goto failure;
+
+  cli->interactive = 1;
+  cli_update_prompt(cli);
+
+  return 0;
+failure:
+  return -1;
+}
+
+static void cli_cleanup_prompt(struct Cli *cli) {
+  if (event_del(cli->event_stdin) == -1) {
+    LOG_ERROR0("Unable to remove event");
+  }
+  if (cli->interactive)
+    rl_callback_handler_remove();
+  cli->interactive = 0;
+  free(cli->input);
+  cli->input = 0;
+}
+
+int cli_run(struct Application *app) {
+  int ret = EXIT_FAILURE;
+  struct Cli cli = {0};
+  cli.app = app;
+
+  if (app_listen(app) == -1)
+    goto failure1;
+
+  cli.event_stdin = malloc(event_get_struct_event_size());
+  if (!cli.event_stdin || cli_setup_prompt(&cli) == -1)
+    goto failure2;
+
+  LOG_DEBUG0("Starting event loop");
+  (void)event_base_dispatch(app_base(app));
+  LOG_DEBUG("Event loop done, exit code: %d", ret);
+
+  ret = EXIT_SUCCESS;
+  cli_cleanup_prompt(&cli);
+failure2:
+  free(cli.event_stdin);
+failure1:
+  return ret;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+struct Application;
+
+// Listens and runs the application from the terminal through readline, or
+// from the lines of stdin when it is a pipe or a file, until stdin ends. Only
+// the p2pchat executable has this, embedders drive the loop through p2pchat.h.
+int cli_run(struct Application *app);
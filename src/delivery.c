@@ -0,0 +1,615 @@
+#include "delivery.h"
+#include "generated/rpc.h"
+#include "log.h"
+#include "peer.h"
+#include "presence.h"
+#include "protocol.h"
+#include "rpc_limits.h"
+#include "sync.h"
+#include <event2/rpc.h>
+#include <event2/util.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Messages held by a receiver while it waits for a gap, one per bit of sack
+#define DELIVERY_REORDER 32
+// Messages in flight to a peer, counted from the oldest unacked one, so the
+// receiver has room to hold all of them
+#define DELIVERY_WINDOW 16
+_Static_assert(DELIVERY_WINDOW <= DELIVERY_REORDER + 1,
+               "receivers would drop messages we have in flight");
+// Messages waiting for a peer before we refuse more
+#define DELIVERY_QUEUE_MAX (64 * 1024)
+#define DELIVERY_RETRY_MIN_MS 500
+#define DELIVERY_RETRY_MAX_MS 8000
+// Receipts are collected for this long and reported together
+#define DELIVERY_RECEIPT_MS 200
+
+struct DeliveryOut {
+  struct DeliveryOut *next;
+  uint32_t sequence;
+  uint64_t sent_ms;
+  delivery_done_cb_t done_cb; // optional
+  void *done_arg;
+  int in_flight;
+  int held; // the receiver has it, waiting for an earlier one
+  char text[];
+};
+
+struct DeliveryHeld {
+  uint32_t sequence; // 0 if free
+  uint64_t sent_ms;
+  char *text;
+};
+
+struct DeliveryPeer { // NOLINT(altera-struct-pack-align)
+  struct Delivery *delivery;
+  int id;
+
+  // Sending
+  struct DeliveryOut *head; // oldest unacked
+  struct DeliveryOut *tail;
+  int queued;
+  uint32_t next_sequence;
+  uint32_t acked;    // the peer has everything up to here
+  uint32_t reported; // receipts went out up to here
+  int receipt_pending;
+  int retry_ms; // 0 unless the last attempt failed
+  struct event *retry_timer;
+
+  // Receiving
+  uint32_t session;
+  uint32_t delivered;
+  struct DeliveryHeld held[DELIVERY_REORDER]; // by sequence % DELIVERY_REORDER
+};
+
+struct Delivery { // NOLINT(altera-struct-pack-align)
+  struct event_base *base;
+  fingerprint_t my_fingerprint;
+  uint32_t session;
+  struct Presence *presence;
+  struct Sync *sync;
+  struct Peer **peers;
+  int *num_peers;
+  delivery_message_cb_t message_cb;
+  delivery_receipt_cb_t receipt_cb;
+  void *cbarg;
+
+  struct DeliveryPeer **states; // indexed like *peers, NULL until used
+  int num_states;
+
+  struct event *receipt_timer;
+  int *receipts; // peers with receipts to report
+  int num_receipts;
+  int receipts_capacity;
+};
+
+struct DeliverySent {
+  struct Delivery *delivery;
+  int id;
+  uint32_t sequence;
+};
+
+static void delivery_pump(struct DeliveryPeer *state);
+
+static void delivery_peer_free(struct DeliveryPeer *state) {
+  struct DeliveryOut *out = state->head;
+  while (out) {
+    struct DeliveryOut *next = out->next;
+    if (out->done_cb)
+      out->done_cb(1, out->done_arg);
+    free(out);
+    out = next;
+  }
+  for (int ii = 0; ii < DELIVERY_REORDER; ++ii)
+    free(state->held[ii].text);
+  if (state->retry_timer)
+    event_free(state->retry_timer);
+  free(state);
+}
+
+static void delivery_receipt_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  struct Delivery *delivery = CAST(struct Delivery *, arg);
+  for (int ii = 0; ii < delivery->num_receipts; ++ii) {
+    struct DeliveryPeer *state = delivery->states[delivery->receipts[ii]];
+    state->receipt_pending = 0;
+    if (state->acked > state->reported)
+      delivery->receipt_cb(state->id, state->reported + 1, state->acked,
+                           delivery->cbarg);
+    state->reported = state->acked;
+  }
+  delivery->num_receipts = 0;
+}
+
+struct Delivery *delivery_new(struct event_base *base,
+                              fingerprint_t my_fingerprint,
+                              struct Presence *presence, struct Sync *sync,
+                              struct Peer **peers, int *num_peers,
+                              delivery_message_cb_t message_cb,
+                              delivery_receipt_cb_t receipt_cb, void *cbarg) {
+  struct Delivery *delivery = calloc(1, sizeof(struct Delivery));
+  if (!delivery)
+    goto failure1;
+  delivery->base = base;
+  delivery->my_fingerprint = my_fingerprint;
+  delivery->presence = presence;
+  delivery->sync = sync;
+  delivery->peers = peers;
+  delivery->num_peers = num_peers;
+  delivery->message_cb = message_cb;
+  delivery->receipt_cb = receipt_cb;
+  delivery->cbarg = cbarg;
+
+  // Never 0, and with the top bit set it always takes the same space
+  evutil_secure_rng_get_bytes(&delivery->session, sizeof(delivery->session));
+  delivery->session |= 1U << 31U;
+
+  delivery->receipt_timer = evtimer_new(base, delivery_receipt_cb, delivery);
+  if (!delivery->receipt_timer)
+    goto failure2;
+  return delivery;
+
+failure2:
+  free(delivery);
+failure1:
+  return 0;
+}
+
+void delivery_free(struct Delivery *delivery) {
+  if (!delivery)
+    return;
+  for (int ii = 0; ii < delivery->num_states; ++ii) {
+    if (delivery->states[ii])
+      delivery_peer_free(delivery->states[ii]);
+  }
+  free(delivery->states);
+  event_free(delivery->receipt_timer);
+  free(delivery->receipts);
+  free(delivery);
+}
+
+static struct DeliveryPeer *delivery_state(struct Delivery *delivery, int id) {
+  if (id >= delivery->num_states) {
+    int num_states = id + 1 > delivery->num_states * 2 ? id + 1
+                                                       : delivery->num_states * 2;
+    struct DeliveryPeer **states = reallocarray(
+        delivery->states, num_states, sizeof(struct DeliveryPeer *));
+    if (!states)
+      return 0;
+    memset(states + delivery->num_states, 0,
+           (num_states - delivery->num_states) * sizeof(struct DeliveryPeer *));
+    delivery->states = states;
+    delivery->num_states = num_states;
+  }
+
+  if (!delivery->states[id]) {
+    struct DeliveryPeer *state = calloc(1, sizeof(struct DeliveryPeer));
+    if (!state)
+      return 0;
+    state->delivery = delivery;
+    state->id = id;
+    state->next_sequence = 1;
+    delivery->states[id] = state;
+  }
+  return delivery->states[id];
+}
+
+static void delivery_add_receipt(struct DeliveryPeer *state) {
+  struct Delivery *delivery = state->delivery;
+  if (state->receipt_pending)
+    return;
+  if (delivery->num_receipts == delivery->receipts_capacity) {
+    int capacity =
+        delivery->receipts_capacity ? delivery->receipts_capacity * 2 : 16;
+    int *receipts = reallocarray(delivery->receipts, capacity, sizeof(int));
+    if (!receipts)
+      return; // the next ack tries again
+    delivery->receipts = receipts;
+    delivery->receipts_capacity = capacity;
+  }
+  delivery->receipts[delivery->num_receipts++] = state->id;
+  state->receipt_pending = 1;
+
+  if (!evtimer_pending(delivery->receipt_timer, 0)) {
+    struct timeval delay = {0, DELIVERY_RECEIPT_MS * 1000};
+    (void)evtimer_add(delivery->receipt_timer, &delay);
+  }
+}
+
+static void delivery_retry_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  delivery_pump(CAST(struct DeliveryPeer *, arg));
+}
+
+static int delivery_backing_off(const struct DeliveryPeer *state) {
+  return state->retry_timer && evtimer_pending(state->retry_timer, 0);
+}
+
+static void delivery_retry_later(struct DeliveryPeer *state) {
+  if (!state->retry_timer) {
+    state->retry_timer =
+        evtimer_new(state->delivery->base, delivery_retry_cb, state);
+    if (!state->retry_timer) {
+      LOG_ERROR("Out of memory, messages to peer %d wait for it to connect",
+                state->id);
+      return;
+    }
+  }
+  if (evtimer_pending(state->retry_timer, 0))
+    return;
+
+  state->retry_ms = state->retry_ms ? state->retry_ms * 2 : DELIVERY_RETRY_MIN_MS;
+  if (state->retry_ms > DELIVERY_RETRY_MAX_MS)
+    state->retry_ms = DELIVERY_RETRY_MAX_MS;
+  const int MS_PER_S = 1000;
+  struct timeval delay = {state->retry_ms / MS_PER_S,
+                          state->retry_ms % MS_PER_S * MS_PER_S};
+  (void)evtimer_add(state->retry_timer, &delay);
+}
+
+// The peer has everything up to ack, and the ones after it in sack
+static void delivery_ack(struct DeliveryPeer *state, uint32_t ack,
+                         uint32_t sack) {
+  if (ack >= state->next_sequence)
+    ack = state->next_sequence - 1;
+  if (ack < state->acked)
+    return; // an older reply overtaken by a newer one
+  int advanced = ack > state->acked;
+  state->acked = ack;
+
+  // Unlinked before anyone is told, since they may send more
+  struct DeliveryOut *done = state->head;
+  struct DeliveryOut *done_tail = 0;
+  while (state->head && state->head->sequence <= ack) {
+    done_tail = state->head;
+    state->head = state->head->next;
+    state->queued -= 1;
+  }
+  if (!state->head)
+    state->tail = 0;
+  if (done_tail)
+    done_tail->next = 0;
+  else
+    done = 0;
+  while (done) {
+    struct DeliveryOut *next = done->next;
+    if (done->done_cb)
+      done->done_cb(0, done->done_arg);
+    free(done);
+    done = next;
+  }
+
+  // Anything the receiver stopped holding, say because it restarted, goes
+  // again. Only the window was ever sent.
+  for (struct DeliveryOut *out = state->head;
+       out && out->sequence <= ack + 1 + DELIVERY_REORDER; out = out->next) {
+    uint32_t bit = out->sequence - ack - 2;
+    int held = out->sequence >= ack + 2 && (sack >> bit) & 1U;
+    out->held = advanced ? held : out->held || held;
+  }
+
+  if (advanced)
+    delivery_add_receipt(state);
+}
+
+static void delivery_sent_cb(int error, struct MessageReply *reply,
+                             void *arg) {
+  struct DeliverySent sent = *CAST(struct DeliverySent *, arg);
+  free(arg);
+  struct DeliveryPeer *state = sent.delivery->states[sent.id];
+
+  for (struct DeliveryOut *out = state->head;
+       out && out->sequence <= sent.sequence; out = out->next) {
+    if (out->sequence == sent.sequence)
+      out->in_flight = 0;
+  }
+
+  if (error) {
+    delivery_retry_later(state);
+    return;
+  }
+  state->retry_ms = 0;
+
+  uint32_t ack = 0;
+  uint32_t sack = 0;
+  if (EVTAG_GET(reply, ack, &ack) == 0) {
+    (void)EVTAG_GET(reply, sack, &sack);
+    delivery_ack(state, ack, sack);
+  } else if (state->head && state->head->sequence == sent.sequence) {
+    // The receiver showed it without ordering it, which is all it will do
+    delivery_ack(state, sent.sequence, 0);
+  }
+  delivery_pump(state);
+}
+
+static int delivery_transmit(struct DeliveryPeer *state,
+                             struct DeliveryOut *out) {
+  struct Delivery *delivery = state->delivery;
+  struct MessageRequest *request = MessageRequest_new();
+  struct DeliverySent *sent = malloc(sizeof(struct DeliverySent));
+  if (!request || !sent)
+    goto failure;
+
+  (void)EVTAG_ASSIGN(request, message, out->text);
+  (void)EVTAG_ASSIGN(request, fingerprint, delivery->my_fingerprint);
+  (void)EVTAG_ASSIGN(request, session, delivery->session);
+  (void)EVTAG_ASSIGN(request, sequence, out->sequence);
+  (void)EVTAG_ASSIGN(request, oldest, state->head->sequence);
+  (void)EVTAG_ASSIGN(request, sent, out->sent_ms);
+
+  sent->delivery = delivery;
+  sent->id = state->id;
+  sent->sequence = out->sequence;
+  if (peer_send_message(state->id, request, *delivery->peers,
+                        *delivery->num_peers, delivery_sent_cb, sent) == -1) {
+    free(sent);
+    return -1;
+  }
+  out->in_flight = 1;
+  return 0;
+
+failure:
+  if (request)
+    MessageRequest_free(request);
+  free(sent);
+  return -1;
+}
+
+static void delivery_pump(struct DeliveryPeer *state) {
+  if (!state->head || delivery_backing_off(state))
+    return;
+  // No point waiting for the connection to time out
+  if (presence_state(state->delivery->presence, state->id) ==
+      PRESENCE_OFFLINE) {
+    delivery_retry_later(state);
+    return;
+  }
+
+  uint32_t end = state->head->sequence + DELIVERY_WINDOW;
+  for (struct DeliveryOut *out = state->head; out && out->sequence < end;
+       out = out->next) {
+    if (out->in_flight || out->held)
+      continue;
+    if (delivery_transmit(state, out) == -1) {
+      delivery_retry_later(state);
+      return;
+    }
+  }
+}
+
+struct DeliveryDone {
+  delivery_done_cb_t callback;
+  void *arg;
+};
+
+static void delivery_unordered_cb(int error, struct MessageReply *reply,
+                                  void *arg) {
+  (void)reply;
+  struct DeliveryDone *done = CAST(struct DeliveryDone *, arg);
+  if (error)
+    LOG_ERROR0("Failed to send message");
+  if (done) {
+    done->callback(error, done->arg);
+    free(done);
+  }
+}
+
+// For peers that do not order messages: once, now or never
+static int delivery_send_unordered(struct Delivery *delivery, int id,
+                                   const char *message, const char *name,
+                                   delivery_done_cb_t done_cb,
+                                   void *done_arg) {
+  if (presence_state(delivery->presence, id) == PRESENCE_OFFLINE) {
+    LOG_WARNING("%s is offline", name);
+    return -1;
+  }
+
+  struct MessageRequest *request = MessageRequest_new();
+  struct DeliveryDone *done =
+      done_cb ? malloc(sizeof(struct DeliveryDone)) : 0;
+  if (!request || (done_cb && !done)) {
+    if (request)
+      MessageRequest_free(request);
+    free(done);
+    return -1;
+  }
+  if (done) {
+    done->callback = done_cb;
+    done->arg = done_arg;
+  }
+  (void)EVTAG_ASSIGN(request, message, message);
+  (void)EVTAG_ASSIGN(request, fingerprint, delivery->my_fingerprint);
+  if (peer_send_message(id, request, *delivery->peers, *delivery->num_peers,
+                        delivery_unordered_cb, done) == -1) {
+    free(done);
+    return -1;
+  }
+  return 0;
+}
+
+int delivery_send(struct Delivery *delivery, int id, const char *message,
+                  delivery_done_cb_t done_cb, void *done_arg) {
+  char name[RPC_MAX_HANDLE_LEN + 16] = "?";
+  if (peer_format(id, *delivery->peers, *delivery->num_peers, name,
+                  sizeof(name)) == -1)
+    return -1;
+  if (!(peer_capabilities(id, *delivery->peers, *delivery->num_peers) &
+        PROTOCOL_CAP_SEQUENCE))
+    return delivery_send_unordered(delivery, id, message, name, done_cb,
+                                   done_arg);
+
+  struct DeliveryPeer *state = delivery_state(delivery, id);
+  if (!state)
+    return -1;
+  if (state->queued >= DELIVERY_QUEUE_MAX) {
+    LOG_ERROR("%d messages already waiting for %s", state->queued, name);
+    return -1;
+  }
+
+  size_t length = strlen(message);
+  struct DeliveryOut *out = malloc(sizeof(struct DeliveryOut) + length + 1);
+  if (!out)
+    return -1;
+  out->next = 0;
+  out->sequence = state->next_sequence++;
+  out->sent_ms = sync_clock_ms();
+  out->done_cb = done_cb;
+  out->done_arg = done_arg;
+  out->in_flight = 0;
+  out->held = 0;
+  (void)memcpy(out->text, message, length + 1);
+  if (state->tail)
+    state->tail->next = out;
+  else
+    state->head = out;
+  state->tail = out;
+  state->queued += 1;
+  (void)sync_record(delivery->sync, id, delivery->my_fingerprint,
+                    delivery->session, out->sequence, out->sent_ms, message);
+
+  if (presence_state(delivery->presence, id) == PRESENCE_OFFLINE)
+    LOG_WARNING("%s is offline, sending once it is back", name);
+  LOG_DEBUG("Message %u to %s queued", out->sequence, name);
+  delivery_pump(state);
+  return 0;
+}
+
+void delivery_resume(struct Delivery *delivery, int id) {
+  if (!delivery || id < 0 || id >= delivery->num_states ||
+      !delivery->states[id])
+    return;
+  struct DeliveryPeer *state = delivery->states[id];
+  // Requests on a connection that was replaced may never be answered, and a
+  // repeat is harmless
+  for (struct DeliveryOut *out = state->head; out; out = out->next)
+    out->in_flight = 0;
+  if (state->retry_timer)
+    (void)evtimer_del(state->retry_timer);
+  state->retry_ms = 0;
+  delivery_pump(state);
+}
+
+// Shows a message that is next in line, unless a sync brought it already
+static void delivery_show(struct Delivery *delivery, struct DeliveryPeer *state,
+                          fingerprint_t fingerprint, uint32_t sequence,
+                          uint64_t sent_ms, const char *message) {
+  if (sync_record(delivery->sync, state->id, fingerprint, state->session,
+                  sequence, sent_ms, message) == 0)
+    delivery->message_cb(fingerprint, message, delivery->cbarg);
+}
+
+// Shows the held messages that are next in line
+static void delivery_drain(struct Delivery *delivery,
+                           fingerprint_t fingerprint,
+                           struct DeliveryPeer *state) {
+  for (;;) {
+    struct DeliveryHeld *held =
+        &state->held[(state->delivered + 1) % DELIVERY_REORDER];
+    if (held->sequence != state->delivered + 1)
+      break;
+    delivery_show(delivery, state, fingerprint, held->sequence, held->sent_ms,
+                  held->text);
+    free(held->text);
+    held->text = 0;
+    held->sequence = 0;
+    state->delivered += 1;
+  }
+}
+
+// A sender that starts over gets a new session, and the sender knows better
+// than a receiver that starts over where its messages begin
+static void delivery_catch_up(struct DeliveryPeer *state, uint32_t session,
+                              uint32_t oldest) {
+  if (state->session != session) {
+    for (int ii = 0; ii < DELIVERY_REORDER; ++ii) {
+      free(state->held[ii].text);
+      state->held[ii].text = 0;
+      state->held[ii].sequence = 0;
+    }
+    state->session = session;
+    state->delivered = 0;
+  }
+  if (oldest <= state->delivered + 1)
+    return;
+  // Whatever we held below oldest, the sender had acked, so it was shown. One
+  // pass over what we hold, however far ahead oldest is.
+  for (int ii = 0; ii < DELIVERY_REORDER; ++ii) {
+    struct DeliveryHeld *held = &state->held[ii];
+    if (held->sequence && held->sequence < oldest) {
+      free(held->text);
+      held->text = 0;
+      held->sequence = 0;
+    }
+  }
+  state->delivered = oldest - 1;
+}
+
+void delivery_receive(struct Delivery *delivery,
+                      struct MessageRequest *request,
+                      struct MessageReply *reply) {
+  char *message = 0;
+  uint32_t fingerprint = 0;
+  uint32_t sequence = 0;
+  if (EVTAG_GET(request, message, &message) == -1 ||
+      EVTAG_GET(request, fingerprint, &fingerprint) == -1)
+    return;
+
+  // The reply gets acks only if the request was ordered, version 0 senders
+  // would reject them
+  if (EVTAG_GET(request, sequence, &sequence) == -1 || sequence == 0) {
+    delivery->message_cb(fingerprint, message, delivery->cbarg);
+    return;
+  }
+
+  uint32_t session = 0;
+  uint32_t oldest = 1;
+  uint64_t sent_ms = 0;
+  (void)EVTAG_GET(request, session, &session);
+  (void)EVTAG_GET(request, oldest, &oldest);
+  if (oldest > sequence)
+    oldest = sequence; // the sender has not acked this one, whatever it says
+  // Senders from before sync do not say, and we get it about now anyway
+  if (EVTAG_GET(request, sent, &sent_ms) == -1)
+    sent_ms = sync_clock_ms();
+
+  int id = peer_index(fingerprint, *delivery->peers, *delivery->num_peers);
+  struct DeliveryPeer *state = id == -1 ? 0 : delivery_state(delivery, id);
+  if (!state) {
+    // Nowhere to keep order, so show it and spare the sender repeating it
+    delivery->message_cb(fingerprint, message, delivery->cbarg);
+    (void)EVTAG_ASSIGN(reply, ack, sequence);
+    return;
+  }
+
+  delivery_catch_up(state, session, oldest);
+  delivery_drain(delivery, fingerprint, state);
+
+  if (sequence == state->delivered + 1) {
+    delivery_show(delivery, state, fingerprint, sequence, sent_ms, message);
+    state->delivered += 1;
+    delivery_drain(delivery, fingerprint, state);
+  } else if (sequence > state->delivered &&
+             sequence - state->delivered - 2 < DELIVERY_REORDER) {
+    struct DeliveryHeld *held = &state->held[sequence % DELIVERY_REORDER];
+    if (held->sequence != sequence) {
+      free(held->text);
+      held->text = strdup(message);
+      held->sequence = held->text ? sequence : 0;
+      held->sent_ms = sent_ms;
+    }
+  }
+  // Repeats and messages too far ahead are dropped, the sender tries again
+
+  uint32_t sack = 0;
+  for (uint32_t ii = 0; ii < DELIVERY_REORDER; ++ii) {
+    uint32_t held = state->delivered + 2 + ii;
+    if (state->held[held % DELIVERY_REORDER].sequence == held)
+      sack |= 1U << ii;
+  }
+  (void)EVTAG_ASSIGN(reply, ack, state->delivered);
+  if (sack)
+    (void)EVTAG_ASSIGN(reply, sack, sack);
+}
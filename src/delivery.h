@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+#include <event2/event.h>
+
+struct Delivery;
+struct MessageReply;
+struct MessageRequest;
+struct Peer;
+struct Presence;
+struct Sync;
+
+// A message from a peer, in the order the peer sent it
+typedef void (*delivery_message_cb_t)(fingerprint_t fingerprint,
+                                      const char *message, void *arg);
+// The peer now has every message we sent it, first to last by sequence
+typedef void (*delivery_receipt_cb_t)(int peer, uint32_t first, uint32_t last,
+                                      void *arg);
+
+// Ordered, acknowledged messages to and from peers that have
+// PROTOCOL_CAP_SEQUENCE. Other peers get each message once, as it is sent.
+//
+// Every message to a peer gets the next sequence number and stays queued
+// until the peer acks it. Acks ride on the replies the transport sends anyway
+// and are cumulative, with a bitmap of later messages that arrived out of
+// order, so one reply can ack a whole window and only the gaps are resent.
+// They are not delayed as in TCP: every request is answered anyway, so an
+// ack costs no message of its own, and holding the reply back would only
+// hold up the sender's window.
+// Receipts are held back a moment and reported once for everything acked in
+// the meantime. Messages that fail wait, backing off, until the peer comes
+// back or connects again, and then go again from the oldest, so nothing is
+// skipped across a reconnect. The receiver holds messages that arrive early
+// until the gap before them fills, and drops repeats. With sync, both sides
+// record every ordered message so a later sync can backfill what was lost.
+//
+// Peers are identified by their index in *peers, like in presence.h.
+struct Delivery *delivery_new(struct event_base *base,
+                              fingerprint_t my_fingerprint,
+                              struct Presence *presence, struct Sync *sync,
+                              struct Peer **peers, int *num_peers,
+                              delivery_message_cb_t message_cb,
+                              delivery_receipt_cb_t receipt_cb, void *cbarg);
+void delivery_free(struct Delivery *delivery);
+
+// The peer has the message, or error is non-zero if it never will
+typedef void (*delivery_done_cb_t)(int error, void *arg);
+
+// done_cb is optional. Ordered messages are only given up on when delivery is
+// freed, which calls done_cb with an error for each of them.
+int delivery_send(struct Delivery *delivery, int peer, const char *message,
+                  delivery_done_cb_t done_cb, void *done_arg);
+
+// Receiving side of a Message request, calls message_cb for every message that
+// is now in order
+void delivery_receive(struct Delivery *delivery,
+                      struct MessageRequest *request,
+                      struct MessageReply *reply);
+
+// A Connect with the peer went through, so send whatever is waiting for it
+void delivery_resume(struct Delivery *delivery, int peer);
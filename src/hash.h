@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_FNV1A_SEED 2166136261U
+
+// FNV-1a, what the hash tables use. Inline since it runs on every lookup.
+// Continues from hash, so a key in several parts hashes like one, starting
+// from HASH_FNV1A_SEED.
+static inline uint32_t hash_fnv1a_more(uint32_t hash, const void *data,
+                                       size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t ii = 0; ii < length; ++ii) {
+    hash ^= bytes[ii];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static inline uint32_t hash_fnv1a(const void *data, size_t length) {
+  return hash_fnv1a_more(HASH_FNV1A_SEED, data, length);
+}
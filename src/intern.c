@@ -0,0 +1,132 @@
+#include "intern.h"
+#include "hash.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_MIN_SLOTS 16 // power of 2
+
+struct InternString {
+  uint32_t refs;
+  uint32_t hash;
+  char text[];
+};
+
+// Open addressing with linear probing, at most 3/4 full
+struct Intern {
+  struct InternString **slots;
+  size_t capacity; // power of 2
+  size_t count;
+};
+
+static struct InternString *intern_string(const char *text) {
+  return (struct InternString *)(text - offsetof(struct InternString, text));
+}
+
+struct Intern *intern_new(void) {
+  struct Intern *intern = calloc(1, sizeof(struct Intern));
+  if (!intern)
+    goto failure1;
+  intern->slots = calloc(INTERN_MIN_SLOTS, sizeof(struct InternString *));
+  if (!intern->slots)
+    goto failure2;
+  intern->capacity = INTERN_MIN_SLOTS;
+  return intern;
+
+failure2:
+  free(intern);
+failure1:
+  return 0;
+}
+
+void intern_free(struct Intern *intern) {
+  if (!intern)
+    return;
+  for (size_t ii = 0; ii < intern->capacity; ++ii)
+    free(intern->slots[ii]);
+  free(intern->slots);
+  free(intern);
+}
+
+static int intern_grow(struct Intern *intern) {
+  size_t capacity = intern->capacity * 2;
+  struct InternString **slots = calloc(capacity, sizeof(struct InternString *));
+  if (!slots)
+    return -1;
+  for (size_t ii = 0; ii < intern->capacity; ++ii) {
+    struct InternString *string = intern->slots[ii];
+    if (!string)
+      continue;
+    size_t slot = string->hash & (capacity - 1);
+    while (slots[slot])
+      slot = (slot + 1) & (capacity - 1);
+    slots[slot] = string;
+  }
+  free(intern->slots);
+  intern->slots = slots;
+  intern->capacity = capacity;
+  return 0;
+}
+
+const char *intern_get(struct Intern *intern, const char *text, size_t length) {
+  uint32_t hash = hash_fnv1a(text, length);
+  size_t mask = intern->capacity - 1;
+  size_t slot = hash & mask;
+  for (; intern->slots[slot]; slot = (slot + 1) & mask) {
+    struct InternString *string = intern->slots[slot];
+    if (string->hash == hash && strncmp(string->text, text, length) == 0 &&
+        string->text[length] == 0) {
+      string->refs += 1;
+      return string->text;
+    }
+  }
+
+  if ((intern->count + 1) * 4 > intern->capacity * 3) {
+    if (intern_grow(intern) == -1)
+      return 0;
+    mask = intern->capacity - 1;
+    slot = hash & mask;
+    while (intern->slots[slot])
+      slot = (slot + 1) & mask;
+  }
+
+  struct InternString *string =
+      malloc(sizeof(struct InternString) + length + 1);
+  if (!string)
+    return 0;
+  string->refs = 1;
+  string->hash = hash;
+  (void)memcpy(string->text, text, length);
+  string->text[length] = 0;
+  intern->slots[slot] = string;
+  intern->count += 1;
+  return string->text;
+}
+
+void intern_release(struct Intern *intern, const char *text) {
+  if (!text)
+    return;
+  struct InternString *string = intern_string(text);
+  if (--string->refs > 0)
+    return;
+
+  size_t mask = intern->capacity - 1;
+  size_t hole = string->hash & mask;
+  while (intern->slots[hole] != string)
+    hole = (hole + 1) & mask;
+  free(string);
+  intern->count -= 1;
+
+  // Pull later entries of the run back over the hole, unless that would put
+  // them before the slot they hash to
+  for (size_t slot = (hole + 1) & mask; intern->slots[slot];
+       slot = (slot + 1) & mask) {
+    size_t home = intern->slots[slot]->hash & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      intern->slots[hole] = intern->slots[slot];
+      hole = slot;
+    }
+  }
+  intern->slots[hole] = 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+// Keeps one copy of each distinct string for everyone holding it. Copies are
+// reference counted and freed with their last holder.
+struct Intern;
+
+struct Intern *intern_new(void);
+// Frees every string, including ones still held
+void intern_free(struct Intern *intern);
+
+// The shared copy of the first length bytes of text, NUL terminated. NULL if
+// out of memory. Each call must be matched by an intern_release.
+const char *intern_get(struct Intern *intern, const char *text, size_t length);
+// text is from intern_get on the same intern, or NULL
+void intern_release(struct Intern *intern, const char *text);
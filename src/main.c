@@ -1,5 +1,7 @@
 #include "app.h"
+#include "cli.h"
 #include "log.h"
+#include <event2/event.h>
 #include <stdlib.h>
 
 int main(int argc, char *argv[]) {
@@ -10,13 +12,14 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  ApplicationConfig cfg;
+  ApplicationConfig cfg = {0};
   const int base = 10;
   cfg.fingerprint = strtol(argv[1], NULL, base);
   struct Application *app = app_new(&cfg);
   if (app) {
-    ret = app_run(app);
+    ret = cli_run(app);
     app_free(app);
   }
+  libevent_global_shutdown();
   return ret;
 }
@@ -0,0 +1,136 @@
+#include "p2pchat.h"
+#include "app.h"
+#include "log.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <event2/event.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct P2pNode { // NOLINT(altera-struct-pack-align)
+  struct Application *app;
+  p2p_message_cb_t message_cb;
+  p2p_peer_cb_t peer_cb;
+  void *cbarg;
+};
+
+struct P2pSend { // NOLINT(altera-struct-pack-align)
+  struct P2pNode *node;
+  p2p_sent_cb_t callback;
+  void *arg;
+};
+
+static void p2p_message_cb(const char *peer, const char *message, void *arg) {
+  struct P2pNode *node = CAST(struct P2pNode *, arg);
+  if (node->message_cb)
+    node->message_cb(node, peer, message, node->cbarg);
+}
+
+static void p2p_peer_cb(const char *peer, void *arg) {
+  struct P2pNode *node = CAST(struct P2pNode *, arg);
+  node->peer_cb(node, peer, node->cbarg);
+}
+
+struct P2pNode *p2p_node_new(const P2pConfig *config) {
+  struct P2pNode *node = calloc(1, sizeof(struct P2pNode));
+  if (!node)
+    goto failure1;
+  node->message_cb = config->message_cb;
+  node->peer_cb = config->peer_cb;
+  node->cbarg = config->cbarg;
+
+  ApplicationConfig cfg = {0};
+  cfg.fingerprint = config->fingerprint;
+  cfg.handle = config->handle;
+  cfg.base = config->base;
+  if (config->transport) {
+    cfg.transport = transport_find(config->transport);
+    if (!cfg.transport) {
+      LOG_ERROR("No %s transport in this build", config->transport);
+      goto failure2;
+    }
+  }
+  // Messages are ours to hand out even with nobody to take them, otherwise
+  // they would end up in the log
+  cfg.message_cb = p2p_message_cb;
+  cfg.peer_cb = config->peer_cb ? p2p_peer_cb : 0;
+  cfg.cbarg = node;
+
+  node->app = app_new(&cfg);
+  if (!node->app)
+    goto failure2;
+  if (app_listen(node->app) == -1)
+    goto failure3;
+  return node;
+
+failure3:
+  app_free(node->app);
+failure2:
+  free(node);
+failure1:
+  return 0;
+}
+
+void p2p_node_free(struct P2pNode *node) {
+  if (!node)
+    return;
+  app_free(node->app);
+  free(node);
+}
+
+const char *p2p_node_address(const struct P2pNode *node) {
+  return app_address(node->app);
+}
+
+uint16_t p2p_node_fingerprint(const struct P2pNode *node) {
+  return app_fingerprint(node->app);
+}
+
+int p2p_node_connect(struct P2pNode *node, const char *address) {
+  return app_connect(node->app, address);
+}
+
+static void p2p_sent_cb(int error, void *arg) {
+  struct P2pSend *send = CAST(struct P2pSend *, arg);
+  send->callback(send->node, error, send->arg);
+  free(send);
+}
+
+int p2p_node_send(struct P2pNode *node, const char *peer, const char *message,
+                  p2p_sent_cb_t sent_cb, void *arg) {
+  if (!peer || !message)
+    return -1;
+  if (strlen(message) > RPC_MAX_MESSAGE_LEN) {
+    LOG_ERROR("Messages are at most %d characters", RPC_MAX_MESSAGE_LEN);
+    return -1;
+  }
+
+  struct P2pSend *send = 0;
+  if (sent_cb) {
+    send = malloc(sizeof(struct P2pSend));
+    if (!send)
+      return -1;
+    send->node = node;
+    send->callback = sent_cb;
+    send->arg = arg;
+  }
+  if (app_send(node->app, peer, strlen(peer), message,
+               send ? p2p_sent_cb : 0, send) == -1) {
+    free(send);
+    return -1;
+  }
+  return 0;
+}
+
+int p2p_node_set_handle(struct P2pNode *node, const char *handle) {
+  return app_set_handle(node->app, handle);
+}
+
+int p2p_node_run_once(struct P2pNode *node) {
+  return event_base_loop(app_base(node->app), EVLOOP_ONCE);
+}
+
+int p2p_node_poll(struct P2pNode *node) {
+  return event_base_loop(app_base(node->app), EVLOOP_NONBLOCK);
+}
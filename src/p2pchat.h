@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+// Embeds a p2pchat node in another program, with no terminal involved.
+//
+// A node owns its peers, connections and transport and keeps no state
+// anywhere else, so a process can run several. Nodes do their work from
+// libevent callbacks: either hand them the event_base the program already
+// runs, or let each node make its own and call p2p_node_run_once or
+// p2p_node_poll regularly. A node is not thread-safe, use it from the thread
+// that runs its loop.
+//
+// Setting P2P_TRACE in the environment times the node's callbacks. It also
+// takes over SIGRTMIN for the whole process, with a timer that reports
+// callbacks running longer than P2P_TRACE_SLOW_MS (50 by default), until the
+// node is freed. Programs that use SIGRTMIN themselves should set
+// P2P_TRACE_SLOW_MS=0 or leave P2P_TRACE unset.
+//
+// Peers are named handle#fingerprint, as at the prompt. Logging still goes to
+// stderr, see log.h.
+
+struct event_base;
+struct P2pNode;
+
+// A message from a peer, including messages backfilled after we missed them
+typedef void (*p2p_message_cb_t)(struct P2pNode *node, const char *peer,
+                                 const char *message, void *arg);
+// A peer connected to us, or we to it
+typedef void (*p2p_peer_cb_t)(struct P2pNode *node, const char *peer,
+                              void *arg);
+// The peer has the message, or error is non-zero if it never will. Messages
+// still queued when the node is freed get an error then.
+typedef void (*p2p_sent_cb_t)(struct P2pNode *node, int error, void *arg);
+
+typedef struct { // NOLINT(altera-struct-pack-align)
+  uint16_t fingerprint;
+  const char *handle;      // defaults to the login name
+  struct event_base *base; // defaults to one owned by the node
+  const char *transport;   // http, uring or udp, defaults to P2P_TRANSPORT
+  p2p_message_cb_t message_cb; // all callbacks are optional
+  p2p_peer_cb_t peer_cb;
+  void *cbarg;
+} P2pConfig;
+
+// Starts listening right away. NULL on failure.
+struct P2pNode *p2p_node_new(const P2pConfig *config);
+void p2p_node_free(struct P2pNode *node);
+
+// host:port for other nodes to connect to
+const char *p2p_node_address(const struct P2pNode *node);
+uint16_t p2p_node_fingerprint(const struct P2pNode *node);
+
+// address is another node's p2p_node_address. Returns once the connection is
+// under way, peer_cb says when it is done.
+int p2p_node_connect(struct P2pNode *node, const char *address);
+// -1 if the message cannot be sent at all, in which case sent_cb is not
+// called
+int p2p_node_send(struct P2pNode *node, const char *peer, const char *message,
+                  p2p_sent_cb_t sent_cb, void *arg);
+int p2p_node_set_handle(struct P2pNode *node, const char *handle);
+
+// Runs the node's event_base until something happens. 0 on success, 1 if
+// there was nothing to wait for, -1 on error.
+int p2p_node_run_once(struct P2pNode *node);
+// Handles whatever is ready without waiting, returns like p2p_node_run_once
+int p2p_node_poll(struct P2pNode *node);
@@ -1,225 +1,542 @@
 #include "peer.h"
+#include "address.h"
+#include "delivery.h"
+#include "hash.h"
+#include "intern.h"
 #include "log.h"
+#include "presence.h"
+#include "protocol.h"
+#include "resolver.h"
 #include "rpc.h"
-#include <arpa/inet.h>
+#include "rpc_limits.h"
+#include "sync.h"
+#include "trace.h"
+#include "transfer.h"
+#include "transport.h"
 #include <assert.h>
-#include <event2/http.h>
-#include <event2/http_compat.h>
 #include <event2/rpc.h>
 #include <event2/rpc_struct.h>
+#include <event2/util.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Every peer we know of takes this much and no more. The link, and with it
+// the transport's buffers and timers, only exists once there is something to
+// send to the peer.
 struct Peer {
+  const struct PeerEnv *env;
+  const char *handle; // interned in env->directory
+  void *link;         // owned by env->transport, NULL while the peer is cold
+  struct AddressPacked addr;
+  int id; // index in the array, which stays the same while the peer exists
   fingerprint_t fingerprint;
-  char *handle;
+  // Negotiated in Connect, both 0 until then or for version 0 peers
+  uint8_t protocol_version;
+  uint8_t capabilities;
+  // Set while the array is freed, so that requests failed by link_free don't
+  // bring the link back
+  uint8_t closing;
+};
+_Static_assert(PROTOCOL_VERSION <= UINT8_MAX &&
+                   PROTOCOL_CAPABILITIES <= UINT8_MAX,
+               "negotiated protocol is kept in a byte each");
+
+// Open addressing with linear probing, at most 3/4 full
+struct PeerDirectory {
+  struct Intern *handles;
+  int *slots; // peer id + 1, 0 if free
+  size_t capacity; // power of 2
+  size_t count;
+  // Same again keyed by fingerprint, holding the peers that have one
+  int *fingerprint_slots;
+  size_t fingerprint_capacity;
+  size_t fingerprint_count;
+};
 
-  struct sockaddr_in sin;
-  struct event_base *base;
+#define PEER_DIRECTORY_MIN_SLOTS 16
 
-  struct evrpc_pool *pool;
-  struct evhttp_connection *connection;
-};
+struct PeerDirectory *peer_directory_new(void) {
+  struct PeerDirectory *directory = calloc(1, sizeof(struct PeerDirectory));
+  if (!directory)
+    goto failure1;
+  directory->handles = intern_new();
+  if (!directory->handles)
+    goto failure2;
+  directory->slots = calloc(PEER_DIRECTORY_MIN_SLOTS, sizeof(int));
+  if (!directory->slots)
+    goto failure3;
+  directory->capacity = PEER_DIRECTORY_MIN_SLOTS;
+  directory->fingerprint_slots = calloc(PEER_DIRECTORY_MIN_SLOTS, sizeof(int));
+  if (!directory->fingerprint_slots)
+    goto failure4;
+  directory->fingerprint_capacity = PEER_DIRECTORY_MIN_SLOTS;
+  return directory;
+
+failure4:
+  free(directory->slots);
+failure3:
+  intern_free(directory->handles);
+failure2:
+  free(directory);
+failure1:
+  return 0;
+}
 
-static int peer_parse_address(char *address, struct sockaddr_in *sin) {
-  if (!sin)
-    return -1;
+void peer_directory_free(struct PeerDirectory *directory) {
+  if (!directory)
+    return;
+  intern_free(directory->handles);
+  free(directory->slots);
+  free(directory->fingerprint_slots);
+  free(directory);
+}
 
-  memset(sin, 0, sizeof(struct sockaddr_in));
-  char *s = strstr(address, ":");
-  if (!s)
-    return -1;
+static size_t peer_address_hash(const struct AddressPacked *addr) {
+  return hash_fnv1a(addr, sizeof(*addr));
+}
 
-  *s = 0; // null terminate ip address temporarily
-  int ret = inet_pton(AF_INET, address, &sin->sin_addr);
-  *s = ':';
+static struct Peer *find_peer_by_address(const struct AddressPacked *addr,
+                                         const struct PeerDirectory *directory,
+                                         struct Peer *peers, int num_peers) {
+  size_t mask = directory->capacity - 1;
+  for (size_t slot = peer_address_hash(addr) & mask; directory->slots[slot];
+       slot = (slot + 1) & mask) {
+    int id = directory->slots[slot] - 1;
+    if (id < num_peers && memcmp(&peers[id].addr, addr, sizeof(*addr)) == 0)
+      return &peers[id];
+  }
+  return 0;
+}
 
-  if (ret <= 0) {
-    if (ret < 0)
-      perror("Unable to parse address");
-    LOG_ERROR("Unable to parse address: %s", address);
-    return -1;
+static void peer_directory_insert(int *slots, size_t capacity,
+                                  const struct Peer *peer) {
+  size_t slot = peer_address_hash(&peer->addr) & (capacity - 1);
+  while (slots[slot])
+    slot = (slot + 1) & (capacity - 1);
+  slots[slot] = peer->id + 1;
+}
+
+static int peer_directory_add(struct PeerDirectory *directory,
+                              const struct Peer *peers, int id) {
+  if ((directory->count + 1) * 4 > directory->capacity * 3) {
+    size_t capacity = directory->capacity * 2;
+    int *slots = calloc(capacity, sizeof(int));
+    if (!slots)
+      return -1;
+    // Peers are never removed, so ids below this one are all in use
+    for (int ii = 0; ii < id; ++ii)
+      peer_directory_insert(slots, capacity, &peers[ii]);
+    free(directory->slots);
+    directory->slots = slots;
+    directory->capacity = capacity;
   }
+  peer_directory_insert(directory->slots, directory->capacity, &peers[id]);
+  directory->count += 1;
+  return 0;
+}
 
-  const int base = 10;
-  long int port = strtol(s + 1, 0, base);
-  if (port == LONG_MIN || port == LONG_MAX) {
-    LOG_ERROR0("Overflow in port???");
-    return -1;
+static size_t peer_fingerprint_hash(fingerprint_t fingerprint) {
+  return hash_fnv1a(&fingerprint, sizeof(fingerprint));
+}
+
+static void peer_fingerprint_insert(int *slots, size_t capacity,
+                                    const struct Peer *peer) {
+  size_t slot = peer_fingerprint_hash(peer->fingerprint) & (capacity - 1);
+  while (slots[slot])
+    slot = (slot + 1) & (capacity - 1);
+  slots[slot] = peer->id + 1;
+}
+
+static int peer_fingerprint_add(struct PeerDirectory *directory,
+                                const struct Peer *peer) {
+  if ((directory->fingerprint_count + 1) * 4 >
+      directory->fingerprint_capacity * 3) {
+    size_t capacity = directory->fingerprint_capacity * 2;
+    int *slots = calloc(capacity, sizeof(int));
+    if (!slots)
+      return -1;
+    const struct Peer *peers = peer - peer->id;
+    for (size_t ii = 0; ii < directory->fingerprint_capacity; ++ii) {
+      int id = directory->fingerprint_slots[ii];
+      if (id)
+        peer_fingerprint_insert(slots, capacity, &peers[id - 1]);
+    }
+    free(directory->fingerprint_slots);
+    directory->fingerprint_slots = slots;
+    directory->fingerprint_capacity = capacity;
   }
+  peer_fingerprint_insert(directory->fingerprint_slots,
+                          directory->fingerprint_capacity, peer);
+  directory->fingerprint_count += 1;
+  return 0;
+}
 
-  sin->sin_port = htons(port);
-  ;
+// Takes the peer out under its current fingerprint, then moves later
+// entries of the run back so that lookups still reach them
+static void peer_fingerprint_remove(struct PeerDirectory *directory,
+                                    const struct Peer *peer) {
+  int *slots = directory->fingerprint_slots;
+  size_t mask = directory->fingerprint_capacity - 1;
+  size_t slot = peer_fingerprint_hash(peer->fingerprint) & mask;
+  while (slots[slot] && slots[slot] != peer->id + 1)
+    slot = (slot + 1) & mask;
+  if (!slots[slot])
+    return;
+  slots[slot] = 0;
+  directory->fingerprint_count -= 1;
+
+  const struct Peer *peers = peer - peer->id;
+  for (size_t next = (slot + 1) & mask; slots[next];
+       next = (next + 1) & mask) {
+    size_t home =
+        peer_fingerprint_hash(peers[slots[next] - 1].fingerprint) & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      slots[slot] = slots[next];
+      slots[next] = 0;
+      slot = next;
+    }
+  }
+}
 
+// Peers without a fingerprint stay out of the index
+static int peer_set_fingerprint(struct Peer *peer, fingerprint_t fingerprint) {
+  struct PeerDirectory *directory = peer->env->directory;
+  if (peer->fingerprint == fingerprint)
+    return 0;
+  if (peer->fingerprint)
+    peer_fingerprint_remove(directory, peer);
+  peer->fingerprint = fingerprint;
+  if (fingerprint && peer_fingerprint_add(directory, peer) == -1) {
+    peer->fingerprint = 0;
+    return -1;
+  }
   return 0;
 }
 
-static struct Peer *find_or_add_peer(char *address, struct Peer **array,
-                                     int *num_peers) {
+static struct Peer *find_or_add_peer(const struct sockaddr_storage *addr,
+                                     struct Peer **array, int *num_peers,
+                                     const struct PeerEnv *env) {
   if (!num_peers)
     return 0;
 
-  struct sockaddr_in sin;
-  if (peer_parse_address(address, &sin) == -1)
-    goto failure1;
-
-  struct Peer *peer = 0;
-  for (int ii = 0; ii < *num_peers; ++ii) {
-    struct Peer *p = &(*array)[ii];
-    if (memcmp(&sin, &p->sin, sizeof(struct sockaddr_in)) == 0) {
-      peer = p;
-      break;
-    }
+  struct AddressPacked packed;
+  if (address_pack(addr, &packed) == -1) {
+    LOG_ERROR0("Peers need an IPv4 or IPv6 address");
+    return 0;
   }
 
+  struct Peer *peer =
+      find_peer_by_address(&packed, env->directory, *array, *num_peers);
   if (peer) {
     LOG_INFO("Found existing peer: %s#%d", peer->handle, peer->fingerprint);
   } else {
-    LOG_INFO0("Creating new connection");
+    LOG_INFO0("Tracking new peer");
     struct Peer *array_alloc =
         reallocarray(*array, *num_peers + 1, sizeof(struct Peer));
     if (!array_alloc) {
       LOG_ERROR0("Could not allocate space for new peer!");
-      goto failure2;
+      goto failure1;
     }
     *array = array_alloc;
-    *num_peers += 1;
-    peer = &(*array)[*num_peers - 1];
+    peer = &(*array)[*num_peers];
     memset(peer, 0, sizeof(struct Peer));
+    peer->env = env;
+    peer->addr = packed;
+    peer->id = *num_peers;
+    if (peer_directory_add(env->directory, *array, peer->id) == -1) {
+      LOG_ERROR0("Could not allocate space for new peer!");
+      goto failure1;
+    }
+    *num_peers += 1;
   }
 
-  (void)memcpy(&peer->sin, &sin, sizeof(sin));
-
   LOG_DEBUG("Working with peer: %s#%d", peer->handle, peer->fingerprint);
   return peer;
-failure2:
 failure1:
   return 0;
 }
 
-static void peer_free_rpc(struct Peer *peer) {
-  if (peer->connection) {
-    if (peer->pool)
-      evrpc_pool_remove_connection(peer->pool, peer->connection);
-    evhttp_connection_free_on_completion(peer->connection);
-  }
+// handle has been through decoding, so it is already bounded
+static int peer_copy_handle(struct Peer *peer, const char *handle) {
+  struct Intern *handles = peer->env->directory->handles;
+  const char *copy =
+      intern_get(handles, handle, strnlen(handle, RPC_MAX_HANDLE_LEN));
+  if (!copy)
+    return -1;
+  intern_release(handles, peer->handle);
+  peer->handle = copy;
+  return 0;
+}
 
-  if (peer->pool)
-    evrpc_pool_free(peer->pool);
+static void peer_free_link(struct Peer *peer) {
+  void *link = peer->link;
+  peer->link = 0;
+  if (link)
+    peer->env->transport->link_free(link);
+}
 
-  peer->pool = 0;
-  peer->connection = 0;
+// Turns a cold peer into one we can send to
+static int peer_promote(struct Peer *peer) {
+  if (peer->closing)
+    return -1;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = address_unpack(&peer->addr, &addr);
+  peer->link = peer->env->transport->link_new(
+      peer->env->transport_ctx, peer->env->base,
+      (const struct sockaddr *)&addr, addrlen);
+  return peer->link ? 0 : -1;
 }
 
-static int peer_setup_rpc(struct Peer *peer) {
-  int ret = -1;
+// Indexed by enum RpcType
+static const char *const g_peer_callback_names[] = {
+    "peer.connect_cb",
+    "peer.message_cb",
+    "peer.handle_change_cb",
+    "peer.file_chunk_cb",
+    "peer.ping_cb",
+    "peer.sync_cb",
+};
+_Static_assert(ARRAY_SIZE(g_peer_callback_names) == RPC_NUM_TYPES,
+               "every RpcType needs a callback name");
+
+struct PeerCall {
+  const struct PeerEnv *env;
+  int id;
+  enum RpcType type;
+  transport_cb_t callback;
+  void *cbarg;
+};
 
-  peer_free_rpc(peer);
+// Every reply doubles as a heartbeat from the peer
+static void peer_call_cb(struct evrpc_status *status, void *request,
+                         void *reply, void *arg) {
+  struct PeerCall call = *CAST(struct PeerCall *, arg);
+  free(arg);
 
-  peer->pool = evrpc_pool_new(peer->base);
-  if (!peer->pool)
-    goto failure1;
+  if (status->error == EVRPC_STATUS_ERR_NONE)
+    presence_heard(call.env->presence, call.id);
 
-  // Pool will set the base when we add the connection
-  char * address = inet_ntoa(peer->sin.sin_addr); // NOLINT(concurrency-mt-unsafe)
-  peer->connection = evhttp_connection_base_new(
-      0, 0, address, ntohs(peer->sin.sin_port));
-  if (!peer->connection)
-    goto failure2;
+  const char *name = g_peer_callback_names[call.type];
+  uint64_t start = tracer_begin(call.env->tracer, name);
+  call.callback(status, request, reply, call.cbarg);
+  tracer_end(call.env->tracer, name, start);
+}
 
-  evrpc_pool_add_connection(peer->pool, peer->connection);
+// Same contract as TransportOps.request: callback is not called on failure
+static int peer_request(struct Peer *peer, enum RpcType type, void *request,
+                        void *reply, transport_cb_t callback, void *cbarg) {
+  if (!peer->link && peer_promote(peer) == -1)
+    return -1;
 
-  ret = 0;
-  goto exit;
+  const struct TransportOps *transport = peer->env->transport;
+  if (!peer->env->tracer && !peer->env->presence)
+    return transport->request(peer->link, type, request, reply, callback,
+                              cbarg);
 
-failure2:
-  evrpc_pool_free(peer->pool);
-  peer->pool = 0;
-failure1:
-exit:
-  return ret;
+  struct PeerCall *call = malloc(sizeof(struct PeerCall));
+  if (!call)
+    return -1;
+  call->env = peer->env;
+  call->id = peer->id;
+  call->type = type;
+  call->callback = callback;
+  call->cbarg = cbarg;
+
+  if (transport->request(peer->link, type, request, reply, peer_call_cb,
+                         call) == -1) {
+    free(call);
+    return -1;
+  }
+  return 0;
 }
 
 static void peer_free(struct Peer *peer) {
-  LOG_INFO("Freeing peer: %s:%d", inet_ntoa(peer->sin.sin_addr), // NOLINT
-           ntohs(peer->sin.sin_port));
-  peer_free_rpc(peer);
-  free(peer->handle);
+  if (peer->link) {
+    struct sockaddr_storage addr;
+    (void)address_unpack(&peer->addr, &addr);
+    char address[ADDRESS_MAX_LEN] = "?";
+    (void)address_format((struct sockaddr *)&addr, address, sizeof(address));
+    LOG_INFO("Freeing peer: %s", address);
+  }
+  peer_free_link(peer);
+  intern_release(peer->env->directory->handles, peer->handle);
 }
 
+// Peers live in a growable array, so callbacks find theirs again by address
+// rather than holding on to a pointer that a later peer_track may move
+struct PeerRef {
+  struct Peer **array;
+  int *num_peers;
+  const struct PeerEnv *env;
+  struct AddressPacked addr;
+};
+
+// Settles on what both sides support
+static void peer_negotiate(struct Peer *peer, uint32_t protocol_version,
+                           uint32_t capabilities) {
+  peer->protocol_version = protocol_version < peer->env->protocol_version
+                               ? protocol_version
+                               : peer->env->protocol_version;
+  peer->capabilities = capabilities & peer->env->capabilities;
+  LOG_DEBUG("Peer %s#%d speaks version %u with capabilities %#x",
+            peer->handle, peer->fingerprint, peer->protocol_version,
+            peer->capabilities);
+
+  // Version 0 peers may not answer pings, so they are never called offline
+  if (peer->capabilities & PROTOCOL_CAP_PING)
+    presence_watch(peer->env->presence, peer->id);
+  // Either way round, a Connect that went through means the peer is back
+  delivery_resume(peer->env->delivery, peer->id);
+  sync_start(peer->env->sync, peer->id);
+  transfers_resume(peer->env->transfers, peer->fingerprint);
+  if (peer->env->connected_cb)
+    peer->env->connected_cb(peer->id, peer->env->connected_arg);
+}
+
+static int peer_send_connect(struct Peer *peer, struct PeerRef *ref,
+                             const char *handle, fingerprint_t fingerprint,
+                             const char *my_address, int with_protocol);
+
 static void connect_cb(struct evrpc_status *status,
                        struct ConnectRequest *request,
                        struct ConnectReply *reply, void *cbarg) {
   LOG_INFO0("New connection");
 
-  struct Peer *peer = CAST(struct Peer *, cbarg);
+  struct PeerRef *ref = CAST(struct PeerRef *, cbarg);
+  if (status->error == EVRPC_STATUS_ERR_BADPAYLOAD &&
+      EVTAG_HAS(request, protocol_version)) {
+    // A version 0 node refuses fields it does not know, try again without
+    struct Peer *peer = find_peer_by_address(&ref->addr, ref->env->directory,
+                                             *ref->array, *ref->num_peers);
+    char *handle = 0;
+    uint32_t fingerprint = 0;
+    char *my_address = 0;
+    if (peer && EVTAG_GET(request, handle, &handle) == 0 &&
+        EVTAG_GET(request, fingerprint, &fingerprint) == 0 &&
+        EVTAG_GET(request, address, &my_address) == 0 &&
+        peer_send_connect(peer, ref, handle, fingerprint, my_address,
+                          /*with_protocol*/ 0) == 0) {
+      LOG_DEBUG0("Peer predates protocol versions, connecting again without");
+      ref = 0; // the new request owns it
+    }
+  }
+  if (!ref)
+    goto exit;
+
   if (status->error != EVRPC_STATUS_ERR_NONE) {
     LOG_ERROR("Failed to connect: %d", status->error);
     goto failure1;
   }
 
+  struct Peer *peer = find_peer_by_address(&ref->addr, ref->env->directory,
+                                           *ref->array, *ref->num_peers);
+  if (!peer) {
+    LOG_ERROR0("Peer went away while connecting");
+    goto failure2;
+  }
+
   char *handle = 0;
   if (EVTAG_GET(reply, handle, &handle) == -1 || handle == 0)
     goto failure3;
 
   uint32_t fingerprint = 0;
   if (EVTAG_GET(reply, fingerprint, &fingerprint) == -1)
-    goto failure2;
-  peer->fingerprint = fingerprint;
+    goto failure4;
+  if (peer_set_fingerprint(peer, fingerprint) == -1)
+    goto failure4;
 
-  free(peer->handle);
-  size_t size = strlen(handle) + 1;
-  peer->handle = malloc(size);
-  (void)strncpy(peer->handle, handle, size);
-  assert(peer->handle[size - 1] == 0);
+  if (peer_copy_handle(peer, handle) == -1)
+    goto failure5;
+
+  uint32_t protocol_version = 0;
+  uint32_t capabilities = 0;
+  (void)EVTAG_GET(reply, protocol_version, &protocol_version);
+  (void)EVTAG_GET(reply, capabilities, &capabilities);
+  peer_negotiate(peer, protocol_version, capabilities);
 
   LOG_INFO("Connected to peer %s#%d", peer->handle, peer->fingerprint);
 
   goto exit;
 
+failure5:
+failure4:
 failure3:
 failure2:
 failure1:
 exit:
+  free(ref);
   ConnectReply_free(reply);
   ConnectRequest_free(request);
 }
 
-int peer_track(char *handle, fingerprint_t fingerprint, char *peer_address,
-               struct Peer **array, int *num_peers, char *my_address,
-               struct event_base *base, int do_connect) {
-  assert(base != 0);
+static int peer_send_connect(struct Peer *peer, struct PeerRef *ref,
+                             const char *handle, fingerprint_t fingerprint,
+                             const char *my_address, int with_protocol) {
+  struct ConnectRequest *request = ConnectRequest_new();
+  struct ConnectReply *reply = ConnectReply_new();
+  if (!request || !reply)
+    goto failure;
+
+  (void)EVTAG_ASSIGN(request, handle, handle);
+  (void)EVTAG_ASSIGN(request, fingerprint, fingerprint);
+  struct sockaddr_storage addr;
+  socklen_t addrlen = address_unpack(&peer->addr, &addr);
+  char advertised[ADDRESS_MAX_LEN];
+  if (transport_advertised_address(my_address, &addr, addrlen, advertised,
+                                   sizeof(advertised)) == -1)
+    goto failure;
+  (void)EVTAG_ASSIGN(request, address, advertised);
+  if (with_protocol && peer->env->protocol_version > 0) {
+    (void)EVTAG_ASSIGN(request, protocol_version, peer->env->protocol_version);
+    (void)EVTAG_ASSIGN(request, capabilities, peer->env->capabilities);
+  }
+
+  if (peer_request(peer, RPC_CONNECT, request, reply,
+                   (transport_cb_t)connect_cb, ref) == -1)
+    goto failure;
+  return 0;
+
+failure:
+  if (reply)
+    ConnectReply_free(reply);
+  if (request)
+    ConnectRequest_free(request);
+  return -1;
+}
+
+static int peer_track_address(const char *handle, fingerprint_t fingerprint,
+                              const struct sockaddr_storage *addr,
+                              struct Peer **array, int *num_peers,
+                              const char *my_address,
+                              const struct PeerEnv *env, int do_connect) {
   int ret = -1;
-  struct Peer *peer = find_or_add_peer(peer_address, array, num_peers);
+  struct Peer *peer = find_or_add_peer(addr, array, num_peers, env);
   if (!peer)
     goto failure1;
 
-  if(peer->handle)
-    free(peer->handle);
-  size_t size = strlen(handle) + 1;
-  peer->handle = malloc(size);
-  (void)strncpy(peer->handle,handle,size);
-  assert(peer->handle[size-1] == 0);
-
-  peer->fingerprint = fingerprint;
+  if (peer_copy_handle(peer, handle) == -1)
+    goto failure2;
 
-  peer->base = base;
-  if (peer_setup_rpc(peer) == -1)
+  if (peer_set_fingerprint(peer, fingerprint) == -1)
     goto failure2;
 
-  struct ConnectRequest *request = 0;
-  struct ConnectReply *reply = 0;
-  if (do_connect) {
-    request = ConnectRequest_new();
-    reply = ConnectReply_new();
+  // The address is the same, so any link stays. Should the peer have
+  // restarted, the transport finds out and reconnects by itself.
 
-    (void)EVTAG_ASSIGN(request, handle, handle);
-    (void)EVTAG_ASSIGN(request, fingerprint, fingerprint);
-    (void)EVTAG_ASSIGN(request, address, my_address);
+  struct PeerRef *ref = 0;
+  if (do_connect) {
+    ref = malloc(sizeof(struct PeerRef));
+    if (!ref)
+      goto failure3;
+    ref->array = array;
+    ref->num_peers = num_peers;
+    ref->env = env;
+    ref->addr = peer->addr;
 
-    if (EVRPC_MAKE_REQUEST(Connect, peer->pool, request, reply, connect_cb,
-                           peer) == -1)
+    if (peer_send_connect(peer, ref, handle, fingerprint, my_address,
+                          /*with_protocol*/ 1) == -1)
       goto failure3;
   }
 
@@ -227,15 +544,120 @@ int peer_track(char *handle, fingerprint_t fingerprint, char *peer_address,
   goto exit;
 
 failure3:
-  ConnectReply_free(reply);
-  ConnectRequest_free(request);
+  free(ref);
 failure2:
 failure1:
 exit:
   return ret;
 }
 
+// Everything peer_track needs to finish once the host name is resolved
+struct PeerTrackRequest { // NOLINT(altera-struct-pack-align)
+  char *handle;
+  fingerprint_t fingerprint;
+  char *host;
+  uint16_t port;
+  char *my_address;
+  struct Peer **array;
+  int *num_peers;
+  const struct PeerEnv *env;
+  int do_connect;
+};
+
+static void peer_track_request_free(struct PeerTrackRequest *req) {
+  free(req->handle);
+  free(req->host);
+  free(req->my_address);
+  free(req);
+}
+
+static void peer_track_resolved_cb(int result, const struct sockaddr *sa,
+                                   socklen_t addrlen, void *arg) {
+  struct PeerTrackRequest *req = CAST(struct PeerTrackRequest *, arg);
+
+  if (result != 0) {
+    LOG_ERROR("Could not resolve %s", req->host);
+    goto failure1;
+  }
+
+  struct sockaddr_storage addr;
+  (void)memcpy(&addr, sa, addrlen);
+  address_set_port(&addr, req->port);
+
+  if (peer_track_address(req->handle, req->fingerprint, &addr, req->array,
+                         req->num_peers, req->my_address, req->env,
+                         req->do_connect) == -1) {
+    LOG_ERROR("Could not track peer at %s", req->host);
+  }
+
+failure1:
+  peer_track_request_free(req);
+}
+
+int peer_track(char *handle, fingerprint_t fingerprint, char *peer_address,
+               struct Peer **array, int *num_peers, char *my_address,
+               const struct PeerEnv *env, int do_connect) {
+  assert(env != 0 && env->base != 0);
+  int ret = -1;
+
+  char *host = malloc(strlen(peer_address) + 1);
+  if (!host)
+    goto failure1;
+
+  uint16_t port = 0;
+  if (address_split(peer_address, host, &port) == -1)
+    goto failure2;
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen = 0;
+  if (address_parse_numeric(host, port, &addr, &addrlen) == 0) {
+    ret = peer_track_address(handle, fingerprint, &addr, array, num_peers,
+                             my_address, env, do_connect);
+    goto exit;
+  }
+
+  if (!env->resolver) {
+    LOG_ERROR("Not a numeric address: %s", host);
+    goto failure2;
+  }
+
+  struct PeerTrackRequest *req = calloc(1, sizeof(struct PeerTrackRequest));
+  if (!req)
+    goto failure2;
+  req->handle = strdup(handle);
+  req->host = host;
+  req->my_address = strdup(my_address);
+  host = 0; // owned by req now
+  if (!req->handle || !req->my_address)
+    goto failure3;
+  req->fingerprint = fingerprint;
+  req->port = port;
+  req->array = array;
+  req->num_peers = num_peers;
+  req->env = env;
+  req->do_connect = do_connect;
+
+  LOG_DEBUG("Resolving %s", req->host);
+  if (resolver_resolve(env->resolver, req->host, peer_track_resolved_cb, req) ==
+      -1)
+    goto failure3;
+
+  ret = 0;
+  goto exit;
+
+failure3:
+  peer_track_request_free(req);
+failure2:
+failure1:
+exit:
+  free(host);
+  return ret;
+}
+
 void peers_free(struct Peer *array, int num_peers) {
+  for (int ii = 0; ii < num_peers; ++ii) {
+    array[ii].closing = 1;
+  }
   for (int ii = 0; ii < num_peers; ++ii) {
     peer_free(&array[ii]);
   }
@@ -278,113 +700,284 @@ static struct Peer *find_peer_by_fingerprint_handle(const char *handle, // optio
                                                     struct Peer *peers,
                                                     int num_peers) {
   assert(fingerprint != 0);
-  for (int ii = 0; ii < num_peers; ++ii) {
-    struct Peer *peer = &peers[ii];
-    LOG_DEBUG("Checking %s#%d against %s#%d",
-              handle ? handle : "(null)",
-              fingerprint, peer->handle,
-              peer->fingerprint);
+  if (num_peers == 0)
+    return 0;
+  const struct PeerDirectory *directory = peers[0].env->directory;
+  // Fingerprints can be shared, and the first peer tracked wins
+  struct Peer *found = 0;
+  size_t mask = directory->fingerprint_capacity - 1;
+  for (size_t slot = peer_fingerprint_hash(fingerprint) & mask;
+       directory->fingerprint_slots[slot]; slot = (slot + 1) & mask) {
+    int id = directory->fingerprint_slots[slot] - 1;
+    if (id >= num_peers || (found && found->id < id))
+      continue;
+    struct Peer *peer = &peers[id];
     if (peer->fingerprint == fingerprint &&
-        (!handle || strncmp(handle, peer->handle, strlen(handle)) == 0)) {
-      return &peers[ii];
-    }
+        (!handle || strncmp(handle, peer->handle, strlen(handle)) == 0))
+      found = peer;
   }
-  return 0;
+  return found;
 }
 
 struct MessageCBData {
-  peer_ack_callback_t callback;
+  peer_message_callback_t callback;
   void *cbarg;
 };
 
 static void message_cb(struct evrpc_status *status,
-                       struct MessageRequest * request,
-                       struct MessageReply *reply,
-                       void *cbarg) {
-  struct MessageCBData *msg = CAST(struct MessageCBData*, cbarg);
-
-  if(status->error != EVRPC_STATUS_ERR_NONE) {
-    LOG_ERROR("Failed to send message: %d", status->error);
-    goto failure1;
-  }
+                       struct MessageRequest *request,
+                       struct MessageReply *reply, void *cbarg) {
+  struct MessageCBData *msg = CAST(struct MessageCBData *, cbarg);
 
-  LOG_DEBUG0("Calling message ack callback");
-  msg->callback(msg->cbarg);
+  int error = status->error != EVRPC_STATUS_ERR_NONE;
+  if (error)
+    LOG_DEBUG("Failed to send message: %d", status->error);
+  msg->callback(error, error ? 0 : reply, msg->cbarg);
 
-  goto cleanup;
- cleanup:
- failure1:
   free(msg);
   MessageRequest_free(request);
   MessageReply_free(reply);
 }
 
-int peer_send_message(fingerprint_t my_fingerprint, char *speer, char *message,
-                      struct Peer *peers, int num_peers,
-                      peer_ack_callback_t callback, void *cbarg) {
-  int ret = -1;
+// handle#fingerprint, with room for the largest fingerprint
+#define PEER_TARGET_MAX_LEN (RPC_MAX_HANDLE_LEN + 12)
+#define PEER_TARGETS_SIZE 8 // power of 2
 
+struct PeerTarget {
+  char text[PEER_TARGET_MAX_LEN];
+  size_t length; // 0 if unused
+  size_t handle_length;
+  fingerprint_t fingerprint;
+  int index; // into the peers array, checked before use since it moves
+};
+
+struct PeerTargets {
+  struct PeerTarget entries[PEER_TARGETS_SIZE];
+};
+
+struct PeerTargets *peer_targets_new(void) {
+  return calloc(1, sizeof(struct PeerTargets));
+}
+
+void peer_targets_free(struct PeerTargets *targets) { free(targets); }
+
+static unsigned peer_target_slot(const char *text, size_t length) {
+  return hash_fnv1a(text, length) & (PEER_TARGETS_SIZE - 1U);
+}
+
+// Same answer as parsing speer and scanning the peers, as long as the peer is
+// still where we last found it and still goes by that handle
+static struct Peer *peer_targets_find(struct PeerTargets *targets,
+                                      const char *speer, size_t length,
+                                      struct Peer *peers, int num_peers) {
+  if (length == 0 || length > PEER_TARGET_MAX_LEN) {
+    LOG_ERROR("Unable to parse peer: %.*s", (int)length, speer);
+    return 0;
+  }
+
+  struct PeerTarget *target = &targets->entries[peer_target_slot(speer, length)];
+  if (target->length == length && memcmp(target->text, speer, length) == 0 &&
+      target->index < num_peers) {
+    struct Peer *peer = &peers[target->index];
+    if (peer->fingerprint == target->fingerprint &&
+        strncmp(target->text, peer->handle, target->handle_length) == 0)
+      return peer;
+  }
+
+  // peer_parse_handle reads past the handle even when there is no #
+  char copy[PEER_TARGET_MAX_LEN + 2] = {0};
+  (void)memcpy(copy, speer, length);
   char *handle = 0;
   fingerprint_t fingerprint = 0;
-
-  if (peer_parse_handle(speer, &handle, &fingerprint) == -1) {
-    LOG_ERROR("Unable to parse peer: %s", speer);
-    goto failure1;
+  if (peer_parse_handle(copy, &handle, &fingerprint) == -1 ||
+      fingerprint == 0) {
+    LOG_ERROR("Unable to parse peer: %.*s", (int)length, speer);
+    return 0;
   }
 
   LOG_DEBUG("Parsed peer %s#%d", handle, fingerprint);
 
   struct Peer *peer =
       find_peer_by_fingerprint_handle(handle, fingerprint, peers, num_peers);
+  if (!peer)
+    return 0;
+
+  (void)memcpy(target->text, speer, length);
+  target->length = length;
+  target->handle_length = strlen(handle);
+  target->fingerprint = fingerprint;
+  target->index = (int)(peer - peers);
+  return peer;
+}
+
+int peer_targets_resolve(struct PeerTargets *targets, const char *speer,
+                         size_t speer_length, struct Peer *peers,
+                         int num_peers) {
+  struct Peer *peer =
+      peer_targets_find(targets, speer, speer_length, peers, num_peers);
   if (!peer) {
     LOG_ERROR0(
         "Unable to find peer to send message, maybe they've never connected?");
-    goto failure2;
+    return -1;
   }
-
   LOG_DEBUG("Found peer %s#%d", peer->handle, peer->fingerprint);
+  return peer->id;
+}
 
-  struct MessageRequest *request = MessageRequest_new();
+int peer_send_message(int id, struct MessageRequest *request,
+                      struct Peer *peers, int num_peers,
+                      peer_message_callback_t callback, void *cbarg) {
   struct MessageReply *reply = MessageReply_new();
-
-  (void)EVTAG_ASSIGN(request, message, message);
-  (void)EVTAG_ASSIGN(request, fingerprint, my_fingerprint);
-
   struct MessageCBData *msg = malloc(sizeof(struct MessageCBData));
+  if (id < 0 || id >= num_peers || !reply || !msg)
+    goto failure;
   msg->callback = callback;
   msg->cbarg = cbarg;
 
-  if (EVRPC_MAKE_REQUEST(Message, peer->pool, request, reply, message_cb,
-                         msg) == -1) {
-    LOG_ERROR0("Unable to send message");
-    goto failure3;
+  if (peer_request(&peers[id], RPC_MESSAGE, request, reply,
+                   (transport_cb_t)message_cb, msg) == -1)
+    goto failure;
+  return 0;
+
+failure:
+  free(msg);
+  if (reply)
+    MessageReply_free(reply);
+  MessageRequest_free(request);
+  return -1;
+}
+
+struct SyncCBData {
+  peer_sync_callback_t callback;
+  void *cbarg;
+};
+
+static void sync_cb(struct evrpc_status *status, struct SyncRequest *request,
+                    struct SyncReply *reply, void *cbarg) {
+  struct SyncCBData *data = CAST(struct SyncCBData *, cbarg);
+
+  int error = status->error != EVRPC_STATUS_ERR_NONE;
+  if (error)
+    LOG_DEBUG("Sync failed: %d", status->error);
+  data->callback(error, error ? 0 : reply, data->cbarg);
+
+  free(data);
+  SyncRequest_free(request);
+  SyncReply_free(reply);
+}
+
+int peer_send_sync(int id, struct SyncRequest *request, struct Peer *peers,
+                   int num_peers, peer_sync_callback_t callback, void *cbarg) {
+  struct SyncReply *reply = SyncReply_new();
+  struct SyncCBData *data = malloc(sizeof(struct SyncCBData));
+  if (id < 0 || id >= num_peers || !reply || !data)
+    goto failure;
+  data->callback = callback;
+  data->cbarg = cbarg;
+
+  if (peer_request(&peers[id], RPC_SYNC, request, reply,
+                   (transport_cb_t)sync_cb, data) == -1)
+    goto failure;
+  return 0;
+
+failure:
+  free(data);
+  if (reply)
+    SyncReply_free(reply);
+  SyncRequest_free(request);
+  return -1;
+}
+
+int peer_resolve_fingerprint(char *speer, struct Peer *peers, int num_peers,
+                             fingerprint_t *fingerprint_out) {
+  char *handle = 0;
+  fingerprint_t fingerprint = 0;
+  if (peer_parse_handle(speer, &handle, &fingerprint) == -1 ||
+      fingerprint == 0) {
+    LOG_ERROR("Unable to parse peer: %s", speer);
+    return -1;
+  }
+
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(handle, fingerprint, peers, num_peers);
+  if (!peer) {
+    LOG_ERROR("Unknown peer %s#%d, maybe they've never connected?", handle,
+              fingerprint);
+    return -1;
+  }
+
+  *fingerprint_out = peer->fingerprint;
+  return 0;
+}
+
+struct FileChunkCBData {
+  peer_chunk_callback_t callback;
+  void *cbarg;
+};
+
+static void file_chunk_cb(struct evrpc_status *status,
+                          struct FileChunkRequest *request,
+                          struct FileChunkReply *reply, void *cbarg) {
+  struct FileChunkCBData *data = CAST(struct FileChunkCBData *, cbarg);
+
+  int error = status->error != EVRPC_STATUS_ERR_NONE;
+  uint64_t offset = 0;
+  if (!error && EVTAG_GET(reply, offset, &offset) == -1)
+    error = 1;
+  if (error)
+    LOG_DEBUG("File chunk failed: %d", status->error);
+
+  data->callback(error, offset, data->cbarg);
+
+  free(data);
+  FileChunkRequest_free(request);
+  FileChunkReply_free(reply);
+}
+
+int peer_send_file_chunk(fingerprint_t fingerprint,
+                         struct FileChunkRequest *request,
+                         struct Peer *peers, int num_peers,
+                         peer_chunk_callback_t callback, void *cbarg) {
+  int ret = -1;
+
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(NULL, fingerprint, peers, num_peers);
+  if (!peer) {
+    LOG_ERROR("No connection to peer with fingerprint %d", fingerprint);
+    goto failure1;
   }
 
-  (void)message;
-  (void)callback;
-  (void)cbarg;
+  struct FileChunkReply *reply = FileChunkReply_new();
+  struct FileChunkCBData *data = malloc(sizeof(struct FileChunkCBData));
+  if (!reply || !data)
+    goto failure2;
+  data->callback = callback;
+  data->cbarg = cbarg;
+
+  if (peer_request(peer, RPC_FILE_CHUNK, request, reply,
+                   (transport_cb_t)file_chunk_cb, data) == -1)
+    goto failure2;
 
   ret = 0;
   goto exit;
 
-failure3:
-  free(msg);
-  MessageRequest_free(request);
-  MessageReply_free(reply);
-failure1:
 failure2:
+  free(data);
+  if (reply)
+    FileChunkReply_free(reply);
+failure1:
+  FileChunkRequest_free(request);
 exit:
   return ret;
 }
 
-char *peer_find_handle(fingerprint_t fingerprint, struct Peer *array,
-                       int num_peers) {
-  for(int ii = 0; ii < num_peers; ++ii) {
-    struct Peer * peer = &array[ii];
-    if(peer->fingerprint == fingerprint)
-      return peer->handle;
-  }
-  return 0;
+const char *peer_find_handle(fingerprint_t fingerprint, struct Peer *array,
+                             int num_peers) {
+  if (fingerprint == 0)
+    return 0;
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(NULL, fingerprint, array, num_peers);
+  return peer ? peer->handle : 0;
 }
 
 static void handle_change_cb(struct evrpc_status *status,
@@ -407,8 +1000,8 @@ void peers_notify_new_handle(const char *handle, fingerprint_t fingerprint,
     (void)EVTAG_ASSIGN(request,handle,handle);
     (void)EVTAG_ASSIGN(request,fingerprint,fingerprint);
 
-    if(EVRPC_MAKE_REQUEST(HandleChange,peer->pool,request,reply,handle_change_cb,
-                          NULL) == -1) {
+    if(peer_request(peer,RPC_HANDLE_CHANGE,request,reply,
+                    (transport_cb_t)handle_change_cb,NULL) == -1) {
       LOG_ERROR("Unable to notify %s", peer->handle);
       HandleChangeRequest_free(request);
       HandleChangeReply_free(reply);
@@ -424,11 +1017,98 @@ void peer_set_handle(const char *handle, fingerprint_t fingerprint,
     return;
   }
 
-  free(peer->handle);
-  size_t len = strlen(handle)+1;
-  peer->handle = malloc(len);
-  (void)strncpy(peer->handle,handle,len);
-  assert(peer->handle[len-1] == 0);
+  if (peer_copy_handle(peer, handle) == -1) {
+    LOG_ERROR0("Could not allocate handle");
+    return;
+  }
 
   LOG_INFO("Set peer with fingerprint %d handle to %s", fingerprint, peer->handle);
 }
+
+struct PingCBData {
+  const struct PeerEnv *env;
+  int id;
+};
+
+static void ping_cb(struct evrpc_status *status, struct PingRequest *request,
+                    struct PingReply *reply, void *cbarg) {
+  struct PingCBData *data = CAST(struct PingCBData *, cbarg);
+  if (status->error != EVRPC_STATUS_ERR_NONE)
+    LOG_DEBUG("Ping to peer %d failed: %d", data->id, status->error);
+  presence_ping_done(data->env->presence, data->id);
+
+  free(data);
+  PingRequest_free(request);
+  PingReply_free(reply);
+}
+
+int peer_ping(fingerprint_t my_fingerprint, int id, struct Peer *peers,
+              int num_peers) {
+  if (id < 0 || id >= num_peers)
+    return -1;
+  struct Peer *peer = &peers[id];
+
+  struct PingRequest *request = PingRequest_new();
+  struct PingReply *reply = PingReply_new();
+  struct PingCBData *data = malloc(sizeof(struct PingCBData));
+  if (!request || !reply || !data)
+    goto failure;
+  data->env = peer->env;
+  data->id = id;
+  (void)EVTAG_ASSIGN(request, fingerprint, my_fingerprint);
+
+  if (peer_request(peer, RPC_PING, request, reply, (transport_cb_t)ping_cb,
+                   data) == -1)
+    goto failure;
+  return 0;
+
+failure:
+  free(data);
+  if (reply)
+    PingReply_free(reply);
+  if (request)
+    PingRequest_free(request);
+  return -1;
+}
+
+int peer_index(fingerprint_t fingerprint, struct Peer *peers, int num_peers) {
+  if (fingerprint == 0)
+    return -1;
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(NULL, fingerprint, peers, num_peers);
+  return peer ? peer->id : -1;
+}
+
+uint32_t peer_capabilities(int id, struct Peer *peers, int num_peers) {
+  return id >= 0 && id < num_peers ? peers[id].capabilities : 0;
+}
+
+void peer_heard(fingerprint_t fingerprint, struct Peer *peers, int num_peers) {
+  if (fingerprint == 0)
+    return;
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(NULL, fingerprint, peers, num_peers);
+  if (peer && peer->env)
+    presence_heard(peer->env->presence, peer->id);
+}
+
+int peer_format(int id, struct Peer *peers, int num_peers, char *out,
+                size_t size) {
+  if (id < 0 || id >= num_peers)
+    return -1;
+  int length = snprintf(out, size, "%s#%d",
+                        peers[id].handle ? peers[id].handle : "?",
+                        peers[id].fingerprint);
+  return length < 0 || (size_t)length >= size ? -1 : 0;
+}
+
+void peer_set_protocol(fingerprint_t fingerprint, uint32_t protocol_version,
+                       uint32_t capabilities, struct Peer *peers,
+                       int num_peers) {
+  if (fingerprint == 0)
+    return;
+  struct Peer *peer =
+      find_peer_by_fingerprint_handle(NULL, fingerprint, peers, num_peers);
+  if (peer && peer->env)
+    peer_negotiate(peer, protocol_version, capabilities);
+}
@@ -2,30 +2,97 @@
 
 #include "types.h"
 #include <netinet/in.h>
+#include <stddef.h>
 #include <event2/event.h>
 
+struct Delivery;
+struct MessageRequest;
+struct MessageReply;
 struct Peer;
+struct PeerDirectory;
+struct Resolver;
+struct TransportOps;
+struct Tracer;
+struct Presence;
+struct FileChunkRequest;
+struct Sync;
+struct SyncReply;
+struct SyncRequest;
+struct Transfers;
 
-char * peer_find_handle(fingerprint_t fingerprint,
-                        struct Peer * array, int num_peers);
+// Everything a peer needs to reach the outside world. Shared by all peers of
+// an application and must outlive them.
+struct PeerEnv {
+  struct event_base *base;
+  struct Resolver *resolver; // optional, without it only numeric addresses
+  const struct TransportOps *transport;
+  void *transport_ctx;
+  struct Tracer *tracer; // optional, times completion callbacks
+  struct Presence *presence; // optional, tracks which peers are alive
+  struct Delivery *delivery; // optional, orders messages to and from peers
+  struct Sync *sync;         // optional, backfills missed messages
+  struct Transfers *transfers; // optional, resumed when a peer reconnects
+  struct PeerDirectory *directory;
+  // What we advertise in Connect, see protocol.h
+  uint32_t protocol_version;
+  uint32_t capabilities;
+  // Optional, a Connect with the peer went through, either way round
+  void (*connected_cb)(int peer, void *arg);
+  void *connected_arg;
+};
+
+// Parses handle#fingerprint and checks that we know such a peer
+int peer_resolve_fingerprint(char *peer, struct Peer *peers, int num_peers,
+                             fingerprint_t *fingerprint_out);
+
+const char *peer_find_handle(fingerprint_t fingerprint, struct Peer *array,
+                             int num_peers);
 
 // do_connect 1 => connect as well as track, 0 => track only
+//
+// peer_address is host:port, where host is a name, an IPv4 address or a
+// bracketed IPv6 address. Names are resolved asynchronously through
+// env->resolver, so the peer may only show up in the array after this returns.
 int peer_track(char *handle, fingerprint_t fingerprint, char *peer_address,
                struct Peer **array_inout, int *num_peers_inout,
-               char *my_address, struct event_base *base, int do_connect);
+               char *my_address, const struct PeerEnv *env, int do_connect);
 
 void peers_free(struct Peer *array,
                 int num_peers);
 
-typedef void(*peer_ack_callback_t)(void *arg);
+// Finds peers by address or fingerprint and keeps one copy of each handle.
+// Goes in PeerEnv.directory and is freed after the peers.
+struct PeerDirectory *peer_directory_new(void);
+void peer_directory_free(struct PeerDirectory *directory);
+
+// Remembers where recently used handle#fingerprint targets resolved to, so
+// sending to the same peer again skips parsing and scanning the peers
+struct PeerTargets;
+struct PeerTargets *peer_targets_new(void);
+void peer_targets_free(struct PeerTargets *targets);
+
+// peer is handle#fingerprint and does not need to be NUL terminated. The
+// index of the peer, or -1 if there is no such peer.
+int peer_targets_resolve(struct PeerTargets *targets, const char *peer,
+                         size_t peer_length, struct Peer *peers,
+                         int num_peers);
+
+// error is non-zero if the message never made it, in which case reply is NULL
+typedef void (*peer_message_callback_t)(int error, struct MessageReply *reply,
+                                        void *arg);
+
+// Takes ownership of request, even on failure
+int peer_send_message(int peer, struct MessageRequest *request,
+                      struct Peer *peers, int num_peers,
+                      peer_message_callback_t callback, void *cbarg);
+
+// error is non-zero if the sync never made it, in which case reply is NULL
+typedef void (*peer_sync_callback_t)(int error, struct SyncReply *reply,
+                                     void *arg);
 
-int peer_send_message(fingerprint_t my_fingerprint,
-                      char * peer,
-                      char * message,
-                      struct Peer * peers,
-                      int num_peers,
-                      peer_ack_callback_t callback,
-                      void *cbarg);
+// Takes ownership of request, even on failure
+int peer_send_sync(int peer, struct SyncRequest *request, struct Peer *peers,
+                   int num_peers, peer_sync_callback_t callback, void *cbarg);
 
 void peers_notify_new_handle(const char * handle,
                              fingerprint_t fingerprint,
@@ -36,3 +103,37 @@ void peer_set_handle(const char * handle,
                      fingerprint_t fingerprint,
                      struct Peer * peers,
                      int num_peers);
+
+// error is non-zero if the chunk never made it, otherwise offset is how much
+// of the file the receiver now has
+typedef void (*peer_chunk_callback_t)(int error, uint64_t offset, void *arg);
+
+// Takes ownership of request, even on failure
+int peer_send_file_chunk(fingerprint_t fingerprint,
+                         struct FileChunkRequest *request,
+                         struct Peer *peers,
+                         int num_peers,
+                         peer_chunk_callback_t callback,
+                         void *cbarg);
+
+// Records what the peer with this fingerprint advertised in its Connect
+void peer_set_protocol(fingerprint_t fingerprint, uint32_t protocol_version,
+                       uint32_t capabilities, struct Peer *peers,
+                       int num_peers);
+
+// Peers are also identified by their index in the array, see presence.h
+int peer_ping(fingerprint_t my_fingerprint, int peer, struct Peer *peers,
+              int num_peers);
+
+// Index of the peer with this fingerprint, -1 if there is none
+int peer_index(fingerprint_t fingerprint, struct Peer *peers, int num_peers);
+
+// What the peer and we both support, see protocol.h
+uint32_t peer_capabilities(int peer, struct Peer *peers, int num_peers);
+
+// We got a request from the peer with this fingerprint, so it is alive
+void peer_heard(fingerprint_t fingerprint, struct Peer *peers, int num_peers);
+
+// Writes handle#fingerprint
+int peer_format(int peer, struct Peer *peers, int num_peers, char *out,
+                size_t size);
@@ -0,0 +1,343 @@
+#include "presence.h"
+#include "log.h"
+#include "peer.h"
+#include "rpc_limits.h"
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PRESENCE_TICK_MS 250
+#define PRESENCE_WHEEL_SLOTS 64 // power of 2, 16s of ticks
+// Peers quiet for this long get pinged
+#define PRESENCE_INTERVAL_MS 2000
+// How often we look for offline peers coming back
+#define PRESENCE_OFFLINE_PING_MS 10000
+// A ping not answered by then is given up on, should the reply be lost
+#define PRESENCE_PING_TIMEOUT_MS 10000
+// phi is -log10 of the chance that a live peer stays quiet this long, 3 is
+// about 7 heartbeat intervals
+#define PRESENCE_PHI_OFFLINE 3.0
+#define PRESENCE_LOG10_E 0.4342944819032518
+// Weight of the newest gap in the moving average
+#define PRESENCE_GAP_WEIGHT 0.1
+// Peers named per line when reporting changes
+#define PRESENCE_REPORT_MAX 8
+
+struct PresencePeer { // NOLINT(altera-struct-pack-align)
+  uint64_t last_heard_ms;
+  uint64_t last_ping_ms;
+  double mean_gap_ms; // moving average of the time between heartbeats
+  uint64_t due_tick;
+  enum PresenceState state;
+  int watched;
+  int ping_pending;
+  int changed; // already in presence->changed
+  int back;    // went from offline to online since the last report
+};
+
+struct PresenceList {
+  int *peers;
+  int length;
+  int capacity;
+};
+
+struct Presence { // NOLINT(altera-struct-pack-align)
+  fingerprint_t my_fingerprint;
+  struct Peer **peers;
+  int *num_peers;
+  struct event *timer;
+
+  struct PresencePeer *states; // indexed like *peers
+  int num_states;
+
+  uint64_t origin_ms;
+  uint64_t tick; // last tick processed
+  struct PresenceList wheel[PRESENCE_WHEEL_SLOTS];
+  struct PresenceList due; // swapped with the slot being processed
+
+  struct PresenceList changed;
+  presence_back_cb_t back_cb;
+  void *back_cbarg;
+};
+
+static uint64_t presence_now_ms(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t MS_PER_S = 1000;
+  const uint64_t NS_PER_MS = 1000000;
+  return (uint64_t)ts.tv_sec * MS_PER_S + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+static int presence_list_add(struct PresenceList *list, int peer) {
+  if (list->length == list->capacity) {
+    int capacity = list->capacity ? list->capacity * 2 : 16;
+    int *peers = reallocarray(list->peers, capacity, sizeof(int));
+    if (!peers)
+      return -1;
+    list->peers = peers;
+    list->capacity = capacity;
+  }
+  list->peers[list->length++] = peer;
+  return 0;
+}
+
+static void presence_schedule(struct Presence *presence, int peer,
+                              uint64_t due_ms) {
+  uint64_t due_tick = due_ms > presence->origin_ms
+                          ? (due_ms - presence->origin_ms + PRESENCE_TICK_MS -
+                             1) / PRESENCE_TICK_MS
+                          : 0;
+  if (due_tick <= presence->tick)
+    due_tick = presence->tick + 1;
+  presence->states[peer].due_tick = due_tick;
+  // Slots further out than the wheel goes around just get looked at again
+  if (presence_list_add(
+          &presence->wheel[due_tick & (PRESENCE_WHEEL_SLOTS - 1U)], peer) ==
+      -1)
+    LOG_ERROR("Out of memory, no longer watching peer %d", peer);
+}
+
+static void presence_set_state(struct Presence *presence, int peer,
+                               enum PresenceState state) {
+  struct PresencePeer *state_peer = &presence->states[peer];
+  if (state_peer->state == state)
+    return;
+  if (state_peer->state == PRESENCE_OFFLINE)
+    state_peer->back = 1;
+  state_peer->state = state;
+  if (!state_peer->changed &&
+      presence_list_add(&presence->changed, peer) == 0)
+    state_peer->changed = 1;
+}
+
+static double presence_phi(const struct PresencePeer *state_peer,
+                           uint64_t elapsed_ms) {
+  // Live peers are heard from at least every interval, thanks to the pings,
+  // so a burst of traffic does not make a short silence look suspicious
+  double mean = state_peer->mean_gap_ms;
+  if (mean < PRESENCE_INTERVAL_MS)
+    mean = PRESENCE_INTERVAL_MS;
+  // Gaps taken as exponentially distributed
+  return (double)elapsed_ms / mean * PRESENCE_LOG10_E;
+}
+
+static void presence_check(struct Presence *presence, int peer,
+                           uint64_t now) {
+  struct PresencePeer *state_peer = &presence->states[peer];
+  uint64_t elapsed = now - state_peer->last_heard_ms;
+
+  if (state_peer->state != PRESENCE_OFFLINE &&
+      presence_phi(state_peer, elapsed) > PRESENCE_PHI_OFFLINE)
+    presence_set_state(presence, peer, PRESENCE_OFFLINE);
+
+  uint64_t ping_every = state_peer->state == PRESENCE_OFFLINE
+                            ? PRESENCE_OFFLINE_PING_MS
+                            : PRESENCE_INTERVAL_MS;
+  int ping_pending =
+      state_peer->ping_pending &&
+      now - state_peer->last_ping_ms < PRESENCE_PING_TIMEOUT_MS;
+  if (elapsed >= PRESENCE_INTERVAL_MS && !ping_pending &&
+      now - state_peer->last_ping_ms >= ping_every &&
+      peer_ping(presence->my_fingerprint, peer, *presence->peers,
+                *presence->num_peers) == 0) {
+    state_peer->ping_pending = 1;
+    state_peer->last_ping_ms = now;
+  }
+
+  if (elapsed < PRESENCE_INTERVAL_MS)
+    presence_schedule(presence, peer,
+                      state_peer->last_heard_ms + PRESENCE_INTERVAL_MS);
+  else
+    presence_schedule(presence, peer, now + ping_every);
+}
+
+static void presence_report_line(struct Presence *presence,
+                                 enum PresenceState state, const char *label) {
+  char line[PRESENCE_REPORT_MAX * (RPC_MAX_HANDLE_LEN + 16)] = {0};
+  size_t used = 0;
+  int count = 0;
+  for (int ii = 0; ii < presence->changed.length; ++ii) {
+    int peer = presence->changed.peers[ii];
+    if (presence->states[peer].state != state)
+      continue;
+    if (count++ >= PRESENCE_REPORT_MAX || used + 2 >= sizeof(line))
+      continue;
+    if (count > 1) {
+      (void)memcpy(line + used, ", ", 2);
+      used += 2;
+    }
+    (void)peer_format(peer, *presence->peers, *presence->num_peers,
+                      line + used, sizeof(line) - used);
+    used += strlen(line + used);
+  }
+  if (count > PRESENCE_REPORT_MAX)
+    LOG_INFO("%s: %s and %d more", label, line, count - PRESENCE_REPORT_MAX);
+  else if (count)
+    LOG_INFO("%s: %s", label, line);
+}
+
+static void presence_report(struct Presence *presence) {
+  if (!presence->changed.length)
+    return;
+  presence_report_line(presence, PRESENCE_ONLINE, "Online");
+  presence_report_line(presence, PRESENCE_OFFLINE, "Offline");
+  for (int ii = 0; ii < presence->changed.length; ++ii) {
+    int peer = presence->changed.peers[ii];
+    struct PresencePeer *state_peer = &presence->states[peer];
+    state_peer->changed = 0;
+    if (state_peer->back && state_peer->state == PRESENCE_ONLINE &&
+        presence->back_cb)
+      presence->back_cb(peer, presence->back_cbarg);
+    state_peer->back = 0;
+  }
+  presence->changed.length = 0;
+}
+
+static void presence_tick_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  struct Presence *presence = CAST(struct Presence *, arg);
+  uint64_t now = presence_now_ms();
+  uint64_t tick = (now - presence->origin_ms) / PRESENCE_TICK_MS;
+
+  // Catches up on ticks missed while the loop was busy
+  while (presence->tick < tick) {
+    presence->tick += 1;
+    struct PresenceList *slot =
+        &presence->wheel[presence->tick & (PRESENCE_WHEEL_SLOTS - 1U)];
+    struct PresenceList due = *slot;
+    *slot = presence->due;
+    slot->length = 0;
+    for (int ii = 0; ii < due.length; ++ii) {
+      int peer = due.peers[ii];
+      if (presence->states[peer].due_tick > presence->tick)
+        presence_schedule(presence, peer,
+                          presence->origin_ms +
+                              presence->states[peer].due_tick *
+                                  PRESENCE_TICK_MS);
+      else
+        presence_check(presence, peer, now);
+    }
+    presence->due = due;
+  }
+
+  presence_report(presence);
+}
+
+struct Presence *presence_new(struct event_base *base,
+                              fingerprint_t my_fingerprint,
+                              struct Peer **peers, int *num_peers) {
+  struct Presence *presence = calloc(1, sizeof(struct Presence));
+  if (!presence)
+    goto failure1;
+  presence->my_fingerprint = my_fingerprint;
+  presence->peers = peers;
+  presence->num_peers = num_peers;
+  presence->origin_ms = presence_now_ms();
+
+  presence->timer = event_new(base, -1, EV_PERSIST, presence_tick_cb, presence);
+  if (!presence->timer)
+    goto failure2;
+
+  return presence;
+
+failure2:
+  free(presence);
+failure1:
+  return 0;
+}
+
+void presence_free(struct Presence *presence) {
+  if (!presence)
+    return;
+  event_free(presence->timer);
+  for (int ii = 0; ii < PRESENCE_WHEEL_SLOTS; ++ii)
+    free(presence->wheel[ii].peers);
+  free(presence->due.peers);
+  free(presence->changed.peers);
+  free(presence->states);
+  free(presence);
+}
+
+static struct PresencePeer *presence_find(const struct Presence *presence,
+                                          int peer) {
+  if (!presence || peer < 0 || peer >= presence->num_states ||
+      !presence->states[peer].watched)
+    return 0;
+  return &presence->states[peer];
+}
+
+void presence_watch(struct Presence *presence, int peer) {
+  if (!presence || peer < 0)
+    return;
+
+  struct PresencePeer *watched = presence_find(presence, peer);
+  if (watched) {
+    // Reconnected, so the ping from before may be lost. Do not wait on it.
+    watched->ping_pending = 0;
+    watched->last_ping_ms = 0;
+    return;
+  }
+
+  if (peer >= presence->num_states) {
+    int num_states = peer + 1 > presence->num_states * 2
+                         ? peer + 1
+                         : presence->num_states * 2;
+    struct PresencePeer *states =
+        reallocarray(presence->states, num_states, sizeof(struct PresencePeer));
+    if (!states) {
+      LOG_ERROR("Out of memory, cannot watch peer %d", peer);
+      return;
+    }
+    memset(states + presence->num_states, 0,
+           (num_states - presence->num_states) * sizeof(struct PresencePeer));
+    presence->states = states;
+    presence->num_states = num_states;
+  }
+
+  uint64_t now = presence_now_ms();
+  struct PresencePeer *state_peer = &presence->states[peer];
+  state_peer->watched = 1;
+  state_peer->state = PRESENCE_UNKNOWN;
+  state_peer->ping_pending = 0; // the one before the reconnect may be lost
+  state_peer->last_heard_ms = now; // a grace period to answer in
+  presence_schedule(presence, peer, now + PRESENCE_INTERVAL_MS);
+
+  if (!evtimer_pending(presence->timer, 0)) {
+    struct timeval tick = {0, PRESENCE_TICK_MS * 1000};
+    (void)evtimer_add(presence->timer, &tick);
+  }
+}
+
+void presence_heard(struct Presence *presence, int peer) {
+  struct PresencePeer *state_peer = presence_find(presence, peer);
+  if (!state_peer)
+    return;
+  uint64_t now = presence_now_ms();
+  double gap = (double)(now - state_peer->last_heard_ms);
+  state_peer->mean_gap_ms =
+      state_peer->mean_gap_ms == 0
+          ? gap
+          : state_peer->mean_gap_ms * (1 - PRESENCE_GAP_WEIGHT) +
+                gap * PRESENCE_GAP_WEIGHT;
+  state_peer->last_heard_ms = now;
+  presence_set_state(presence, peer, PRESENCE_ONLINE);
+}
+
+void presence_set_back_cb(struct Presence *presence, presence_back_cb_t back_cb,
+                          void *cbarg) {
+  presence->back_cb = back_cb;
+  presence->back_cbarg = cbarg;
+}
+
+void presence_ping_done(struct Presence *presence, int peer) {
+  struct PresencePeer *state_peer = presence_find(presence, peer);
+  if (state_peer)
+    state_peer->ping_pending = 0;
+}
+
+enum PresenceState presence_state(const struct Presence *presence, int peer) {
+  const struct PresencePeer *state_peer = presence_find(presence, peer);
+  return state_peer ? state_peer->state : PRESENCE_UNKNOWN;
+}
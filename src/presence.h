@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+#include <event2/event.h>
+
+struct Peer;
+struct Presence;
+
+enum PresenceState {
+  PRESENCE_UNKNOWN, // not heard from yet
+  PRESENCE_ONLINE,
+  PRESENCE_OFFLINE,
+};
+
+// Tells whether peers are alive. Any traffic with a peer counts as a
+// heartbeat, and a peer that has been quiet for a while gets pinged. A
+// phi-accrual detector turns the gaps between heartbeats into a verdict.
+//
+// All peers share a single timer driving a timing wheel, so the cost per tick
+// is the number of peers due rather than the number of peers. Changes are
+// reported once per tick for all peers at once.
+//
+// Peers are identified by their index in *peers, which never changes while
+// the peer exists.
+struct Presence *presence_new(struct event_base *base,
+                              fingerprint_t my_fingerprint,
+                              struct Peer **peers, int *num_peers);
+void presence_free(struct Presence *presence);
+
+// A peer that was offline is online again
+typedef void (*presence_back_cb_t)(int peer, void *arg);
+// Called once per tick for every peer that came back, after the report
+void presence_set_back_cb(struct Presence *presence, presence_back_cb_t back_cb,
+                          void *cbarg);
+
+// Starts watching a peer we have a connection to. Watching again is harmless.
+void presence_watch(struct Presence *presence, int peer);
+// We got a reply from or a request by the peer
+void presence_heard(struct Presence *presence, int peer);
+// A ping to the peer finished, whether or not it got through
+void presence_ping_done(struct Presence *presence, int peer);
+
+// PRESENCE_UNKNOWN for peers that are not watched, or if presence is NULL
+enum PresenceState presence_state(const struct Presence *presence, int peer);
@@ -0,0 +1,17 @@
+#pragma once
+
+// Version 1 added protocol_version and capabilities to Connect, and decoders
+// that skip fields they do not know. Nodes that send neither are version 0,
+// and reject any field they do not know.
+#define PROTOCOL_VERSION 1
+
+// Features a node supports. Peers use the ones both sides advertised in
+// Connect, which for a version 0 node is none of them.
+enum ProtocolCapability {
+  PROTOCOL_CAP_PING = 1U << 0U,     // answers Ping, see presence.h
+  PROTOCOL_CAP_SEQUENCE = 1U << 1U, // orders and acks messages, see delivery.h
+  PROTOCOL_CAP_SYNC = 1U << 2U,     // backfills missed messages, see sync.h
+};
+
+#define PROTOCOL_CAPABILITIES                                                  \
+  (PROTOCOL_CAP_PING | PROTOCOL_CAP_SEQUENCE | PROTOCOL_CAP_SYNC)
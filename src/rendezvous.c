@@ -0,0 +1,57 @@
+#include "rendezvous.h"
+#include <netinet/in.h>
+#include <string.h>
+
+#define RENDEZVOUS_V4 4
+#define RENDEZVOUS_V6 6
+
+int rendezvous_encode(uint8_t *out, enum RendezvousType type,
+                      const struct sockaddr_storage *addr) {
+  out[0] = (uint8_t)type;
+  if (!addr)
+    return 1;
+
+  uint16_t port = 0;
+  if (addr->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    out[1] = RENDEZVOUS_V4;
+    port = ntohs(sin->sin_port);
+    (void)memcpy(out + 4, &sin->sin_addr, sizeof(sin->sin_addr));
+  } else if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    out[1] = RENDEZVOUS_V6;
+    port = ntohs(sin6->sin6_port);
+    (void)memcpy(out + 4, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+  } else {
+    return -1;
+  }
+  out[2] = (uint8_t)(port >> 8U);
+  out[3] = (uint8_t)port;
+  return out[1] == RENDEZVOUS_V4 ? 1 + 3 + 4 : 1 + 3 + 16;
+}
+
+int rendezvous_decode_address(const uint8_t *in, size_t length,
+                              struct sockaddr_storage *addr,
+                              socklen_t *addrlen) {
+  memset(addr, 0, sizeof(*addr));
+  if (length < 4)
+    return -1;
+  uint16_t port = (uint16_t)((unsigned)in[2] << 8U | in[3]);
+  if (in[1] == RENDEZVOUS_V4 && length == 1 + 3 + 4) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    (void)memcpy(&sin->sin_addr, in + 4, sizeof(sin->sin_addr));
+    *addrlen = sizeof(*sin);
+    return 0;
+  }
+  if (in[1] == RENDEZVOUS_V6 && length == 1 + 3 + 16) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    (void)memcpy(&sin6->sin6_addr, in + 4, sizeof(sin6->sin6_addr));
+    *addrlen = sizeof(*sin6);
+    return 0;
+  }
+  return -1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// What the UDP transport and a rendezvous server say to each other, one
+// datagram each, starting with the type:
+//   REGISTER              peer -> server, every so often
+//   REGISTERED address    server -> peer, the address the server saw it at
+//   INTRODUCE address     peer -> server, wants to reach the peer at address
+//   PUNCH address         server -> both peers, send something to address
+// so that both NATs have let the other one through before any data goes.
+//
+// The server is stateless apart from which addresses have registered lately.
+// dev/rendezvous has one to run locally.
+
+enum RendezvousType {
+  // Below these, datagrams belong to the transport
+  RENDEZVOUS_REGISTER = 16,
+  RENDEZVOUS_REGISTERED,
+  RENDEZVOUS_INTRODUCE,
+  RENDEZVOUS_PUNCH,
+};
+
+// family (1) port (2) host (4 or 16), integers big endian
+#define RENDEZVOUS_ADDRESS_MAX 19
+
+// Registrations not renewed for this long are forgotten
+#define RENDEZVOUS_EXPIRY_S 60
+
+// Writes type and, unless addr is NULL, the address. Returns the length of
+// the datagram, or -1 if addr is neither IPv4 nor IPv6.
+int rendezvous_encode(uint8_t *out, enum RendezvousType type,
+                      const struct sockaddr_storage *addr);
+// The address after the type, -1 if there is none
+int rendezvous_decode_address(const uint8_t *in, size_t length,
+                              struct sockaddr_storage *addr,
+                              socklen_t *addrlen);
@@ -0,0 +1,334 @@
+#include "resolver.h"
+#include "log.h"
+#include "types.h"
+#include <assert.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bounds on how long we trust an answer, whatever the TTL says
+#define RESOLVER_MIN_TTL 1
+#define RESOLVER_MAX_TTL 3600
+// Names that come from /etc/hosts carry no TTL
+#define RESOLVER_DEFAULT_TTL 60
+// Failures are remembered briefly so a burst of /connects does not turn into
+// a burst of queries
+#define RESOLVER_NEGATIVE_TTL 5
+// Lookups in flight count too, so this also bounds how many there can be
+#define RESOLVER_MAX_ENTRIES 256
+
+struct ResolverWaiter {
+  resolver_callback_t callback;
+  void *arg;
+  struct ResolverWaiter *next;
+};
+
+struct ResolverEntry { // NOLINT(altera-struct-pack-align)
+  struct Resolver *resolver;
+  char *name;
+
+  int result;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  time_t expires;
+
+  int pending;
+  int notifying; // waiters are being called, so the entry must stay
+  int hosts_only;
+  struct evdns_request *request;
+  struct ResolverWaiter *waiters;
+};
+
+struct Resolver {
+  struct event_base *base;
+  struct evdns_base *dns;
+
+  struct ResolverEntry **entries;
+  int num_entries;
+};
+
+static time_t resolver_now(struct Resolver *resolver) {
+  struct timeval tv = {0};
+  (void)event_base_gettimeofday_cached(resolver->base, &tv);
+  return tv.tv_sec;
+}
+
+struct Resolver *resolver_new(struct event_base *base) {
+  struct Resolver *resolver = calloc(1, sizeof(struct Resolver));
+  if (!resolver)
+    goto failure1;
+
+  resolver->base = base;
+  return resolver;
+
+failure1:
+  return 0;
+}
+
+// The DNS base opens a socket and reads resolv.conf, which applications that
+// only ever see numeric addresses (the simulator, for one) should not pay for
+static struct evdns_base *resolver_dns(struct Resolver *resolver) {
+  if (!resolver->dns) {
+    resolver->dns =
+        evdns_base_new(resolver->base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+    if (!resolver->dns)
+      LOG_ERROR0("Could not initialize DNS resolver");
+  }
+  return resolver->dns;
+}
+
+static void resolver_complete(struct ResolverEntry *entry, int result,
+                              int ttl);
+
+static void resolver_entry_free(struct ResolverEntry *entry) {
+  assert(!entry->pending && !entry->notifying);
+  free(entry->name);
+  free(entry);
+}
+
+void resolver_free(struct Resolver *resolver) {
+  // evdns only reports failed lookups from the event loop, which is not
+  // running any more, so tell the waiters ourselves and then drop the queries
+  for (int ii = 0; ii < resolver->num_entries; ++ii) {
+    if (resolver->entries[ii]->pending)
+      resolver_complete(resolver->entries[ii], -1, RESOLVER_NEGATIVE_TTL);
+  }
+  if (resolver->dns)
+    evdns_base_free(resolver->dns, 0);
+  for (int ii = 0; ii < resolver->num_entries; ++ii)
+    resolver_entry_free(resolver->entries[ii]);
+  free(resolver->entries);
+  free(resolver);
+}
+
+struct evdns_base *resolver_get_dns(struct Resolver *resolver) {
+  return resolver_dns(resolver);
+}
+
+static void resolver_complete(struct ResolverEntry *entry, int result,
+                              int ttl) {
+  if (ttl < RESOLVER_MIN_TTL)
+    ttl = RESOLVER_MIN_TTL;
+  if (ttl > RESOLVER_MAX_TTL)
+    ttl = RESOLVER_MAX_TTL;
+
+  entry->result = result;
+  entry->expires = resolver_now(entry->resolver) + ttl;
+  entry->pending = 0;
+  entry->request = 0;
+
+  LOG_DEBUG("Resolved %s: %d, ttl %d", entry->name, result, ttl);
+
+  // A waiter may resolve another name and make room for it by evicting
+  struct ResolverWaiter *waiter = entry->waiters;
+  entry->waiters = 0;
+  entry->notifying = 1;
+  while (waiter) {
+    struct ResolverWaiter *next = waiter->next;
+    waiter->callback(result, (struct sockaddr *)&entry->addr, entry->addrlen,
+                     waiter->arg);
+    free(waiter);
+    waiter = next;
+  }
+  entry->notifying = 0;
+}
+
+static void resolver_gai_cb(int result, struct evutil_addrinfo *res,
+                            void *arg) {
+  struct ResolverEntry *entry = CAST(struct ResolverEntry *, arg);
+
+  // Only answers from /etc/hosts are taken from getaddrinfo, anything else is
+  // cancelled in favour of a direct query that tells us the TTL
+  if (result == EVUTIL_EAI_CANCEL || !entry->hosts_only) {
+    if (res)
+      evutil_freeaddrinfo(res);
+    return;
+  }
+
+  if (result != 0 || !res || res->ai_addrlen > sizeof(entry->addr)) {
+    LOG_ERROR("Unable to resolve %s: %s", entry->name,
+              evutil_gai_strerror(result));
+    if (res)
+      evutil_freeaddrinfo(res);
+    resolver_complete(entry, -1, RESOLVER_NEGATIVE_TTL);
+    return;
+  }
+
+  (void)memcpy(&entry->addr, res->ai_addr, res->ai_addrlen);
+  entry->addrlen = res->ai_addrlen;
+  evutil_freeaddrinfo(res);
+  resolver_complete(entry, 0, RESOLVER_DEFAULT_TTL);
+}
+
+static void resolver_dns_cb(int result, char type, int count, int ttl,
+                            void *addresses, void *arg) {
+  struct ResolverEntry *entry = CAST(struct ResolverEntry *, arg);
+  entry->request = 0;
+
+  if (result == DNS_ERR_SHUTDOWN || result == DNS_ERR_CANCEL) {
+    resolver_complete(entry, -1, RESOLVER_NEGATIVE_TTL);
+    return;
+  }
+
+  if (result == DNS_ERR_NONE && count > 0 && type == DNS_IPv4_A) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&entry->addr;
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    (void)memcpy(&sin->sin_addr, addresses, sizeof(sin->sin_addr));
+    entry->addrlen = sizeof(*sin);
+    resolver_complete(entry, 0, ttl);
+    return;
+  }
+
+  if (result == DNS_ERR_NONE && count > 0 && type == DNS_IPv6_AAAA) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&entry->addr;
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    (void)memcpy(&sin6->sin6_addr, addresses, sizeof(sin6->sin6_addr));
+    entry->addrlen = sizeof(*sin6);
+    resolver_complete(entry, 0, ttl);
+    return;
+  }
+
+  if (type == DNS_IPv4_A) {
+    // No A record, try AAAA
+    entry->request = evdns_base_resolve_ipv6(entry->resolver->dns, entry->name,
+                                             0, resolver_dns_cb, entry);
+    if (entry->request)
+      return;
+  }
+
+  LOG_ERROR("Unable to resolve %s: %s", entry->name, evdns_err_to_string(result));
+  resolver_complete(entry, -1, RESOLVER_NEGATIVE_TTL);
+}
+
+static struct ResolverEntry *resolver_find(struct Resolver *resolver,
+                                           const char *host) {
+  for (int ii = 0; ii < resolver->num_entries; ++ii) {
+    if (strcmp(resolver->entries[ii]->name, host) == 0)
+      return resolver->entries[ii];
+  }
+  return 0;
+}
+
+static int resolver_evict(struct Resolver *resolver) {
+  // Prefer expired entries, otherwise the one closest to expiring
+  time_t now = resolver_now(resolver);
+  int victim = -1;
+  for (int ii = 0; ii < resolver->num_entries; ++ii) {
+    struct ResolverEntry *entry = resolver->entries[ii];
+    if (entry->pending || entry->notifying)
+      continue;
+    if (victim == -1 || entry->expires < resolver->entries[victim]->expires)
+      victim = ii;
+    if (entry->expires <= now)
+      break;
+  }
+  if (victim == -1)
+    return -1;
+
+  resolver_entry_free(resolver->entries[victim]);
+  resolver->entries[victim] = resolver->entries[resolver->num_entries - 1];
+  resolver->num_entries -= 1;
+  return 0;
+}
+
+static struct ResolverEntry *resolver_add(struct Resolver *resolver,
+                                          const char *host) {
+  if (resolver->num_entries >= RESOLVER_MAX_ENTRIES &&
+      resolver_evict(resolver) == -1) {
+    LOG_ERROR("Too many lookups in flight to resolve %s", host);
+    return 0;
+  }
+
+  struct ResolverEntry *entry = calloc(1, sizeof(struct ResolverEntry));
+  if (!entry)
+    goto failure1;
+  entry->resolver = resolver;
+  entry->name = strdup(host);
+  if (!entry->name)
+    goto failure2;
+
+  struct ResolverEntry **entries = reallocarray(
+      resolver->entries, resolver->num_entries + 1, sizeof(*entries));
+  if (!entries)
+    goto failure3;
+  resolver->entries = entries;
+  resolver->entries[resolver->num_entries++] = entry;
+  return entry;
+
+failure3:
+  free(entry->name);
+failure2:
+  free(entry);
+failure1:
+  LOG_ERROR0("Could not allocate resolver entry");
+  return 0;
+}
+
+int resolver_resolve(struct Resolver *resolver, const char *host,
+                     resolver_callback_t callback, void *arg) {
+  struct ResolverEntry *entry = resolver_find(resolver, host);
+  if (entry && !entry->pending && entry->expires > resolver_now(resolver)) {
+    LOG_DEBUG("Resolver cache hit for %s", host);
+    callback(entry->result, (struct sockaddr *)&entry->addr, entry->addrlen,
+             arg);
+    return 0;
+  }
+
+  if (!entry) {
+    entry = resolver_add(resolver, host);
+    if (!entry)
+      return -1;
+  }
+
+  struct ResolverWaiter *waiter = malloc(sizeof(struct ResolverWaiter));
+  if (!waiter)
+    return -1;
+  waiter->callback = callback;
+  waiter->arg = arg;
+  waiter->next = entry->waiters;
+  entry->waiters = waiter;
+
+  if (entry->pending) {
+    LOG_DEBUG("Joining in-flight lookup for %s", host);
+    return 0;
+  }
+
+  struct evdns_base *dns = resolver_dns(resolver);
+  if (!dns)
+    goto failure;
+
+  entry->pending = 1;
+
+  // Names in /etc/hosts (localhost, for one) never reach a nameserver.
+  // getaddrinfo answers those synchronously, otherwise it has started a
+  // query of its own which we cancel.
+  struct evutil_addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  entry->hosts_only = 1;
+  struct evdns_getaddrinfo_request *gai_request = evdns_getaddrinfo(
+      dns, host, 0, &hints, resolver_gai_cb, entry);
+  entry->hosts_only = 0;
+  if (!gai_request)
+    return 0;
+  evdns_getaddrinfo_cancel(gai_request);
+
+  entry->request =
+      evdns_base_resolve_ipv4(dns, host, 0, resolver_dns_cb, entry);
+  if (!entry->request) {
+    LOG_ERROR("Could not start lookup for %s", host);
+    entry->pending = 0;
+    goto failure;
+  }
+
+  return 0;
+
+failure:
+  entry->waiters = waiter->next;
+  free(waiter);
+  return -1;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <event2/event.h>
+#include <sys/socket.h>
+
+struct Resolver;
+struct evdns_base;
+
+// result is 0 on success, in which case addr is valid for the duration of
+// the callback only. The port in addr is always 0.
+typedef void (*resolver_callback_t)(int result, const struct sockaddr *addr,
+                                    socklen_t addrlen, void *arg);
+
+struct Resolver *resolver_new(struct event_base *base);
+void resolver_free(struct Resolver *resolver);
+
+struct evdns_base *resolver_get_dns(struct Resolver *resolver);
+
+// Resolves host through evdns without blocking the event loop. Answers are
+// cached for their DNS TTL and concurrent lookups of the same name are
+// coalesced into a single query. The callback may be invoked before this
+// function returns if the answer is already cached.
+int resolver_resolve(struct Resolver *resolver, const char *host,
+                     resolver_callback_t callback, void *arg);
@@ -1,5 +1,34 @@
-#include "generated/rpc.h"
+#include "rpc.h"
+#include "types.h"
+#include <assert.h>
 
-EVRPC_GENERATE(Connect, ConnectRequest, ConnectReply)
-EVRPC_GENERATE(Message, MessageRequest, MessageReply)
-EVRPC_GENERATE(HandleChange, HandleChangeRequest, HandleChangeReply)
+#define RPC_INFO(rpcname, request, reply)                                      \
+  {                                                                            \
+    #rpcname, (void *(*)(void *))request##_new_with_arg,                       \
+        (void (*)(void *))request##_free,                                      \
+        (void (*)(struct evbuffer *, void *))request##_marshal,                \
+        (int (*)(void *, struct evbuffer *))request##_unmarshal,               \
+        (int (*)(void *))request##_complete,                                   \
+        (void *(*)(void *))reply##_new_with_arg,                               \
+        (void (*)(void *))reply##_free, (void (*)(void *))reply##_clear,       \
+        (void (*)(struct evbuffer *, void *))reply##_marshal,                  \
+        (int (*)(void *, struct evbuffer *))reply##_unmarshal,                 \
+        (int (*)(void *))reply##_complete                                      \
+  }
+
+// Indexed by enum RpcType
+static const struct RpcInfo g_rpc_info[] = {
+    RPC_INFO(Connect, ConnectRequest, ConnectReply),
+    RPC_INFO(Message, MessageRequest, MessageReply),
+    RPC_INFO(HandleChange, HandleChangeRequest, HandleChangeReply),
+    RPC_INFO(FileChunk, FileChunkRequest, FileChunkReply),
+    RPC_INFO(Ping, PingRequest, PingReply),
+    RPC_INFO(Sync, SyncRequest, SyncReply),
+};
+_Static_assert(ARRAY_SIZE(g_rpc_info) == RPC_NUM_TYPES,
+               "every RpcType needs an RpcInfo");
+
+const struct RpcInfo *rpc_info(enum RpcType type) {
+  assert(type < ARRAY_SIZE(g_rpc_info));
+  return &g_rpc_info[type];
+}
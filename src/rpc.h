@@ -2,6 +2,33 @@
 
 #include "generated/rpc.h"
 
-EVRPC_HEADER(Connect, ConnectRequest, ConnectReply)
-EVRPC_HEADER(Message, MessageRequest, MessageReply)
-EVRPC_HEADER(HandleChange, HandleChangeRequest, HandleChangeReply)
+enum RpcType {
+  RPC_CONNECT,
+  RPC_MESSAGE,
+  RPC_HANDLE_CHANGE,
+  RPC_FILE_CHUNK,
+  RPC_PING,
+  RPC_SYNC,
+  RPC_NUM_TYPES
+};
+
+// Everything needed to handle an RPC without knowing its structs, laid out
+// the way evrpc's generic functions want it
+struct RpcInfo {
+  const char *name;
+
+  void *(*request_new)(void *);
+  void (*request_free)(void *);
+  void (*request_marshal)(struct evbuffer *, void *);
+  int (*request_unmarshal)(void *, struct evbuffer *);
+  int (*request_complete)(void *);
+
+  void *(*reply_new)(void *);
+  void (*reply_free)(void *);
+  void (*reply_clear)(void *);
+  void (*reply_marshal)(struct evbuffer *, void *);
+  int (*reply_unmarshal)(void *, struct evbuffer *);
+  int (*reply_complete)(void *);
+};
+
+const struct RpcInfo *rpc_info(enum RpcType type);
@@ -0,0 +1,40 @@
+#pragma once
+
+// Upper bounds on what a peer may send us. Decoding rejects anything larger
+// before allocating for it, and we refuse to send anything larger ourselves.
+// Override at build time with -D, on both ends of a conversation.
+
+#ifndef RPC_MAX_HANDLE_LEN
+#define RPC_MAX_HANDLE_LEN 64
+#endif
+
+#ifndef RPC_MAX_ADDRESS_LEN
+#define RPC_MAX_ADDRESS_LEN 64 // bracketed IPv6 literal with port, or a name
+#endif
+
+#ifndef RPC_MAX_MESSAGE_LEN
+#define RPC_MAX_MESSAGE_LEN (16 * 1024)
+#endif
+
+#ifndef RPC_MAX_FILE_NAME_LEN
+#define RPC_MAX_FILE_NAME_LEN 255
+#endif
+
+#ifndef RPC_MAX_CHUNK_LEN
+#define RPC_MAX_CHUNK_LEN (64 * 1024)
+#endif
+
+// Cells of the table in a Sync request, see src/sync.h
+#ifndef RPC_MAX_SYNC_TABLE_LEN
+#define RPC_MAX_SYNC_TABLE_LEN (60 * 1024)
+#endif
+
+// Largest HTTP body for any request or reply: the biggest field plus room
+// for the others and the tags around them
+#ifndef RPC_MAX_BODY_SIZE
+#define RPC_MAX_BODY_SIZE (RPC_MAX_CHUNK_LEN + 4 * 1024)
+#endif
+
+#ifndef RPC_MAX_HEADERS_SIZE
+#define RPC_MAX_HEADERS_SIZE (8 * 1024)
+#endif
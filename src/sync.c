@@ -0,0 +1,527 @@
+#include "sync.h"
+#include "generated/rpc.h"
+#include "log.h"
+#include "peer.h"
+#include "protocol.h"
+#include "rpc_limits.h"
+#include <event2/rpc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Messages kept per conversation
+#define SYNC_HISTORY_MAX 1024
+// Cells each id goes in, one in each third of the table
+#define SYNC_HASHES 3
+// count (4) ids (8) checks (8), big endian
+#define SYNC_CELL_SIZE 20
+#define SYNC_CELLS_MIN (16 * SYNC_HASHES)
+#define SYNC_CELLS_MAX                                                         \
+  (RPC_MAX_SYNC_TABLE_LEN / SYNC_CELL_SIZE / SYNC_HASHES * SYNC_HASHES)
+_Static_assert(SYNC_CELLS_MIN <= SYNC_CELLS_MAX, "no table fits a request");
+// Half again as many cells as ids peels almost always, so two histories
+// with nothing in common still sync
+_Static_assert(2 * SYNC_HISTORY_MAX * 3 / 2 <= SYNC_CELLS_MAX,
+               "histories differ by more than a table can tell");
+// Message bytes per reply, counting the tags around each
+#define SYNC_REPLY_BUDGET (RPC_MAX_BODY_SIZE - 4 * 1024)
+#define SYNC_MESSAGE_OVERHEAD 40
+// A round not answered by then is given up on, should the reply be lost
+#define SYNC_TIMEOUT_MS 30000
+
+struct SyncEntry {
+  uint64_t id;
+  uint64_t sent_ms;
+  fingerprint_t author;
+  uint32_t session;
+  uint32_t sequence;
+  char *message;
+};
+
+struct SyncHistory {
+  struct SyncEntry *entries; // by sent_ms, oldest first
+  int length;
+  int capacity;
+  uint64_t since; // messages sent before this were dropped, 0 if none were
+  int cells;      // in the next table we send
+  uint64_t syncing_ms; // when the round in flight went out, 0 if none is
+  uint32_t round;      // replies to older rounds only backfill
+};
+
+struct Sync { // NOLINT(altera-struct-pack-align)
+  fingerprint_t my_fingerprint;
+  struct Peer **peers;
+  int *num_peers;
+  sync_backfill_cb_t backfill_cb;
+  void *cbarg;
+
+  struct SyncHistory **histories; // indexed like *peers, NULL until used
+  int num_histories;
+};
+
+struct SyncCell {
+  int32_t count;
+  uint64_t ids;    // xor of the ids in the cell
+  uint64_t checks; // xor of sync_check of them, tells a single id apart
+};
+
+struct SyncCall {
+  struct Sync *sync;
+  int peer;
+  uint32_t round;
+};
+
+uint64_t sync_clock_ms(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_REALTIME, &ts);
+  const uint64_t MS_PER_S = 1000;
+  const uint64_t NS_PER_MS = 1000000;
+  return (uint64_t)ts.tv_sec * MS_PER_S + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+static uint64_t sync_now_ms(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t MS_PER_S = 1000;
+  const uint64_t NS_PER_MS = 1000000;
+  return (uint64_t)ts.tv_sec * MS_PER_S + (uint64_t)ts.tv_nsec / NS_PER_MS;
+}
+
+// splitmix64's finalizer
+static uint64_t sync_mix(uint64_t value) {
+  value ^= value >> 30U;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27U;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31U;
+  return value;
+}
+
+static uint64_t sync_id(fingerprint_t author, uint32_t session,
+                        uint32_t sequence) {
+  return sync_mix(sync_mix((uint64_t)author << 32U | session) ^ sequence);
+}
+
+static uint64_t sync_check(uint64_t id) {
+  const uint64_t SEED = 0x9e3779b97f4a7c15ULL;
+  return sync_mix(id ^ SEED);
+}
+
+// Where the id goes in the hash-th third of the table
+static int sync_cell(int num_cells, uint64_t id, int hash) {
+  int third = num_cells / SYNC_HASHES;
+  return hash * third + (int)(sync_mix(id + hash + 1) % (uint64_t)third);
+}
+
+static void sync_table_add(struct SyncCell *cells, int num_cells, uint64_t id,
+                           int32_t sign) {
+  uint64_t check = sync_check(id);
+  for (int ii = 0; ii < SYNC_HASHES; ++ii) {
+    struct SyncCell *cell = &cells[sync_cell(num_cells, id, ii)];
+    cell->count += sign;
+    cell->ids ^= id;
+    cell->checks ^= check;
+  }
+}
+
+static void sync_put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)(value >> 24U);
+  out[1] = (uint8_t)(value >> 16U);
+  out[2] = (uint8_t)(value >> 8U);
+  out[3] = (uint8_t)value;
+}
+
+static uint32_t sync_get_u32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24U | (uint32_t)in[1] << 16U |
+         (uint32_t)in[2] << 8U | (uint32_t)in[3];
+}
+
+static void sync_table_encode(const struct SyncCell *cells, int num_cells,
+                              uint8_t *out) {
+  for (int ii = 0; ii < num_cells; ++ii, out += SYNC_CELL_SIZE) {
+    sync_put_u32(out, (uint32_t)cells[ii].count);
+    sync_put_u32(out + 4, (uint32_t)(cells[ii].ids >> 32U));
+    sync_put_u32(out + 8, (uint32_t)cells[ii].ids);
+    sync_put_u32(out + 12, (uint32_t)(cells[ii].checks >> 32U));
+    sync_put_u32(out + 16, (uint32_t)cells[ii].checks);
+  }
+}
+
+static void sync_table_decode(const uint8_t *in, int num_cells,
+                              struct SyncCell *cells) {
+  for (int ii = 0; ii < num_cells; ++ii, in += SYNC_CELL_SIZE) {
+    cells[ii].count = (int32_t)sync_get_u32(in);
+    cells[ii].ids =
+        (uint64_t)sync_get_u32(in + 4) << 32U | sync_get_u32(in + 8);
+    cells[ii].checks =
+        (uint64_t)sync_get_u32(in + 12) << 32U | sync_get_u32(in + 16);
+  }
+}
+
+// A cell that holds just the one id, which must be one of the id's own
+// cells, or taking it off would leave the cell as it was
+static int sync_pure(const struct SyncCell *cells, int num_cells, int index) {
+  const struct SyncCell *cell = &cells[index];
+  if ((cell->count != 1 && cell->count != -1) ||
+      cell->checks != sync_check(cell->ids))
+    return 0;
+  return sync_cell(num_cells, cell->ids, index / (num_cells / SYNC_HASHES)) ==
+         index;
+}
+
+// Takes ids off the difference of two tables one at a time, from cells that
+// hold nothing else, until none are left. Ids only we have go in ours, up to
+// max_ours of them, and theirs counts the ones only the other side has. 1 if
+// the whole difference came off. A table of n cells holds at most n ids, so a
+// crafted one cannot keep us at it for longer.
+static int sync_peel(struct SyncCell *cells, int num_cells, uint64_t *ours,
+                     int max_ours, int *num_ours, int *theirs) {
+  int peeled = 0;
+  for (int progress = 1; progress;) {
+    progress = 0;
+    for (int ii = 0; ii < num_cells; ++ii) {
+      if (!sync_pure(cells, num_cells, ii))
+        continue;
+      if (peeled++ == num_cells)
+        return 0;
+      const struct SyncCell *cell = &cells[ii];
+      uint64_t id = cell->ids;
+      int32_t sign = cell->count;
+      if (sign == -1) {
+        if (*num_ours == max_ours)
+          return 0;
+        ours[(*num_ours)++] = id;
+      } else {
+        *theirs += 1;
+      }
+      sync_table_add(cells, num_cells, id, -sign);
+      progress = 1;
+    }
+  }
+  for (int ii = 0; ii < num_cells; ++ii) {
+    if (cells[ii].count || cells[ii].ids || cells[ii].checks)
+      return 0;
+  }
+  return 1;
+}
+
+/********************
+ History
+********************/
+struct Sync *sync_new(fingerprint_t my_fingerprint, struct Peer **peers,
+                      int *num_peers, sync_backfill_cb_t backfill_cb,
+                      void *cbarg) {
+  struct Sync *sync = calloc(1, sizeof(struct Sync));
+  if (!sync)
+    return 0;
+  sync->my_fingerprint = my_fingerprint;
+  sync->peers = peers;
+  sync->num_peers = num_peers;
+  sync->backfill_cb = backfill_cb;
+  sync->cbarg = cbarg;
+  return sync;
+}
+
+static void sync_history_free(struct SyncHistory *history) {
+  for (int ii = 0; ii < history->length; ++ii)
+    free(history->entries[ii].message);
+  free(history->entries);
+  free(history);
+}
+
+void sync_free(struct Sync *sync) {
+  if (!sync)
+    return;
+  for (int ii = 0; ii < sync->num_histories; ++ii) {
+    if (sync->histories[ii])
+      sync_history_free(sync->histories[ii]);
+  }
+  free(sync->histories);
+  free(sync);
+}
+
+static struct SyncHistory *sync_history(struct Sync *sync, int peer) {
+  if (peer >= sync->num_histories) {
+    int num_histories = peer + 1 > sync->num_histories * 2
+                            ? peer + 1
+                            : sync->num_histories * 2;
+    struct SyncHistory **histories = reallocarray(
+        sync->histories, num_histories, sizeof(struct SyncHistory *));
+    if (!histories)
+      return 0;
+    memset(histories + sync->num_histories, 0,
+           (num_histories - sync->num_histories) *
+               sizeof(struct SyncHistory *));
+    sync->histories = histories;
+    sync->num_histories = num_histories;
+  }
+  if (!sync->histories[peer]) {
+    sync->histories[peer] = calloc(1, sizeof(struct SyncHistory));
+    if (sync->histories[peer])
+      sync->histories[peer]->cells = SYNC_CELLS_MIN;
+  }
+  return sync->histories[peer];
+}
+
+// Drops the oldest, and whatever was sent in the same ms, so that since
+// splits the history cleanly
+static void sync_trim(struct SyncHistory *history) {
+  uint64_t oldest = history->entries[0].sent_ms;
+  int drop = 0;
+  while (drop < history->length && history->entries[drop].sent_ms == oldest)
+    free(history->entries[drop++].message);
+  history->length -= drop;
+  memmove(history->entries, history->entries + drop,
+          history->length * sizeof(struct SyncEntry));
+  history->since = oldest + 1;
+}
+
+int sync_record(struct Sync *sync, int peer, fingerprint_t author,
+                uint32_t session, uint32_t sequence, uint64_t sent_ms,
+                const char *message) {
+  if (!sync || peer < 0)
+    return 0;
+  struct SyncHistory *history = sync_history(sync, peer);
+  if (!history)
+    return 0;
+  uint64_t id = sync_id(author, session, sequence);
+  // Repeats are usually of something recent
+  for (int ii = history->length - 1; ii >= 0; --ii) {
+    if (history->entries[ii].id == id)
+      return 1;
+  }
+  if (sent_ms < history->since)
+    return 0; // older than we keep
+
+  if (history->length == history->capacity) {
+    int capacity = history->capacity ? history->capacity * 2 : 16;
+    struct SyncEntry *entries =
+        reallocarray(history->entries, capacity, sizeof(struct SyncEntry));
+    if (!entries)
+      return 0;
+    history->entries = entries;
+    history->capacity = capacity;
+  }
+  char *copy = strdup(message);
+  if (!copy)
+    return 0;
+  int pos = history->length;
+  while (pos > 0 && history->entries[pos - 1].sent_ms > sent_ms)
+    pos -= 1;
+  memmove(history->entries + pos + 1, history->entries + pos,
+          (history->length - pos) * sizeof(struct SyncEntry));
+  struct SyncEntry *entry = &history->entries[pos];
+  entry->id = id;
+  entry->sent_ms = sent_ms;
+  entry->author = author;
+  entry->session = session;
+  entry->sequence = sequence;
+  entry->message = copy;
+  history->length += 1;
+
+  if (history->length > SYNC_HISTORY_MAX)
+    sync_trim(history);
+  return 0;
+}
+
+/********************
+ Requesting
+********************/
+static int sync_send(struct Sync *sync, int peer, struct SyncHistory *history);
+
+static void sync_done_cb(int error, struct SyncReply *reply, void *arg) {
+  struct SyncCall call = *CAST(struct SyncCall *, arg);
+  free(arg);
+  struct Sync *sync = call.sync;
+  struct SyncHistory *history = sync->histories[call.peer];
+  int current = call.round == history->round;
+  if (current)
+    history->syncing_ms = 0;
+  if (error)
+    return; // the next Connect or return online tries again
+
+  int num_messages = EVTAG_ARRAY_LEN(reply, messages);
+  for (int ii = 0; ii < num_messages; ++ii) {
+    struct SyncMessage *message = 0;
+    uint32_t author = 0;
+    uint32_t session = 0;
+    uint32_t sequence = 0;
+    uint64_t sent_ms = 0;
+    char *text = 0;
+    if (EVTAG_ARRAY_GET(reply, messages, ii, &message) == -1 ||
+        EVTAG_GET(message, author, &author) == -1 ||
+        EVTAG_GET(message, session, &session) == -1 ||
+        EVTAG_GET(message, sequence, &sequence) == -1 ||
+        EVTAG_GET(message, sent, &sent_ms) == -1 ||
+        EVTAG_GET(message, message, &text) == -1)
+      continue;
+    if (sync_record(sync, call.peer, author, session, sequence, sent_ms,
+                    text) == 0)
+      sync->backfill_cb(call.peer, author, sent_ms, text, sync->cbarg);
+  }
+  if (!current)
+    return; // a later round took over once this one timed out
+
+  uint32_t flag = 0;
+  if (EVTAG_GET(reply, too_small, &flag) == 0 && flag) {
+    if (history->cells == SYNC_CELLS_MAX) {
+      char name[RPC_MAX_HANDLE_LEN + 16] = "?";
+      (void)peer_format(call.peer, *sync->peers, *sync->num_peers, name,
+                        sizeof(name));
+      LOG_WARNING("Too much differs to sync history with %s", name);
+      history->cells = SYNC_CELLS_MIN;
+      return;
+    }
+    history->cells = history->cells * 2 < SYNC_CELLS_MAX ? history->cells * 2
+                                                         : SYNC_CELLS_MAX;
+  } else if (EVTAG_GET(reply, more, &flag) == -1 || !flag) {
+    LOG_DEBUG("Synced with peer %d", call.peer);
+    history->cells = SYNC_CELLS_MIN;
+    return;
+  }
+  (void)sync_send(sync, call.peer, history);
+}
+
+static int sync_send(struct Sync *sync, int peer, struct SyncHistory *history) {
+  int num_cells = history->cells;
+  struct SyncCell *cells = calloc(num_cells, sizeof(struct SyncCell));
+  uint8_t *table = malloc((size_t)num_cells * SYNC_CELL_SIZE);
+  struct SyncRequest *request = SyncRequest_new();
+  struct SyncCall *call = malloc(sizeof(struct SyncCall));
+  if (!cells || !table || !request || !call)
+    goto failure;
+
+  for (int ii = 0; ii < history->length; ++ii)
+    sync_table_add(cells, num_cells, history->entries[ii].id, 1);
+  sync_table_encode(cells, num_cells, table);
+  (void)EVTAG_ASSIGN(request, fingerprint, sync->my_fingerprint);
+  if (EVTAG_ASSIGN_WITH_LEN(request, table, table,
+                            (uint32_t)num_cells * SYNC_CELL_SIZE) == -1)
+    goto failure;
+  if (history->since)
+    (void)EVTAG_ASSIGN(request, since, history->since);
+  free(cells);
+  free(table);
+
+  call->sync = sync;
+  call->peer = peer;
+  call->round = history->round + 1;
+  if (peer_send_sync(peer, request, *sync->peers, *sync->num_peers,
+                     sync_done_cb, call) == -1) {
+    free(call);
+    return -1;
+  }
+  history->round += 1;
+  history->syncing_ms = sync_now_ms();
+  LOG_DEBUG("Syncing %d messages with peer %d in %d cells", history->length,
+            peer, num_cells);
+  return 0;
+
+failure:
+  free(cells);
+  free(table);
+  if (request)
+    SyncRequest_free(request);
+  free(call);
+  return -1;
+}
+
+void sync_start(struct Sync *sync, int peer) {
+  if (!sync ||
+      !(peer_capabilities(peer, *sync->peers, *sync->num_peers) &
+        PROTOCOL_CAP_SYNC))
+    return;
+  struct SyncHistory *history = sync_history(sync, peer);
+  if (!history || (history->syncing_ms &&
+                   sync_now_ms() - history->syncing_ms < SYNC_TIMEOUT_MS))
+    return;
+  (void)sync_send(sync, peer, history);
+}
+
+/********************
+ Answering
+********************/
+static int sync_compare_ids(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+// The messages with these ids, oldest first, as many as fit
+static void sync_reply(const struct SyncHistory *history, uint64_t *ids,
+                       int num_ids, struct SyncReply *reply) {
+  qsort(ids, num_ids, sizeof(uint64_t), sync_compare_ids);
+  size_t used = 0;
+  for (int ii = 0; ii < history->length; ++ii) {
+    const struct SyncEntry *entry = &history->entries[ii];
+    if (!bsearch(&entry->id, ids, num_ids, sizeof(uint64_t),
+                 sync_compare_ids))
+      continue;
+    size_t cost = strlen(entry->message) + SYNC_MESSAGE_OVERHEAD;
+    if (used && used + cost > SYNC_REPLY_BUDGET) {
+      (void)EVTAG_ASSIGN(reply, more, 1);
+      return;
+    }
+    struct SyncMessage *message = EVTAG_ARRAY_ADD(reply, messages);
+    if (!message)
+      return;
+    used += cost;
+    (void)EVTAG_ASSIGN(message, author, entry->author);
+    (void)EVTAG_ASSIGN(message, session, entry->session);
+    (void)EVTAG_ASSIGN(message, sequence, entry->sequence);
+    (void)EVTAG_ASSIGN(message, sent, entry->sent_ms);
+    (void)EVTAG_ASSIGN(message, message, entry->message);
+  }
+}
+
+void sync_receive(struct Sync *sync, struct SyncRequest *request,
+                  struct SyncReply *reply) {
+  uint32_t fingerprint = 0;
+  uint8_t *table = 0;
+  uint32_t length = 0;
+  uint64_t since = 0;
+  if (!sync || EVTAG_GET(request, fingerprint, &fingerprint) == -1 ||
+      EVTAG_GET_WITH_LEN(request, table, &table, &length) == -1)
+    return;
+  (void)EVTAG_GET(request, since, &since);
+
+  int num_cells = (int)(length / SYNC_CELL_SIZE);
+  if (length % SYNC_CELL_SIZE || num_cells % SYNC_HASHES || !num_cells) {
+    LOG_DEBUG("Bad sync table of %u bytes", length);
+    return;
+  }
+  int peer = peer_index(fingerprint, *sync->peers, *sync->num_peers);
+  struct SyncHistory *history = peer == -1 ? 0 : sync_history(sync, peer);
+  if (!history)
+    return;
+
+  struct SyncCell *cells = calloc(num_cells, sizeof(struct SyncCell));
+  uint64_t *ours = malloc(sizeof(uint64_t) * (history->length + 1));
+  if (!cells || !ours)
+    goto exit;
+  sync_table_decode(table, num_cells, cells);
+  for (int ii = 0; ii < history->length; ++ii) {
+    if (history->entries[ii].sent_ms >= since)
+      sync_table_add(cells, num_cells, history->entries[ii].id, -1);
+  }
+
+  int num_ours = 0;
+  int theirs = 0;
+  // What came off a table that did not peel whole would be shown out of
+  // order, so it waits for the larger one
+  if (!sync_peel(cells, num_cells, ours, history->length, &num_ours,
+                 &theirs)) {
+    (void)EVTAG_ASSIGN(reply, too_small, 1);
+    goto exit;
+  }
+  sync_reply(history, ours, num_ours, reply);
+  LOG_DEBUG("Peer %d is missing %d messages, we are missing %d", peer,
+            num_ours, theirs);
+  // Asking in turn spares us waiting for the next reconnect
+  if (theirs)
+    sync_start(sync, peer);
+
+exit:
+  free(cells);
+  free(ours);
+}
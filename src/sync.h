@@ -0,0 +1,53 @@
+#pragma once
+
+#include "types.h"
+#include <stdint.h>
+
+struct Peer;
+struct Sync;
+struct SyncReply;
+struct SyncRequest;
+
+// A message we did not have, from our history with the peer. author is us if
+// we sent it before we lost track of it, by restarting for instance.
+typedef void (*sync_backfill_cb_t)(int peer, fingerprint_t author,
+                                   uint64_t sent_ms, const char *message,
+                                   void *arg);
+
+// Backfills the messages one side of a conversation missed, with peers that
+// have PROTOCOL_CAP_SYNC.
+//
+// Both sides record every ordered message of the conversation under an id
+// made of its author, session and sequence, see delivery.h. After a Connect,
+// and when the peer comes back from being offline, we send it an invertible
+// Bloom lookup table of the ids we have. The peer subtracts its own ids, and
+// peeling what is left gives exactly the ids only one side has, so the
+// request only needs to be large enough for the difference, not for the
+// history. The reply carries the messages we lack. A table too small to peel
+// is sent again twice as large.
+//
+// Each conversation keeps its last SYNC_HISTORY_MAX messages, ordered by when
+// their authors sent them, and older ones are left out of the comparison.
+//
+// Peers are identified by their index in *peers, like in presence.h.
+struct Sync *sync_new(fingerprint_t my_fingerprint, struct Peer **peers,
+                      int *num_peers, sync_backfill_cb_t backfill_cb,
+                      void *cbarg);
+void sync_free(struct Sync *sync);
+
+// Wall clock in ms since the epoch, what messages are stamped with
+uint64_t sync_clock_ms(void);
+
+// Adds a message to the history with the peer. 1 if it was there already, so
+// it has been shown, 0 otherwise, including when sync is NULL.
+int sync_record(struct Sync *sync, int peer, fingerprint_t author,
+                uint32_t session, uint32_t sequence, uint64_t sent_ms,
+                const char *message);
+
+// Asks the peer for the messages we are missing, unless it cannot tell us or
+// is already on it
+void sync_start(struct Sync *sync, int peer);
+
+// Receiving side of a Sync request
+void sync_receive(struct Sync *sync, struct SyncRequest *request,
+                  struct SyncReply *reply);
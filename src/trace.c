@@ -0,0 +1,292 @@
+#include "trace.h"
+#include "log.h"
+#include "types.h"
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bucket n holds durations in [2^n, 2^(n+1)) microseconds, the last one is
+// open ended
+#define TRACE_BUCKETS 24
+#define TRACE_MAX_CALLBACKS 32
+#define TRACE_RING_SIZE (64 * 1024)
+#define TRACE_MAX_FRAMES 32
+
+struct TraceCallback {
+  const char *name;
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t buckets[TRACE_BUCKETS];
+};
+
+struct TraceSpan {
+  const char *name;
+  uint64_t start_us;
+  uint64_t duration_us;
+};
+
+struct Tracer { // NOLINT(altera-struct-pack-align)
+  uint64_t origin_us;
+  uint64_t slow_us;
+  int depth; // callbacks can run other traced code, only time the outermost
+
+  timer_t watchdog;
+  int has_watchdog;
+  struct sigaction previous; // put back once the watchdog is gone
+  // Read by the signal handler, which the watchdog hands the tracer to
+  const char *volatile watched;
+
+  struct TraceCallback callbacks[TRACE_MAX_CALLBACKS];
+  int num_callbacks;
+
+  struct TraceSpan *ring;
+  uint64_t num_spans; // total ever, the ring keeps the last TRACE_RING_SIZE
+};
+
+static uint64_t trace_now_us(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t US_PER_S = 1000000;
+  const uint64_t NS_PER_US = 1000;
+  return (uint64_t)ts.tv_sec * US_PER_S + (uint64_t)ts.tv_nsec / NS_PER_US;
+}
+
+static void trace_write(const char *text) {
+  (void)!write(STDERR_FILENO, text, strlen(text));
+}
+
+static void trace_watchdog_fired(int sig, siginfo_t *info, void *context) {
+  (void)sig;
+  (void)context;
+  const struct Tracer *tracer =
+      CAST(const struct Tracer *, info->si_value.sival_ptr);
+  const char *name = tracer ? tracer->watched : 0;
+  if (!name)
+    return;
+  // Only async-signal-safe calls from here on
+  trace_write("WARNING: slow callback ");
+  trace_write(name);
+  trace_write(", still running at:\n");
+  void *frames[TRACE_MAX_FRAMES];
+  int num_frames = backtrace(frames, TRACE_MAX_FRAMES);
+  backtrace_symbols_fd(frames, num_frames, STDERR_FILENO);
+}
+
+static int trace_setup_watchdog(struct Tracer *tracer) {
+  // Not SIGALRM, which readline handles itself
+  struct sigaction action = {0};
+  action.sa_sigaction = trace_watchdog_fired;
+  action.sa_flags = SA_RESTART | SA_SIGINFO; // NOLINT(hicpp-signed-bitwise)
+  (void)sigemptyset(&action.sa_mask);
+  if (sigaction(SIGRTMIN, &action, &tracer->previous) == -1)
+    return -1;
+
+  struct sigevent event = {0};
+  event.sigev_notify = SIGEV_SIGNAL;
+  event.sigev_signo = SIGRTMIN;
+  event.sigev_value.sival_ptr = tracer;
+  if (timer_create(CLOCK_MONOTONIC, &event, &tracer->watchdog) == -1) {
+    (void)sigaction(SIGRTMIN, &tracer->previous, 0);
+    return -1;
+  }
+  tracer->has_watchdog = 1;
+
+  // backtrace() loads libgcc the first time, which must not happen in the
+  // signal handler
+  void *frame = 0;
+  (void)backtrace(&frame, 1);
+  return 0;
+}
+
+static void trace_arm_watchdog(struct Tracer *tracer, uint64_t delay_us) {
+  if (!tracer->has_watchdog)
+    return;
+  const uint64_t US_PER_S = 1000000;
+  const uint64_t NS_PER_US = 1000;
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = (time_t)(delay_us / US_PER_S);
+  spec.it_value.tv_nsec = (long)(delay_us % US_PER_S * NS_PER_US);
+  (void)timer_settime(tracer->watchdog, 0, &spec, 0);
+}
+
+struct Tracer *tracer_new(unsigned slow_ms) {
+  struct Tracer *tracer = calloc(1, sizeof(struct Tracer));
+  if (!tracer)
+    goto failure1;
+
+  tracer->ring = calloc(TRACE_RING_SIZE, sizeof(struct TraceSpan));
+  if (!tracer->ring)
+    goto failure2;
+
+  const uint64_t US_PER_MS = 1000;
+  tracer->origin_us = trace_now_us();
+  tracer->slow_us = slow_ms * US_PER_MS;
+  if (tracer->slow_us && trace_setup_watchdog(tracer) == -1)
+    LOG_WARNING0("Cannot watch for slow callbacks, only timing them");
+
+  LOG_INFO("Tracing callbacks, slow is %ums", slow_ms);
+  return tracer;
+
+failure2:
+  free(tracer);
+failure1:
+  return 0;
+}
+
+// Deleting the timer leaves a signal it already queued, which would hand the
+// handler a freed tracer. Take those off the queue with the signal blocked.
+static void trace_stop_watchdog(struct Tracer *tracer) {
+  sigset_t set;
+  sigset_t old;
+  (void)sigemptyset(&set);
+  (void)sigaddset(&set, SIGRTMIN);
+  (void)pthread_sigmask(SIG_BLOCK, &set, &old);
+
+  (void)timer_delete(tracer->watchdog);
+  const struct timespec now = {0};
+  while (sigtimedwait(&set, 0, &now) != -1)
+    ;
+  (void)sigaction(SIGRTMIN, &tracer->previous, 0);
+
+  (void)pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+void tracer_free(struct Tracer *tracer) {
+  if (!tracer)
+    return;
+  if (tracer->has_watchdog)
+    trace_stop_watchdog(tracer);
+  free(tracer->ring);
+  free(tracer);
+}
+
+uint64_t tracer_begin(struct Tracer *tracer, const char *name) {
+  if (!tracer)
+    return 0;
+  if (tracer->depth++ == 0) {
+    tracer->watched = name;
+    trace_arm_watchdog(tracer, tracer->slow_us);
+  }
+  return trace_now_us();
+}
+
+static struct TraceCallback *trace_find(struct Tracer *tracer,
+                                        const char *name) {
+  for (int ii = 0; ii < tracer->num_callbacks; ++ii) {
+    if (tracer->callbacks[ii].name == name ||
+        strcmp(tracer->callbacks[ii].name, name) == 0)
+      return &tracer->callbacks[ii];
+  }
+  if (tracer->num_callbacks == TRACE_MAX_CALLBACKS)
+    return 0;
+  struct TraceCallback *callback = &tracer->callbacks[tracer->num_callbacks++];
+  callback->name = name;
+  return callback;
+}
+
+static int trace_bucket(uint64_t duration_us) {
+  int bucket = 0;
+  while (duration_us > 1 && bucket < TRACE_BUCKETS - 1) {
+    duration_us >>= 1U;
+    bucket += 1;
+  }
+  return bucket;
+}
+
+void tracer_end(struct Tracer *tracer, const char *name, uint64_t start) {
+  if (!tracer)
+    return;
+  uint64_t end = trace_now_us();
+  uint64_t duration = end - start;
+
+  if (--tracer->depth == 0) {
+    trace_arm_watchdog(tracer, 0);
+    tracer->watched = 0;
+  }
+
+  struct TraceCallback *callback = trace_find(tracer, name);
+  if (callback) {
+    callback->count += 1;
+    callback->total_us += duration;
+    if (duration > callback->max_us)
+      callback->max_us = duration;
+    callback->buckets[trace_bucket(duration)] += 1;
+  }
+
+  struct TraceSpan *span = &tracer->ring[tracer->num_spans % TRACE_RING_SIZE];
+  span->name = name;
+  span->start_us = start - tracer->origin_us;
+  span->duration_us = duration;
+  tracer->num_spans += 1;
+
+  if (tracer->slow_us && duration >= tracer->slow_us)
+    LOG_WARNING("Slow callback %s took %llu us", name,
+                (unsigned long long)duration);
+}
+
+// Upper bound of the bucket holding the given fraction of calls
+static uint64_t trace_percentile(const struct TraceCallback *callback,
+                                 double fraction) {
+  uint64_t wanted = (uint64_t)((double)callback->count * fraction);
+  uint64_t seen = 0;
+  for (int ii = 0; ii < TRACE_BUCKETS; ++ii) {
+    seen += callback->buckets[ii];
+    if (seen > wanted)
+      return ii == TRACE_BUCKETS - 1 ? callback->max_us : (1ULL << (ii + 1U));
+  }
+  return callback->max_us;
+}
+
+int tracer_dump(struct Tracer *tracer, const char *path) {
+  if (!tracer) {
+    LOG_ERROR0("Tracing is off, start with P2P_TRACE=1");
+    return -1;
+  }
+
+  for (int ii = 0; ii < tracer->num_callbacks; ++ii) {
+    const struct TraceCallback *callback = &tracer->callbacks[ii];
+    const double P50 = 0.5;
+    const double P99 = 0.99;
+    LOG_INFO("%-24s calls %8llu avg %8llu us p50 <%8llu us p99 <%8llu us max "
+             "%8llu us",
+             callback->name, (unsigned long long)callback->count,
+             (unsigned long long)(callback->total_us / callback->count),
+             (unsigned long long)trace_percentile(callback, P50),
+             (unsigned long long)trace_percentile(callback, P99),
+             (unsigned long long)callback->max_us);
+  }
+
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    LOG_ERROR("Cannot write trace to %s", path);
+    return -1;
+  }
+
+  uint64_t first = tracer->num_spans > TRACE_RING_SIZE
+                       ? tracer->num_spans - TRACE_RING_SIZE
+                       : 0;
+  (void)fprintf(file, "{\"traceEvents\":[\n");
+  for (uint64_t ii = first; ii < tracer->num_spans; ++ii) {
+    const struct TraceSpan *span = &tracer->ring[ii % TRACE_RING_SIZE];
+    // Names are identifiers from our own source, nothing to escape
+    (void)fprintf(file,
+                  "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                  "\"pid\":%d,\"tid\":1}\n",
+                  ii == first ? "" : ",", span->name,
+                  (unsigned long long)span->start_us,
+                  (unsigned long long)span->duration_us, getpid());
+  }
+  (void)fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  if (fclose(file) != 0) {
+    LOG_ERROR("Cannot write trace to %s", path);
+    return -1;
+  }
+  LOG_INFO("Wrote %llu callbacks to %s",
+           (unsigned long long)(tracer->num_spans - first), path);
+  return 0;
+}
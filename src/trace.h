@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Tracer;
+
+// Opt-in tracing of the callbacks we run on the event loop. Every traced
+// dispatch goes into a per-callback latency histogram and a ring of recent
+// spans. A callback still running after slow_ms gets its stack written to
+// stderr from a timer signal, so the stack shows where it is stuck rather
+// than where it was called from.
+struct Tracer *tracer_new(unsigned slow_ms);
+void tracer_free(struct Tracer *tracer);
+
+// name must be a string literal, it is kept as is. Both are no-ops when
+// tracer is NULL, so call sites do not need to check.
+uint64_t tracer_begin(struct Tracer *tracer, const char *name);
+void tracer_end(struct Tracer *tracer, const char *name, uint64_t start);
+
+// Logs the histograms and writes the recent spans to path in Chrome's trace
+// event format, for chrome://tracing or Perfetto
+int tracer_dump(struct Tracer *tracer, const char *path);
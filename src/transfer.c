@@ -0,0 +1,545 @@
+#include "transfer.h"
+#include "generated/rpc.h"
+#include "hash.h"
+#include "log.h"
+#include "peer.h"
+#include "rpc_limits.h"
+#include <errno.h>
+#include <event2/rpc.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRANSFER_CHUNK_SIZE (64 * 1024)
+_Static_assert(TRANSFER_CHUNK_SIZE <= RPC_MAX_CHUNK_LEN,
+               "receivers would reject our chunks");
+// Chunks in flight per transfer, which bounds the memory a transfer uses
+#define TRANSFER_WINDOW 8
+#define TRANSFER_MAX_RETRIES 10
+#define TRANSFER_RETRY_SECONDS 2
+
+struct FileTransfer { // NOLINT(altera-struct-pack-align)
+  struct Transfers *transfers;
+  struct FileTransfer *next;
+
+  fingerprint_t peer;
+  uint32_t id;
+  char *name;
+
+  int fd;
+  uint64_t size;
+  int truncated; // the file got shorter while we were sending it
+
+  uint64_t next_offset;  // next byte to send
+  uint64_t acked_offset; // the receiver has everything below this
+  int in_flight;
+  int rewind; // receiver rejected a chunk, go back to acked_offset
+  int failed; // a chunk got lost, probe the receiver again
+  int retries;
+  struct event *retry_timer;
+  uint32_t epoch; // bumped when the peer reconnects, see transfers_resume
+};
+
+struct Transfers {
+  struct event_base *base;
+  fingerprint_t my_fingerprint;
+  struct Peer **peers;
+  int *num_peers;
+
+  struct FileTransfer *head;
+  uint8_t chunk[TRANSFER_CHUNK_SIZE]; // read into, then copied into a request
+};
+
+// Finds its transfer again by peer and id, which may be gone by the time a
+// chunk from before a reconnect is answered
+struct ChunkCBData {
+  struct Transfers *transfers;
+  fingerprint_t peer;
+  uint32_t id;
+  uint32_t epoch;
+  uint64_t end; // 0 for a probe
+};
+
+static void transfer_pump(struct FileTransfer *transfer);
+
+// Standard CRC-32, a nibble at a time to keep the table small
+static uint32_t transfer_crc32(const uint8_t *data, size_t len) {
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+      0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+      0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  uint32_t crc = ~0U;
+  for (size_t ii = 0; ii < len; ++ii) {
+    crc ^= data[ii];
+    crc = (crc >> 4) ^ table[crc & 0xf]; // NOLINT(hicpp-signed-bitwise)
+    crc = (crc >> 4) ^ table[crc & 0xf]; // NOLINT(hicpp-signed-bitwise)
+  }
+  return ~crc;
+}
+
+// Same file, same id, so a transfer started again after a restart resumes
+static uint32_t transfer_make_id(const char *name, const struct stat *st) {
+  uint32_t hash = hash_fnv1a(name, strlen(name));
+  uint64_t values[2] = {st->st_size, st->st_mtime};
+  return hash_fnv1a_more(hash, values, sizeof(values));
+}
+
+struct Transfers *transfers_new(struct event_base *base,
+                                fingerprint_t my_fingerprint,
+                                struct Peer **peers, int *num_peers) {
+  struct Transfers *transfers = calloc(1, sizeof(struct Transfers));
+  if (!transfers)
+    return 0;
+  transfers->base = base;
+  transfers->my_fingerprint = my_fingerprint;
+  transfers->peers = peers;
+  transfers->num_peers = num_peers;
+  return transfers;
+}
+
+static void transfer_free(struct FileTransfer *transfer) {
+  if (transfer->retry_timer)
+    event_free(transfer->retry_timer);
+  if (transfer->fd != -1)
+    (void)close(transfer->fd);
+  free(transfer->name);
+  free(transfer);
+}
+
+static void transfer_remove(struct FileTransfer *transfer) {
+  struct FileTransfer **link = &transfer->transfers->head;
+  while (*link && *link != transfer)
+    link = &(*link)->next;
+  if (*link)
+    *link = transfer->next;
+  transfer_free(transfer);
+}
+
+void transfers_free(struct Transfers *transfers) {
+  struct FileTransfer *transfer = transfers->head;
+  while (transfer) {
+    struct FileTransfer *next = transfer->next;
+    transfer_free(transfer);
+    transfer = next;
+  }
+  free(transfers);
+}
+
+static struct FileTransfer *transfer_find(struct Transfers *transfers,
+                                          fingerprint_t peer, uint32_t id) {
+  struct FileTransfer *transfer = transfers->head;
+  while (transfer && (transfer->peer != peer || transfer->id != id))
+    transfer = transfer->next;
+  return transfer;
+}
+
+static void transfer_chunk_cb(int error, uint64_t offset, void *arg) {
+  struct ChunkCBData data = *CAST(struct ChunkCBData *, arg);
+  free(arg);
+  struct FileTransfer *transfer =
+      transfer_find(data.transfers, data.peer, data.id);
+  if (!transfer || transfer->epoch != data.epoch)
+    return; // no longer counted in in_flight
+  transfer->in_flight -= 1;
+
+  if (error) {
+    transfer->failed = 1;
+  } else if (data.end == 0) {
+    // Probe: carry on from wherever the receiver got to
+    transfer->acked_offset = offset;
+    transfer->next_offset = offset;
+    if (offset > 0)
+      LOG_INFO("Resuming %s at %llu of %llu bytes", transfer->name,
+               (unsigned long long)offset, (unsigned long long)transfer->size);
+  } else {
+    if (offset > transfer->acked_offset) {
+      transfer->acked_offset = offset;
+      transfer->retries = 0;
+    }
+    if (offset < data.end)
+      transfer->rewind = 1;
+  }
+
+  transfer_pump(transfer);
+}
+
+// Read as each chunk goes out rather than mapped, since touching a mapping
+// past the end of a file that shrank raises SIGBUS
+static const uint8_t *transfer_read(struct FileTransfer *transfer,
+                                    uint64_t offset, size_t len) {
+  uint8_t *chunk = transfer->transfers->chunk;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = pread(transfer->fd, chunk + done, len - done,
+                        (off_t)(offset + done));
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      LOG_ERROR("Cannot read %s at %llu, did it change?", transfer->name,
+                (unsigned long long)(offset + done));
+      transfer->truncated = 1;
+      return 0;
+    }
+    done += ret;
+  }
+  return chunk;
+}
+
+static int transfer_send(struct FileTransfer *transfer, uint64_t offset,
+                         size_t len) {
+  struct FileChunkRequest *request = FileChunkRequest_new();
+  struct ChunkCBData *data = malloc(sizeof(struct ChunkCBData));
+  if (!request || !data)
+    goto failure1;
+
+  (void)EVTAG_ASSIGN(request, fingerprint, transfer->transfers->my_fingerprint);
+  (void)EVTAG_ASSIGN(request, transfer_id, transfer->id);
+  (void)EVTAG_ASSIGN(request, name, transfer->name);
+  (void)EVTAG_ASSIGN(request, size, transfer->size);
+  (void)EVTAG_ASSIGN(request, offset, offset);
+  if (len > 0) {
+    const uint8_t *chunk = transfer_read(transfer, offset, len);
+    if (!chunk || EVTAG_ASSIGN_WITH_LEN(request, data, chunk, len) == -1)
+      goto failure1;
+    (void)EVTAG_ASSIGN(request, checksum, transfer_crc32(chunk, len));
+  }
+
+  data->transfers = transfer->transfers;
+  data->peer = transfer->peer;
+  data->id = transfer->id;
+  data->epoch = transfer->epoch;
+  data->end = len > 0 ? offset + len : 0;
+
+  struct Transfers *transfers = transfer->transfers;
+  if (peer_send_file_chunk(transfer->peer, request, *transfers->peers,
+                           *transfers->num_peers, transfer_chunk_cb,
+                           data) == -1)
+    goto failure2; // request is gone either way
+
+  transfer->in_flight += 1;
+  return 0;
+
+failure1:
+  if (request)
+    FileChunkRequest_free(request);
+failure2:
+  free(data);
+  return -1;
+}
+
+static void transfer_retry_cb(evutil_socket_t fd, short what, void *arg) {
+  (void)fd;
+  (void)what;
+  struct FileTransfer *transfer = CAST(struct FileTransfer *, arg);
+  transfer->failed = 0;
+  if (transfer_send(transfer, 0, 0) == -1) {
+    transfer->failed = 1;
+    transfer_pump(transfer);
+  }
+}
+
+static void transfer_give_up(struct FileTransfer *transfer) {
+  LOG_ERROR("Giving up on %s after %llu of %llu bytes, send it again to "
+            "resume",
+            transfer->name, (unsigned long long)transfer->acked_offset,
+            (unsigned long long)transfer->size);
+  transfer_remove(transfer);
+}
+
+static void transfer_schedule_retry(struct FileTransfer *transfer) {
+  transfer->retries += 1;
+  if (transfer->retries > TRANSFER_MAX_RETRIES) {
+    transfer_give_up(transfer);
+    return;
+  }
+
+  struct timeval delay = {TRANSFER_RETRY_SECONDS * transfer->retries, 0};
+  LOG_WARNING("Transfer of %s interrupted, retrying in %ld seconds",
+              transfer->name, (long)delay.tv_sec);
+  (void)evtimer_add(transfer->retry_timer, &delay);
+}
+
+static void transfer_pump(struct FileTransfer *transfer) {
+  if (transfer->failed || transfer->rewind) {
+    if (transfer->in_flight > 0)
+      return; // let the window drain first
+    if (transfer->failed) {
+      transfer_schedule_retry(transfer);
+      return;
+    }
+    if (++transfer->retries > TRANSFER_MAX_RETRIES) {
+      transfer_give_up(transfer);
+      return;
+    }
+    transfer->next_offset = transfer->acked_offset;
+    transfer->rewind = 0;
+  }
+
+  if (transfer->acked_offset >= transfer->size) {
+    if (transfer->in_flight == 0) {
+      LOG_INFO("Sent %s (%llu bytes)", transfer->name,
+               (unsigned long long)transfer->size);
+      transfer_remove(transfer);
+    }
+    return;
+  }
+
+  while (transfer->in_flight < TRANSFER_WINDOW &&
+         transfer->next_offset < transfer->size) {
+    uint64_t remaining = transfer->size - transfer->next_offset;
+    size_t len =
+        remaining < TRANSFER_CHUNK_SIZE ? remaining : TRANSFER_CHUNK_SIZE;
+    if (transfer_send(transfer, transfer->next_offset, len) == -1) {
+      transfer->failed = 1;
+      break;
+    }
+    transfer->next_offset += len;
+  }
+
+  // Retrying would read the same short file again. Chunks still in flight
+  // find the transfer gone when they are answered.
+  if (transfer->truncated) {
+    transfer_give_up(transfer);
+    return;
+  }
+
+  if (transfer->failed && transfer->in_flight == 0)
+    transfer_schedule_retry(transfer);
+}
+
+int transfer_send_file(struct Transfers *transfers, char *peer,
+                       const char *path) {
+  fingerprint_t fingerprint = 0;
+  if (peer_resolve_fingerprint(peer, *transfers->peers, *transfers->num_peers,
+                               &fingerprint) == -1)
+    goto failure1;
+
+  struct FileTransfer *transfer = calloc(1, sizeof(struct FileTransfer));
+  if (!transfer)
+    goto failure1;
+  transfer->transfers = transfers;
+  transfer->peer = fingerprint;
+
+  transfer->fd = open(path, O_RDONLY | O_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+  if (transfer->fd == -1) {
+    LOG_ERROR("Cannot open %s: %s", path, strerror(errno)); // NOLINT(concurrency-mt-unsafe)
+    goto failure2;
+  }
+
+  struct stat st;
+  if (fstat(transfer->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    LOG_ERROR("Not a regular file: %s", path);
+    goto failure2;
+  }
+  transfer->size = st.st_size;
+
+  const char *slash = strrchr(path, '/');
+  transfer->name = strdup(slash ? slash + 1 : path);
+  if (!transfer->name)
+    goto failure2;
+  if (strlen(transfer->name) > RPC_MAX_FILE_NAME_LEN) {
+    LOG_ERROR("File names are at most %d characters", RPC_MAX_FILE_NAME_LEN);
+    goto failure2;
+  }
+  transfer->id = transfer_make_id(transfer->name, &st);
+  if (transfer_find(transfers, fingerprint, transfer->id)) {
+    LOG_ERROR("Already sending %s to #%d", transfer->name, fingerprint);
+    goto failure2;
+  }
+
+  transfer->retry_timer =
+      evtimer_new(transfers->base, transfer_retry_cb, transfer);
+  if (!transfer->retry_timer)
+    goto failure2;
+
+  // Ask the receiver how much it already has before sending anything
+  if (transfer_send(transfer, 0, 0) == -1)
+    goto failure2;
+
+  transfer->next = transfers->head;
+  transfers->head = transfer;
+
+  LOG_INFO("Sending %s (%llu bytes) to #%d", transfer->name,
+           (unsigned long long)transfer->size, fingerprint);
+  return 0;
+
+failure2:
+  transfer_free(transfer);
+failure1:
+  return -1;
+}
+
+void transfers_resume(struct Transfers *transfers, fingerprint_t peer) {
+  if (!transfers)
+    return;
+  struct FileTransfer *transfer = transfers->head;
+  while (transfer) {
+    struct FileTransfer *next = transfer->next; // pumping may remove it
+    if (transfer->peer == peer) {
+      // Chunks on the old connection may never be answered. Forget them and
+      // ask the receiver where to carry on from.
+      transfer->epoch += 1;
+      transfer->in_flight = 0;
+      transfer->rewind = 0;
+      transfer->failed = 0;
+      transfer->retries = 0;
+      (void)evtimer_del(transfer->retry_timer);
+      if (transfer_send(transfer, 0, 0) == -1) {
+        transfer->failed = 1;
+        transfer_pump(transfer);
+      }
+    }
+    transfer = next;
+  }
+}
+
+static int transfer_valid_name(const char *name) {
+  return *name != 0 && *name != '.' && strchr(name, '/') == 0;
+}
+
+static int transfer_write(int fd, const uint8_t *data, size_t len,
+                          uint64_t offset) {
+  while (len > 0) {
+    ssize_t written = pwrite(fd, data, len, (off_t)offset);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+// The part file for a chunk. Only a transfer's first request, the probe at
+// offset 0, may start one. Without a part file, the chunk is either late for
+// a transfer already finished, which *done_out reports, or early.
+static int transfer_open_part(const char *path, const char *name,
+                              uint64_t size, uint64_t offset, int probe,
+                              int *done_out) {
+  *done_out = 0;
+  int fd = open(path, O_WRONLY | O_CLOEXEC); // NOLINT(hicpp-signed-bitwise)
+  if (fd != -1 || errno != ENOENT)
+    return fd;
+
+  struct stat st;
+  if (lstat(name, &st) == 0) {
+    // A chunk resent after we finished, as long as that is what is there
+    if (!probe && S_ISREG(st.st_mode) && (uint64_t)st.st_size == size) {
+      *done_out = 1;
+      return -1;
+    }
+    LOG_ERROR("Refusing %s, there is a file by that name already", name);
+    errno = EEXIST;
+    return -1;
+  }
+  if (offset != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  return open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, // NOLINT
+              0600);
+}
+
+void transfer_receive_chunk(struct Transfers *transfers,
+                            struct FileChunkRequest *request,
+                            struct FileChunkReply *reply) {
+  uint32_t fingerprint = 0;
+  uint32_t id = 0;
+  char *name = 0;
+  uint64_t size = 0;
+  uint64_t offset = 0;
+  if (EVTAG_GET(request, fingerprint, &fingerprint) == -1 ||
+      EVTAG_GET(request, transfer_id, &id) == -1 ||
+      EVTAG_GET(request, name, &name) == -1 ||
+      EVTAG_GET(request, size, &size) == -1 ||
+      EVTAG_GET(request, offset, &offset) == -1)
+    goto failure1;
+
+  if (peer_index(fingerprint, *transfers->peers, *transfers->num_peers) ==
+      -1) {
+    LOG_WARNING("Refusing file from unknown peer #%d", fingerprint);
+    goto failure1;
+  }
+
+  if (!transfer_valid_name(name)) {
+    LOG_ERROR("Refusing file with unsafe name from #%d", fingerprint);
+    goto failure1;
+  }
+
+  char path[PATH_MAX];
+  int len = snprintf(path, sizeof(path), "%s.%08x.part", name, id);
+  if (len < 0 || (size_t)len >= sizeof(path))
+    goto failure1;
+
+  int probe = !EVTAG_HAS(request, data);
+  int done = 0;
+  int fd = transfer_open_part(path, name, size, offset, probe, &done);
+  if (fd == -1) {
+    if (done) {
+      (void)EVTAG_ASSIGN(reply, offset, size);
+    } else if (errno == ENOENT) {
+      // Nothing of it here yet, the sender goes back to the start
+      (void)EVTAG_ASSIGN(reply, offset, 0);
+    } else if (errno != EEXIST) {
+      LOG_ERROR("Cannot open %s: %s", path, strerror(errno)); // NOLINT(concurrency-mt-unsafe)
+    }
+    goto failure1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    goto failure2;
+  uint64_t have = st.st_size;
+  if (have > size) {
+    // Left over from a different file with the same name, start again
+    if (ftruncate(fd, 0) == -1)
+      goto failure2;
+    have = 0;
+  }
+
+  uint8_t *data = 0;
+  uint32_t data_len = 0;
+  if (EVTAG_GET_WITH_LEN(request, data, &data, &data_len) == 0) {
+    uint32_t checksum = 0;
+    if (EVTAG_GET(request, checksum, &checksum) == -1 ||
+        checksum != transfer_crc32(data, data_len)) {
+      LOG_WARNING("Bad checksum for %s at %llu", name,
+                  (unsigned long long)offset);
+    } else if (offset > have || offset + data_len > size) {
+      LOG_DEBUG("Out of order chunk for %s at %llu, have %llu", name,
+                (unsigned long long)offset, (unsigned long long)have);
+    } else if (transfer_write(fd, data, data_len, offset) == -1) {
+      LOG_ERROR("Cannot write %s: %s", path, strerror(errno)); // NOLINT(concurrency-mt-unsafe)
+    } else if (offset + data_len > have) {
+      have = offset + data_len;
+    }
+  } else if (have == 0) {
+    LOG_INFO("Receiving %s (%llu bytes) from #%d", name,
+             (unsigned long long)size, fingerprint);
+  }
+
+  if (have == size) {
+    // link, unlike rename, never replaces a file that got there meanwhile.
+    // The part file stays if it cannot be done, and the sender is told.
+    if (link(path, name) == -1) {
+      LOG_ERROR("Cannot move %s to %s: %s", path, name, strerror(errno)); // NOLINT(concurrency-mt-unsafe)
+      goto failure2;
+    }
+    (void)unlink(path);
+    LOG_INFO("Received %s (%llu bytes) from #%d", name,
+             (unsigned long long)size, fingerprint);
+  }
+
+  (void)EVTAG_ASSIGN(reply, offset, have);
+
+// An incomplete reply goes back as an error, which the sender retries
+failure2:
+  (void)close(fd);
+failure1:
+  return;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.h"
+#include <event2/event.h>
+
+struct Peer;
+struct Transfers;
+struct FileChunkRequest;
+struct FileChunkReply;
+
+// Outgoing transfers of one application. peers/num_peers point at the
+// application's peer array so transfers follow it when it is reallocated.
+struct Transfers *transfers_new(struct event_base *base,
+                                fingerprint_t my_fingerprint,
+                                struct Peer **peers, int *num_peers);
+void transfers_free(struct Transfers *transfers);
+
+// peer is handle#fingerprint. The file is streamed in fixed-size chunks with
+// a bounded number in flight, so memory use does not depend on its size.
+int transfer_send_file(struct Transfers *transfers, char *peer,
+                       const char *path);
+
+// The peer connected again, so transfers to it start over from what the
+// receiver has. Does nothing when transfers is NULL.
+void transfers_resume(struct Transfers *transfers, fingerprint_t peer);
+
+// Receiving side of a FileChunk request, from peers we track only. Chunks are
+// written straight to <name>.<transfer id>.part in the current directory,
+// which becomes <name> once complete. A file that is already there is never
+// replaced. Keeps no state between chunks: progress is the size of the part
+// file, which is also what a resuming sender is told.
+void transfer_receive_chunk(struct Transfers *transfers,
+                            struct FileChunkRequest *request,
+                            struct FileChunkReply *reply);
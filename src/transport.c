@@ -0,0 +1,153 @@
+#include "transport.h"
+#include "address.h"
+#include "log.h"
+#include "types.h"
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static evutil_socket_t transport_bound_socket(int type, uint16_t port,
+                                              char **address_out) {
+  // Prefer a dual-stack socket so peers can reach us over IPv4 and IPv6
+  struct sockaddr_storage addr = {0};
+  socklen_t addrlen = sizeof(struct sockaddr_in6);
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_addr = in6addr_any;
+  sin6->sin6_port = htons(port);
+
+  evutil_socket_t server_socket = socket(AF_INET6, type, 0);
+  if (server_socket == -1) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+    memset(&addr, 0, sizeof(addr));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = 0;
+    sin->sin_port = htons(port);
+    addrlen = sizeof(struct sockaddr_in);
+    server_socket = socket(AF_INET, type, 0);
+  }
+
+  if (server_socket == -1) {
+    perror("socket() failed");
+    goto failure;
+  }
+
+  int reuseaddr_opt_val = 1;
+  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_opt_val,
+                 sizeof(int))) {
+    perror("Could not retrieve socket information");
+    goto failure;
+  }
+
+  int v6only_opt_val = 0;
+  if (addr.ss_family == AF_INET6 &&
+      setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6only_opt_val,
+                 sizeof(int))) {
+    perror("Could not make socket dual-stack");
+    goto failure;
+  }
+
+  if (evutil_make_socket_nonblocking(server_socket) == -1) {
+    perror("Could not make socket nonblocking");
+    goto failure;
+  }
+
+  const int MAX_BACKLOG_LENGTH = 16;
+  if (bind(server_socket, (void *)&addr, addrlen) == -1 ||
+      (type == SOCK_STREAM &&
+       listen(server_socket, MAX_BACKLOG_LENGTH) == -1)) {
+    LOG_ERROR0("Could not bind socket");
+    perror("Could not bind socket");
+    goto failure;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  socklen_t size = sizeof(addr);
+  if (getsockname(server_socket, (void *)&addr, &size) == -1) {
+    LOG_ERROR0("Could not get bound socket");
+    perror("Could not get bound socket");
+    goto failure;
+  }
+
+  char *bound_addr = malloc(ADDRESS_MAX_LEN);
+  if (!bound_addr ||
+      address_format((struct sockaddr *)&addr, bound_addr, ADDRESS_MAX_LEN) ==
+          -1) {
+    LOG_ERROR0("Could not format bound address");
+    free(bound_addr);
+    goto failure;
+  }
+
+  *address_out = bound_addr;
+  return server_socket;
+
+failure:
+  if (server_socket != -1)
+    (void)evutil_closesocket(server_socket);
+  return -1;
+}
+
+evutil_socket_t transport_listen_socket(char **address_out) {
+  return transport_bound_socket(SOCK_STREAM, 0, address_out);
+}
+
+evutil_socket_t transport_datagram_socket(uint16_t port, char **address_out) {
+  return transport_bound_socket(SOCK_DGRAM, port, address_out);
+}
+
+static int transport_is_wildcard(const struct sockaddr_storage *addr) {
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+  if (addr->ss_family == AF_INET)
+    return sin->sin_addr.s_addr == INADDR_ANY;
+  return addr->ss_family == AF_INET6 &&
+         IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr);
+}
+
+int transport_advertised_address(const char *bound,
+                                 const struct sockaddr_storage *to,
+                                 socklen_t tolen, char *buf, size_t len) {
+  char host[ADDRESS_MAX_LEN] = {0};
+  uint16_t port = 0;
+  struct sockaddr_storage addr = {0};
+  socklen_t addrlen = sizeof(addr);
+  if (strlen(bound) >= sizeof(host) ||
+      address_split(bound, host, &port) == -1 ||
+      address_parse_numeric(host, port, &addr, &addrlen) != 0 ||
+      !transport_is_wildcard(&addr))
+    goto unchanged;
+
+  // Connecting a datagram socket sends nothing, it only picks the route
+  evutil_socket_t fd = socket(to->ss_family, SOCK_DGRAM, 0);
+  if (fd == -1)
+    goto unchanged;
+  addrlen = sizeof(addr);
+  int routed = connect(fd, (const struct sockaddr *)to, tolen) == 0 &&
+               getsockname(fd, (struct sockaddr *)&addr, &addrlen) == 0;
+  (void)evutil_closesocket(fd);
+  if (!routed)
+    goto unchanged;
+
+  address_unmap(&addr, &addrlen);
+  address_set_port(&addr, port);
+  return address_format((struct sockaddr *)&addr, buf, len);
+
+unchanged:
+  if (strlen(bound) >= len)
+    return -1;
+  (void)strcpy(buf, bound);
+  return 0;
+}
+
+const struct TransportOps *transport_find(const char *name) {
+  const struct TransportOps *transports[] = {transport_http(),
+                                             transport_uring(),
+                                             transport_udp()};
+  for (unsigned ii = 0; ii < ARRAY_SIZE(transports); ++ii) {
+    if (transports[ii] && strcmp(transports[ii]->name, name) == 0)
+      return transports[ii];
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "rpc.h"
+#include <event2/event.h>
+#include <event2/rpc.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// How requests get from one application to another. The default carries
+// evrpc requests over HTTP; anything else, a simulator for instance, plugs in
+// by providing its own TransportOps.
+
+// Same shape as evrpc's callbacks, so request and reply are the structs
+// for the RPC's type and status->error is one of EVRPC_STATUS_ERR_*
+typedef void (*transport_cb_t)(struct evrpc_status *status, void *request,
+                               void *reply, void *arg);
+
+// Handles an incoming request by filling in reply. The transport sends the
+// reply if it is complete, and an error otherwise.
+typedef void (*transport_dispatch_t)(enum RpcType type, void *request,
+                                     void *reply, void *arg);
+
+// Decides whether to take a request of this type from this address, before
+// the request is decoded. 0 refuses it, and the caller sees an error.
+typedef int (*transport_admit_t)(enum RpcType type, const struct sockaddr *from,
+                                 socklen_t fromlen, void *arg);
+
+struct TransportOps {
+  const char *name;
+
+  // Starts accepting requests, which are handed to dispatch. admit, if not
+  // NULL, is asked first and gets dispatch_arg too. Sets *address_out to a
+  // malloc'd host:port that peers can use to reach us.
+  void *(*listen)(void *ctx, struct event_base *base,
+                  transport_dispatch_t dispatch, transport_admit_t admit,
+                  void *dispatch_arg, char **address_out);
+  void (*close)(void *server);
+
+  // A link carries requests to one remote address. link_free fails the
+  // requests still waiting with EVRPC_STATUS_ERR_UNSTARTED once the link is
+  // gone, and is not for calling from the link's own callbacks.
+  void *(*link_new)(void *ctx, struct event_base *base,
+                    const struct sockaddr *addr, socklen_t addrlen);
+  void (*link_free)(void *link);
+
+  // Takes ownership of request and reply, which are handed back through
+  // callback, never before this returns. On failure the callback is not
+  // called and request and reply still belong to the caller.
+  int (*request)(void *link, enum RpcType type, void *request, void *reply,
+                 transport_cb_t callback, void *cbarg);
+
+  // Optional, state shared by the server and links of one application, passed
+  // to listen and link_new as ctx. Freed after them.
+  void *(*ctx_new)(struct event_base *base);
+  void (*ctx_free)(void *ctx);
+};
+
+const struct TransportOps *transport_http(void);
+// What a request answered with this HTTP code fails with.
+// EVRPC_STATUS_ERR_BADPAYLOAD for any error: evrpc answers 503 whether it
+// refused the request or could not decode it, and a version 0 peer refusing
+// newer fields has to be recognized.
+int transport_http_status(int code);
+// Framed RPCs over io_uring, see transport_uring.c. NULL when not built in.
+// Only talks to peers using it too.
+const struct TransportOps *transport_uring(void);
+// Framed RPCs over UDP with their own retransmission and congestion control,
+// and NAT traversal through a rendezvous server, see transport_udp.c. Only
+// talks to peers using it too.
+const struct TransportOps *transport_udp(void);
+
+// By name, NULL if there is no such transport
+const struct TransportOps *transport_find(const char *name);
+
+// A dual-stack TCP socket listening on an ephemeral port. Sets *address_out
+// to a malloc'd host:port for it.
+evutil_socket_t transport_listen_socket(char **address_out);
+// What to tell a peer at to to reach us at, given the address we listen on.
+// A wildcard host becomes the local address we would reach the peer from, in
+// the peer's address family: "[::]:port" means nothing to the peer, and
+// version 0 peers cannot parse IPv6 at all.
+int transport_advertised_address(const char *bound,
+                                 const struct sockaddr_storage *to,
+                                 socklen_t tolen, char *buf, size_t len);
+// A dual-stack UDP socket bound to port, or an ephemeral one if port is 0.
+// Sets *address_out like transport_listen_socket.
+evutil_socket_t transport_datagram_socket(uint16_t port, char **address_out);
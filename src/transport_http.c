@@ -0,0 +1,350 @@
+#include "address.h"
+#include "log.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/rpc.h>
+#include <event2/rpc_struct.h>
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/********************
+ Server
+********************/
+struct HttpServer;
+
+struct HttpHandler {
+  struct HttpServer *server;
+  enum RpcType type;
+};
+
+struct HttpServer {
+  struct evhttp *http;
+  struct evrpc_base *rpc;
+  evutil_socket_t socket;
+
+  transport_dispatch_t dispatch;
+  transport_admit_t admit;
+  void *dispatch_arg;
+  struct HttpHandler handlers[RPC_NUM_TYPES];
+};
+
+static void log_unhandled_requests(struct evhttp_request *req, void *ignored) {
+  (void)ignored;
+  LOG_DEBUG("Got unhandled request: %d", evhttp_request_get_command(req));
+  evhttp_send_error(req, HTTP_BADREQUEST, "Unknown request");
+}
+
+static void http_rpc_cb(struct evrpc_req_generic *req, void *arg) {
+  struct HttpHandler *handler = CAST(struct HttpHandler *, arg);
+  struct HttpServer *server = handler->server;
+  server->dispatch(handler->type, evrpc_get_request(req), evrpc_get_reply(req),
+                   server->dispatch_arg);
+  // evrpc answers with an error if the reply was left incomplete
+  evrpc_request_done(req);
+}
+
+// Runs before evrpc allocates or decodes anything. Terminating makes evrpc
+// answer 503.
+static int http_admit_hook(void *ctx, struct evhttp_request *req,
+                           struct evbuffer *body, void *arg) {
+  (void)ctx;
+  (void)body;
+  struct HttpServer *server = CAST(struct HttpServer *, arg);
+  const char *uri = evhttp_request_get_uri(req);
+  const char *PREFIX = "/.rpc.";
+  const size_t PREFIX_LEN = 6;
+  if (!uri || strncmp(uri, PREFIX, PREFIX_LEN) != 0)
+    return EVRPC_CONTINUE; // evrpc will not find a handler either
+  for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+    if (strcmp(uri + PREFIX_LEN, rpc_info(ii)->name) != 0)
+      continue;
+    struct evhttp_connection *connection = evhttp_request_get_connection(req);
+    const struct sockaddr *from =
+        connection ? evhttp_connection_get_addr(connection) : 0;
+    if (!from)
+      return EVRPC_CONTINUE;
+    socklen_t fromlen = from->sa_family == AF_INET6
+                            ? sizeof(struct sockaddr_in6)
+                            : sizeof(struct sockaddr_in);
+    return server->admit(ii, from, fromlen, server->dispatch_arg)
+               ? EVRPC_CONTINUE
+               : EVRPC_TERMINATE;
+  }
+  return EVRPC_CONTINUE;
+}
+
+static void http_close(void *arg) {
+  struct HttpServer *server = CAST(struct HttpServer *, arg);
+  for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+    if (server->handlers[ii].server)
+      (void)evrpc_unregister_rpc(server->rpc, rpc_info(ii)->name);
+  }
+  if (server->rpc)
+    evrpc_free(server->rpc);
+  if (server->http)
+    evhttp_free(server->http);
+  if (server->socket != -1)
+    (void)evutil_closesocket(server->socket);
+  free(server);
+}
+
+static void *http_listen(void *ctx, struct event_base *base,
+                         transport_dispatch_t dispatch,
+                         transport_admit_t admit, void *dispatch_arg,
+                         char **address_out) {
+  (void)ctx;
+  struct HttpServer *server = calloc(1, sizeof(struct HttpServer));
+  if (!server)
+    return 0;
+  server->socket = -1;
+  server->dispatch = dispatch;
+  server->admit = admit;
+  server->dispatch_arg = dispatch_arg;
+
+  server->http = evhttp_new(base);
+  if (!server->http)
+    goto failure;
+  LOG_DEBUG0("Initialized HTTP server");
+
+  server->rpc = evrpc_init(server->http);
+  if (!server->rpc)
+    goto failure;
+
+  for (int ii = 0; ii < RPC_NUM_TYPES; ++ii) {
+    const struct RpcInfo *info = rpc_info(ii);
+    struct HttpHandler *handler = &server->handlers[ii];
+    handler->type = ii;
+    if (evrpc_register_generic(
+            server->rpc, info->name, http_rpc_cb, handler, info->request_new,
+            NULL, info->request_free, info->request_unmarshal, info->reply_new,
+            NULL, info->reply_free, info->reply_complete,
+            info->reply_marshal) == -1)
+      goto failure;
+    handler->server = server;
+  }
+  if (admit &&
+      !evrpc_add_hook(server->rpc, EVRPC_INPUT, http_admit_hook, server))
+    goto failure;
+  LOG_DEBUG0("Initialized RPC server");
+
+  server->socket = transport_listen_socket(address_out);
+  if (server->socket == -1)
+    goto failure;
+
+  if (evhttp_accept_socket(server->http, server->socket) == -1)
+    goto failure;
+
+  // Refuse oversized requests from their headers, before reading the body
+  evhttp_set_max_headers_size(server->http, RPC_MAX_HEADERS_SIZE);
+  evhttp_set_max_body_size(server->http, RPC_MAX_BODY_SIZE);
+  evhttp_set_gencb(server->http, log_unhandled_requests, NULL);
+
+  return server;
+
+failure:
+  http_close(server);
+  return 0;
+}
+
+/********************
+ Client
+********************/
+struct HttpCall;
+
+struct HttpLink {
+  struct evrpc_pool *pool;
+  struct evhttp_connection *connection;
+  evutil_socket_t nodelay_fd;
+  struct HttpCall *calls; // waiting for replies, so link_free can fail them
+};
+
+struct HttpCall {
+  struct HttpCall *prev;
+  struct HttpCall *next;
+  struct HttpLink *link;
+  transport_cb_t callback;
+  void *cbarg;
+  void *request;
+  void *reply;
+};
+
+static void http_call_unlink(struct HttpCall *call) {
+  if (call->prev)
+    call->prev->next = call->next;
+  else
+    call->link->calls = call->next;
+  if (call->next)
+    call->next->prev = call->prev;
+}
+
+int transport_http_status(int code) {
+  return code == HTTP_OK ? EVRPC_STATUS_ERR_NONE : EVRPC_STATUS_ERR_BADPAYLOAD;
+}
+
+static void http_call_cb(struct evrpc_status *status, void *request,
+                         void *reply, void *arg) {
+  struct HttpCall *call = CAST(struct HttpCall *, arg);
+  // http_reply_hook aborts every reply that is not a 200
+  if (status->error == EVRPC_STATUS_ERR_HOOKABORTED && status->http_req)
+    status->error = transport_http_status(
+        evhttp_request_get_response_code(status->http_req));
+  http_call_unlink(call);
+  transport_cb_t callback = call->callback;
+  void *cbarg = call->cbarg;
+  free(call);
+  callback(status, request, reply, cbarg);
+}
+
+// Not from the link's own callbacks. The connection goes at once, since
+// evrpc would still touch the freed pool when a reply came in later, and
+// evhttp drops what it was sending without calling back.
+static void http_link_free(void *arg) {
+  struct HttpLink *link = CAST(struct HttpLink *, arg);
+  if (link->connection) {
+    if (link->pool)
+      evrpc_pool_remove_connection(link->pool, link->connection);
+    evhttp_connection_free(link->connection);
+  }
+
+  if (link->pool)
+    evrpc_pool_free(link->pool);
+
+  struct HttpCall *call = link->calls;
+  free(link);
+
+  // Once the link is gone, so that callbacks sending more can't reach it
+  while (call) {
+    struct HttpCall *next = call->next;
+    struct evrpc_status status = {0};
+    status.error = EVRPC_STATUS_ERR_UNSTARTED;
+    call->callback(&status, call->request, call->reply, call->cbarg);
+    free(call);
+    call = next;
+  }
+}
+
+// evrpc decodes whatever body comes back, even the page of a 503, so an
+// error could pass for an empty reply
+static int http_reply_hook(void *ctx, struct evhttp_request *req,
+                           struct evbuffer *body, void *arg) {
+  (void)ctx;
+  (void)body;
+  (void)arg;
+  return evhttp_request_get_response_code(req) == HTTP_OK ? EVRPC_CONTINUE
+                                                          : EVRPC_TERMINATE;
+}
+
+static void *http_link_new(void *ctx, struct event_base *base,
+                           const struct sockaddr *addr, socklen_t addrlen) {
+  (void)ctx;
+  (void)addrlen;
+  struct HttpLink *link = calloc(1, sizeof(struct HttpLink));
+  if (!link)
+    goto failure1;
+  link->nodelay_fd = -1;
+
+  link->pool = evrpc_pool_new(base);
+  if (!link->pool ||
+      !evrpc_add_hook(link->pool, EVRPC_INPUT, http_reply_hook, NULL))
+    goto failure2;
+
+  // The address is always numeric by now, so evhttp never has to resolve it
+  const struct sockaddr_storage *storage =
+      (const struct sockaddr_storage *)addr;
+  char host[INET6_ADDRSTRLEN] = {0};
+  if (!address_format_host(storage, host, sizeof(host)))
+    goto failure2;
+
+  // The pool sets the connection's base and asserts it has none yet, so only
+  // the bufferevent gets ours up front. Otherwise evhttp would make it on
+  // libevent's global base.
+  struct bufferevent *bev =
+      bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev)
+    goto failure2;
+  link->connection = evhttp_connection_base_bufferevent_new(
+      0, 0, bev, host, address_get_port(storage));
+  if (!link->connection)
+    goto failure3;
+
+  evhttp_connection_set_max_headers_size(link->connection,
+                                         RPC_MAX_HEADERS_SIZE);
+  evhttp_connection_set_max_body_size(link->connection, RPC_MAX_BODY_SIZE);
+  evrpc_pool_add_connection(link->pool, link->connection);
+
+  return link;
+
+failure3:
+  bufferevent_free(bev);
+failure2:
+  http_link_free(link);
+failure1:
+  return 0;
+}
+
+// evhttp sends a request as separate header and body writes, so with Nagle
+// every request after the first waits out the receiver's delayed ACK. evhttp
+// creates the socket when it connects, so catch it on the way out instead.
+static void http_set_nodelay(struct HttpLink *link) {
+  struct bufferevent *bev = evhttp_connection_get_bufferevent(link->connection);
+  evutil_socket_t fd = bev ? bufferevent_getfd(bev) : -1;
+  if (fd == -1 || fd == link->nodelay_fd)
+    return;
+
+  int nodelay_opt_val = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay_opt_val,
+                 sizeof(int)) == 0)
+    link->nodelay_fd = fd;
+}
+
+static int http_request(void *arg, enum RpcType type, void *request,
+                        void *reply, transport_cb_t callback, void *cbarg) {
+  struct HttpLink *link = CAST(struct HttpLink *, arg);
+  const struct RpcInfo *info = rpc_info(type);
+
+  http_set_nodelay(link);
+  struct HttpCall *call = malloc(sizeof(struct HttpCall));
+  if (!call)
+    return -1;
+  call->prev = 0;
+  call->next = link->calls;
+  call->link = link;
+  call->callback = callback;
+  call->cbarg = cbarg;
+  call->request = request;
+  call->reply = reply;
+
+  // Not evrpc_send_request_generic, which calls back even when it fails
+  struct evrpc_request_wrapper *ctx = evrpc_make_request_ctx(
+      link->pool, request, reply, info->name, info->request_marshal,
+      info->reply_clear, info->reply_unmarshal, http_call_cb, call);
+  if (!ctx) {
+    free(call);
+    return -1;
+  }
+  if (link->calls)
+    link->calls->prev = call;
+  link->calls = call;
+  if (evrpc_make_request(ctx) == -1) {
+    http_call_unlink(call);
+    free(call);
+    return -1;
+  }
+  return 0;
+}
+
+const struct TransportOps *transport_http(void) {
+  static const struct TransportOps ops = {
+      "http",        http_listen,    http_close,
+      http_link_new, http_link_free, http_request,
+      NULL,          NULL,
+  };
+  return &ops;
+}
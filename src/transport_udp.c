@@ -0,0 +1,1846 @@
+#define _GNU_SOURCE // sendmmsg and recvmmsg
+
+#include "address.h"
+#include "hash.h"
+#include "log.h"
+#include "rendezvous.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/rpc_struct.h>
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+// Requests and replies as messages over one UDP socket per application, which
+// is the transport ctx. It serves and sends alike, so peers reply to the
+// address a NAT opened for us, and there is no handshake: the first datagram
+// to a peer already carries the request.
+//
+// Datagrams are packets
+//   type (1) session (4) number (4) oldest (4) frames
+// with the integers big endian, and frames one of
+//   ACK   largest (4) bitmap (8), bit i acks packet largest - 1 - i
+//   DATA  message (4) length (4) fragment (2) data
+//   PING  asks for an ack and nothing else
+// A message is what a uring frame carries: kind (1) type (1) status (1)
+// unused (1) id (4) body, cut into fragments of UDP_FRAGMENT bytes. A message
+// is handed over as soon as all its fragments are in, so a lost datagram only
+// holds up the message it was part of.
+//
+// Like QUIC, packet numbers are never reused, acks name packets and what a
+// lost packet carried goes again in a new one. A packet is lost once three
+// later ones are acked, or an eighth of a round trip after a later one was.
+// When nothing is acked for a probe timeout the oldest data goes again
+// regardless, and after UDP_TIMEOUT_US of that every request to the peer
+// fails. The congestion window is NewReno's, counted in bytes. At most
+// UDP_WINDOW messages to a peer are in flight, oldest names the first of them
+// not acked yet, and the receiver drops any message it already handed over.
+// A session that changes means the peer started again.
+//
+// Everything sent during one pass of the event loop, acks included, goes out
+// with a single sendmmsg, and reads take up to UDP_BATCH datagrams at a time.
+//
+// Peers behind NAT register with a rendezvous server (P2P_RENDEZVOUS, see
+// rendezvous.h) and give out the address it saw them at. Sending to a peer we
+// have not heard from asks the server to introduce us, and then both sides
+// punch through to each other. P2P_UDP_FILTER=1 drops datagrams from anyone
+// we have not sent to, like such a NAT would, and P2P_UDP_LOSS=percent drops
+// that many of the datagrams we receive, so both can be tried on loopback.
+
+#define UDP_PACKET_MAX 1232 // the IPv6 minimum MTU less IPv6 and UDP headers
+#define UDP_HEADER_SIZE 13
+#define UDP_ACK_SIZE 13
+#define UDP_DATA_HEADER_SIZE 11
+#define UDP_FRAGMENT                                                           \
+  (UDP_PACKET_MAX - UDP_HEADER_SIZE - UDP_ACK_SIZE - UDP_DATA_HEADER_SIZE)
+#define UDP_MESSAGE_HEADER_SIZE 8
+#define UDP_MESSAGE_MAX (UDP_MESSAGE_HEADER_SIZE + RPC_MAX_BODY_SIZE)
+#define UDP_WINDOW 64 // messages, as many as bits in UdpConn.in_done
+#define UDP_FRAMES_MAX 16
+#define UDP_BATCH 32
+#define UDP_READS_MAX 8
+#define UDP_REORDER 3
+#define UDP_SENT_MIN 16 // power of 2
+#define UDP_MIN_BUCKETS 16
+#define UDP_INITIAL_WINDOW (10 * UDP_PACKET_MAX)
+#define UDP_MIN_WINDOW (2 * UDP_PACKET_MAX)
+#define UDP_INITIAL_RTT_US 100000
+#define UDP_GRANULARITY_US 1000
+#define UDP_MAX_PTO_US 2000000
+#define UDP_KEEPALIVE_US 1000000 // while waiting for replies
+#define UDP_TIMEOUT_US 10000000
+#define UDP_IDLE_US 60000000
+#define UDP_SOCKET_BUFFER (1024 * 1024)
+#define UDP_REGISTER_TRIES 4
+#define UDP_REGISTER_WAIT_US 250000
+#define UDP_REGISTER_EVERY_S 15
+
+enum UdpDatagramType { UDP_PACKET = 1, UDP_PUNCH };
+
+enum UdpFrameType { UDP_FRAME_ACK = 1, UDP_FRAME_DATA, UDP_FRAME_PING };
+
+enum UdpMessageKind { UDP_REQUEST, UDP_REPLY };
+
+enum UdpFragmentState { UDP_UNSENT, UDP_IN_FLIGHT, UDP_ACKED };
+
+#ifdef P2PCHAT_HAVE_MMSG
+typedef struct mmsghdr udp_mmsg_t;
+#else
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned msg_len;
+} udp_mmsg_t;
+#endif
+
+struct UdpCtx;
+struct UdpLink;
+
+// A message on its way out, followed by the state of each fragment
+struct UdpOut {
+  struct UdpOut *next; // while waiting for room in the window
+  uint32_t id;
+  uint32_t length;
+  uint16_t fragments;
+  uint16_t acked;
+  uint16_t unsent; // no unsent fragment before this one
+  uint8_t *state;
+  uint8_t data[];
+};
+
+// A message coming in, followed by which fragments have arrived
+struct UdpIn {
+  uint32_t id;
+  uint32_t length;
+  uint16_t fragments;
+  uint16_t received;
+  uint8_t *have;
+  uint8_t data[];
+};
+
+struct UdpSentFrame {
+  uint32_t message;
+  uint16_t fragment;
+};
+
+// A packet that asked for an ack, until it is acked or lost
+struct UdpSent { // NOLINT(altera-struct-pack-align)
+  uint64_t sent_us;
+  uint32_t number;
+  uint16_t bytes;
+  uint8_t outstanding;
+  uint8_t num_frames;
+  struct UdpSentFrame frames[UDP_FRAMES_MAX];
+};
+
+struct UdpPending {
+  struct UdpPending *next;
+  struct UdpLink *link;
+  uint32_t id;
+  enum RpcType type;
+  void *request;
+  void *reply;
+  transport_cb_t callback;
+  void *cbarg;
+};
+
+// Everything about one remote address, which we may both serve and send to
+struct UdpConn { // NOLINT(altera-struct-pack-align)
+  struct UdpCtx *ctx;
+  struct UdpConn *bucket_next;
+  struct UdpConn *dirty_next;
+  struct AddressPacked key;
+  struct sockaddr_storage addr; // the way the socket takes it
+  socklen_t addrlen;
+  struct event *timer;
+  uint64_t deadline_us;
+  uint64_t active_us; // last sent or received anything
+  int links;
+  int dirty;
+  int sent_to;
+  int heard;
+  int introduced;
+  uint32_t remote_session;
+
+  // Sending
+  uint32_t next_number;
+  uint32_t sent_base; // no outstanding packet before this
+  uint32_t sent_capacity; // power of 2
+  struct UdpSent *sent;
+  int any_acked;
+  uint32_t largest_acked;
+  size_t in_flight; // bytes
+  size_t cwnd;
+  size_t ssthresh;
+  uint64_t recovery_us; // losses of packets sent before this are old news
+  int rtt_sampled;
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t latest_rtt_us;
+  uint64_t loss_us; // when the next outstanding packet counts as lost
+  uint64_t eliciting_us; // last packet that asked for an ack
+  uint64_t progress_us;  // last ack of anything new, or since we wait
+  int probes;            // timeouts in a row
+  int probes_due;        // packets to send whatever the window
+  int ping_due;
+  int ack_due;
+  struct UdpOut *out[UDP_WINDOW];
+  uint32_t out_base; // oldest message not acked
+  uint32_t out_next; // id of the next message let into the window
+  struct UdpOut *waiting_head;
+  struct UdpOut *waiting_tail;
+  struct UdpPending *pending_head; // requests waiting for replies
+  struct UdpPending *pending_tail;
+  uint32_t next_request;
+
+  // Receiving
+  int any_received;
+  uint32_t largest_received;
+  uint64_t received; // bit i: packet largest_received - 1 - i arrived
+  struct UdpIn *in[UDP_WINDOW];
+  uint32_t in_base; // every message before this one was handed over
+  uint64_t in_done; // messages after in_base handed over, by id % UDP_WINDOW
+};
+
+struct UdpServer {
+  struct UdpCtx *ctx;
+  transport_dispatch_t dispatch;
+  transport_admit_t admit;
+  void *dispatch_arg;
+};
+
+struct UdpLink {
+  struct UdpCtx *ctx;
+  struct UdpConn *conn;
+};
+
+struct UdpCtx { // NOLINT(altera-struct-pack-align)
+  struct event_base *base;
+  evutil_socket_t fd;
+  int family;
+  char *address; // where the socket is bound
+  uint32_t session;
+  struct event *readable;
+  struct event *writable;
+  struct event *flush;
+  struct UdpServer *server;
+
+  struct UdpConn **buckets;
+  size_t num_buckets; // power of 2
+  size_t num_conns;
+  struct UdpConn *dirty; // may have something to send
+
+  // Queued until the end of this pass of the event loop
+  udp_mmsg_t out_msgs[UDP_BATCH];
+  struct iovec out_iov[UDP_BATCH];
+  struct sockaddr_storage out_addrs[UDP_BATCH];
+  uint8_t out_data[UDP_BATCH][UDP_PACKET_MAX];
+  unsigned out_count;
+  unsigned out_sent;
+
+  udp_mmsg_t in_msgs[UDP_BATCH];
+  struct iovec in_iov[UDP_BATCH];
+  struct sockaddr_storage in_addrs[UDP_BATCH];
+  uint8_t in_data[UDP_BATCH][UDP_PACKET_MAX];
+
+  struct evbuffer *frame;   // body of the message being handled
+  struct evbuffer *marshal; // body of the message being sent
+
+  int has_rendezvous;
+  struct AddressPacked rendezvous_key;
+  struct sockaddr_storage rendezvous;
+  socklen_t rendezvous_len;
+  struct event *register_timer;
+  int has_public;
+  struct AddressPacked public_key; // where the rendezvous server sees us
+
+  int filter;
+  int loss_percent;
+};
+
+/********************
+ Helpers
+********************/
+static uint64_t udp_now_us(void) {
+  struct timespec ts = {0};
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t US_PER_S = 1000000;
+  const uint64_t NS_PER_US = 1000;
+  return (uint64_t)ts.tv_sec * US_PER_S + (uint64_t)ts.tv_nsec / NS_PER_US;
+}
+
+static void udp_put_u16(uint8_t *out, uint16_t value) {
+  out[0] = (uint8_t)(value >> 8U);
+  out[1] = (uint8_t)value;
+}
+
+static uint16_t udp_get_u16(const uint8_t *in) {
+  return (uint16_t)((unsigned)in[0] << 8U | in[1]);
+}
+
+static void udp_put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)(value >> 24U);
+  out[1] = (uint8_t)(value >> 16U);
+  out[2] = (uint8_t)(value >> 8U);
+  out[3] = (uint8_t)value;
+}
+
+static uint32_t udp_get_u32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24U | (uint32_t)in[1] << 16U |
+         (uint32_t)in[2] << 8U | (uint32_t)in[3];
+}
+
+static void udp_put_u64(uint8_t *out, uint64_t value) {
+  udp_put_u32(out, (uint32_t)(value >> 32U));
+  udp_put_u32(out + 4, (uint32_t)value);
+}
+
+static uint64_t udp_get_u64(const uint8_t *in) {
+  return (uint64_t)udp_get_u32(in) << 32U | udp_get_u32(in + 4);
+}
+
+static uint32_t udp_fragment_length(uint32_t length, uint16_t fragment) {
+  uint32_t rest = length - (uint32_t)fragment * UDP_FRAGMENT;
+  return rest < UDP_FRAGMENT ? rest : UDP_FRAGMENT;
+}
+
+// Conns are keyed by addresses the way peers give them to each other: IPv4 as
+// IPv4, and the unspecified address as loopback, which is where sending to it
+// ends up anyway
+static int udp_key(const struct sockaddr_storage *addr, socklen_t addrlen,
+                   struct AddressPacked *key) {
+  struct sockaddr_storage copy = {0};
+  if (addrlen > sizeof(copy))
+    return -1;
+  memcpy(&copy, addr, addrlen);
+  address_unmap(&copy, &addrlen);
+  if (copy.ss_family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&copy;
+    if (sin->sin_addr.s_addr == htonl(INADDR_ANY))
+      sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  } else if (copy.ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&copy;
+    if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr))
+      sin6->sin6_addr = in6addr_loopback;
+  }
+  return address_pack(&copy, key);
+}
+
+// key as the socket takes it
+static socklen_t udp_sockaddr(const struct UdpCtx *ctx,
+                              const struct AddressPacked *key,
+                              struct sockaddr_storage *addr) {
+  socklen_t addrlen = address_unpack(key, addr);
+  if (ctx->family == AF_INET6)
+    address_map(addr, &addrlen);
+  return addrlen;
+}
+
+static const char *udp_format(const struct AddressPacked *key, char *buf,
+                              size_t len) {
+  struct sockaddr_storage addr = {0};
+  (void)address_unpack(key, &addr);
+  if (address_format((struct sockaddr *)&addr, buf, len) == -1)
+    return "?";
+  return buf;
+}
+
+/********************
+ Socket
+********************/
+#ifdef P2PCHAT_HAVE_MMSG
+static int udp_sendmmsg(evutil_socket_t fd, udp_mmsg_t *msgs, unsigned count) {
+  return sendmmsg(fd, msgs, count, 0);
+}
+
+static int udp_recvmmsg(evutil_socket_t fd, udp_mmsg_t *msgs, unsigned count) {
+  return recvmmsg(fd, msgs, count, MSG_DONTWAIT, 0);
+}
+#else
+// One datagram at a time where there is no sendmmsg or recvmmsg
+static int udp_sendmmsg(evutil_socket_t fd, udp_mmsg_t *msgs, unsigned count) {
+  (void)count;
+  ssize_t sent = sendmsg(fd, &msgs->msg_hdr, 0);
+  if (sent == -1)
+    return -1;
+  msgs->msg_len = (unsigned)sent;
+  return 1;
+}
+
+static int udp_recvmmsg(evutil_socket_t fd, udp_mmsg_t *msgs, unsigned count) {
+  (void)count;
+  ssize_t received = recvmsg(fd, &msgs->msg_hdr, MSG_DONTWAIT);
+  if (received == -1)
+    return -1;
+  msgs->msg_len = (unsigned)received;
+  return 1;
+}
+#endif
+
+// 0 once everything queued has gone, -1 if the socket is full
+static int udp_send_batch(struct UdpCtx *ctx) {
+  while (ctx->out_sent < ctx->out_count) {
+    int sent = udp_sendmmsg(ctx->fd, ctx->out_msgs + ctx->out_sent,
+                            ctx->out_count - ctx->out_sent);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return -1;
+      // The first one failed, the rest may still go. It is lost like any
+      // other datagram.
+      LOG_DEBUG("Could not send datagram: %s", strerror(errno));
+      sent = 1;
+    }
+    ctx->out_sent += sent;
+  }
+  ctx->out_count = 0;
+  ctx->out_sent = 0;
+  return 0;
+}
+
+// Room for a datagram to addr, which goes out at the end of this pass of the
+// event loop once udp_datagram_end says how long it is. NULL if the socket is
+// full.
+static uint8_t *udp_datagram_begin(struct UdpCtx *ctx,
+                                   const struct sockaddr_storage *addr,
+                                   socklen_t addrlen) {
+  if (ctx->out_count == UDP_BATCH && udp_send_batch(ctx) == -1)
+    return 0;
+  memcpy(&ctx->out_addrs[ctx->out_count], addr, addrlen);
+  ctx->out_msgs[ctx->out_count].msg_hdr.msg_namelen = addrlen;
+  return ctx->out_data[ctx->out_count];
+}
+
+static void udp_datagram_end(struct UdpCtx *ctx, size_t length) {
+  ctx->out_iov[ctx->out_count].iov_len = length;
+  if (ctx->out_count == 0)
+    event_active(ctx->flush, 0, 0);
+  ctx->out_count += 1;
+}
+
+/********************
+ Conns
+********************/
+static size_t udp_hash(const struct AddressPacked *key) {
+  return hash_fnv1a(key, sizeof(*key));
+}
+
+static struct UdpConn *udp_conn_find(struct UdpCtx *ctx,
+                                     const struct AddressPacked *key) {
+  struct UdpConn *conn = ctx->buckets[udp_hash(key) & (ctx->num_buckets - 1)];
+  while (conn && memcmp(&conn->key, key, sizeof(*key)) != 0)
+    conn = conn->bucket_next;
+  return conn;
+}
+
+static void udp_conn_timer_cb(evutil_socket_t fd, short flags, void *arg);
+
+static struct UdpConn *udp_conn_get(struct UdpCtx *ctx,
+                                    const struct AddressPacked *key) {
+  struct UdpConn *conn = udp_conn_find(ctx, key);
+  if (conn)
+    return conn;
+
+  if (ctx->num_conns == ctx->num_buckets) {
+    size_t num_buckets = ctx->num_buckets * 2;
+    struct UdpConn **buckets = calloc(num_buckets, sizeof(struct UdpConn *));
+    if (!buckets)
+      return 0;
+    for (size_t ii = 0; ii < ctx->num_buckets; ++ii) {
+      while (ctx->buckets[ii]) {
+        struct UdpConn *moved = ctx->buckets[ii];
+        ctx->buckets[ii] = moved->bucket_next;
+        size_t bucket = udp_hash(&moved->key) & (num_buckets - 1);
+        moved->bucket_next = buckets[bucket];
+        buckets[bucket] = moved;
+      }
+    }
+    free(ctx->buckets);
+    ctx->buckets = buckets;
+    ctx->num_buckets = num_buckets;
+  }
+
+  conn = calloc(1, sizeof(struct UdpConn));
+  if (!conn)
+    return 0;
+  conn->timer = event_new(ctx->base, -1, 0, udp_conn_timer_cb, conn);
+  if (!conn->timer) {
+    free(conn);
+    return 0;
+  }
+  conn->ctx = ctx;
+  conn->key = *key;
+  conn->addrlen = udp_sockaddr(ctx, key, &conn->addr);
+  conn->active_us = udp_now_us();
+  conn->cwnd = UDP_INITIAL_WINDOW;
+  conn->ssthresh = SIZE_MAX;
+  conn->srtt_us = UDP_INITIAL_RTT_US;
+  conn->rttvar_us = UDP_INITIAL_RTT_US / 2;
+
+  size_t bucket = udp_hash(key) & (ctx->num_buckets - 1);
+  conn->bucket_next = ctx->buckets[bucket];
+  ctx->buckets[bucket] = conn;
+  ctx->num_conns += 1;
+  return conn;
+}
+
+static void udp_conn_clear_out(struct UdpConn *conn) {
+  for (unsigned ii = 0; ii < UDP_WINDOW; ++ii) {
+    free(conn->out[ii]);
+    conn->out[ii] = 0;
+  }
+  while (conn->waiting_head) {
+    struct UdpOut *next = conn->waiting_head->next;
+    free(conn->waiting_head);
+    conn->waiting_head = next;
+  }
+  conn->waiting_tail = 0;
+  conn->out_base = conn->out_next;
+}
+
+static void udp_conn_clear_in(struct UdpConn *conn) {
+  for (unsigned ii = 0; ii < UDP_WINDOW; ++ii) {
+    free(conn->in[ii]);
+    conn->in[ii] = 0;
+  }
+  conn->in_done = 0;
+  conn->any_received = 0;
+  conn->received = 0;
+  conn->ack_due = 0;
+}
+
+// Without callbacks, for requests that nobody is waiting for any more
+static void udp_conn_free(struct UdpConn *conn) {
+  struct UdpCtx *ctx = conn->ctx;
+  struct UdpConn **bucket = &ctx->buckets[udp_hash(&conn->key) &
+                                          (ctx->num_buckets - 1)];
+  while (*bucket != conn)
+    bucket = &(*bucket)->bucket_next;
+  *bucket = conn->bucket_next;
+  ctx->num_conns -= 1;
+  if (conn->dirty) {
+    struct UdpConn **dirty = &ctx->dirty;
+    while (*dirty != conn)
+      dirty = &(*dirty)->dirty_next;
+    *dirty = conn->dirty_next;
+  }
+
+  event_free(conn->timer);
+  udp_conn_clear_out(conn);
+  udp_conn_clear_in(conn);
+  free(conn->sent);
+  while (conn->pending_head) {
+    struct UdpPending *next = conn->pending_head->next;
+    free(conn->pending_head);
+    conn->pending_head = next;
+  }
+  free(conn);
+}
+
+// Something may be ready to go, which udp_flush finds out at the end of this
+// pass of the event loop
+static void udp_conn_wake(struct UdpConn *conn) {
+  struct UdpCtx *ctx = conn->ctx;
+  if (!conn->dirty) {
+    conn->dirty = 1;
+    conn->dirty_next = ctx->dirty;
+    ctx->dirty = conn;
+  }
+  event_active(ctx->flush, 0, 0);
+}
+
+static struct UdpOut *udp_out_find(struct UdpConn *conn, uint32_t id) {
+  struct UdpOut *out = conn->out[id & (UDP_WINDOW - 1U)];
+  return out && out->id == id ? out : 0;
+}
+
+// Lets waiting messages into the window, numbering them
+static void udp_conn_admit(struct UdpConn *conn) {
+  while (conn->out_base != conn->out_next &&
+         !conn->out[conn->out_base & (UDP_WINDOW - 1U)])
+    conn->out_base += 1;
+  while (conn->waiting_head && conn->out_next - conn->out_base < UDP_WINDOW) {
+    struct UdpOut *out = conn->waiting_head;
+    conn->waiting_head = out->next;
+    if (!conn->waiting_head)
+      conn->waiting_tail = 0;
+    out->next = 0;
+    out->id = conn->out_next++;
+    conn->out[out->id & (UDP_WINDOW - 1U)] = out;
+  }
+}
+
+static struct UdpSent *udp_sent_find(struct UdpConn *conn, uint32_t number) {
+  if (number - conn->sent_base >= conn->next_number - conn->sent_base)
+    return 0;
+  struct UdpSent *sent = &conn->sent[number & (conn->sent_capacity - 1)];
+  return sent->outstanding && sent->number == number ? sent : 0;
+}
+
+// Room to remember the next packet
+static int udp_sent_reserve(struct UdpConn *conn) {
+  if (conn->sent && conn->next_number - conn->sent_base < conn->sent_capacity)
+    return 0;
+  uint32_t capacity = conn->sent ? conn->sent_capacity * 2 : UDP_SENT_MIN;
+  struct UdpSent *sent = calloc(capacity, sizeof(struct UdpSent));
+  if (!sent)
+    return -1;
+  for (uint32_t number = conn->sent_base; number != conn->next_number;
+       ++number)
+    sent[number & (capacity - 1)] =
+        conn->sent[number & (conn->sent_capacity - 1)];
+  free(conn->sent);
+  conn->sent = sent;
+  conn->sent_capacity = capacity;
+  return 0;
+}
+
+static void udp_sent_trim(struct UdpConn *conn) {
+  while (conn->sent_base != conn->next_number &&
+         !udp_sent_find(conn, conn->sent_base))
+    conn->sent_base += 1;
+}
+
+/********************
+ Recovery
+********************/
+static void udp_conn_rtt(struct UdpConn *conn, uint64_t sample) {
+  conn->latest_rtt_us = sample;
+  if (!conn->rtt_sampled) {
+    conn->rtt_sampled = 1;
+    conn->srtt_us = sample;
+    conn->rttvar_us = sample / 2;
+    return;
+  }
+  uint64_t diff =
+      conn->srtt_us > sample ? conn->srtt_us - sample : sample - conn->srtt_us;
+  conn->rttvar_us = (3 * conn->rttvar_us + diff) / 4;
+  conn->srtt_us = (7 * conn->srtt_us + sample) / 8;
+}
+
+static uint64_t udp_conn_pto(const struct UdpConn *conn) {
+  uint64_t variance = 4 * conn->rttvar_us;
+  if (variance < UDP_GRANULARITY_US)
+    variance = UDP_GRANULARITY_US;
+  uint64_t pto = conn->srtt_us + variance;
+  for (int ii = 0; ii < conn->probes && pto < UDP_MAX_PTO_US; ++ii)
+    pto *= 2;
+  return pto < UDP_MAX_PTO_US ? pto : UDP_MAX_PTO_US;
+}
+
+static void udp_sent_acked(struct UdpConn *conn, struct UdpSent *sent) {
+  sent->outstanding = 0;
+  // Only a window in use grows
+  int limited = conn->in_flight * 2 < conn->cwnd;
+  conn->in_flight -= sent->bytes;
+  for (unsigned ii = 0; ii < sent->num_frames; ++ii) {
+    const struct UdpSentFrame *frame = &sent->frames[ii];
+    struct UdpOut *out = udp_out_find(conn, frame->message);
+    if (!out || out->state[frame->fragment] == UDP_ACKED)
+      continue;
+    out->state[frame->fragment] = UDP_ACKED;
+    out->acked += 1;
+    if (out->acked == out->fragments) {
+      conn->out[out->id & (UDP_WINDOW - 1U)] = 0;
+      free(out);
+    }
+  }
+
+  if (sent->sent_us <= conn->recovery_us || limited)
+    return;
+  if (conn->cwnd < conn->ssthresh)
+    conn->cwnd += sent->bytes;
+  else
+    conn->cwnd += (size_t)UDP_PACKET_MAX * sent->bytes / conn->cwnd;
+}
+
+static void udp_sent_lost(struct UdpConn *conn, struct UdpSent *sent,
+                          uint64_t now) {
+  sent->outstanding = 0;
+  conn->in_flight -= sent->bytes;
+  for (unsigned ii = 0; ii < sent->num_frames; ++ii) {
+    const struct UdpSentFrame *frame = &sent->frames[ii];
+    struct UdpOut *out = udp_out_find(conn, frame->message);
+    if (!out || out->state[frame->fragment] != UDP_IN_FLIGHT)
+      continue;
+    out->state[frame->fragment] = UDP_UNSENT;
+    if (frame->fragment < out->unsent)
+      out->unsent = frame->fragment;
+  }
+
+  // Once per round trip, however many went
+  if (sent->sent_us <= conn->recovery_us)
+    return;
+  conn->recovery_us = now;
+  conn->ssthresh =
+      conn->cwnd / 2 > UDP_MIN_WINDOW ? conn->cwnd / 2 : UDP_MIN_WINDOW;
+  conn->cwnd = conn->ssthresh;
+}
+
+// Declares lost what is overdue and notes when the rest will be. Returns
+// how many went.
+static int udp_conn_detect_loss(struct UdpConn *conn, uint64_t now) {
+  conn->loss_us = 0;
+  if (!conn->any_acked)
+    return 0;
+  uint64_t rtt = conn->srtt_us > conn->latest_rtt_us ? conn->srtt_us
+                                                      : conn->latest_rtt_us;
+  uint64_t delay = rtt + rtt / 8;
+  if (delay < UDP_GRANULARITY_US)
+    delay = UDP_GRANULARITY_US;
+
+  int lost = 0;
+  for (uint32_t number = conn->sent_base;
+       number != conn->next_number && number < conn->largest_acked;
+       ++number) {
+    struct UdpSent *sent = udp_sent_find(conn, number);
+    if (!sent)
+      continue;
+    if (conn->largest_acked - number >= UDP_REORDER ||
+        sent->sent_us + delay <= now) {
+      udp_sent_lost(conn, sent, now);
+      lost += 1;
+    } else if (!conn->loss_us || sent->sent_us + delay < conn->loss_us) {
+      conn->loss_us = sent->sent_us + delay;
+    }
+  }
+  udp_sent_trim(conn);
+  return lost;
+}
+
+static void udp_conn_acked(struct UdpConn *conn, uint32_t largest,
+                           uint64_t bitmap, uint64_t now) {
+  if (largest - conn->sent_base >= conn->next_number - conn->sent_base)
+    return; // nothing outstanding, or not a packet we sent
+  int newly = 0;
+  struct UdpSent *sent = udp_sent_find(conn, largest);
+  if (sent) {
+    udp_conn_rtt(conn, now - sent->sent_us);
+    udp_sent_acked(conn, sent);
+    newly = 1;
+  }
+  const unsigned BITS = 64;
+  for (unsigned ii = 0; ii < BITS && ii < largest; ++ii) {
+    if (!(bitmap >> ii & 1U))
+      continue;
+    sent = udp_sent_find(conn, largest - 1 - ii);
+    if (sent) {
+      udp_sent_acked(conn, sent);
+      newly = 1;
+    }
+  }
+  if (!conn->any_acked || largest > conn->largest_acked) {
+    conn->any_acked = 1;
+    conn->largest_acked = largest;
+  }
+  if (newly) {
+    conn->probes = 0;
+    conn->progress_us = now;
+  }
+  (void)udp_conn_detect_loss(conn, now);
+  udp_conn_admit(conn);
+}
+
+static void udp_conn_introduce(struct UdpConn *conn) {
+  struct UdpCtx *ctx = conn->ctx;
+  if (!ctx->has_rendezvous || conn->heard)
+    return;
+  uint8_t *datagram =
+      udp_datagram_begin(ctx, &ctx->rendezvous, ctx->rendezvous_len);
+  if (!datagram)
+    return;
+  struct sockaddr_storage target = {0};
+  (void)address_unpack(&conn->key, &target);
+  int length = rendezvous_encode(datagram, RENDEZVOUS_INTRODUCE, &target);
+  if (length == -1)
+    return;
+  udp_datagram_end(ctx, length);
+  conn->introduced = 1;
+  char buf[ADDRESS_MAX_LEN];
+  LOG_DEBUG("Asking to be introduced to %s",
+            udp_format(&conn->key, buf, sizeof(buf)));
+}
+
+// Sends the oldest outstanding data again, or a ping if there is none,
+// whatever the window
+static void udp_conn_probe(struct UdpConn *conn) {
+  int resending = 0;
+  udp_sent_trim(conn);
+  struct UdpSent *sent = udp_sent_find(conn, conn->sent_base);
+  for (unsigned ii = 0; sent && ii < sent->num_frames; ++ii) {
+    const struct UdpSentFrame *frame = &sent->frames[ii];
+    struct UdpOut *out = udp_out_find(conn, frame->message);
+    if (!out || out->state[frame->fragment] != UDP_IN_FLIGHT)
+      continue;
+    out->state[frame->fragment] = UDP_UNSENT;
+    if (frame->fragment < out->unsent)
+      out->unsent = frame->fragment;
+    resending = 1;
+  }
+  if (!resending)
+    conn->ping_due = 1;
+  conn->probes_due = 2;
+  udp_conn_introduce(conn);
+  udp_conn_wake(conn);
+}
+
+// Forgets everything on its way out and fails the requests waiting for
+// replies
+static void udp_conn_fail(struct UdpConn *conn, int error) {
+  struct UdpPending *pending = conn->pending_head;
+  conn->pending_head = 0;
+  conn->pending_tail = 0;
+
+  udp_conn_clear_out(conn);
+  conn->sent_base = conn->next_number;
+  conn->in_flight = 0;
+  conn->any_acked = 0;
+  conn->loss_us = 0;
+  conn->probes = 0;
+  conn->probes_due = 0;
+  conn->ping_due = 0;
+  conn->cwnd = UDP_INITIAL_WINDOW;
+  conn->ssthresh = SIZE_MAX;
+  conn->recovery_us = 0;
+  conn->introduced = 0;
+
+  // Callbacks may send more, which starts afresh
+  while (pending) {
+    struct UdpPending *next = pending->next;
+    struct evrpc_status status = {0};
+    status.error = error;
+    pending->callback(&status, pending->request, pending->reply,
+                      pending->cbarg);
+    free(pending);
+    pending = next;
+  }
+}
+
+static int udp_conn_idle(const struct UdpConn *conn) {
+  return !conn->links && !conn->pending_head && !conn->in_flight &&
+         conn->out_base == conn->out_next && !conn->waiting_head;
+}
+
+static void udp_conn_arm(struct UdpConn *conn, uint64_t now) {
+  uint64_t deadline = 0;
+  if (conn->in_flight) {
+    deadline = conn->eliciting_us + udp_conn_pto(conn);
+    if (conn->loss_us && conn->loss_us < deadline)
+      deadline = conn->loss_us;
+  } else if (conn->pending_head) {
+    deadline = conn->active_us + UDP_KEEPALIVE_US;
+  } else if (udp_conn_idle(conn)) {
+    deadline = conn->active_us + UDP_IDLE_US;
+  }
+
+  if (deadline == conn->deadline_us)
+    return;
+  conn->deadline_us = deadline;
+  if (!deadline) {
+    (void)evtimer_del(conn->timer);
+    return;
+  }
+  const uint64_t US_PER_S = 1000000;
+  uint64_t wait = deadline > now ? deadline - now : 0;
+  struct timeval tv = {(time_t)(wait / US_PER_S),
+                       (suseconds_t)(wait % US_PER_S)};
+  (void)evtimer_add(conn->timer, &tv);
+}
+
+static void udp_conn_timer_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  struct UdpConn *conn = CAST(struct UdpConn *, arg);
+  uint64_t now = udp_now_us();
+  conn->deadline_us = 0;
+  char buf[ADDRESS_MAX_LEN];
+
+  if ((conn->in_flight || conn->pending_head) &&
+      now - conn->progress_us >= UDP_TIMEOUT_US) {
+    LOG_DEBUG("No answer from %s", udp_format(&conn->key, buf, sizeof(buf)));
+    udp_conn_fail(conn, conn->heard ? EVRPC_STATUS_ERR_TIMEOUT
+                                    : EVRPC_STATUS_ERR_UNSTARTED);
+  } else if (conn->in_flight) {
+    if (!udp_conn_detect_loss(conn, now) &&
+        now >= conn->eliciting_us + udp_conn_pto(conn)) {
+      conn->probes += 1;
+      udp_conn_probe(conn);
+    } else {
+      udp_conn_wake(conn);
+    }
+  } else if (conn->pending_head) {
+    // Replies may never come from a peer that went away
+    conn->ping_due = 1;
+    udp_conn_wake(conn);
+  } else if (udp_conn_idle(conn) && now >= conn->active_us + UDP_IDLE_US) {
+    udp_conn_free(conn);
+    return;
+  }
+  udp_conn_arm(conn, now);
+}
+
+/********************
+ Sending
+********************/
+// Adds the fragments that are due, oldest first, as long as they fit
+static size_t udp_conn_fill(struct UdpConn *conn, uint8_t *packet,
+                            size_t length, struct UdpSent *sent) {
+  for (uint32_t id = conn->out_base; id != conn->out_next; ++id) {
+    struct UdpOut *out = udp_out_find(conn, id);
+    if (!out)
+      continue;
+    while (out->unsent < out->fragments &&
+           out->state[out->unsent] != UDP_UNSENT)
+      out->unsent += 1;
+    for (uint16_t ff = out->unsent; ff < out->fragments; ++ff) {
+      if (out->state[ff] != UDP_UNSENT)
+        continue;
+      uint32_t bytes = udp_fragment_length(out->length, ff);
+      if (sent->num_frames == UDP_FRAMES_MAX ||
+          length + UDP_DATA_HEADER_SIZE + bytes > UDP_PACKET_MAX)
+        return length;
+      uint8_t *frame = packet + length;
+      frame[0] = UDP_FRAME_DATA;
+      udp_put_u32(frame + 1, id);
+      udp_put_u32(frame + 5, out->length);
+      udp_put_u16(frame + 9, ff);
+      memcpy(frame + UDP_DATA_HEADER_SIZE,
+             out->data + (size_t)ff * UDP_FRAGMENT, bytes);
+      length += UDP_DATA_HEADER_SIZE + bytes;
+      out->state[ff] = UDP_IN_FLIGHT;
+      sent->frames[sent->num_frames].message = id;
+      sent->frames[sent->num_frames].fragment = ff;
+      sent->num_frames += 1;
+    }
+  }
+  return length;
+}
+
+static int udp_conn_unsent(struct UdpConn *conn) {
+  for (uint32_t id = conn->out_base; id != conn->out_next; ++id) {
+    struct UdpOut *out = udp_out_find(conn, id);
+    if (!out)
+      continue;
+    while (out->unsent < out->fragments &&
+           out->state[out->unsent] != UDP_UNSENT)
+      out->unsent += 1;
+    if (out->unsent < out->fragments)
+      return 1;
+  }
+  return 0;
+}
+
+// Packets for whatever is due, as the window allows. -1 if the socket is full.
+static int udp_conn_send(struct UdpConn *conn, uint64_t now) {
+  struct UdpCtx *ctx = conn->ctx;
+  udp_conn_admit(conn);
+  for (;;) {
+    int data = conn->probes_due > 0 ||
+               conn->in_flight + UDP_PACKET_MAX <= conn->cwnd;
+    if (!conn->ack_due && !conn->ping_due && !(data && udp_conn_unsent(conn)))
+      break;
+    if (udp_sent_reserve(conn) == -1)
+      break;
+    uint8_t *packet = udp_datagram_begin(ctx, &conn->addr, conn->addrlen);
+    if (!packet)
+      return -1;
+
+    uint32_t number = conn->next_number;
+    struct UdpSent *sent = &conn->sent[number & (conn->sent_capacity - 1)];
+    sent->outstanding = 0;
+    sent->num_frames = 0;
+    packet[0] = UDP_PACKET;
+    udp_put_u32(packet + 1, ctx->session);
+    udp_put_u32(packet + 5, number);
+    udp_put_u32(packet + 9, conn->out_base);
+    size_t length = UDP_HEADER_SIZE;
+    if (conn->ack_due) {
+      packet[length] = UDP_FRAME_ACK;
+      udp_put_u32(packet + length + 1, conn->largest_received);
+      udp_put_u64(packet + length + 5, conn->received);
+      length += UDP_ACK_SIZE;
+      conn->ack_due = 0;
+    }
+    if (data)
+      length = udp_conn_fill(conn, packet, length, sent);
+    int eliciting = sent->num_frames > 0;
+    if (!eliciting && conn->ping_due) {
+      packet[length++] = UDP_FRAME_PING;
+      eliciting = 1;
+    }
+    conn->ping_due = 0;
+    udp_datagram_end(ctx, length);
+    conn->next_number += 1;
+    conn->sent_to = 1;
+    conn->active_us = now;
+
+    if (eliciting) {
+      if (!conn->in_flight)
+        conn->progress_us = now;
+      sent->outstanding = 1;
+      sent->number = number;
+      sent->sent_us = now;
+      sent->bytes = (uint16_t)length;
+      conn->in_flight += length;
+      conn->eliciting_us = now;
+      if (conn->probes_due > 0)
+        conn->probes_due -= 1;
+    }
+  }
+  conn->probes_due = 0;
+  udp_sent_trim(conn);
+  udp_conn_arm(conn, now);
+  return 0;
+}
+
+static void udp_flush(struct UdpCtx *ctx) {
+  if (udp_send_batch(ctx) == -1) {
+    (void)event_add(ctx->writable, 0);
+    return;
+  }
+  uint64_t now = udp_now_us();
+  while (ctx->dirty) {
+    struct UdpConn *conn = ctx->dirty;
+    ctx->dirty = conn->dirty_next;
+    conn->dirty = 0;
+    conn->dirty_next = 0;
+    if (udp_conn_send(conn, now) == -1) {
+      // Back where it was, for when the socket has room
+      conn->dirty = 1;
+      conn->dirty_next = ctx->dirty;
+      ctx->dirty = conn;
+      break;
+    }
+  }
+  if (udp_send_batch(ctx) == -1)
+    (void)event_add(ctx->writable, 0);
+}
+
+static void udp_flush_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  udp_flush(CAST(struct UdpCtx *, arg));
+}
+
+// The message in ctx->marshal, waiting for room in the window
+static int udp_conn_queue(struct UdpConn *conn, enum UdpMessageKind kind,
+                          enum RpcType type, int status, uint32_t id) {
+  struct evbuffer *marshal = conn->ctx->marshal;
+  size_t body = evbuffer_get_length(marshal);
+  if (body > RPC_MAX_BODY_SIZE) {
+    LOG_ERROR("Not sending %s of %zu bytes", rpc_info(type)->name, body);
+    goto failure;
+  }
+  uint32_t length = UDP_MESSAGE_HEADER_SIZE + (uint32_t)body;
+  uint16_t fragments = (uint16_t)((length + UDP_FRAGMENT - 1) / UDP_FRAGMENT);
+  struct UdpOut *out = malloc(sizeof(struct UdpOut) + length + fragments);
+  if (!out)
+    goto failure;
+  memset(out, 0, sizeof(*out));
+  out->length = length;
+  out->fragments = fragments;
+  out->state = out->data + length;
+  memset(out->state, UDP_UNSENT, fragments);
+  out->data[0] = (uint8_t)kind;
+  out->data[1] = (uint8_t)type;
+  out->data[2] = (uint8_t)status;
+  out->data[3] = 0;
+  udp_put_u32(out->data + 4, id);
+  (void)evbuffer_remove(marshal, out->data + UDP_MESSAGE_HEADER_SIZE, body);
+
+  if (conn->waiting_tail)
+    conn->waiting_tail->next = out;
+  else
+    conn->waiting_head = out;
+  conn->waiting_tail = out;
+  udp_conn_admit(conn);
+  udp_conn_wake(conn);
+  return 0;
+
+failure:
+  (void)evbuffer_drain(marshal, evbuffer_get_length(marshal));
+  return -1;
+}
+
+static void udp_punch(struct UdpConn *conn) {
+  uint8_t *datagram =
+      udp_datagram_begin(conn->ctx, &conn->addr, conn->addrlen);
+  if (!datagram)
+    return;
+  datagram[0] = UDP_PUNCH;
+  udp_put_u32(datagram + 1, conn->ctx->session);
+  udp_datagram_end(conn->ctx, 1 + 4);
+  conn->sent_to = 1;
+  conn->active_us = udp_now_us();
+}
+
+/********************
+ Server
+********************/
+static void udp_serve(struct UdpConn *conn, enum RpcType type, uint32_t id) {
+  struct UdpCtx *ctx = conn->ctx;
+  struct UdpServer *server = ctx->server;
+  const struct RpcInfo *info = rpc_info(type);
+  int status = EVRPC_STATUS_ERR_NONE;
+
+  void *request = 0;
+  void *reply = 0;
+  if (!server) {
+    status = EVRPC_STATUS_ERR_UNSTARTED;
+  } else if (server->admit &&
+             !server->admit(type, (struct sockaddr *)&conn->addr,
+                            conn->addrlen, server->dispatch_arg)) {
+    status = EVRPC_STATUS_ERR_HOOKABORTED;
+  } else if (!(request = info->request_new(NULL)) ||
+             !(reply = info->reply_new(NULL)) ||
+             info->request_unmarshal(request, ctx->frame) == -1) {
+    LOG_DEBUG("Bad %s request", info->name);
+    status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  } else {
+    server->dispatch(type, request, reply, server->dispatch_arg);
+    if (info->reply_complete(reply) == -1)
+      status = EVRPC_STATUS_ERR_BADPAYLOAD;
+    else
+      info->reply_marshal(ctx->marshal, reply);
+  }
+  if (request)
+    info->request_free(request);
+  if (reply)
+    info->reply_free(reply);
+
+  if (udp_conn_queue(conn, UDP_REPLY, type, status, id) == -1)
+    LOG_ERROR("Could not send %s reply", info->name);
+}
+
+static void udp_close(void *arg) {
+  struct UdpServer *server = CAST(struct UdpServer *, arg);
+  server->ctx->server = 0;
+  (void)evtimer_del(server->ctx->register_timer);
+  free(server);
+}
+
+/********************
+ Client
+********************/
+static void udp_answer(struct UdpConn *conn, enum RpcType type, int status,
+                       uint32_t id) {
+  struct UdpCtx *ctx = conn->ctx;
+  struct UdpPending *before = 0;
+  struct UdpPending *pending = conn->pending_head;
+  while (pending && pending->id != id) {
+    before = pending;
+    pending = pending->next;
+  }
+  if (!pending) {
+    LOG_DEBUG("Reply to unknown request %u", id);
+    return;
+  }
+  if (before)
+    before->next = pending->next;
+  else
+    conn->pending_head = pending->next;
+  if (conn->pending_tail == pending)
+    conn->pending_tail = before;
+
+  const struct RpcInfo *info = rpc_info(pending->type);
+  if (pending->type != type)
+    status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  if (status == EVRPC_STATUS_ERR_NONE) {
+    info->reply_clear(pending->reply);
+    if (info->reply_unmarshal(pending->reply, ctx->frame) == -1)
+      status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  }
+
+  struct evrpc_status evrpc_status = {0};
+  evrpc_status.error = status;
+  pending->callback(&evrpc_status, pending->request, pending->reply,
+                    pending->cbarg);
+  free(pending);
+}
+
+static void udp_link_free(void *arg) {
+  struct UdpLink *link = CAST(struct UdpLink *, arg);
+  struct UdpConn *conn = link->conn;
+  struct UdpPending *failed = 0;
+  struct UdpPending **failed_tail = &failed;
+  struct UdpPending **pending = &conn->pending_head;
+  conn->pending_tail = 0;
+  while (*pending) {
+    if ((*pending)->link == link) {
+      *failed_tail = *pending;
+      failed_tail = &(*pending)->next;
+      *pending = (*pending)->next;
+      *failed_tail = 0;
+    } else {
+      conn->pending_tail = *pending;
+      pending = &(*pending)->next;
+    }
+  }
+  conn->links -= 1;
+  udp_conn_arm(conn, udp_now_us());
+  free(link);
+
+  // Requests still waiting fail, once the link is gone so that callbacks
+  // sending more can't reach it
+  while (failed) {
+    struct UdpPending *next = failed->next;
+    struct evrpc_status status = {0};
+    status.error = EVRPC_STATUS_ERR_UNSTARTED;
+    failed->callback(&status, failed->request, failed->reply, failed->cbarg);
+    free(failed);
+    failed = next;
+  }
+}
+
+static void *udp_link_new(void *arg, struct event_base *base,
+                          const struct sockaddr *addr, socklen_t addrlen) {
+  (void)base;
+  struct UdpCtx *ctx = CAST(struct UdpCtx *, arg);
+  struct AddressPacked key;
+  if (!ctx ||
+      udp_key((const struct sockaddr_storage *)addr, addrlen, &key) == -1)
+    return 0;
+  struct UdpLink *link = calloc(1, sizeof(struct UdpLink));
+  if (!link)
+    return 0;
+  link->ctx = ctx;
+  link->conn = udp_conn_get(ctx, &key);
+  if (!link->conn) {
+    free(link);
+    return 0;
+  }
+  link->conn->links += 1;
+  udp_conn_arm(link->conn, udp_now_us());
+  return link;
+}
+
+static int udp_request(void *arg, enum RpcType type, void *request,
+                       void *reply, transport_cb_t callback, void *cbarg) {
+  struct UdpLink *link = CAST(struct UdpLink *, arg);
+  struct UdpConn *conn = link->conn;
+  const struct RpcInfo *info = rpc_info(type);
+
+  struct UdpPending *pending = calloc(1, sizeof(struct UdpPending));
+  if (!pending)
+    return -1;
+  info->request_marshal(link->ctx->marshal, request);
+  pending->id = conn->next_request++;
+  if (udp_conn_queue(conn, UDP_REQUEST, type, 0, pending->id) == -1) {
+    free(pending);
+    return -1;
+  }
+  pending->link = link;
+  pending->type = type;
+  pending->request = request;
+  pending->reply = reply;
+  pending->callback = callback;
+  pending->cbarg = cbarg;
+  if (conn->pending_tail)
+    conn->pending_tail->next = pending;
+  else
+    conn->pending_head = pending;
+  conn->pending_tail = pending;
+
+  if (!conn->introduced)
+    udp_conn_introduce(conn);
+  return 0;
+}
+
+/********************
+ Receiving
+********************/
+static void udp_conn_deliver(struct UdpConn *conn, const struct UdpIn *in) {
+  struct UdpCtx *ctx = conn->ctx;
+  int kind = in->data[0];
+  int type = in->data[1];
+  int status = in->data[2];
+  uint32_t id = udp_get_u32(in->data + 4);
+  if (type >= RPC_NUM_TYPES || (kind != UDP_REQUEST && kind != UDP_REPLY)) {
+    LOG_DEBUG("Bad message of %u bytes", in->length);
+    return;
+  }
+  if (evbuffer_add(ctx->frame, in->data + UDP_MESSAGE_HEADER_SIZE,
+                   in->length - UDP_MESSAGE_HEADER_SIZE) == -1)
+    return;
+  if (kind == UDP_REQUEST)
+    udp_serve(conn, type, id);
+  else
+    udp_answer(conn, type, status, id);
+  (void)evbuffer_drain(ctx->frame, evbuffer_get_length(ctx->frame));
+}
+
+// Everything before oldest was handed over or given up on by the sender
+static void udp_conn_skip(struct UdpConn *conn, uint32_t oldest) {
+  for (unsigned ii = 0; ii < UDP_WINDOW && conn->in_base != oldest; ++ii) {
+    unsigned slot = conn->in_base & (UDP_WINDOW - 1U);
+    free(conn->in[slot]);
+    conn->in[slot] = 0;
+    conn->in_done &= ~((uint64_t)1 << slot);
+    conn->in_base += 1;
+  }
+  if (conn->in_base != oldest) {
+    udp_conn_clear_in(conn);
+    conn->any_received = 1;
+    conn->in_base = oldest;
+  }
+  while (conn->in_done >> (conn->in_base & (UDP_WINDOW - 1U)) & 1U) {
+    conn->in_done &= ~((uint64_t)1 << (conn->in_base & (UDP_WINDOW - 1U)));
+    conn->in_base += 1;
+  }
+}
+
+static void udp_conn_fragment(struct UdpConn *conn, uint32_t id,
+                              uint32_t length, uint16_t fragment,
+                              const uint8_t *data) {
+  if (id - conn->in_base >= UDP_WINDOW)
+    return; // handed over already, or the sender is ahead of itself
+  unsigned slot = id & (UDP_WINDOW - 1U);
+  if (conn->in_done >> slot & 1U)
+    return;
+  struct UdpIn *in = conn->in[slot];
+  uint16_t fragments = (uint16_t)((length + UDP_FRAGMENT - 1) / UDP_FRAGMENT);
+  if (!in) {
+    in = malloc(sizeof(struct UdpIn) + length + fragments);
+    if (!in)
+      return;
+    in->id = id;
+    in->length = length;
+    in->fragments = fragments;
+    in->received = 0;
+    in->have = in->data + length;
+    memset(in->have, 0, fragments);
+    conn->in[slot] = in;
+  } else if (in->length != length) {
+    return;
+  }
+  if (in->have[fragment])
+    return;
+  memcpy(in->data + (size_t)fragment * UDP_FRAGMENT, data,
+         udp_fragment_length(length, fragment));
+  in->have[fragment] = 1;
+  in->received += 1;
+  if (in->received < in->fragments)
+    return;
+
+  conn->in[slot] = 0;
+  conn->in_done |= (uint64_t)1 << slot;
+  udp_conn_skip(conn, conn->in_base);
+  udp_conn_deliver(conn, in);
+  free(in);
+}
+
+// 1 unless the packet is a repeat
+static int udp_conn_number(struct UdpConn *conn, uint32_t number) {
+  const uint32_t BITS = 64;
+  if (!conn->any_received || number > conn->largest_received) {
+    uint32_t shift = number - conn->largest_received;
+    if (!conn->any_received || shift > BITS)
+      conn->received = 0;
+    else if (shift == BITS)
+      conn->received = (uint64_t)1 << (BITS - 1);
+    else
+      conn->received = conn->received << shift | (uint64_t)1 << (shift - 1);
+    conn->largest_received = number;
+    conn->any_received = 1;
+    return 1;
+  }
+  if (number == conn->largest_received)
+    return 0;
+  uint32_t back = conn->largest_received - 1 - number;
+  if (back >= BITS)
+    return 1; // too old to tell, messages it has are dropped if need be
+  if (conn->received >> back & 1U)
+    return 0;
+  conn->received |= (uint64_t)1 << back;
+  return 1;
+}
+
+static void udp_conn_packet(struct UdpConn *conn, const uint8_t *packet,
+                            size_t length, uint64_t now) {
+  char buf[ADDRESS_MAX_LEN];
+  uint32_t session = udp_get_u32(packet + 1);
+  uint32_t number = udp_get_u32(packet + 5);
+  uint32_t oldest = udp_get_u32(packet + 9);
+
+  if (conn->remote_session && session != conn->remote_session) {
+    LOG_DEBUG("%s started again", udp_format(&conn->key, buf, sizeof(buf)));
+    udp_conn_clear_in(conn);
+    // It knows nothing of what we sent, or replies it owes us
+    udp_conn_fail(conn, EVRPC_STATUS_ERR_TIMEOUT);
+  }
+  conn->remote_session = session;
+  conn->heard = 1;
+  conn->active_us = now;
+  if (!conn->any_received)
+    conn->in_base = oldest;
+  else if (oldest - conn->in_base - 1 < UINT32_MAX / 2)
+    udp_conn_skip(conn, oldest);
+
+  int fresh = udp_conn_number(conn, number);
+  int eliciting = 0;
+  size_t pos = UDP_HEADER_SIZE;
+  while (pos < length) {
+    const uint8_t *frame = packet + pos;
+    if (frame[0] == UDP_FRAME_ACK) {
+      if (pos + UDP_ACK_SIZE > length)
+        goto bad;
+      if (fresh)
+        udp_conn_acked(conn, udp_get_u32(frame + 1), udp_get_u64(frame + 5),
+                       now);
+      pos += UDP_ACK_SIZE;
+    } else if (frame[0] == UDP_FRAME_DATA) {
+      if (pos + UDP_DATA_HEADER_SIZE > length)
+        goto bad;
+      uint32_t id = udp_get_u32(frame + 1);
+      uint32_t total = udp_get_u32(frame + 5);
+      uint16_t fragment = udp_get_u16(frame + 9);
+      if (total < UDP_MESSAGE_HEADER_SIZE || total > UDP_MESSAGE_MAX ||
+          (uint32_t)fragment * UDP_FRAGMENT >= total)
+        goto bad;
+      uint32_t bytes = udp_fragment_length(total, fragment);
+      if (pos + UDP_DATA_HEADER_SIZE + bytes > length)
+        goto bad;
+      if (fresh)
+        udp_conn_fragment(conn, id, total, fragment,
+                          frame + UDP_DATA_HEADER_SIZE);
+      eliciting = 1;
+      pos += UDP_DATA_HEADER_SIZE + bytes;
+    } else if (frame[0] == UDP_FRAME_PING) {
+      eliciting = 1;
+      pos += 1;
+    } else {
+      goto bad;
+    }
+  }
+  goto done;
+
+bad:
+  LOG_DEBUG("Bad packet from %s", udp_format(&conn->key, buf, sizeof(buf)));
+done:
+  // Repeats too, the ack for them may have been lost
+  if (eliciting)
+    conn->ack_due = 1;
+  udp_conn_wake(conn);
+}
+
+static void udp_rendezvous(struct UdpCtx *ctx, const uint8_t *data,
+                           size_t length) {
+  struct sockaddr_storage addr = {0};
+  socklen_t addrlen = 0;
+  struct AddressPacked key;
+  char buf[ADDRESS_MAX_LEN];
+  if (rendezvous_decode_address(data, length, &addr, &addrlen) == -1 ||
+      udp_key(&addr, addrlen, &key) == -1)
+    return;
+
+  if (data[0] == RENDEZVOUS_REGISTERED) {
+    if (ctx->has_public &&
+        memcmp(&ctx->public_key, &key, sizeof(key)) != 0)
+      LOG_WARNING("The rendezvous server sees us at %s now, peers may not "
+                  "reach us at the address we gave them",
+                  udp_format(&key, buf, sizeof(buf)));
+    ctx->public_key = key;
+    ctx->has_public = 1;
+  } else if (data[0] == RENDEZVOUS_PUNCH) {
+    struct UdpConn *conn = udp_conn_get(ctx, &key);
+    if (!conn)
+      return;
+    LOG_DEBUG("Punching through to %s", udp_format(&key, buf, sizeof(buf)));
+    udp_punch(conn);
+    // Whatever we sent before may have hit a closed NAT
+    if (conn->in_flight)
+      udp_conn_probe(conn);
+    udp_conn_arm(conn, udp_now_us());
+  }
+}
+
+static void udp_datagram(struct UdpCtx *ctx,
+                         const struct sockaddr_storage *addr,
+                         socklen_t addrlen, const uint8_t *data,
+                         size_t length, uint64_t now) {
+  const uint32_t PERCENT = 100;
+  if (ctx->loss_percent) {
+    uint32_t roll = 0;
+    evutil_secure_rng_get_bytes(&roll, sizeof(roll));
+    if (roll % PERCENT < (uint32_t)ctx->loss_percent)
+      return;
+  }
+  struct AddressPacked key;
+  if (length < 1 || udp_key(addr, addrlen, &key) == -1)
+    return;
+  if (ctx->has_rendezvous &&
+      memcmp(&key, &ctx->rendezvous_key, sizeof(key)) == 0) {
+    udp_rendezvous(ctx, data, length);
+    return;
+  }
+
+  struct UdpConn *conn = udp_conn_find(ctx, &key);
+  char buf[ADDRESS_MAX_LEN];
+  if (ctx->filter && (!conn || !conn->sent_to)) {
+    LOG_DEBUG("Filtered datagram from %s", udp_format(&key, buf, sizeof(buf)));
+    return;
+  }
+
+  if (data[0] == UDP_PUNCH) {
+    if (!conn || conn->heard)
+      return;
+    LOG_DEBUG("Punched through from %s", udp_format(&key, buf, sizeof(buf)));
+    conn->heard = 1;
+    if (conn->in_flight)
+      udp_conn_probe(conn);
+    udp_conn_arm(conn, now);
+    return;
+  }
+  if (data[0] != UDP_PACKET || length < UDP_HEADER_SIZE)
+    return;
+
+  if (!conn) {
+    conn = udp_conn_get(ctx, &key);
+    if (!conn)
+      return;
+  }
+  udp_conn_packet(conn, data, length, now);
+  udp_conn_arm(conn, now);
+}
+
+// ICMP port unreachable, which is as close as UDP gets to a refused
+// connection
+static void udp_errors(struct UdpCtx *ctx) {
+#if defined(__linux__) && defined(IP_RECVERR)
+  for (;;) {
+    struct sockaddr_storage addr = {0};
+    uint8_t data[UDP_HEADER_SIZE];
+    char control[512];
+    struct iovec iov = {data, sizeof(data)};
+    struct msghdr msg = {0};
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(ctx->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      return;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == IPPROTO_IPV6 &&
+            cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      struct AddressPacked key;
+      if (err.ee_errno != ECONNREFUSED ||
+          udp_key(&addr, msg.msg_namelen, &key) == -1)
+        continue;
+      struct UdpConn *conn = udp_conn_find(ctx, &key);
+      if (!conn || (!conn->in_flight && !conn->pending_head))
+        continue;
+      char buf[ADDRESS_MAX_LEN];
+      LOG_DEBUG("Nobody at %s", udp_format(&key, buf, sizeof(buf)));
+      udp_conn_fail(conn, conn->heard ? EVRPC_STATUS_ERR_TIMEOUT
+                                      : EVRPC_STATUS_ERR_UNSTARTED);
+      udp_conn_arm(conn, udp_now_us());
+    }
+  }
+#else
+  (void)ctx;
+#endif
+}
+
+static void udp_receive(struct UdpCtx *ctx) {
+  for (int round = 0; round < UDP_READS_MAX; ++round) {
+    for (unsigned ii = 0; ii < UDP_BATCH; ++ii)
+      ctx->in_msgs[ii].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    int count = udp_recvmmsg(ctx->fd, ctx->in_msgs, UDP_BATCH);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      // Woken up for nothing to read is an error waiting
+      if (errno != EAGAIN || round == 0)
+        udp_errors(ctx);
+      return;
+    }
+
+    uint64_t now = udp_now_us();
+    for (int ii = 0; ii < count; ++ii) {
+      const struct msghdr *hdr = &ctx->in_msgs[ii].msg_hdr;
+      if (hdr->msg_flags & MSG_TRUNC)
+        continue;
+      udp_datagram(ctx, &ctx->in_addrs[ii], hdr->msg_namelen,
+                   ctx->in_data[ii], ctx->in_msgs[ii].msg_len, now);
+    }
+    if (count < UDP_BATCH)
+      return;
+  }
+}
+
+static void udp_readable_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  udp_receive(CAST(struct UdpCtx *, arg));
+}
+
+/********************
+ Rendezvous
+********************/
+static void udp_register(struct UdpCtx *ctx) {
+  uint8_t *datagram =
+      udp_datagram_begin(ctx, &ctx->rendezvous, ctx->rendezvous_len);
+  if (datagram)
+    udp_datagram_end(ctx,
+                     rendezvous_encode(datagram, RENDEZVOUS_REGISTER, 0));
+}
+
+static void udp_register_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  // Also keeps our NAT open towards the server
+  udp_register(CAST(struct UdpCtx *, arg));
+}
+
+// Registers with the rendezvous server and waits a moment for it to say where
+// it sees us, which is the address to give peers. NULL if it did not say.
+static char *udp_register_wait(struct UdpCtx *ctx) {
+  char buf[ADDRESS_MAX_LEN];
+  for (int ii = 0; ii < UDP_REGISTER_TRIES && !ctx->has_public; ++ii) {
+    udp_register(ctx);
+    if (udp_send_batch(ctx) == -1)
+      continue;
+    uint64_t until = udp_now_us() + UDP_REGISTER_WAIT_US;
+    for (uint64_t now = udp_now_us(); now < until && !ctx->has_public;
+         now = udp_now_us()) {
+      const uint64_t US_PER_MS = 1000;
+      struct pollfd pfd = {ctx->fd, POLLIN, 0};
+      if (poll(&pfd, 1, (int)((until - now) / US_PER_MS) + 1) == -1 &&
+          errno != EINTR)
+        break;
+      udp_receive(ctx);
+    }
+  }
+
+  if (!ctx->has_public) {
+    struct AddressPacked *key = &ctx->rendezvous_key;
+    LOG_WARNING("No answer from the rendezvous server at %s, peers behind "
+                "NAT may not reach us",
+                udp_format(key, buf, sizeof(buf)));
+    return 0;
+  }
+  const char *address = udp_format(&ctx->public_key, buf, sizeof(buf));
+  LOG_DEBUG("The rendezvous server sees us at %s", address);
+  return strdup(address);
+}
+
+static int udp_rendezvous_parse(struct UdpCtx *ctx, const char *address) {
+  char *host = malloc(strlen(address) + 1);
+  uint16_t port = 0;
+  struct sockaddr_storage addr = {0};
+  socklen_t addrlen = 0;
+  if (!host || address_split(address, host, &port) == -1)
+    goto failure;
+  int ret = address_parse_numeric(host, port, &addr, &addrlen);
+  if (ret == 1) {
+    // Once, before anything else happens
+    struct evutil_addrinfo hints = {0};
+    struct evutil_addrinfo *ai = 0;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (evutil_getaddrinfo(host, 0, &hints, &ai) != 0 || !ai)
+      goto failure;
+    memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+    addrlen = ai->ai_addrlen;
+    address_set_port(&addr, port);
+    evutil_freeaddrinfo(ai);
+  } else if (ret == -1) {
+    goto failure;
+  }
+  if (udp_key(&addr, addrlen, &ctx->rendezvous_key) == -1)
+    goto failure;
+  ctx->rendezvous_len =
+      udp_sockaddr(ctx, &ctx->rendezvous_key, &ctx->rendezvous);
+  ctx->has_rendezvous = 1;
+  free(host);
+  return 0;
+
+failure:
+  LOG_ERROR("Cannot use %s as rendezvous server", address);
+  free(host);
+  return -1;
+}
+
+static void *udp_listen(void *arg, struct event_base *base,
+                        transport_dispatch_t dispatch, transport_admit_t admit,
+                        void *dispatch_arg, char **address_out) {
+  (void)base;
+  struct UdpCtx *ctx = CAST(struct UdpCtx *, arg);
+  if (!ctx || ctx->server)
+    return 0;
+  struct UdpServer *server = calloc(1, sizeof(struct UdpServer));
+  if (!server)
+    return 0;
+  server->ctx = ctx;
+  server->dispatch = dispatch;
+  server->admit = admit;
+  server->dispatch_arg = dispatch_arg;
+
+  char *address = 0;
+  if (ctx->has_rendezvous) {
+    address = udp_register_wait(ctx);
+    struct timeval every = {UDP_REGISTER_EVERY_S, 0};
+    (void)evtimer_add(ctx->register_timer, &every);
+  }
+  if (!address)
+    address = strdup(ctx->address);
+  if (!address) {
+    (void)evtimer_del(ctx->register_timer);
+    free(server);
+    return 0;
+  }
+  ctx->server = server;
+  *address_out = address;
+  LOG_DEBUG0("Initialized UDP server");
+  return server;
+}
+
+/********************
+ Context
+********************/
+static void udp_ctx_free(void *arg) {
+  struct UdpCtx *ctx = CAST(struct UdpCtx *, arg);
+  if (!ctx)
+    return;
+  for (size_t ii = 0; ctx->buckets && ii < ctx->num_buckets; ++ii) {
+    while (ctx->buckets[ii])
+      udp_conn_free(ctx->buckets[ii]);
+  }
+  free(ctx->buckets);
+  free(ctx->server);
+  if (ctx->readable)
+    event_free(ctx->readable);
+  if (ctx->writable)
+    event_free(ctx->writable);
+  if (ctx->flush)
+    event_free(ctx->flush);
+  if (ctx->register_timer)
+    event_free(ctx->register_timer);
+  if (ctx->frame)
+    evbuffer_free(ctx->frame);
+  if (ctx->marshal)
+    evbuffer_free(ctx->marshal);
+  if (ctx->fd != -1)
+    (void)evutil_closesocket(ctx->fd);
+  free(ctx->address);
+  free(ctx);
+}
+
+static int udp_options(struct UdpCtx *ctx) {
+  const char *server = getenv("P2P_RENDEZVOUS"); // NOLINT(concurrency-mt-unsafe)
+  if (server && *server && udp_rendezvous_parse(ctx, server) == -1)
+    return -1;
+  const char *filter = getenv("P2P_UDP_FILTER"); // NOLINT(concurrency-mt-unsafe)
+  ctx->filter = filter && strcmp(filter, "0") != 0;
+  const char *loss = getenv("P2P_UDP_LOSS"); // NOLINT(concurrency-mt-unsafe)
+  if (loss) {
+    const int base = 10;
+    const int PERCENT = 100;
+    ctx->loss_percent = (int)strtol(loss, NULL, base);
+    if (ctx->loss_percent < 0 || ctx->loss_percent >= PERCENT)
+      ctx->loss_percent = 0;
+  }
+  return 0;
+}
+
+static void udp_writable_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  udp_flush(CAST(struct UdpCtx *, arg));
+}
+
+static void *udp_ctx_new(struct event_base *base) {
+  struct UdpCtx *ctx = calloc(1, sizeof(struct UdpCtx));
+  if (!ctx)
+    return 0;
+  ctx->base = base;
+  ctx->fd = transport_datagram_socket(0, &ctx->address);
+  if (ctx->fd == -1)
+    goto failure;
+
+  struct sockaddr_storage bound = {0};
+  socklen_t bound_len = sizeof(bound);
+  if (getsockname(ctx->fd, (struct sockaddr *)&bound, &bound_len) == -1)
+    goto failure;
+  ctx->family = bound.ss_family;
+  int opt_val = 1;
+#if defined(__linux__) && defined(IP_RECVERR)
+  (void)setsockopt(ctx->fd, IPPROTO_IP, IP_RECVERR, &opt_val, sizeof(int));
+  if (ctx->family == AF_INET6)
+    (void)setsockopt(ctx->fd, IPPROTO_IPV6, IPV6_RECVERR, &opt_val,
+                     sizeof(int));
+#endif
+  // Room for bursts that arrive while the event loop is busy
+  opt_val = UDP_SOCKET_BUFFER;
+  (void)setsockopt(ctx->fd, SOL_SOCKET, SO_RCVBUF, &opt_val, sizeof(int));
+  (void)setsockopt(ctx->fd, SOL_SOCKET, SO_SNDBUF, &opt_val, sizeof(int));
+
+  evutil_secure_rng_get_bytes(&ctx->session, sizeof(ctx->session));
+  ctx->session |= 1U << 31U; // never 0, which is no session
+  ctx->num_buckets = UDP_MIN_BUCKETS;
+  ctx->buckets = calloc(ctx->num_buckets, sizeof(struct UdpConn *));
+  if (!ctx->buckets)
+    goto failure;
+
+  for (unsigned ii = 0; ii < UDP_BATCH; ++ii) {
+    ctx->out_iov[ii].iov_base = ctx->out_data[ii];
+    ctx->out_msgs[ii].msg_hdr.msg_iov = &ctx->out_iov[ii];
+    ctx->out_msgs[ii].msg_hdr.msg_iovlen = 1;
+    ctx->out_msgs[ii].msg_hdr.msg_name = &ctx->out_addrs[ii];
+    ctx->in_iov[ii].iov_base = ctx->in_data[ii];
+    ctx->in_iov[ii].iov_len = UDP_PACKET_MAX;
+    ctx->in_msgs[ii].msg_hdr.msg_iov = &ctx->in_iov[ii];
+    ctx->in_msgs[ii].msg_hdr.msg_iovlen = 1;
+    ctx->in_msgs[ii].msg_hdr.msg_name = &ctx->in_addrs[ii];
+  }
+
+  ctx->readable = event_new(base, ctx->fd, EV_READ | EV_PERSIST,
+                            udp_readable_cb, ctx);
+  ctx->writable = event_new(base, ctx->fd, EV_WRITE, udp_writable_cb, ctx);
+  ctx->flush = event_new(base, -1, 0, udp_flush_cb, ctx);
+  ctx->register_timer =
+      event_new(base, -1, EV_PERSIST, udp_register_cb, ctx);
+  ctx->frame = evbuffer_new();
+  ctx->marshal = evbuffer_new();
+  if (!ctx->readable || !ctx->writable || !ctx->flush ||
+      !ctx->register_timer || !ctx->frame || !ctx->marshal ||
+      event_add(ctx->readable, 0) == -1)
+    goto failure;
+  if (udp_options(ctx) == -1)
+    goto failure;
+
+  LOG_DEBUG0("Initialized UDP transport");
+  return ctx;
+
+failure:
+  udp_ctx_free(ctx);
+  return 0;
+}
+
+const struct TransportOps *transport_udp(void) {
+  static const struct TransportOps ops = {
+      "udp",         udp_listen,  udp_close,   udp_link_new,
+      udp_link_free, udp_request, udp_ctx_new, udp_ctx_free,
+  };
+  return &ops;
+}
@@ -0,0 +1,1040 @@
+#include "log.h"
+#include "rpc_limits.h"
+#include "transport.h"
+#include "types.h"
+
+#ifndef P2PCHAT_HAVE_IO_URING
+
+const struct TransportOps *transport_uring(void) { return 0; }
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <event2/buffer.h>
+#include <event2/rpc_struct.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Requests and replies travel as frames over plain TCP instead of HTTP:
+//   length (4) kind (1) type (1) status (1) unused (1) id (4) body (length)
+// with the integers big endian and the body what evrpc would have sent.
+// Requests on a connection are pipelined, replies name the request they
+// answer by id.
+//
+// One ring per application, which is the transport ctx. Accepts and receives
+// are multishot, so one submission keeps delivering. Receives pick from a ring
+// of buffers registered with the kernel, and everything queued during a pass
+// of the event loop is submitted with a single io_uring_enter. The kernel
+// signals completions on an eventfd that libevent watches.
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 128 // power of 2
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_MAX (64 * 1024)
+#define URING_HEADER_SIZE 12
+
+enum UringFrameKind { URING_REQUEST, URING_REPLY };
+
+enum UringOpKind { URING_ACCEPT, URING_RECV, URING_SEND, URING_CONNECT };
+
+struct UringCtx;
+struct UringOwner;
+
+// What the user_data of a submission points at
+struct UringOp {
+  struct UringOwner *owner;
+  enum UringOpKind kind;
+};
+
+// Servers and connections, which cannot be freed while the kernel still has
+// operations of theirs
+struct UringOwner {
+  struct UringCtx *ctx;
+  struct UringOwner *prev;
+  struct UringOwner *next;
+  int inflight;
+  int closing;
+  void (*free)(struct UringOwner *owner);
+};
+
+struct UringCtx { // NOLINT(altera-struct-pack-align)
+  struct event_base *base;
+  int ring_fd;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_flags;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // sqes handed out, published when submitting
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  void *cq_ring; // same mapping as sq_ring on kernels that allow it
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  int event_fd;
+  struct event *completions;
+  struct event *submit;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  uint8_t *buffers;
+  uint16_t buf_tail;
+
+  struct evbuffer *frame;   // body of the frame being handled
+  struct evbuffer *marshal; // body of the frame being sent
+  struct UringOwner *owners;
+};
+
+struct UringServer {
+  struct UringOwner owner;
+  int fd;
+  struct UringOp accept_op;
+  transport_dispatch_t dispatch;
+  transport_admit_t admit;
+  void *dispatch_arg;
+};
+
+struct UringLink;
+
+struct UringConn { // NOLINT(altera-struct-pack-align)
+  struct UringOwner owner;
+  int fd;
+  struct UringServer *server; // set on connections we accepted
+  struct UringLink *link;     // set on connections we made
+  int connected;
+
+  struct UringOp recv_op;
+  struct UringOp send_op;
+  struct UringOp connect_op;
+
+  struct evbuffer *in;
+  struct evbuffer *out;
+  uint8_t *sending; // the one send the kernel has
+  size_t sending_length;
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+struct UringPending {
+  struct UringPending *next;
+  uint32_t id;
+  enum RpcType type;
+  void *request;
+  void *reply;
+  transport_cb_t callback;
+  void *cbarg;
+};
+
+struct UringLink {
+  struct UringCtx *ctx;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct UringConn *conn; // made on the first request, and after errors
+  uint32_t next_id;
+  struct UringPending *head; // in the order they were sent
+  struct UringPending *tail;
+};
+
+/********************
+ Ring
+********************/
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_submit(struct UringCtx *ctx) {
+  __atomic_store_n(ctx->sq_tail, ctx->sq_local_tail, __ATOMIC_RELEASE);
+  for (;;) {
+    unsigned head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+    unsigned to_submit = ctx->sq_local_tail - head;
+    if (!to_submit)
+      return;
+    if (uring_enter(ctx->ring_fd, to_submit, 0) >= 0)
+      continue;
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EBUSY) {
+      // Completions have to be reaped first, try again after that
+      event_active(ctx->submit, 0, 0);
+      return;
+    }
+    LOG_ERROR("io_uring_enter failed: %s", strerror(errno));
+    return;
+  }
+}
+
+static void uring_submit_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)fd;
+  (void)flags;
+  uring_submit(CAST(struct UringCtx *, arg));
+}
+
+// Queued until the end of this pass of the event loop. NULL if the queue is
+// full even after submitting what is in it.
+static struct io_uring_sqe *uring_sqe(struct UringCtx *ctx) {
+  unsigned head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+  if (ctx->sq_local_tail - head >= ctx->sq_entries) {
+    uring_submit(ctx);
+    head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+    if (ctx->sq_local_tail - head >= ctx->sq_entries)
+      return 0;
+  }
+  if (ctx->sq_local_tail == *ctx->sq_tail)
+    event_active(ctx->submit, 0, 0);
+  struct io_uring_sqe *sqe = &ctx->sqes[ctx->sq_local_tail & ctx->sq_mask];
+  ctx->sq_local_tail += 1;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_recycle(struct UringCtx *ctx, uint16_t bid) {
+  // Only the fields before tail, which shares the first entry
+  struct io_uring_buf *buf =
+      &ctx->buf_ring->bufs[ctx->buf_tail & (URING_BUFFERS - 1U)];
+  buf->addr = (uintptr_t)(ctx->buffers + (size_t)bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  ctx->buf_tail += 1;
+  __atomic_store_n(&ctx->buf_ring->tail, ctx->buf_tail, __ATOMIC_RELEASE);
+}
+
+/********************
+ Owners
+********************/
+static void uring_owner_add(struct UringCtx *ctx, struct UringOwner *owner,
+                            void (*free_owner)(struct UringOwner *)) {
+  owner->ctx = ctx;
+  owner->free = free_owner;
+  owner->next = ctx->owners;
+  if (ctx->owners)
+    ctx->owners->prev = owner;
+  ctx->owners = owner;
+}
+
+static void uring_owner_release(struct UringOwner *owner) {
+  if (!owner->closing || owner->inflight)
+    return;
+  if (owner->prev)
+    owner->prev->next = owner->next;
+  else
+    owner->ctx->owners = owner->next;
+  if (owner->next)
+    owner->next->prev = owner->prev;
+  owner->free(owner);
+}
+
+// Whatever the kernel is doing with fd, completions still come for each
+static void uring_cancel(struct UringCtx *ctx, int fd) {
+  struct io_uring_sqe *sqe = uring_sqe(ctx);
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+/********************
+ Connections
+********************/
+static void uring_conn_free(struct UringOwner *owner) {
+  struct UringConn *conn = CAST(struct UringConn *, owner);
+  (void)close(conn->fd);
+  evbuffer_free(conn->in);
+  evbuffer_free(conn->out);
+  free(conn->sending);
+  free(conn);
+}
+
+static struct UringConn *uring_conn_new(struct UringCtx *ctx, int fd) {
+  struct UringConn *conn = calloc(1, sizeof(struct UringConn));
+  if (!conn)
+    goto failure1;
+  conn->fd = fd;
+  conn->recv_op.owner = &conn->owner;
+  conn->recv_op.kind = URING_RECV;
+  conn->send_op.owner = &conn->owner;
+  conn->send_op.kind = URING_SEND;
+  conn->connect_op.owner = &conn->owner;
+  conn->connect_op.kind = URING_CONNECT;
+
+  conn->in = evbuffer_new();
+  if (!conn->in)
+    goto failure2;
+  conn->out = evbuffer_new();
+  if (!conn->out)
+    goto failure3;
+
+  // Replies are a single small write each, no point waiting to coalesce
+  int nodelay_opt_val = 1;
+  (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay_opt_val,
+                   sizeof(int));
+
+  uring_owner_add(ctx, &conn->owner, uring_conn_free);
+  return conn;
+
+failure3:
+  evbuffer_free(conn->in);
+failure2:
+  free(conn);
+failure1:
+  (void)close(fd);
+  return 0;
+}
+
+static void uring_conn_close(struct UringConn *conn) {
+  if (conn->owner.closing)
+    return;
+  conn->owner.closing = 1;
+  if (conn->link && conn->link->conn == conn)
+    conn->link->conn = 0;
+  conn->link = 0;
+  conn->server = 0;
+  if (conn->owner.inflight)
+    uring_cancel(conn->owner.ctx, conn->fd);
+  uring_owner_release(&conn->owner);
+}
+
+static int uring_conn_recv(struct UringConn *conn) {
+  struct io_uring_sqe *sqe = uring_sqe(conn->owner.ctx);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = (uintptr_t)&conn->recv_op;
+  conn->owner.inflight += 1;
+  return 0;
+}
+
+static void uring_conn_send(struct UringConn *conn) {
+  if (conn->sending || !conn->connected || conn->owner.closing)
+    return;
+  size_t length = evbuffer_get_length(conn->out);
+  if (!length)
+    return;
+  if (length > URING_SEND_MAX)
+    length = URING_SEND_MAX;
+
+  conn->sending = malloc(length);
+  if (!conn->sending)
+    goto failure;
+  conn->sending_length = length;
+  (void)evbuffer_remove(conn->out, conn->sending, length);
+
+  struct io_uring_sqe *sqe = uring_sqe(conn->owner.ctx);
+  if (!sqe)
+    goto failure;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t)conn->sending;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)&conn->send_op;
+  conn->owner.inflight += 1;
+  return;
+
+failure:
+  LOG_ERROR0("Cannot send, closing connection");
+  uring_conn_close(conn);
+}
+
+static void uring_put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)(value >> 24U);
+  out[1] = (uint8_t)(value >> 16U);
+  out[2] = (uint8_t)(value >> 8U);
+  out[3] = (uint8_t)value;
+}
+
+static uint32_t uring_get_u32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24U | (uint32_t)in[1] << 16U |
+         (uint32_t)in[2] << 8U | (uint32_t)in[3];
+}
+
+// Moves ctx->marshal into the connection's output as one frame
+static int uring_conn_frame(struct UringConn *conn, enum UringFrameKind kind,
+                            enum RpcType type, int status, uint32_t id) {
+  struct UringCtx *ctx = conn->owner.ctx;
+  size_t length = evbuffer_get_length(ctx->marshal);
+  if (length > RPC_MAX_BODY_SIZE) {
+    LOG_ERROR("Not sending %s of %zu bytes", rpc_info(type)->name, length);
+    (void)evbuffer_drain(ctx->marshal, length);
+    return -1;
+  }
+  uint8_t header[URING_HEADER_SIZE] = {0};
+  uring_put_u32(header, (uint32_t)length);
+  header[4] = (uint8_t)kind;
+  header[5] = (uint8_t)type;
+  header[6] = (uint8_t)status;
+  uring_put_u32(header + 8, id);
+  if (evbuffer_add(conn->out, header, sizeof(header)) == -1 ||
+      evbuffer_add_buffer(conn->out, ctx->marshal) == -1) {
+    (void)evbuffer_drain(ctx->marshal, evbuffer_get_length(ctx->marshal));
+    return -1;
+  }
+  return 0;
+}
+
+/********************
+ Server
+********************/
+static void uring_serve(struct UringConn *conn, enum RpcType type,
+                        uint32_t id) {
+  struct UringCtx *ctx = conn->owner.ctx;
+  struct UringServer *server = conn->server;
+  const struct RpcInfo *info = rpc_info(type);
+  int status = EVRPC_STATUS_ERR_NONE;
+
+  void *request = 0;
+  void *reply = 0;
+  if (server->admit &&
+      !server->admit(type, (struct sockaddr *)&conn->addr, conn->addrlen,
+                     server->dispatch_arg)) {
+    status = EVRPC_STATUS_ERR_HOOKABORTED;
+  } else if (!(request = info->request_new(NULL)) ||
+             !(reply = info->reply_new(NULL)) ||
+             info->request_unmarshal(request, ctx->frame) == -1) {
+    LOG_DEBUG("Bad %s request", info->name);
+    status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  } else {
+    server->dispatch(type, request, reply, server->dispatch_arg);
+    if (info->reply_complete(reply) == -1)
+      status = EVRPC_STATUS_ERR_BADPAYLOAD;
+    else
+      info->reply_marshal(ctx->marshal, reply);
+  }
+  if (request)
+    info->request_free(request);
+  if (reply)
+    info->reply_free(reply);
+
+  // The dispatch may have closed us
+  if (conn->owner.closing)
+    return;
+  if (uring_conn_frame(conn, URING_REPLY, type, status, id) == -1) {
+    uring_conn_close(conn);
+    return;
+  }
+  uring_conn_send(conn);
+}
+
+static void uring_server_free(struct UringOwner *owner) {
+  struct UringServer *server = CAST(struct UringServer *, owner);
+  (void)close(server->fd);
+  free(server);
+}
+
+static int uring_server_accept(struct UringServer *server) {
+  struct io_uring_sqe *sqe = uring_sqe(server->owner.ctx);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t)&server->accept_op;
+  server->owner.inflight += 1;
+  return 0;
+}
+
+static void uring_accepted(struct UringServer *server,
+                           const struct io_uring_cqe *cqe) {
+  if (cqe->res < 0) {
+    LOG_DEBUG("Accept failed: %s", strerror(-cqe->res));
+  } else if (!server->owner.closing) {
+    struct UringConn *conn = uring_conn_new(server->owner.ctx, cqe->res);
+    if (conn) {
+      conn->server = server;
+      conn->connected = 1;
+      // Where requests come from, for admission
+      conn->addrlen = sizeof(conn->addr);
+      if (getpeername(conn->fd, (struct sockaddr *)&conn->addr,
+                      &conn->addrlen) == -1)
+        conn->addrlen = 0;
+      if (uring_conn_recv(conn) == -1)
+        uring_conn_close(conn);
+    }
+  } else {
+    (void)close(cqe->res);
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE) && !server->owner.closing &&
+      uring_server_accept(server) == -1)
+    LOG_ERROR0("Cannot accept connections any more");
+}
+
+static void uring_close(void *arg) {
+  struct UringServer *server = CAST(struct UringServer *, arg);
+  struct UringCtx *ctx = server->owner.ctx;
+  server->owner.closing = 1;
+  for (struct UringOwner *owner = ctx->owners; owner;) {
+    struct UringOwner *next = owner->next;
+    if (owner->free == uring_conn_free &&
+        CAST(struct UringConn *, owner)->server == server)
+      uring_conn_close(CAST(struct UringConn *, owner));
+    owner = next;
+  }
+  if (server->owner.inflight)
+    uring_cancel(ctx, server->fd);
+  uring_owner_release(&server->owner);
+}
+
+static void *uring_listen(void *arg, struct event_base *base,
+                          transport_dispatch_t dispatch,
+                          transport_admit_t admit, void *dispatch_arg,
+                          char **address_out) {
+  (void)base;
+  struct UringCtx *ctx = CAST(struct UringCtx *, arg);
+  if (!ctx)
+    goto failure1;
+  struct UringServer *server = calloc(1, sizeof(struct UringServer));
+  if (!server)
+    goto failure1;
+  server->dispatch = dispatch;
+  server->admit = admit;
+  server->dispatch_arg = dispatch_arg;
+  server->accept_op.owner = &server->owner;
+  server->accept_op.kind = URING_ACCEPT;
+
+  server->fd = transport_listen_socket(address_out);
+  if (server->fd == -1)
+    goto failure2;
+  // The ring waits for connections itself, and gives up on nonblocking ones
+  int flags = fcntl(server->fd, F_GETFL);
+  if (flags != -1)
+    (void)fcntl(server->fd, F_SETFL, (unsigned)flags & ~(unsigned)O_NONBLOCK);
+
+  uring_owner_add(ctx, &server->owner, uring_server_free);
+  if (uring_server_accept(server) == -1) {
+    uring_close(server);
+    free(*address_out);
+    *address_out = 0;
+    goto failure1;
+  }
+  LOG_DEBUG0("Initialized io_uring server");
+  return server;
+
+failure2:
+  free(server);
+failure1:
+  return 0;
+}
+
+/********************
+ Client
+********************/
+static void uring_link_fail(struct UringLink *link, struct UringConn *conn) {
+  int error = conn->connected ? EVRPC_STATUS_ERR_TIMEOUT
+                              : EVRPC_STATUS_ERR_UNSTARTED;
+  // Callbacks may send more, which go out on a new connection
+  struct UringPending *pending = link->head;
+  link->head = 0;
+  link->tail = 0;
+  uring_conn_close(conn);
+
+  while (pending) {
+    struct UringPending *next = pending->next;
+    struct evrpc_status status = {0};
+    status.error = error;
+    pending->callback(&status, pending->request, pending->reply,
+                      pending->cbarg);
+    free(pending);
+    pending = next;
+  }
+}
+
+static void uring_conn_fail(struct UringConn *conn) {
+  if (conn->link)
+    uring_link_fail(conn->link, conn);
+  else
+    uring_conn_close(conn);
+}
+
+static void uring_answer(struct UringLink *link, enum RpcType type, int status,
+                         uint32_t id) {
+  struct UringCtx *ctx = link->ctx;
+  // Replies come in order, so this is almost always the head
+  struct UringPending *before = 0;
+  struct UringPending *pending = link->head;
+  while (pending && pending->id != id) {
+    before = pending;
+    pending = pending->next;
+  }
+  if (!pending) {
+    LOG_DEBUG("Reply to unknown request %u", id);
+    return;
+  }
+  if (before)
+    before->next = pending->next;
+  else
+    link->head = pending->next;
+  if (link->tail == pending)
+    link->tail = before;
+
+  const struct RpcInfo *info = rpc_info(pending->type);
+  if (pending->type != type)
+    status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  if (status == EVRPC_STATUS_ERR_NONE) {
+    info->reply_clear(pending->reply);
+    if (info->reply_unmarshal(pending->reply, ctx->frame) == -1)
+      status = EVRPC_STATUS_ERR_BADPAYLOAD;
+  }
+
+  struct evrpc_status evrpc_status = {0};
+  evrpc_status.error = status;
+  pending->callback(&evrpc_status, pending->request, pending->reply,
+                    pending->cbarg);
+  free(pending);
+}
+
+static int uring_link_connect(struct UringLink *link) {
+  int fd = socket(link->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  struct UringConn *conn = uring_conn_new(link->ctx, fd);
+  if (!conn)
+    return -1;
+  conn->link = link;
+  memcpy(&conn->addr, &link->addr, link->addrlen);
+  conn->addrlen = link->addrlen;
+
+  struct io_uring_sqe *sqe = uring_sqe(link->ctx);
+  if (!sqe) {
+    uring_conn_close(conn);
+    return -1;
+  }
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)&conn->addr;
+  sqe->off = conn->addrlen;
+  sqe->user_data = (uintptr_t)&conn->connect_op;
+  conn->owner.inflight += 1;
+  link->conn = conn;
+  return 0;
+}
+
+static void uring_connected(struct UringConn *conn,
+                            const struct io_uring_cqe *cqe) {
+  if (conn->owner.closing)
+    return;
+  if (cqe->res < 0) {
+    LOG_DEBUG("Connect failed: %s", strerror(-cqe->res));
+    uring_conn_fail(conn);
+    return;
+  }
+  conn->connected = 1;
+  if (uring_conn_recv(conn) == -1) {
+    uring_conn_fail(conn);
+    return;
+  }
+  uring_conn_send(conn);
+}
+
+static void uring_link_free(void *arg) {
+  struct UringLink *link = CAST(struct UringLink *, arg);
+  if (link->conn)
+    uring_conn_close(link->conn);
+  struct UringPending *pending = link->head;
+  free(link);
+
+  // Requests still waiting fail, once the link is gone so that callbacks
+  // sending more can't reach it
+  while (pending) {
+    struct UringPending *next = pending->next;
+    struct evrpc_status status = {0};
+    status.error = EVRPC_STATUS_ERR_UNSTARTED;
+    pending->callback(&status, pending->request, pending->reply,
+                      pending->cbarg);
+    free(pending);
+    pending = next;
+  }
+}
+
+static void *uring_link_new(void *arg, struct event_base *base,
+                            const struct sockaddr *addr, socklen_t addrlen) {
+  (void)base;
+  struct UringCtx *ctx = CAST(struct UringCtx *, arg);
+  if (!ctx || addrlen > sizeof(struct sockaddr_storage))
+    return 0;
+  struct UringLink *link = calloc(1, sizeof(struct UringLink));
+  if (!link)
+    return 0;
+  link->ctx = ctx;
+  memcpy(&link->addr, addr, addrlen);
+  link->addrlen = addrlen;
+  return link;
+}
+
+static int uring_request(void *arg, enum RpcType type, void *request,
+                         void *reply, transport_cb_t callback, void *cbarg) {
+  struct UringLink *link = CAST(struct UringLink *, arg);
+  const struct RpcInfo *info = rpc_info(type);
+
+  if (!link->conn && uring_link_connect(link) == -1)
+    return -1;
+  struct UringPending *pending = calloc(1, sizeof(struct UringPending));
+  if (!pending)
+    return -1;
+
+  info->request_marshal(link->ctx->marshal, request);
+  pending->id = link->next_id++;
+  if (uring_conn_frame(link->conn, URING_REQUEST, type, 0, pending->id) ==
+      -1) {
+    free(pending);
+    return -1;
+  }
+  pending->type = type;
+  pending->request = request;
+  pending->reply = reply;
+  pending->callback = callback;
+  pending->cbarg = cbarg;
+  if (link->tail)
+    link->tail->next = pending;
+  else
+    link->head = pending;
+  link->tail = pending;
+
+  uring_conn_send(link->conn);
+  return 0;
+}
+
+/********************
+ Completions
+********************/
+static void uring_frames(struct UringConn *conn) {
+  struct UringCtx *ctx = conn->owner.ctx;
+  while (!conn->owner.closing) {
+    size_t available = evbuffer_get_length(conn->in);
+    if (available < URING_HEADER_SIZE)
+      return;
+    const uint8_t *header = evbuffer_pullup(conn->in, URING_HEADER_SIZE);
+    uint32_t length = uring_get_u32(header);
+    int kind = header[4];
+    int type = header[5];
+    int status = header[6];
+    uint32_t id = uring_get_u32(header + 8);
+    if (length > RPC_MAX_BODY_SIZE || type >= RPC_NUM_TYPES ||
+        (kind == URING_REQUEST && !conn->server) ||
+        (kind == URING_REPLY && !conn->link) ||
+        (kind != URING_REQUEST && kind != URING_REPLY)) {
+      LOG_WARNING("Bad frame of %u bytes, closing connection", length);
+      uring_conn_fail(conn);
+      return;
+    }
+    if (available < URING_HEADER_SIZE + (size_t)length)
+      return;
+
+    (void)evbuffer_drain(conn->in, URING_HEADER_SIZE);
+    (void)evbuffer_remove_buffer(conn->in, ctx->frame, length);
+    if (kind == URING_REQUEST)
+      uring_serve(conn, type, id);
+    else
+      uring_answer(conn->link, type, status, id);
+    (void)evbuffer_drain(ctx->frame, evbuffer_get_length(ctx->frame));
+  }
+}
+
+static void uring_received(struct UringConn *conn,
+                           const struct io_uring_cqe *cqe) {
+  struct UringCtx *ctx = conn->owner.ctx;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe->res > 0 && !conn->owner.closing &&
+        evbuffer_add(conn->in, ctx->buffers + (size_t)bid * URING_BUFFER_SIZE,
+                     cqe->res) == -1)
+      uring_conn_fail(conn);
+    uring_recycle(ctx, bid);
+  }
+  if (conn->owner.closing)
+    return;
+
+  if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+    LOG_DEBUG("Connection closed: %s",
+              cqe->res ? strerror(-cqe->res) : "end of stream");
+    uring_conn_fail(conn);
+    return;
+  }
+  uring_frames(conn);
+
+  // Multishot stops when the buffers run out, among other reasons
+  if (!conn->owner.closing && !(cqe->flags & IORING_CQE_F_MORE) &&
+      uring_conn_recv(conn) == -1)
+    uring_conn_fail(conn);
+}
+
+static void uring_sent(struct UringConn *conn, const struct io_uring_cqe *cqe) {
+  uint8_t *sent = conn->sending;
+  size_t length = conn->sending_length;
+  conn->sending = 0;
+  if (cqe->res < 0) {
+    free(sent);
+    if (!conn->owner.closing) {
+      LOG_DEBUG("Send failed: %s", strerror(-cqe->res));
+      uring_conn_fail(conn);
+    }
+    return;
+  }
+  if ((size_t)cqe->res < length &&
+      evbuffer_prepend(conn->out, sent + cqe->res, length - cqe->res) == -1) {
+    free(sent);
+    uring_conn_fail(conn);
+    return;
+  }
+  free(sent);
+  uring_conn_send(conn);
+}
+
+static void uring_complete(const struct io_uring_cqe *cqe) {
+  struct UringOp *op = (struct UringOp *)(uintptr_t)cqe->user_data;
+  if (!op) // cancellations
+    return;
+  struct UringOwner *owner = op->owner;
+  // Multishot operations keep going while they set F_MORE
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    owner->inflight -= 1;
+
+  // Handlers may close the owner, which must stay around until they return
+  owner->inflight += 1;
+  switch (op->kind) {
+  case URING_ACCEPT:
+    uring_accepted(CAST(struct UringServer *, owner), cqe);
+    break;
+  case URING_RECV:
+    uring_received(CAST(struct UringConn *, owner), cqe);
+    break;
+  case URING_SEND:
+    uring_sent(CAST(struct UringConn *, owner), cqe);
+    break;
+  case URING_CONNECT:
+    uring_connected(CAST(struct UringConn *, owner), cqe);
+    break;
+  }
+  owner->inflight -= 1;
+  uring_owner_release(owner);
+}
+
+static void uring_completions_cb(evutil_socket_t fd, short flags, void *arg) {
+  (void)flags;
+  struct UringCtx *ctx = CAST(struct UringCtx *, arg);
+  uint64_t count = 0;
+  (void)!read(fd, &count, sizeof(count));
+
+  for (;;) {
+    unsigned head = *ctx->cq_head;
+    unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // Completions that did not fit are only moved over when asked
+      if (!(__atomic_load_n(ctx->sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) ||
+          uring_enter(ctx->ring_fd, 0, IORING_ENTER_GETEVENTS) == -1 ||
+          *ctx->cq_head == __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE))
+        return;
+      continue;
+    }
+    struct io_uring_cqe cqe = ctx->cqes[head & ctx->cq_mask];
+    __atomic_store_n(ctx->cq_head, head + 1, __ATOMIC_RELEASE);
+    uring_complete(&cqe);
+  }
+}
+
+/********************
+ Context
+********************/
+static void uring_ctx_free(void *arg) {
+  struct UringCtx *ctx = CAST(struct UringCtx *, arg);
+  if (!ctx)
+    return;
+  // Closing the ring cancels everything, so what is left can go
+  if (ctx->ring_fd != -1)
+    (void)close(ctx->ring_fd);
+  while (ctx->owners) {
+    struct UringOwner *owner = ctx->owners;
+    ctx->owners = owner->next;
+    owner->free(owner);
+  }
+  if (ctx->completions)
+    event_free(ctx->completions);
+  if (ctx->submit)
+    event_free(ctx->submit);
+  if (ctx->event_fd != -1)
+    (void)close(ctx->event_fd);
+  if (ctx->frame)
+    evbuffer_free(ctx->frame);
+  if (ctx->marshal)
+    evbuffer_free(ctx->marshal);
+  free(ctx->buffers);
+  if (ctx->buf_ring)
+    (void)munmap(ctx->buf_ring, ctx->buf_ring_size);
+  if (ctx->sqes)
+    (void)munmap(ctx->sqes, ctx->sqes_size);
+  if (ctx->cq_ring && ctx->cq_ring != ctx->sq_ring)
+    (void)munmap(ctx->cq_ring, ctx->cq_ring_size);
+  if (ctx->sq_ring)
+    (void)munmap(ctx->sq_ring, ctx->sq_ring_size);
+  free(ctx);
+}
+
+static int uring_map(struct UringCtx *ctx,
+                     const struct io_uring_params *params) {
+  ctx->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  ctx->cq_ring_size =
+      params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  int single = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ctx->cq_ring_size > ctx->sq_ring_size)
+    ctx->sq_ring_size = ctx->cq_ring_size;
+
+  void *sq_ring = mmap(0, ctx->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return -1;
+  ctx->sq_ring = sq_ring;
+
+  if (single) {
+    ctx->cq_ring = sq_ring;
+  } else {
+    void *cq_ring = mmap(0, ctx->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      return -1;
+    ctx->cq_ring = cq_ring;
+  }
+
+  ctx->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(0, ctx->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return -1;
+  ctx->sqes = sqes;
+
+  uint8_t *sq = sq_ring;
+  ctx->sq_head = (unsigned *)(sq + params->sq_off.head);
+  ctx->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+  ctx->sq_flags = (unsigned *)(sq + params->sq_off.flags);
+  ctx->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+  ctx->sq_entries = *(unsigned *)(sq + params->sq_off.ring_entries);
+  ctx->sq_local_tail = *ctx->sq_tail;
+  // Slot n of the array always names sqe n
+  unsigned *array = (unsigned *)(sq + params->sq_off.array);
+  for (unsigned ii = 0; ii < ctx->sq_entries; ++ii)
+    array[ii] = ii;
+
+  uint8_t *cq = ctx->cq_ring;
+  ctx->cq_head = (unsigned *)(cq + params->cq_off.head);
+  ctx->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+  ctx->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+  ctx->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+  return 0;
+}
+
+static int uring_register_buffers(struct UringCtx *ctx) {
+  ctx->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  void *buf_ring = mmap(0, ctx->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED)
+    return -1;
+  ctx->buf_ring = buf_ring;
+
+  ctx->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+  if (!ctx->buffers)
+    return -1;
+
+  struct io_uring_buf_reg reg = {0};
+  reg.ring_addr = (uintptr_t)buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (uring_register(ctx->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    return -1;
+  for (uint16_t ii = 0; ii < URING_BUFFERS; ++ii)
+    uring_recycle(ctx, ii);
+  return 0;
+}
+
+static void *uring_ctx_new(struct event_base *base) {
+  struct UringCtx *ctx = calloc(1, sizeof(struct UringCtx));
+  if (!ctx)
+    return 0;
+  ctx->base = base;
+  ctx->event_fd = -1;
+
+  struct io_uring_params params = {0};
+  params.flags = IORING_SETUP_CLAMP;
+  ctx->ring_fd = uring_setup(URING_ENTRIES, &params);
+  if (ctx->ring_fd == -1) {
+    LOG_ERROR("io_uring_setup failed: %s", strerror(errno));
+    goto failure;
+  }
+  if (!(params.features & IORING_FEAT_NODROP))
+    LOG_WARNING0("Kernel may drop io_uring completions under load");
+  if (uring_map(ctx, &params) == -1) {
+    LOG_ERROR("Cannot map io_uring: %s", strerror(errno));
+    goto failure;
+  }
+  if (uring_register_buffers(ctx) == -1) {
+    LOG_ERROR("Cannot register receive buffers: %s", strerror(errno));
+    goto failure;
+  }
+
+  ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ctx->event_fd == -1 ||
+      uring_register(ctx->ring_fd, IORING_REGISTER_EVENTFD, &ctx->event_fd,
+                     1) == -1) {
+    LOG_ERROR("Cannot get io_uring completions: %s", strerror(errno));
+    goto failure;
+  }
+
+  ctx->completions = event_new(base, ctx->event_fd, EV_READ | EV_PERSIST,
+                               uring_completions_cb, ctx);
+  ctx->submit = event_new(base, -1, 0, uring_submit_cb, ctx);
+  ctx->frame = evbuffer_new();
+  ctx->marshal = evbuffer_new();
+  if (!ctx->completions || !ctx->submit || !ctx->frame || !ctx->marshal ||
+      event_add(ctx->completions, 0) == -1)
+    goto failure;
+
+  LOG_DEBUG0("Initialized io_uring");
+  return ctx;
+
+failure:
+  uring_ctx_free(ctx);
+  return 0;
+}
+
+const struct TransportOps *transport_uring(void) {
+  static const struct TransportOps ops = {
+      "uring",        uring_listen,    uring_close,   uring_link_new,
+      uring_link_free, uring_request,  uring_ctx_new, uring_ctx_free,
+  };
+  return &ops;
+}
+
+#endif